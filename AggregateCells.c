@@ -0,0 +1,297 @@
+/******************************************************************************
+   SUMMARY:
+   This program aggregates a fine resolution raster to VIC model cells with
+   the reducers of CellAggregate.c, in one pass over the rasters.  It
+   replaces the ArcGIS zonal statistics of CalculateLandUseFractions.py
+   (class fractions) and BuildCellSlopeGrid.py (mean slope), and summarises
+   wetness index or other grids by VIC cell.
+
+   The fine raster and the cell number raster (the VIC cell number of every
+   fine pixel, on the same grid) are streamed a block of rows at a time.
+
+******************************************************************************
+   NOTES:
+
+   USAGE: AggregateCells <fine grid> <cell number grid> <output table>
+                         [-mean] [-std] [-min] [-max] [-fraction] [-majority]
+                         [-quantile <q1,q2,...>] [-alpha <error>]
+                         [-vicgrid <VIC cell number grid> <output format>]
+     fine grid, cell number grid: ascii or float (.flt) grids, same size
+     output table: tab delimited, one line per cell, with the columns cell,
+                   npixels, nvalid and one per reducer (frac_<class> for
+                   each class with -fraction)
+     -quantile: quantiles (0-1) of the values, from a sketch with a
+                relative error of -alpha (default 0.01)
+     -vicgrid: also write each column as a grid of the VIC cells, named by
+               the output format with %s replaced by the column name (the
+               format has one %s and no other % than %%)
+     the default reducer is -mean
+
+   Compile with: gcc -O3 -fopenmp AggregateCells.c CellAggregate.c RasterIO.c -lm -o AggregateCells
+
+   COMMENTS:
+   Fractions are of the pixels with data, classes are the integer values of
+   the fine grid.
+
+*******************************************************************************/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "RasterIO.h"
+#include "CellAggregate.h"
+
+#define MAXSTRING 500
+#define ROWBLOCK 256
+
+/* columns of the output, after cell */
+#define COL_NPIXELS  0
+#define COL_NVALID   1
+#define COL_MEAN     2
+#define COL_STD      3
+#define COL_MIN      4
+#define COL_MAX      5
+#define COL_MAJORITY 6
+#define COL_QUANTILE 7          /* + quantile */
+#define COL_FRACTION (COL_QUANTILE + MAXQUANTILES)   /* + class */
+
+void   Usage(char *name);
+int    OutputColumns(AGGREGATOR *a, int *cols, char names[][MAXSTRING]);
+double ColumnValue(CELLSUMMARY *s, int col);
+int    CheckFormat(char *format);
+void   WriteVicGrids(AGGREGATOR *a, CELLSUMMARY *cells, long ncells, char *vicgrid, char *format);
+
+int main(int argc, char *argv[])
+{
+  char        *vicgrid = NULL, *format = NULL, *p;
+  int         i, n, reducers = 0, nquantiles = 0, ncols, *cols;
+  double      quantiles[MAXQUANTILES], alpha = 0.01, *values, *cellnums;
+  char        (*names)[MAXSTRING];
+  long        ncells, k;
+  RASTER      fine, cellgrid;
+  AGGREGATOR  *a;
+  CELLSUMMARY *cells;
+  FILE        *fo;
+
+  if(argc < 4)
+    Usage(argv[0]);
+  for(i=4; i<argc; i++) {
+    if(strcmp(argv[i], "-mean") == 0) reducers |= RED_MEAN;
+    else if(strcmp(argv[i], "-std") == 0) reducers |= RED_STD;
+    else if(strcmp(argv[i], "-min") == 0) reducers |= RED_MIN;
+    else if(strcmp(argv[i], "-max") == 0) reducers |= RED_MAX;
+    else if(strcmp(argv[i], "-fraction") == 0) reducers |= RED_FRACTION;
+    else if(strcmp(argv[i], "-majority") == 0) reducers |= RED_MAJORITY;
+    else if(i+1 < argc && strcmp(argv[i], "-alpha") == 0) alpha = atof(argv[++i]);
+    else if(i+1 < argc && strcmp(argv[i], "-quantile") == 0) {
+      for(p=strtok(argv[++i], ","); p != NULL && nquantiles < MAXQUANTILES; p=strtok(NULL, ","))
+	quantiles[nquantiles++] = atof(p);
+      reducers |= RED_QUANTILE;
+    }
+    else if(i+2 < argc && strcmp(argv[i], "-vicgrid") == 0) {
+      vicgrid = argv[++i];
+      format = argv[++i];
+      if(!CheckFormat(format)) {
+	fprintf(stderr, "ERROR: the output format %s must have one %%s and no other %% than %%%%\n", format);
+	exit(1);
+      }
+    }
+    else {
+      fprintf(stderr, "ERROR - No such option.\n");
+      Usage(argv[0]);
+    }
+  }
+  if(reducers == 0)
+    reducers = RED_MEAN;
+
+  memset(&fine, 0, sizeof(RASTER));
+  memset(&cellgrid, 0, sizeof(RASTER));
+  OpenRaster(argv[1], &fine);
+  OpenRaster(argv[2], &cellgrid);
+  if(fine.ncols != cellgrid.ncols || fine.nrows != cellgrid.nrows) {
+    fprintf(stderr, "ERROR: %s is %d x %d but %s is %d x %d\n", argv[1], fine.ncols, fine.nrows,
+	    argv[2], cellgrid.ncols, cellgrid.nrows);
+    exit(1);
+  }
+  if(fabs(fine.xllcorner - cellgrid.xllcorner) > 0.5*fine.cellsize
+     || fabs(fine.yllcorner - cellgrid.yllcorner) > 0.5*fine.cellsize)
+    fprintf(stderr, "WARNING: %s and %s do not have the same lower left corner\n", argv[1], argv[2]);
+
+  /* one pass over the rasters */
+  a = NewAggregator(reducers, nquantiles, quantiles, alpha, fine.nodata);
+  values = (double*) malloc((size_t)ROWBLOCK*fine.ncols*sizeof(double));
+  cellnums = (double*) malloc((size_t)ROWBLOCK*fine.ncols*sizeof(double));
+  if(values == NULL || cellnums == NULL) {
+    printf("Cannot allocate memory to first record: rows\n");
+    exit(8);
+  }
+  while((n = ReadRasterRows(&fine, ROWBLOCK, values)) > 0) {
+    ReadRasterRows(&cellgrid, n, cellnums);
+    AggregateRows(a, (long)n*fine.ncols, values, fine.nodata, cellnums, cellgrid.nodata);
+  }
+  CloseRaster(&fine);
+  CloseRaster(&cellgrid);
+  free(values);
+  free(cellnums);
+  ncells = AggregateResults(a, &cells);
+  printf("Aggregated %d x %d pixels to %ld cells\n", fine.ncols, fine.nrows, ncells);
+
+  /* table of the cells */
+  ncols = COL_FRACTION + a->nclasses;
+  cols = (int*) malloc(ncols*sizeof(int));
+  names = malloc(ncols*sizeof(*names));
+  if(cols == NULL || names == NULL) {
+    printf("Cannot allocate memory to first record: columns\n");
+    exit(8);
+  }
+  ncols = OutputColumns(a, cols, names);
+  if((fo = fopen(argv[3], "w")) == NULL) {
+    fprintf(stderr, "cannot open output file,%s\n", argv[3]);
+    exit(1);
+  }
+  fprintf(fo, "cell");
+  for(i=0; i<ncols; i++)
+    fprintf(fo, "\t%s", names[i]);
+  fprintf(fo, "\n");
+  for(k=0; k<ncells; k++) {
+    fprintf(fo, "%ld", cells[k].cell);
+    for(i=0; i<ncols; i++)
+      fprintf(fo, "\t%.10g", ColumnValue(&cells[k], cols[i]));
+    fprintf(fo, "\n");
+  }
+  fclose(fo);
+
+  if(vicgrid != NULL)
+    WriteVicGrids(a, cells, ncells, vicgrid, format);
+
+  free(cols);
+  free(names);
+  FreeAggregator(a, cells, ncells);
+  return 0;
+}
+
+/*****************************************************************************/
+/*   OutputColumns: the columns of the reducers and their names.             */
+/*****************************************************************************/
+int OutputColumns(AGGREGATOR *a, int *cols, char names[][MAXSTRING])
+{
+  int n = 0, i;
+
+  cols[n] = COL_NPIXELS; strcpy(names[n++], "npixels");
+  cols[n] = COL_NVALID; strcpy(names[n++], "nvalid");
+  if(a->reducers & RED_MEAN) { cols[n] = COL_MEAN; strcpy(names[n++], "mean"); }
+  if(a->reducers & RED_STD) { cols[n] = COL_STD; strcpy(names[n++], "std"); }
+  if(a->reducers & RED_MIN) { cols[n] = COL_MIN; strcpy(names[n++], "min"); }
+  if(a->reducers & RED_MAX) { cols[n] = COL_MAX; strcpy(names[n++], "max"); }
+  for(i=0; i<a->nquantiles; i++) {
+    cols[n] = COL_QUANTILE + i;
+    sprintf(names[n++], "q%g", a->quantiles[i]);
+  }
+  if(a->reducers & RED_MAJORITY) { cols[n] = COL_MAJORITY; strcpy(names[n++], "majority"); }
+  if(a->reducers & RED_FRACTION)
+    for(i=0; i<a->nclasses; i++) {
+      cols[n] = COL_FRACTION + i;
+      sprintf(names[n++], "frac_%g", a->classes[i]);
+    }
+  return n;
+}
+
+double ColumnValue(CELLSUMMARY *s, int col)
+{
+  switch(col) {
+  case COL_NPIXELS: return s->npixels;
+  case COL_NVALID: return s->nvalid;
+  case COL_MEAN: return s->mean;
+  case COL_STD: return s->std;
+  case COL_MIN: return s->min;
+  case COL_MAX: return s->max;
+  case COL_MAJORITY: return s->majority;
+  }
+  if(col < COL_FRACTION)
+    return s->quantile[col - COL_QUANTILE];
+  return s->fraction[col - COL_FRACTION];
+}
+
+/*****************************************************************************/
+/*   CheckFormat: 1 if the output format of -vicgrid has exactly one %s and  */
+/*   no other conversion than %%, as it is passed to snprintf.               */
+/*****************************************************************************/
+int CheckFormat(char *format)
+{
+  int n = 0;
+
+  for(; *format; format++)
+    if(*format == '%') {
+      format++;
+      if(*format == 's') n++;
+      else if(*format != '%') return 0;
+    }
+  return (n == 1);
+}
+
+/*****************************************************************************/
+/*   WriteVicGrids: write every column as a grid of the VIC cells, where     */
+/*   the cell numbers of vicgrid are replaced by the values of the cells.    */
+/*****************************************************************************/
+void WriteVicGrids(AGGREGATOR *a, CELLSUMMARY *cells, long ncells, char *vicgrid, char *format)
+{
+  RASTER      vic, *out;
+  double      *rows, *outrows;
+  char        (*names)[MAXSTRING], outname[2*MAXSTRING];
+  int         *cols, ncols, i, n;
+  long        k;
+
+  memset(&vic, 0, sizeof(RASTER));
+  OpenRaster(vicgrid, &vic);
+  cols = (int*) malloc((COL_FRACTION + a->nclasses)*sizeof(int));
+  names = malloc((COL_FRACTION + a->nclasses)*sizeof(*names));
+  if(cols == NULL || names == NULL) {
+    printf("Cannot allocate memory to first record: columns\n");
+    exit(8);
+  }
+  ncols = OutputColumns(a, cols, names);
+  out = (RASTER*) calloc(ncols, sizeof(RASTER));
+  rows = (double*) malloc((size_t)ROWBLOCK*vic.ncols*sizeof(double));
+  outrows = (double*) malloc((size_t)ROWBLOCK*vic.ncols*sizeof(double));
+  if(out == NULL || rows == NULL || outrows == NULL) {
+    printf("Cannot allocate memory to first record: VIC grids\n");
+    exit(8);
+  }
+  for(i=0; i<ncols; i++) {
+    snprintf(outname, sizeof(outname), format, names[i]);
+    out[i] = vic;
+    out[i].precision = 0;
+    CreateRaster(outname, &out[i]);
+  }
+
+  while((n = ReadRasterRows(&vic, ROWBLOCK, rows)) > 0)
+    for(i=0; i<ncols; i++) {
+#pragma omp parallel for
+      for(k=0; k<(long)n*vic.ncols; k++) {
+	CELLSUMMARY *s = (rows[k] == vic.nodata) ? NULL : FindCell(cells, ncells, (long)rows[k]);
+
+	outrows[k] = (s == NULL) ? vic.nodata : ColumnValue(s, cols[i]);
+	if(outrows[k] == a->nodata) outrows[k] = vic.nodata;
+      }
+      WriteRasterRows(&out[i], n, outrows);
+    }
+  for(i=0; i<ncols; i++)
+    CloseRaster(&out[i]);
+  CloseRaster(&vic);
+  printf("Wrote %d grids of %d x %d VIC cells\n", ncols, vic.ncols, vic.nrows);
+  free(out);
+  free(rows);
+  free(outrows);
+  free(cols);
+  free(names);
+}
+
+void Usage(char *name)
+{
+  fprintf(stderr, "\nUsage: %s <fine grid> <cell number grid> <output table> [-mean] [-std] [-min] [-max]\n", name);
+  fprintf(stderr, "\t\t[-fraction] [-majority] [-quantile <q1,q2,...>] [-alpha <error>]\n");
+  fprintf(stderr, "\t\t[-vicgrid <VIC cell number grid> <output format>]\n");
+  fprintf(stderr, "\n\tNOTE: The cell number grid gives the VIC cell of every pixel of the fine grid.\n");
+  fprintf(stderr, "\tNOTE 2: The output format of -vicgrid has one %%s, replaced by the column name\n\t\t(write %%%% for a %%).\n\n");
+  exit(0);
+}
@@ -0,0 +1,390 @@
+/******************************************************************************
+   SUMMARY:
+   This program produces the grid and fraction files of the GIS routing
+   model from zonal statistics of travel times, as BuildGisRoutingGrids.py,
+   in one pass over the VIC cell number grid.
+
+   The zonal statistics are a table (the ArcGIS zonal statistics csv read by
+   BuildGisRoutingGrids.py, or the table of AggregateCells), or are computed
+   here from the travel time grid and a zone grid of VIC cell numbers with
+   the aggregation library (CellAggregate.c).  The statistics are joined to
+   the cells of the cell number grid through a table indexed by cell number,
+   and the rows of the mean travel time (_t0.asc), standard deviation
+   (_delta.asc) and mask (_mask.asc) grids and the lines of the fraction
+   file (_fract.txt) are all formatted in the same pass.
+
+******************************************************************************
+   NOTES:
+
+   USAGE: BuildRoutingGrids <basin prefix> <zonal table> <out path> <cell number grid>
+                            [-zones <zone grid>]
+     zonal table: csv or tab delimited table with the zone (VIC cell number)
+                  in the first column and MEAN, STD and COUNT columns (mean,
+                  std and nvalid for AggregateCells tables), or, with -zones,
+                  the travel time grid
+     -zones: grid of the VIC cell number of every pixel of the travel time
+             grid, to compute the zonal statistics here
+
+   Compile with: gcc -O3 -fopenmp BuildRoutingGrids.c CellAggregate.c RasterIO.c -lm -o BuildRoutingGrids
+
+   COMMENTS:
+   As in BuildGisRoutingGrids.py, the fraction of a cell is its pixel count
+   divided by the first quartile of the counts of all zones, up to 1, and
+   the mask is 1 for cells with statistics.  Flux file names are
+   fluxes_<lat>_<lng> with 4 decimals.
+
+*******************************************************************************/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "RasterIO.h"
+#include "CellAggregate.h"
+
+#define MAXSTRING 500
+#define MAXCOLS 200
+#define ROWBLOCK 256
+
+/* zonal statistics of one zone */
+typedef struct
+{
+  long   zone;
+  double mean, std, count;
+} ZONE;
+
+void   Usage(char *name);
+long   ReadZonalTable(char *name, ZONE **zones);
+long   ComputeZonal(char *grid, char *zonegrid, ZONE **zones);
+int    SplitFields(char *line, int comma, char **fields, int max);
+int    FindColumn(char **names, int ncols, const char **candidates);
+double Quartile(ZONE *zones, long n);
+int    CompareDoubles(const void *a, const void *b);
+
+int main(int argc, char *argv[])
+{
+  char    *zonefile = NULL, outname[3*MAXSTRING], *text;
+  long    nzones, k, minzone, maxzone, *index, nlines = 0;
+  double  q25, *cells, *grids[3];
+  int     i, n, r, g;
+  size_t  linemax, *len;
+  ZONE    *zones;
+  RASTER  cellgrid, out[3];
+  FILE    *ff;
+  static const char *suffix[3] = { "t0", "delta", "mask" };
+
+  if(argc < 5)
+    Usage(argv[0]);
+  for(i=5; i<argc; i++) {
+    if(i+1 < argc && strcmp(argv[i], "-zones") == 0) zonefile = argv[++i];
+    else {
+      fprintf(stderr, "ERROR - No such option.\n");
+      Usage(argv[0]);
+    }
+  }
+
+  /* zonal statistics, and the table from cell number to zone */
+  nzones = (zonefile != NULL) ? ComputeZonal(argv[2], zonefile, &zones) : ReadZonalTable(argv[2], &zones);
+  if(nzones == 0) {
+    fprintf(stderr, "ERROR: no zonal statistics in %s\n", argv[2]);
+    exit(1);
+  }
+  q25 = Quartile(zones, nzones);
+  printf("Quantile %g\n", q25);
+  minzone = maxzone = zones[0].zone;
+  for(k=1; k<nzones; k++) {
+    if(zones[k].zone < minzone) minzone = zones[k].zone;
+    if(zones[k].zone > maxzone) maxzone = zones[k].zone;
+  }
+  if((index = (long*) malloc((maxzone - minzone + 1)*sizeof(long))) == NULL) {
+    printf("Cannot allocate memory to first record: zone index\n");
+    exit(8);
+  }
+  for(k=0; k<=maxzone-minzone; k++)
+    index[k] = -1;
+  for(k=0; k<nzones; k++)
+    index[zones[k].zone - minzone] = k;
+
+  /* output files */
+  memset(&cellgrid, 0, sizeof(RASTER));
+  OpenRaster(argv[4], &cellgrid);
+  for(g=0; g<3; g++) {
+    snprintf(outname, sizeof(outname), "%s/%s_%s.asc", argv[3], argv[1], suffix[g]);
+    printf("Working on %s\n", outname);
+    out[g] = cellgrid;
+    out[g].precision = 0;
+    CreateRaster(outname, &out[g]);
+  }
+  snprintf(outname, sizeof(outname), "%s/%s_fract.txt", argv[3], argv[1]);
+  printf("Working on %s\n", outname);
+  if((ff = fopen(outname, "w")) == NULL) {
+    fprintf(stderr, "cannot open output file,%s\n", outname);
+    exit(1);
+  }
+
+  linemax = 128;
+  cells = (double*) malloc((size_t)ROWBLOCK*cellgrid.ncols*sizeof(double));
+  text = (char*) malloc((size_t)ROWBLOCK*cellgrid.ncols*linemax);
+  len = (size_t*) malloc(ROWBLOCK*sizeof(size_t));
+  for(g=0; g<3; g++)
+    grids[g] = (double*) malloc((size_t)ROWBLOCK*cellgrid.ncols*sizeof(double));
+  if(cells == NULL || text == NULL || len == NULL || grids[0] == NULL || grids[1] == NULL || grids[2] == NULL) {
+    printf("Cannot allocate memory to first record: rows\n");
+    exit(8);
+  }
+
+  /* one pass over the cell number grid: grid rows and fraction lines of a
+     block are formatted in parallel, then written in order */
+  while((n = ReadRasterRows(&cellgrid, ROWBLOCK, cells)) > 0) {
+    long first = cellgrid.row - n;
+
+#pragma omp parallel for schedule(dynamic) reduction(+:nlines)
+    for(r=0; r<n; r++) {
+      double lat = cellgrid.yllcorner + cellgrid.cellsize*(cellgrid.nrows - (first + r) - 0.5);
+      char   *s = text + (size_t)r*cellgrid.ncols*linemax;
+      int    c;
+
+      for(c=0; c<cellgrid.ncols; c++) {
+	long   at = (long)r*cellgrid.ncols + c, z = -1, cell;
+	double lng, f;
+
+	grids[0][at] = grids[1][at] = grids[2][at] = cellgrid.nodata;
+	if(cells[at] == cellgrid.nodata)
+	  continue;
+	cell = (long)cells[at];
+	if(cell >= minzone && cell <= maxzone)
+	  z = index[cell - minzone];
+	if(z < 0)
+	  continue;
+	/* zones without statistics get the grid nodata, as the fillna() did */
+	if(!isnan(zones[z].mean))
+	  grids[0][at] = zones[z].mean;
+	if(!isnan(zones[z].std))
+	  grids[1][at] = zones[z].std;
+	f = zones[z].count/q25;
+	if(f > 1.) f = 1.;
+	if(isnan(f))
+	  continue;
+	grids[2][at] = 1.;
+	lng = cellgrid.xllcorner + cellgrid.cellsize*(c + 0.5);
+	s += sprintf(s, "%ld\t%ld\tfluxes_%.4f_%.4f\t%.10g\n", cell, cell, lat, lng, f);
+	nlines++;
+      }
+      len[r] = s - (text + (size_t)r*cellgrid.ncols*linemax);
+    }
+    for(g=0; g<3; g++)
+      WriteRasterRows(&out[g], n, grids[g]);
+    for(r=0; r<n; r++)
+      fwrite(text + (size_t)r*cellgrid.ncols*linemax, 1, len[r], ff);
+  }
+  fclose(ff);
+  printf("Wrote %ld lines.\n", nlines);
+  for(g=0; g<3; g++)
+    CloseRaster(&out[g]);
+  CloseRaster(&cellgrid);
+
+  free(zones);
+  free(index);
+  free(cells);
+  free(text);
+  free(len);
+  for(g=0; g<3; g++)
+    free(grids[g]);
+  return 0;
+}
+
+/*****************************************************************************/
+/*   ReadZonalTable: read the zone, mean, std and count of every zone of a  */
+/*   csv or tab delimited table with a header line.                          */
+/*****************************************************************************/
+long ReadZonalTable(char *name, ZONE **zones)
+{
+  static const char *meannames[] = { "MEAN", NULL };
+  static const char *stdnames[] = { "STD", NULL };
+  static const char *countnames[] = { "COUNT", "nvalid", NULL };
+  FILE   *fp;
+  char   *line = NULL, *header, *names[MAXCOLS], *fields[MAXCOLS];
+  size_t size = 0;
+  long   n = 0, maxzones = 1024;
+  int    ncols, nf, comma, cmean, cstd, ccount;
+
+  if((fp = fopen(name, "r")) == NULL || getline(&line, &size, fp) < 0) {
+    fprintf(stderr, "cannot open/read zonal table,%s\n", name);
+    exit(1);
+  }
+  comma = (strchr(line, ',') != NULL);
+  header = strdup(line);
+  ncols = SplitFields(header, comma, names, MAXCOLS);
+  cmean = FindColumn(names, ncols, meannames);
+  cstd = FindColumn(names, ncols, stdnames);
+  ccount = FindColumn(names, ncols, countnames);
+  if(cmean < 0 || cstd < 0 || ccount < 0) {
+    fprintf(stderr, "ERROR: zonal table %s must have MEAN, STD and COUNT columns\n", name);
+    exit(1);
+  }
+
+  if((*zones = (ZONE*) malloc(maxzones*sizeof(ZONE))) == NULL) {
+    printf("Cannot allocate memory to first record: zones\n");
+    exit(8);
+  }
+  while(getline(&line, &size, fp) >= 0) {
+    ZONE *z;
+
+    if(n == maxzones) {
+      maxzones *= 2;
+      if((*zones = (ZONE*) realloc(*zones, maxzones*sizeof(ZONE))) == NULL) {
+	printf("Cannot allocate memory to first record: zones\n");
+	exit(8);
+      }
+    }
+    z = &(*zones)[n];
+    z->mean = z->std = z->count = NAN;
+    if((nf = SplitFields(line, comma, fields, MAXCOLS)) == 0 || fields[0][0] == '\0')
+      continue;
+    /* empty fields (pandas NaN) are left NaN */
+    z->zone = atol(fields[0]);
+    if(cmean < nf && fields[cmean][0] != '\0') z->mean = atof(fields[cmean]);
+    if(cstd < nf && fields[cstd][0] != '\0') z->std = atof(fields[cstd]);
+    if(ccount < nf && fields[ccount][0] != '\0') z->count = atof(fields[ccount]);
+    /* zones without data (in AggregateCells tables) are not zonal statistics */
+    if(z->count != 0.)
+      n++;
+  }
+  fclose(fp);
+  free(line);
+  free(header);
+  return n;
+}
+
+/* ----------------------
+  Split a line into fields at each comma, or at runs of whitespace.
+ ------------------------*/
+int SplitFields(char *line, int comma, char **fields, int max)
+{
+  int  n = 0;
+  char *p = line;
+
+  line[strcspn(line, "\r\n")] = '\0';
+  if(!comma) {
+    char *tok;
+
+    for(; n<max && (tok = strtok(p, " \t")) != NULL; p=NULL)
+      fields[n++] = tok;
+    return n;
+  }
+  while(n < max) {
+    fields[n++] = p;
+    if((p = strchr(p, ',')) == NULL)
+      break;
+    *p++ = '\0';
+  }
+  return n;
+}
+
+int FindColumn(char **names, int ncols, const char **candidates)
+{
+  int i, k;
+
+  for(k=0; candidates[k] != NULL; k++)
+    for(i=0; i<ncols; i++)
+      if(strcasecmp(names[i], candidates[k]) == 0)
+	return i;
+  return -1;
+}
+
+/*****************************************************************************/
+/*   ComputeZonal: zonal mean, std and count of a grid, by the zones of a    */
+/*   zone grid, with the aggregation library.                                */
+/*****************************************************************************/
+long ComputeZonal(char *grid, char *zonegrid, ZONE **zones)
+{
+  RASTER      values, zonegr;
+  AGGREGATOR  *a;
+  CELLSUMMARY *cells;
+  double      *v, *z;
+  long        ncells, k, nz;
+  int         n;
+
+  memset(&values, 0, sizeof(RASTER));
+  memset(&zonegr, 0, sizeof(RASTER));
+  OpenRaster(grid, &values);
+  OpenRaster(zonegrid, &zonegr);
+  if(values.ncols != zonegr.ncols || values.nrows != zonegr.nrows) {
+    fprintf(stderr, "ERROR: %s is %d x %d but %s is %d x %d\n", grid, values.ncols, values.nrows,
+	    zonegrid, zonegr.ncols, zonegr.nrows);
+    exit(1);
+  }
+  a = NewAggregator(RED_MEAN | RED_STD, 0, NULL, 0., NAN);
+  v = (double*) malloc((size_t)ROWBLOCK*values.ncols*sizeof(double));
+  z = (double*) malloc((size_t)ROWBLOCK*values.ncols*sizeof(double));
+  if(v == NULL || z == NULL) {
+    printf("Cannot allocate memory to first record: rows\n");
+    exit(8);
+  }
+  while((n = ReadRasterRows(&values, ROWBLOCK, v)) > 0) {
+    ReadRasterRows(&zonegr, n, z);
+    AggregateRows(a, (long)n*values.ncols, v, values.nodata, z, zonegr.nodata);
+  }
+  CloseRaster(&values);
+  CloseRaster(&zonegr);
+  free(v);
+  free(z);
+
+  /* zones with data, as in an ArcGIS zonal statistics table */
+  ncells = AggregateResults(a, &cells);
+  if((*zones = (ZONE*) malloc((ncells + 1)*sizeof(ZONE))) == NULL) {
+    printf("Cannot allocate memory to first record: zones\n");
+    exit(8);
+  }
+  for(k=0, nz=0; k<ncells; k++)
+    if(cells[k].nvalid > 0) {
+      (*zones)[nz].zone = cells[k].cell;
+      (*zones)[nz].mean = cells[k].mean;
+      (*zones)[nz].std = cells[k].std;
+      (*zones)[nz].count = cells[k].nvalid;
+      nz++;
+    }
+  FreeAggregator(a, cells, ncells);
+  printf("Computed zonal statistics of %ld zones\n", nz);
+  return nz;
+}
+
+/*****************************************************************************/
+/*   Quartile: first quartile of the counts, interpolated as pandas.         */
+/*****************************************************************************/
+double Quartile(ZONE *zones, long n)
+{
+  double *c, pos, q;
+  long   k, m = 0;
+
+  if((c = (double*) malloc(n*sizeof(double))) == NULL) {
+    printf("Cannot allocate memory to first record: counts\n");
+    exit(8);
+  }
+  for(k=0; k<n; k++)
+    if(!isnan(zones[k].count))
+      c[m++] = zones[k].count;
+  if(m == 0) {
+    free(c);
+    return NAN;
+  }
+  qsort(c, m, sizeof(double), CompareDoubles);
+  pos = 0.25*(m - 1);
+  k = (long)floor(pos);
+  q = (k + 1 < m) ? c[k] + (pos - k)*(c[k+1] - c[k]) : c[k];
+  free(c);
+  return q;
+}
+
+int CompareDoubles(const void *a, const void *b)
+{
+  return (*(const double*)a > *(const double*)b) - (*(const double*)a < *(const double*)b);
+}
+
+void Usage(char *name)
+{
+  fprintf(stderr, "\nUsage: %s <basin prefix> <zonal table> <out path> <cell number grid> [-zones <zone grid>]\n", name);
+  fprintf(stderr, "\n\tNOTE: The zonal table has the zone in the first column and MEAN, STD and COUNT columns.\n");
+  fprintf(stderr, "\tNOTE 2: With -zones, the zonal table is the travel time grid, and the statistics are computed.\n\n");
+  exit(0);
+}
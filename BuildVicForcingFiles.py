@@ -20,6 +20,7 @@
 # 20150707 Added a '#' to the start of the header line so that the VIC model
 #          will skip it in the open_file() routine.   KAC  
 
+import sys
 import pandas as pd
 import numpy as np
 import read_arcinfo_files as rwarc
@@ -34,6 +35,19 @@ OutAnnualP = 'ClimateData/annual_prec.csv' # name for annual precip file
 OutAnnualT = 'ClimateData/annual_Tavg.csv' # name of annual Tavg file
 OutJulyT   = 'ClimateData/annual_July_Tavg.csv' # name of annual July_Tavg file
 
+# optional command line arguments: <climate data dir> <forcing dir> (e.g. a
+# synthetic basin of SynthBasin)
+if len(sys.argv) == 3:
+    BaseInfoFile = "%s/PredtandfilaGrid.dat" % sys.argv[1]
+    DataFileNameFmt = sys.argv[1] + "/CARPATGRID_%s_D.ser"
+    OutFileNameFmt = sys.argv[2] + "/data_%.4f_%.4f"
+    OutAnnualP = "%s/annual_prec.csv" % sys.argv[1]
+    OutAnnualT = "%s/annual_Tavg.csv" % sys.argv[1]
+    OutJulyT = "%s/annual_July_Tavg.csv" % sys.argv[1]
+elif len(sys.argv) != 1:
+    sys.stderr.write( "Usage: %s [<climate data dir> <forcing dir>]\n" % sys.argv[0] )
+    sys.exit()
+
 # set which climate variables will be output and in what order
 DataTypes = [ "PREC", "TMAX", "TMIN", "WS2", "PVAP", "RH", "PAIR", "RG" ]
 
@@ -0,0 +1,543 @@
+/******************************************************************************
+   SUMMARY:
+   Bulk reader of many small files (the cell DEMs of a basin), for batches
+   that read thousands of files once each.  Opening and reading the files
+   one at a time waits on every system call, and on the server for every
+   file on a network file system.  Here an I/O thread keeps up to <depth>
+   files in flight, and the files are handed whole, as they complete, to
+   the threads that parse and process them (ParseDEM()), so the storage
+   and the compute threads are both kept busy.
+
+   Backends:
+     IO_URING   the opens, sizes (statx), reads and closes are submitted in
+                batches to an io_uring (Linux 5.6 or later), compiled with
+                -DHAVE_IO_URING.  No library is needed, the ring is set up
+                with the system calls.
+     IO_THREADS <depth> threads each open, size, read and close a file at
+                a time.  Used when io_uring is not compiled in, or is not
+                allowed or does not have the operations.
+
+   The files that are read but not yet released by the consumers are kept
+   under a byte budget, so the reader does not run ahead of the compute
+   threads by more than that.  BulkReaderStats() gives the files, I/O
+   operations and bytes done and the IOPS and MB/s achieved.
+*******************************************************************************/
+#ifdef HAVE_IO_URING
+#define _GNU_SOURCE            /* struct statx */
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#include "TerrainEngine.h"
+
+/* a file being read */
+typedef struct
+{
+  int    fd, opened, sized;
+  size_t got, alloc;           /* bytes read, and held in the budget */
+  BULKFILE f;
+#ifdef HAVE_IO_URING
+  struct statx stx;
+#endif
+} SLOT;
+
+struct BULKREADER
+{
+  int      nfiles, depth, backend;
+  size_t   budget, held;       /* bytes read and not released */
+  SLOT     *slots;
+  int      next;               /* next file to start */
+  int      *done, ndone, ntaken;   /* files in the order they completed */
+  int      nthreads;
+  pthread_t *threads;
+  void     *uring;             /* the ring of the io_uring thread */
+  pthread_mutex_t lock;
+  pthread_cond_t  ready, room;
+  long     ops;
+  double   bytes, start, end;
+};
+
+static double Now(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1.e-6*tv.tv_usec;
+}
+
+static void *Alloc(size_t size, char *what)
+{
+  void *p;
+
+  if((p = malloc(size > 0 ? size : 1)) == NULL) {
+    printf("Cannot allocate memory to first record: %s\n", what);
+    exit(8);
+  }
+  return p;
+}
+
+/* ----------------------
+  Hand a file to the consumers.  Called with the lock held.
+ ------------------------*/
+static void Deliver(BULKREADER *r, int i, int ops)
+{
+  SLOT *s = &r->slots[i];
+
+  if(s->f.error == 0) {
+    s->f.size = s->got;
+    s->f.buf[s->got] = '\0';
+    r->bytes += s->got;
+  }
+  else {
+    free(s->f.buf);
+    s->f.buf = NULL;
+    s->f.size = 0;
+    r->held -= s->alloc;
+    s->alloc = 0;
+    pthread_cond_broadcast(&r->room);
+  }
+  r->ops += ops;
+  r->end = Now();
+  r->done[r->ndone++] = i;
+  pthread_cond_broadcast(&r->ready);
+}
+
+/* ----------------------
+  Next file to start, or -1 when all are started.  Waits while the files
+  held are over the budget.  Called with the lock held.
+ ------------------------*/
+static int StartNext(BULKREADER *r, int wait)
+{
+  while(r->next < r->nfiles && r->held > r->budget && r->held > 0) {
+    if(!wait) return -2;
+    pthread_cond_wait(&r->room, &r->lock);
+  }
+  return (r->next < r->nfiles) ? r->next++ : -1;
+}
+
+/*****************************************************************************/
+/*   Thread pool backend                                                     */
+/*****************************************************************************/
+static void *ReadThread(void *arg)
+{
+  BULKREADER  *r = (BULKREADER*)arg;
+  SLOT        *s;
+  struct stat st;
+  ssize_t     n;
+  int         i, ops;
+
+  for(;;) {
+    pthread_mutex_lock(&r->lock);
+    i = StartNext(r, 1);
+    pthread_mutex_unlock(&r->lock);
+    if(i < 0) break;
+    s = &r->slots[i];
+    ops = 1;
+    if((s->fd = open(s->f.name, O_RDONLY)) < 0)
+      s->f.error = errno;
+    else {
+      ops += 2;
+      if(fstat(s->fd, &st) != 0)
+	s->f.error = errno;
+      else {
+	s->f.buf = (char*) Alloc(st.st_size + 1, "file");
+	s->alloc = st.st_size + 1;
+	pthread_mutex_lock(&r->lock);
+	r->held += s->alloc;
+	pthread_mutex_unlock(&r->lock);
+	while(s->got < (size_t)st.st_size &&
+	      (n = read(s->fd, s->f.buf + s->got, st.st_size - s->got)) != 0) {
+	  ops++;
+	  if(n < 0) {
+	    if(errno == EINTR) continue;
+	    s->f.error = errno;
+	    break;
+	  }
+	  s->got += n;
+	}
+      }
+      close(s->fd);
+    }
+    pthread_mutex_lock(&r->lock);
+    Deliver(r, i, ops);
+    pthread_mutex_unlock(&r->lock);
+  }
+  return NULL;
+}
+
+/*****************************************************************************/
+/*   io_uring backend                                                        */
+/*****************************************************************************/
+#ifdef HAVE_IO_URING
+
+#define OP_OPEN  0
+#define OP_STAT  1
+#define OP_READ  2
+#define OP_CLOSE 3
+
+typedef struct
+{
+  int      fd;
+  unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+  unsigned *cqhead, *cqtail, *cqmask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void     *sqring, *cqring;
+  size_t   sqsize, cqsize, sqesize;
+  unsigned entries, pending;   /* sqes written and not yet submitted */
+} URING;
+
+static int SetupUring(URING *u, unsigned entries)
+{
+  struct io_uring_params p;
+  struct io_uring_probe  *probe;
+  int    ops[4] = { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_CLOSE };
+  int    k, ok;
+
+  memset(u, 0, sizeof(URING));
+  memset(&p, 0, sizeof(p));
+  if((u->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+    return 0;
+
+  /* All the operations are needed, or the thread pool is used. */
+  probe = (struct io_uring_probe*) calloc(1, sizeof(*probe) + 256*sizeof(struct io_uring_probe_op));
+  ok = (probe != NULL &&
+	syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PROBE, probe, 256) >= 0);
+  for(k=0; ok && k<4; k++)
+    ok = ops[k] <= probe->last_op && (probe->ops[ops[k]].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  if(!ok) {
+    close(u->fd);
+    return 0;
+  }
+
+  u->entries = p.sq_entries;
+  u->sqsize = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+  u->cqsize = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+  u->sqesize = p.sq_entries*sizeof(struct io_uring_sqe);
+  u->sqring = mmap(NULL, u->sqsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		   u->fd, IORING_OFF_SQ_RING);
+  u->cqring = mmap(NULL, u->cqsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		   u->fd, IORING_OFF_CQ_RING);
+  u->sqes = (struct io_uring_sqe*) mmap(NULL, u->sqesize, PROT_READ|PROT_WRITE,
+					MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if(u->sqring == MAP_FAILED || u->cqring == MAP_FAILED || u->sqes == MAP_FAILED) {
+    close(u->fd);
+    return 0;
+  }
+  u->sqhead = (unsigned*)((char*)u->sqring + p.sq_off.head);
+  u->sqtail = (unsigned*)((char*)u->sqring + p.sq_off.tail);
+  u->sqmask = (unsigned*)((char*)u->sqring + p.sq_off.ring_mask);
+  u->sqarray = (unsigned*)((char*)u->sqring + p.sq_off.array);
+  u->cqhead = (unsigned*)((char*)u->cqring + p.cq_off.head);
+  u->cqtail = (unsigned*)((char*)u->cqring + p.cq_off.tail);
+  u->cqmask = (unsigned*)((char*)u->cqring + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe*)((char*)u->cqring + p.cq_off.cqes);
+  return 1;
+}
+
+static void FreeUring(URING *u)
+{
+  munmap(u->sqes, u->sqesize);
+  munmap(u->cqring, u->cqsize);
+  munmap(u->sqring, u->sqsize);
+  close(u->fd);
+}
+
+/* next free sqe, cleared, with the file and operation as user data */
+static struct io_uring_sqe *GetSqe(URING *u, int i, int op)
+{
+  unsigned tail = *u->sqtail + u->pending, idx = tail & *u->sqmask;
+  struct io_uring_sqe *sqe = &u->sqes[idx];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = (unsigned long long)i*4 + op;
+  u->sqarray[idx] = idx;
+  u->pending++;
+  return sqe;
+}
+
+/* Submit the pending sqes and wait for at least min completions. */
+static void EnterUring(URING *u, unsigned min)
+{
+  int ret;
+
+  __atomic_store_n(u->sqtail, *u->sqtail + u->pending, __ATOMIC_RELEASE);
+  do
+    ret = syscall(__NR_io_uring_enter, u->fd, u->pending, min,
+		  min > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  while(ret < 0 && errno == EINTR);
+  if(ret < 0) {
+    fprintf(stderr, "ERROR: io_uring_enter failed (%s)\n", strerror(errno));
+    exit(1);
+  }
+  u->pending = 0;
+}
+
+static void SubmitRead(URING *u, BULKREADER *r, int i)
+{
+  SLOT *s = &r->slots[i];
+  struct io_uring_sqe *sqe = GetSqe(u, i, OP_READ);
+
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = s->fd;
+  sqe->addr = (unsigned long)(s->f.buf + s->got);
+  sqe->len = s->f.size - s->got;
+  sqe->off = s->got;
+}
+
+static void SubmitClose(URING *u, int i, int fd)
+{
+  struct io_uring_sqe *sqe = GetSqe(u, i, OP_CLOSE);
+
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = fd;
+}
+
+static void *UringThread(void *arg)
+{
+  BULKREADER *r = (BULKREADER*)arg;
+  URING      u = *(URING*)r->uring;     /* set up by OpenBulkReader() */
+  SLOT       *s;
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  unsigned   head;
+  int        i, op, res, active = 0, closing = 0, started = 0, all;
+
+  for(;;) {
+    /* Start files while there is room in the ring (4 sqes per file at
+       most in flight) and in the budget. */
+    pthread_mutex_lock(&r->lock);
+    while(4*(active + 1) + closing <= (int)u.entries && active < r->depth &&
+	  (i = StartNext(r, active == 0 && closing == 0)) >= 0) {
+      s = &r->slots[i];
+      sqe = GetSqe(&u, i, OP_OPEN);
+      sqe->opcode = IORING_OP_OPENAT;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (unsigned long)s->f.name;
+      sqe->open_flags = O_RDONLY;
+      sqe = GetSqe(&u, i, OP_STAT);
+      sqe->opcode = IORING_OP_STATX;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (unsigned long)s->f.name;
+      sqe->len = STATX_SIZE;
+      sqe->off = (unsigned long)&s->stx;
+      active++;
+      started++;
+    }
+    all = (started == r->nfiles);
+    pthread_mutex_unlock(&r->lock);
+    if(active == 0 && closing == 0 && all)
+      break;
+
+    EnterUring(&u, 1);
+
+    head = *u.cqhead;
+    while(head != __atomic_load_n(u.cqtail, __ATOMIC_ACQUIRE)) {
+      cqe = &u.cqes[head & *u.cqmask];
+      i = cqe->user_data / 4;
+      op = cqe->user_data % 4;
+      res = cqe->res;
+      head++;
+      s = &r->slots[i];
+      pthread_mutex_lock(&r->lock);
+      r->ops++;
+      pthread_mutex_unlock(&r->lock);
+
+      if(op == OP_CLOSE) {
+	closing--;
+	continue;
+      }
+      if(op == OP_OPEN) {
+	s->opened = 1;
+	if(res < 0) s->f.error = -res;
+	else s->fd = res;
+      }
+      else if(op == OP_STAT) {
+	s->sized = 1;
+	if(res < 0) s->f.error = -res;
+	else {
+	  s->f.size = s->stx.stx_size;
+	  s->f.buf = (char*) Alloc(s->f.size + 1, "file");
+	  s->alloc = s->f.size + 1;
+	  pthread_mutex_lock(&r->lock);
+	  r->held += s->alloc;
+	  pthread_mutex_unlock(&r->lock);
+	}
+      }
+      else if(res < 0 && res != -EINTR && res != -EAGAIN)
+	s->f.error = -res;
+      else if(res > 0)
+	s->got += res;
+      else if(res == 0)
+	s->f.size = s->got;     /* the file is shorter than it was */
+
+      if(!s->opened || !s->sized)
+	continue;
+      if(s->f.error == 0 && s->got < s->f.size) {
+	SubmitRead(&u, r, i);
+	continue;
+      }
+      /* done, or failed */
+      if(s->fd >= 0) {
+	SubmitClose(&u, i, s->fd);
+	closing++;
+      }
+      s->fd = -1;
+      active--;
+      pthread_mutex_lock(&r->lock);
+      Deliver(r, i, 0);
+      pthread_mutex_unlock(&r->lock);
+    }
+    __atomic_store_n(u.cqhead, head, __ATOMIC_RELEASE);
+  }
+  FreeUring(&u);
+  return NULL;
+}
+#endif
+
+/*****************************************************************************/
+/*   OpenBulkReader: start reading n files with up to depth files in flight  */
+/*   and budget bytes read ahead of the consumers.  backend is IO_AUTO (the  */
+/*   best available), IO_URING or IO_THREADS.                                */
+/*****************************************************************************/
+BULKREADER *OpenBulkReader(char **names, int n, int depth, size_t budget, int backend)
+{
+  BULKREADER *r;
+  int        i;
+
+  r = (BULKREADER*) Alloc(sizeof(BULKREADER), "bulk reader");
+  memset(r, 0, sizeof(BULKREADER));
+  r->nfiles = n;
+  r->depth = (depth > 0) ? depth : 1;
+  r->budget = budget;
+  r->slots = (SLOT*) Alloc(n*sizeof(SLOT), "bulk reader");
+  r->done = (int*) Alloc(n*sizeof(int), "bulk reader");
+  memset(r->slots, 0, n*sizeof(SLOT));
+  for(i=0; i<n; i++) {
+    r->slots[i].fd = -1;
+    r->slots[i].f.name = names[i];
+    r->slots[i].f.index = i;
+  }
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->ready, NULL);
+  pthread_cond_init(&r->room, NULL);
+  r->start = r->end = Now();
+
+  r->backend = IO_THREADS;
+#ifdef HAVE_IO_URING
+  if(backend != IO_THREADS) {
+    r->uring = Alloc(sizeof(URING), "io_uring");
+    if(SetupUring((URING*)r->uring, 8*r->depth)) {
+      r->backend = IO_URING;
+      r->nthreads = 1;
+      r->threads = (pthread_t*) Alloc(sizeof(pthread_t), "threads");
+      if(pthread_create(&r->threads[0], NULL, UringThread, r) != 0) {
+	fprintf(stderr, "ERROR: cannot start the I/O thread\n");
+	exit(1);
+      }
+      return r;
+    }
+    free(r->uring);
+    r->uring = NULL;
+  }
+#endif
+  if(backend == IO_URING)
+    fprintf(stderr, "WARNING: io_uring is not available, files are read by threads\n");
+  r->nthreads = r->depth;
+  r->threads = (pthread_t*) Alloc(r->nthreads*sizeof(pthread_t), "threads");
+  for(i=0; i<r->nthreads; i++)
+    if(pthread_create(&r->threads[i], NULL, ReadThread, r) != 0) {
+      fprintf(stderr, "ERROR: cannot start the I/O threads\n");
+      exit(1);
+    }
+  return r;
+}
+
+/*****************************************************************************/
+/*   NextBulkFile: next file read (in the order they complete), waiting for  */
+/*   it if needed.  f->error is the errno of a file that could not be read.  */
+/*   Returns 0 when all the files have been handed out.  Thread safe.        */
+/*****************************************************************************/
+int NextBulkFile(BULKREADER *r, BULKFILE *f)
+{
+  pthread_mutex_lock(&r->lock);
+  while(r->ntaken == r->ndone && r->ntaken < r->nfiles)
+    pthread_cond_wait(&r->ready, &r->lock);
+  if(r->ntaken == r->nfiles) {
+    pthread_mutex_unlock(&r->lock);
+    return 0;
+  }
+  *f = r->slots[r->done[r->ntaken++]].f;
+  pthread_mutex_unlock(&r->lock);
+  return 1;
+}
+
+/*****************************************************************************/
+/*   ReleaseBulkFile: free the buffer of a file, making room for more reads. */
+/*****************************************************************************/
+void ReleaseBulkFile(BULKREADER *r, BULKFILE *f)
+{
+  SLOT *s = &r->slots[f->index];
+
+  free(f->buf);
+  f->buf = NULL;
+  pthread_mutex_lock(&r->lock);
+  r->held -= s->alloc;
+  s->alloc = 0;
+  s->f.buf = NULL;
+  pthread_cond_broadcast(&r->room);
+  pthread_mutex_unlock(&r->lock);
+}
+
+void BulkReaderStats(BULKREADER *r, IOSTATS *stats)
+{
+  pthread_mutex_lock(&r->lock);
+  stats->backend = r->backend;
+  stats->files = r->ndone;
+  stats->ops = r->ops;
+  stats->bytes = r->bytes;
+  stats->seconds = r->end - r->start;
+  pthread_mutex_unlock(&r->lock);
+  stats->iops = (stats->seconds > 0) ? stats->ops/stats->seconds : 0;
+  stats->mbps = (stats->seconds > 0) ? stats->bytes/1.e6/stats->seconds : 0;
+}
+
+/*****************************************************************************/
+/*   CloseBulkReader: stop starting files, wait for the I/O threads and      */
+/*   free the files that were not released.                                  */
+/*****************************************************************************/
+void CloseBulkReader(BULKREADER *r)
+{
+  int i;
+
+  pthread_mutex_lock(&r->lock);
+  r->nfiles = r->next;
+  r->budget = (size_t)-1;
+  pthread_cond_broadcast(&r->room);
+  pthread_mutex_unlock(&r->lock);
+  for(i=0; i<r->nthreads; i++)
+    pthread_join(r->threads[i], NULL);
+  for(i=0; i<r->nfiles; i++)
+    if(r->slots[i].alloc > 0)
+      free(r->slots[i].f.buf);
+  pthread_mutex_destroy(&r->lock);
+  pthread_cond_destroy(&r->ready);
+  pthread_cond_destroy(&r->room);
+  free(r->threads);
+  free(r->uring);
+  free(r->slots);
+  free(r->done);
+  free(r);
+}
@@ -0,0 +1,157 @@
+/******************************************************************************
+   SUMMARY:
+   This program computes the Saxton and Rawls (2006) soil water
+   characteristics and VIC soil parameters (SoilHydraulics.c) for a table of
+   soil layers, such as the per cell and layer HWSD properties used by
+   CalculatePerSoilDBLayer.py.
+
+   The table is read and written in blocks of BLOCKROWS lines, so any number
+   of cells and layers can be processed.
+
+******************************************************************************
+   NOTES:
+
+   The input table is whitespace delimited with a header line naming the
+   columns.  Each output line is the input line followed by the columns
+   Theta_1500 Theta_33 Theta_S33 Theta_S Psi_e B Lambda Ksat Bulk_Density
+   Dsmax Expt Bubble Wcr_FRACT Wpwp_FRACT (units in SoilHydraulics.h).
+
+   USAGE: CalcSoilHydraulics <input table> <output table> [-sand <col>]
+                             [-clay <col>] [-om <col>] [-slope <col>] [-percent]
+     -sand, -clay, -om, -slope: column names (default sand, clay, om, slope);
+            without a slope column Dsmax is 0
+     -percent: sand and clay are in percent, not fractions
+
+   Compile with: gcc -O3 -ffast-math CalcSoilHydraulics.c SoilHydraulics.c -lm -o CalcSoilHydraulics
+   (add -fopenmp to use all processors)
+
+   COMMENTS:
+   Organic matter is in percent by weight.
+
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "SoilHydraulics.h"
+
+#define MAXSTRING 500
+#define MAXCOLS 200
+#define BLOCKROWS 65536
+
+void Usage(char *name);
+int  FindColumn(char **names, int ncols, char *name);
+
+int main(int argc, char *argv[])
+{
+  FILE   *fin, *fout;
+  char   *line = NULL, *copy, *tok, *p, *names[MAXCOLS], **lines;
+  char   *colname[4] = { "sand", "clay", "om", "slope" };
+  size_t size = 0;
+  double *in[4], *block, scale = 1.;
+  long   nrows, total;
+  int    i, v, n, ncols, col[4];
+
+  if(argc < 3)
+    Usage(argv[0]);
+  for(i=3; i<argc; i++) {
+    if(strcmp(argv[i], "-percent") == 0) scale = 0.01;
+    else if(i+1 < argc && strcmp(argv[i], "-sand") == 0) colname[0] = argv[++i];
+    else if(i+1 < argc && strcmp(argv[i], "-clay") == 0) colname[1] = argv[++i];
+    else if(i+1 < argc && strcmp(argv[i], "-om") == 0) colname[2] = argv[++i];
+    else if(i+1 < argc && strcmp(argv[i], "-slope") == 0) colname[3] = argv[++i];
+    else Usage(argv[0]);
+  }
+
+  if((fin = fopen(argv[1], "r")) == NULL || getline(&line, &size, fin) < 0) {
+    fprintf(stderr, "cannot open/read input table,%s\n", argv[1]);
+    exit(1);
+  }
+  if((fout = fopen(argv[2], "w")) == NULL) {
+    fprintf(stderr, "cannot open output file,%s\n", argv[2]);
+    exit(1);
+  }
+
+  /* header */
+  line[strcspn(line, "\r\n")] = '\0';
+  fprintf(fout, "%s", line);
+  for(v=0; v<SH_NOUT; v++)
+    fprintf(fout, "\t%s", SoilHydraulicsNames[v]);
+  fprintf(fout, "\n");
+  copy = strdup(line);
+  ncols = 0;
+  for(p=copy; ncols<MAXCOLS && (tok = strtok(p, " \t")) != NULL; p=NULL)
+    names[ncols++] = tok;
+  for(v=0; v<4; v++)
+    if((col[v] = FindColumn(names, ncols, colname[v])) < 0 && v < 3) {
+      fprintf(stderr, "ERROR: column %s not found in %s\n", colname[v], argv[1]);
+      exit(1);
+    }
+  free(copy);
+
+  lines = (char**) calloc(BLOCKROWS, sizeof(char*));
+  block = (double*) malloc((size_t)SH_NOUT*BLOCKROWS*sizeof(double));
+  for(v=0; v<4; v++)
+    in[v] = (double*) calloc(BLOCKROWS, sizeof(double));
+  if(lines == NULL || block == NULL || in[0] == NULL || in[1] == NULL || in[2] == NULL || in[3] == NULL) {
+    printf("Cannot allocate memory to first record: block\n");
+    exit(8);
+  }
+
+  total = 0;
+  do {
+    /* read a block of layers */
+    for(nrows=0; nrows<BLOCKROWS && getline(&line, &size, fin) >= 0; ) {
+      line[strcspn(line, "\r\n")] = '\0';
+      if(strspn(line, " \t") == strlen(line)) continue;
+      lines[nrows] = strdup(line);
+      for(n=0, p=line; (tok = strtok(p, " \t")) != NULL; n++, p=NULL)
+	for(v=0; v<4; v++)
+	  if(n == col[v]) in[v][nrows] = atof(tok);
+      if(n < ncols) {
+	fprintf(stderr, "ERROR: line %ld of %s has %d of %d columns\n", total+nrows+2, argv[1], n, ncols);
+	exit(1);
+      }
+      in[0][nrows] *= scale;
+      in[1][nrows] *= scale;
+      nrows++;
+    }
+
+    SaxtonRawlsBlock(nrows, in[0], in[1], in[2], (col[3] < 0) ? NULL : in[3], block);
+
+    for(i=0; i<nrows; i++) {
+      fprintf(fout, "%s", lines[i]);
+      for(v=0; v<SH_NOUT; v++)
+	fprintf(fout, "\t%.6g", block[(long)v*nrows + i]);
+      fprintf(fout, "\n");
+      free(lines[i]);
+    }
+    total += nrows;
+  } while(nrows == BLOCKROWS);
+
+  printf("Computed %ld soil layers\n", total);
+  fclose(fin);
+  fclose(fout);
+  free(line);
+  free(lines);
+  free(block);
+  for(v=0; v<4; v++)
+    free(in[v]);
+  return 0;
+}
+
+void Usage(char *name)
+{
+  fprintf(stderr, "\nUsage: %s <input table> <output table> [-sand <col>] [-clay <col>] [-om <col>] [-slope <col>] [-percent]\n", name);
+  fprintf(stderr, "\n\tNOTE: The input table is whitespace delimited with a header line naming the columns.\n");
+  fprintf(stderr, "\tNOTE 2: Organic matter is in percent by weight, sand and clay are fractions unless -percent is given.\n\n");
+  exit(0);
+}
+
+int FindColumn(char **names, int ncols, char *name)
+{
+  int i;
+
+  for(i=0; i<ncols; i++)
+    if(strcmp(names[i], name) == 0) return i;
+  return -1;
+}
@@ -5,6 +5,9 @@
 # vegetation type in a VIC model grid cell using MODIS MCD12Q1 land cover
 # and the 0.1 degree resolution CARPATGRID used by the climte dataset.
 #
+# LandUseFractions.c computes the same fraction grids in one pass over the
+# land use raster, without ArcGIS (one zonal sum per class here).
+#
 
 import os.path
 import arcpy as ap
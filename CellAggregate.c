@@ -0,0 +1,523 @@
+/******************************************************************************
+   SUMMARY:
+   Aggregation of fine resolution rasters to VIC model cells, see
+   CellAggregate.h.
+
+   Each thread keeps, for the cells of the pixels it is given, a slot with
+   the pixel counts, the running mean and sum of squared deviations
+   (Welford), the smallest and largest values, and hash tables of the pixel
+   counts of each (cell, class) and (cell, sketch bucket).  The partials of
+   the threads are merged in thread order (Chan et al. for the moments), so
+   results only depend on the number of threads through rounding.
+
+   Compile with -fopenmp to use all processors.
+*******************************************************************************/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "CellAggregate.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define EMPTYKEY (-1LL-0x7fffffffffffffffLL)
+#define KEY(cell,k) (((long long)(cell) << 32) | (unsigned int)(k))
+#define KEYCELL(key) ((long)((key) >> 32))
+#define KEYK(key) ((int)(unsigned int)((key) & 0xffffffffLL))
+#define SKETCHMAX (1 << 20)      /* largest log bucket of the sketch */
+#define SKETCHZERO 1.e-12        /* smaller values are in the zero bucket */
+
+/* Open addressing hash from a 64 bit key to a count or slot. */
+typedef struct
+{
+  long long *keys;
+  long      *values;
+  long      size;                /* power of 2 */
+  long      count;
+} HASH;
+
+/* a (cell, class or bucket) count, for sorting */
+typedef struct
+{
+  long cell;
+  int  k;
+  long count;
+} ENTRY;
+
+struct PARTIAL
+{
+  HASH   cellindex;              /* cell number to slot */
+  long   nslots, maxslots;
+  long   *cell, *npixels, *nvalid;
+  double *mean, *m2, *min, *max;
+  HASH   classcount;             /* KEY(cell, class) to pixels */
+  HASH   buckets;                /* KEY(cell, bucket) to pixels */
+  long   lastcell, lastslot;     /* slot of the last pixel */
+};
+
+static void   HashInit(HASH *h, long n);
+static long   *HashSlot(HASH *h, long long key, int add);
+static void   HashFree(HASH *h);
+static void   PartialInit(PARTIAL *p);
+static long   PartialSlot(PARTIAL *p, long cell);
+static int    Bucket(double x, double lngamma);
+static double BucketValue(int b, double gamma);
+static long   CollectEntries(AGGREGATOR *a, int classes, ENTRY **entries);
+static int    CompareEntries(const void *a, const void *b);
+static int    CompareCells(const void *a, const void *b);
+static int    CompareInts(const void *a, const void *b);
+
+static void HashInit(HASH *h, long n)
+{
+  long i;
+
+  for(h->size = 64; h->size < 2*n; h->size *= 2);
+  h->keys = (long long*) malloc(h->size*sizeof(long long));
+  h->values = (long*) malloc(h->size*sizeof(long));
+  if(h->keys == NULL || h->values == NULL) {
+    printf("Cannot allocate memory to first record: hash\n");
+    exit(8);
+  }
+  for(i=0; i<h->size; i++)
+    h->keys[i] = EMPTYKEY;
+  h->count = 0;
+}
+
+/* ----------------------
+  The value of key, NULL if it is not in the table, unless add is set: it
+  is then added with the value 0.
+ ------------------------*/
+static long *HashSlot(HASH *h, long long key, int add)
+{
+  unsigned long long x = (unsigned long long)key;
+  long i;
+
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  for(i = (long)(x & (h->size - 1)); h->keys[i] != EMPTYKEY; i = (i + 1) & (h->size - 1))
+    if(h->keys[i] == key)
+      return &h->values[i];
+  if(!add)
+    return NULL;
+
+  if(2*(h->count + 1) > h->size) {
+    HASH old = *h;
+    long j;
+
+    HashInit(h, old.size);
+    for(j=0; j<old.size; j++)
+      if(old.keys[j] != EMPTYKEY)
+	*HashSlot(h, old.keys[j], 1) = old.values[j];
+    HashFree(&old);
+    return HashSlot(h, key, 1);
+  }
+  h->keys[i] = key;
+  h->values[i] = 0;
+  h->count++;
+  return &h->values[i];
+}
+
+static void HashFree(HASH *h)
+{
+  free(h->keys);
+  free(h->values);
+  h->keys = NULL;
+  h->values = NULL;
+}
+
+static void PartialInit(PARTIAL *p)
+{
+  memset(p, 0, sizeof(PARTIAL));
+  HashInit(&p->cellindex, 1024);
+  HashInit(&p->classcount, 1024);
+  HashInit(&p->buckets, 1024);
+  p->lastcell = -1;
+  p->lastslot = -1;
+}
+
+/* ----------------------
+  Slot of a cell in the partial of a thread, added if it is new.
+ ------------------------*/
+static long PartialSlot(PARTIAL *p, long cell)
+{
+  long *slot;
+
+  if(p->lastslot >= 0 && cell == p->lastcell)
+    return p->lastslot;
+  slot = HashSlot(&p->cellindex, cell, 1);
+  if(*slot == 0) {
+    if(p->nslots == p->maxslots) {
+      p->maxslots = p->maxslots ? 2*p->maxslots : 1024;
+      p->cell = (long*) realloc(p->cell, p->maxslots*sizeof(long));
+      p->npixels = (long*) realloc(p->npixels, p->maxslots*sizeof(long));
+      p->nvalid = (long*) realloc(p->nvalid, p->maxslots*sizeof(long));
+      p->mean = (double*) realloc(p->mean, p->maxslots*sizeof(double));
+      p->m2 = (double*) realloc(p->m2, p->maxslots*sizeof(double));
+      p->min = (double*) realloc(p->min, p->maxslots*sizeof(double));
+      p->max = (double*) realloc(p->max, p->maxslots*sizeof(double));
+      if(p->cell == NULL || p->npixels == NULL || p->nvalid == NULL || p->mean == NULL
+	 || p->m2 == NULL || p->min == NULL || p->max == NULL) {
+	printf("Cannot allocate memory to first record: cells\n");
+	exit(8);
+      }
+    }
+    /* slots are stored +1, so that 0 is a new cell */
+    *slot = ++p->nslots;
+    p->cell[*slot-1] = cell;
+    p->npixels[*slot-1] = p->nvalid[*slot-1] = 0;
+    p->mean[*slot-1] = p->m2[*slot-1] = 0.;
+    p->min[*slot-1] = HUGE_VAL;
+    p->max[*slot-1] = -HUGE_VAL;
+  }
+  p->lastcell = cell;
+  p->lastslot = *slot - 1;
+  return p->lastslot;
+}
+
+/* ----------------------
+  Sketch bucket of x: buckets grow by gamma = (1+alpha)/(1-alpha), so the
+  bucket value is within alpha of every value in it.  Negative values have
+  negative buckets, and the order of the buckets is that of the values.
+ ------------------------*/
+static int Bucket(double x, double lngamma)
+{
+  int k;
+
+  if(fabs(x) < SKETCHZERO)
+    return 0;
+  k = (int)ceil(log(fabs(x))/lngamma);
+  if(k < -SKETCHMAX) k = -SKETCHMAX;
+  if(k > SKETCHMAX) k = SKETCHMAX;
+  return (x > 0.) ? k + SKETCHMAX + 1 : -(k + SKETCHMAX + 1);
+}
+
+static double BucketValue(int b, double gamma)
+{
+  double v;
+
+  if(b == 0)
+    return 0.;
+  v = 2.*pow(gamma, abs(b) - SKETCHMAX - 1)/(gamma + 1.);
+  return (b > 0) ? v : -v;
+}
+
+/*****************************************************************************/
+/*   NewAggregator: an aggregator for the reducers (RED_ bits), with         */
+/*   nquantiles quantiles (0-1) of relative error alpha.  Summaries of cells */
+/*   without valid pixels are set to nodata.                                 */
+/*****************************************************************************/
+AGGREGATOR *NewAggregator(int reducers, int nquantiles, const double *quantiles, double alpha,
+			  double nodata)
+{
+  AGGREGATOR *a;
+  int        i;
+
+  if((a = (AGGREGATOR*) calloc(1, sizeof(AGGREGATOR))) == NULL) {
+    printf("Cannot allocate memory to first record: aggregator\n");
+    exit(8);
+  }
+  a->reducers = reducers;
+  a->nquantiles = (nquantiles > MAXQUANTILES) ? MAXQUANTILES : nquantiles;
+  for(i=0; i<a->nquantiles; i++)
+    a->quantiles[i] = quantiles[i];
+  if(a->nquantiles > 0)
+    a->reducers |= RED_QUANTILE;
+  a->alpha = (alpha > 0. && alpha < 1.) ? alpha : 0.01;
+  a->nodata = nodata;
+#ifdef _OPENMP
+  a->nthreads = omp_get_max_threads();
+#else
+  a->nthreads = 1;
+#endif
+  if((a->partials = (PARTIAL*) malloc(a->nthreads*sizeof(PARTIAL))) == NULL) {
+    printf("Cannot allocate memory to first record: aggregator\n");
+    exit(8);
+  }
+  for(i=0; i<a->nthreads; i++)
+    PartialInit(&a->partials[i]);
+  return a;
+}
+
+/*****************************************************************************/
+/*   AggregateRows: add n pixels, values[] with the cell numbers cells[].    */
+/*   Pixels without a cell (cellnodata) are ignored, pixels of a cell        */
+/*   without data (nodata) only count in npixels.                            */
+/*****************************************************************************/
+void AggregateRows(AGGREGATOR *a, long n, const double *values, double nodata,
+		   const double *cells, double cellnodata)
+{
+  const double lngamma = log((1. + a->alpha)/(1. - a->alpha));
+  const int    classes = (a->reducers & (RED_FRACTION | RED_MAJORITY)) != 0;
+  const int    sketch = (a->reducers & RED_QUANTILE) != 0;
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(a->nthreads)
+#endif
+  {
+    PARTIAL *p;
+    long    k, s;
+
+#ifdef _OPENMP
+    p = &a->partials[omp_get_thread_num()];
+#else
+    p = &a->partials[0];
+#endif
+
+#pragma omp for schedule(static)
+    for(k=0; k<n; k++) {
+      double v = values[k], d;
+
+      if(cells[k] == cellnodata || isnan(cells[k]))
+	continue;
+      s = PartialSlot(p, (long)cells[k]);
+      p->npixels[s]++;
+      if(v == nodata || isnan(v))
+	continue;
+      p->nvalid[s]++;
+      d = v - p->mean[s];
+      p->mean[s] += d/p->nvalid[s];
+      p->m2[s] += d*(v - p->mean[s]);
+      if(v < p->min[s]) p->min[s] = v;
+      if(v > p->max[s]) p->max[s] = v;
+      if(classes)
+	(*HashSlot(&p->classcount, KEY(p->cell[s], lround(v)), 1))++;
+      if(sketch)
+	(*HashSlot(&p->buckets, KEY(p->cell[s], Bucket(v, lngamma)), 1))++;
+    }
+  }
+}
+
+/* ----------------------
+  The (cell, class) or (cell, bucket) counts of all threads, summed and
+  sorted by cell and class or bucket.
+ ------------------------*/
+static long CollectEntries(AGGREGATOR *a, int classes, ENTRY **entries)
+{
+  HASH  all;
+  long  i, n;
+  int   t;
+
+  HashInit(&all, 1024);
+  for(t=0; t<a->nthreads; t++) {
+    HASH *h = classes ? &a->partials[t].classcount : &a->partials[t].buckets;
+
+    for(i=0; i<h->size; i++)
+      if(h->keys[i] != EMPTYKEY)
+	*HashSlot(&all, h->keys[i], 1) += h->values[i];
+    HashFree(h);
+  }
+  if((*entries = (ENTRY*) malloc((all.count + 1)*sizeof(ENTRY))) == NULL) {
+    printf("Cannot allocate memory to first record: entries\n");
+    exit(8);
+  }
+  for(i=0, n=0; i<all.size; i++)
+    if(all.keys[i] != EMPTYKEY) {
+      (*entries)[n].cell = KEYCELL(all.keys[i]);
+      (*entries)[n].k = KEYK(all.keys[i]);
+      (*entries)[n].count = all.values[i];
+      n++;
+    }
+  HashFree(&all);
+  qsort(*entries, n, sizeof(ENTRY), CompareEntries);
+  return n;
+}
+
+static int CompareEntries(const void *a, const void *b)
+{
+  const ENTRY *x = (const ENTRY*)a, *y = (const ENTRY*)b;
+
+  if(x->cell != y->cell) return (x->cell < y->cell) ? -1 : 1;
+  return (x->k < y->k) ? -1 : (x->k > y->k);
+}
+
+static int CompareCells(const void *a, const void *b)
+{
+  const CELLSUMMARY *x = (const CELLSUMMARY*)a, *y = (const CELLSUMMARY*)b;
+
+  return (x->cell < y->cell) ? -1 : (x->cell > y->cell);
+}
+
+static int CompareInts(const void *a, const void *b)
+{
+  return (*(const int*)a > *(const int*)b) - (*(const int*)a < *(const int*)b);
+}
+
+/*****************************************************************************/
+/*   AggregateResults: merge the partials of the threads into one summary   */
+/*   per cell, sorted by cell number.  Returns the number of cells.          */
+/*****************************************************************************/
+long AggregateResults(AGGREGATOR *a, CELLSUMMARY **summaries)
+{
+  const double gamma = (1. + a->alpha)/(1. - a->alpha);
+  HASH        index;
+  CELLSUMMARY *c;
+  ENTRY       *e;
+  double      *m2;
+  long        ncells = 0, i, k, ne, *slot;
+  int         t, q;
+
+  /* moments and counts, merged in thread order */
+  for(t=0, k=0; t<a->nthreads; t++)
+    k += a->partials[t].nslots;
+  c = (CELLSUMMARY*) calloc(k + 1, sizeof(CELLSUMMARY));
+  m2 = (double*) calloc(k + 1, sizeof(double));
+  if(c == NULL || m2 == NULL) {
+    printf("Cannot allocate memory to first record: summaries\n");
+    exit(8);
+  }
+  HashInit(&index, k);
+  for(t=0; t<a->nthreads; t++) {
+    PARTIAL *p = &a->partials[t];
+
+    for(i=0; i<p->nslots; i++) {
+      CELLSUMMARY *s;
+      long        na, nb;
+      double      delta;
+
+      slot = HashSlot(&index, p->cell[i], 1);
+      if(*slot == 0) {
+	*slot = ++ncells;
+	c[*slot-1].cell = p->cell[i];
+	c[*slot-1].min = HUGE_VAL;
+	c[*slot-1].max = -HUGE_VAL;
+      }
+      s = &c[*slot-1];
+      na = s->nvalid;
+      nb = p->nvalid[i];
+      s->npixels += p->npixels[i];
+      if(nb == 0)
+	continue;
+      delta = p->mean[i] - s->mean;
+      s->nvalid = na + nb;
+      s->mean += delta*nb/s->nvalid;
+      m2[*slot-1] += p->m2[i] + delta*delta*((double)na*nb/s->nvalid);
+      if(p->min[i] < s->min) s->min = p->min[i];
+      if(p->max[i] > s->max) s->max = p->max[i];
+    }
+    HashFree(&p->cellindex);
+    free(p->cell); free(p->npixels); free(p->nvalid);
+    free(p->mean); free(p->m2); free(p->min); free(p->max);
+  }
+  HashFree(&index);
+  for(i=0; i<ncells; i++) {
+    c[i].std = (c[i].nvalid > 0) ? sqrt(m2[i]/c[i].nvalid) : a->nodata;
+    if(c[i].nvalid == 0)
+      c[i].mean = c[i].min = c[i].max = c[i].majority = a->nodata;
+    for(q=0; q<a->nquantiles; q++)
+      c[i].quantile[q] = a->nodata;
+  }
+  free(m2);
+  qsort(c, ncells, sizeof(CELLSUMMARY), CompareCells);
+
+  /* class fractions and majority */
+  if(a->reducers & (RED_FRACTION | RED_MAJORITY)) {
+    ne = CollectEntries(a, 1, &e);
+    /* distinct classes, in order */
+    {
+      int *k2 = (int*) malloc((ne + 1)*sizeof(int));
+
+      free(a->classes);
+      a->classes = (double*) malloc((ne + 1)*sizeof(double));
+      if(k2 == NULL || a->classes == NULL) {
+	printf("Cannot allocate memory to first record: classes\n");
+	exit(8);
+      }
+      for(k=0; k<ne; k++)
+	k2[k] = e[k].k;
+      qsort(k2, ne, sizeof(int), CompareInts);
+      for(k=0, t=0; k<ne; k++)
+	if(t == 0 || k2[k] != a->classes[t-1])
+	  a->classes[t++] = k2[k];
+      free(k2);
+    }
+    a->nclasses = t;
+
+    for(i=0, k=0; i<ncells; i++) {
+      long best = 0;
+
+      c[i].fraction = (double*) calloc(a->nclasses + 1, sizeof(double));
+      if(c[i].fraction == NULL) {
+	printf("Cannot allocate memory to first record: fractions\n");
+	exit(8);
+      }
+      for(t=0; t<a->nclasses && c[i].nvalid == 0; t++)
+	c[i].fraction[t] = a->nodata;
+      for(; k<ne && e[k].cell < c[i].cell; k++);
+      for(t=0; k<ne && e[k].cell == c[i].cell; k++) {
+	while(a->classes[t] < e[k].k) t++;
+	c[i].fraction[t] = (double)e[k].count/c[i].nvalid;
+	if(e[k].count > best) {
+	  best = e[k].count;
+	  c[i].majority = e[k].k;
+	}
+      }
+    }
+    free(e);
+  }
+
+  /* quantiles: the bucket where the count reaches the rank of each */
+  if(a->reducers & RED_QUANTILE) {
+    ne = CollectEntries(a, 0, &e);
+    for(i=0, k=0; i<ncells; i++) {
+      long first, last, cum;
+
+      for(; k<ne && e[k].cell < c[i].cell; k++);
+      for(first=k; k<ne && e[k].cell == c[i].cell; k++);
+      last = k;
+      if(c[i].nvalid == 0)
+	continue;
+      for(q=0; q<a->nquantiles; q++) {
+	double rank = a->quantiles[q]*(c[i].nvalid - 1), v;
+	long   j;
+
+	for(j=first, cum=0; j<last-1 && cum + e[j].count <= rank; j++)
+	  cum += e[j].count;
+	v = BucketValue(e[j].k, gamma);
+	if(v < c[i].min || a->quantiles[q] <= 0.) v = c[i].min;
+	if(v > c[i].max || a->quantiles[q] >= 1.) v = c[i].max;
+	c[i].quantile[q] = v;
+      }
+    }
+    free(e);
+  }
+  else
+    for(t=0; t<a->nthreads; t++)
+      HashFree(&a->partials[t].buckets);
+  if(!(a->reducers & (RED_FRACTION | RED_MAJORITY)))
+    for(t=0; t<a->nthreads; t++)
+      HashFree(&a->partials[t].classcount);
+
+  *summaries = c;
+  return ncells;
+}
+
+/*****************************************************************************/
+/*   FindCell: the summary of a cell number, NULL if it has no pixels.       */
+/*****************************************************************************/
+CELLSUMMARY *FindCell(CELLSUMMARY *summaries, long n, long cell)
+{
+  long lo = 0, hi = n - 1, mid;
+
+  while(lo <= hi) {
+    mid = (lo + hi)/2;
+    if(summaries[mid].cell == cell) return &summaries[mid];
+    if(summaries[mid].cell < cell) lo = mid + 1;
+    else hi = mid - 1;
+  }
+  return NULL;
+}
+
+void FreeAggregator(AGGREGATOR *a, CELLSUMMARY *summaries, long n)
+{
+  long i;
+
+  for(i=0; i<n && summaries != NULL; i++)
+    free(summaries[i].fraction);
+  free(summaries);
+  free(a->classes);
+  free(a->partials);
+  free(a);
+}
@@ -0,0 +1,70 @@
+/******************************************************************************
+   SUMMARY:
+   Aggregation of fine resolution rasters to VIC model cells.  The pixels of
+   a fine raster (land use classes, slopes, wetness index...) are grouped by
+   the VIC cell number of the same pixel in a cell number raster, and all
+   the requested reducers are computed in one pass over the rasters:
+
+     RED_MEAN, RED_STD  mean and (population) standard deviation
+     RED_MIN, RED_MAX   smallest and largest value
+     RED_FRACTION       fraction of the valid pixels in each class (integer
+                        pixel values), as the zonal statistics of
+                        CalculateLandUseFractions.py
+     RED_MAJORITY       most frequent class (the lowest class for ties)
+     RED_QUANTILE       quantiles from a mergeable sketch with a relative
+                        error of alpha (log spaced buckets, as DDSketch)
+
+   Rows are given a block at a time (AggregateRows), so rasters of any size
+   are streamed.  When compiled with -fopenmp each thread keeps partial
+   sums, counts and sketch buckets for the cells it sees, and the partials
+   are merged by AggregateResults.
+*******************************************************************************/
+#ifndef CELLAGGREGATE_H
+#define CELLAGGREGATE_H
+
+#define RED_MEAN      1
+#define RED_STD       2
+#define RED_MIN       4
+#define RED_MAX       8
+#define RED_FRACTION 16
+#define RED_MAJORITY 32
+#define RED_QUANTILE 64
+
+#define MAXQUANTILES 16
+
+/* summary of one VIC cell */
+typedef struct
+{
+  long   cell;                   /* cell number */
+  long   npixels;                /* pixels of the cell */
+  long   nvalid;                 /* pixels with data */
+  double mean, std, min, max;
+  double quantile[MAXQUANTILES];
+  double majority;               /* class, nodata if no valid pixels */
+  double *fraction;              /* of each class of classes[] */
+} CELLSUMMARY;
+
+typedef struct PARTIAL PARTIAL;
+
+typedef struct
+{
+  int     reducers;              /* RED_ bits */
+  int     nquantiles;
+  double  quantiles[MAXQUANTILES];
+  double  alpha;                 /* relative error of the quantiles */
+  double  nodata;                /* of the summaries without valid pixels */
+  int     nclasses;              /* classes found, after AggregateResults */
+  double  *classes;
+  int     nthreads;
+  PARTIAL *partials;             /* one per thread */
+} AGGREGATOR;
+
+AGGREGATOR *NewAggregator(int reducers, int nquantiles, const double *quantiles, double alpha,
+			  double nodata);
+void AggregateRows(AGGREGATOR *a, long n, const double *values, double nodata,
+		   const double *cells, double cellnodata);
+long AggregateResults(AGGREGATOR *a, CELLSUMMARY **summaries);
+CELLSUMMARY *FindCell(CELLSUMMARY *summaries, long n, long cell);
+void FreeAggregator(AGGREGATOR *a, CELLSUMMARY *summaries, long n);
+
+#endif
@@ -0,0 +1,474 @@
+/******************************************************************************
+   SUMMARY:
+   This program uses a mask file to extract soil and vegetation parameters from
+   the full LDAS (or any continental) VIC parameter files.  It does the same
+   job as ExtractWatershedFromLdas.py, but the parameter files are memory
+   mapped and indexed once, so continental files are clipped in seconds.
+
+   The soil parameter file is indexed by the latitude and longitude of each
+   cell (rounded to 4 decimals, as in the python script), and the vegetation
+   parameter file by cell number.  The matching cells are then copied to the
+   output as byte ranges of the input files, in the order of the input files,
+   without parsing or reformatting the parameters.
+
+******************************************************************************
+   NOTES:
+
+   The soil file is in ASCII column format, one cell per line, with the cell
+   number, latitude and longitude in columns 2, 3 and 4.  Each cell of the
+   vegetation file starts with a "<cell number> <Nveg>" line followed by Nveg
+   vegetation lines, each with a line of monthly LAI when GLOBAL_LAI is used.
+
+   USAGE: ExtractWatershed <mask file> <output dir> [-S <Soil Param File>]
+                           [-V <Veg Param File>] [-nolai]
+     mask file: ArcInfo ascii grid (cells with data are kept) or a list of
+                cell centers (<lat> <lng>, one per line)
+     output dir: SoilParams and VegParams are written here
+     -nolai: the vegetation file has no LAI lines (GLOBAL_LAI FALSE)
+
+   Compile with: gcc ExtractWatershed.c -lm -o ExtractWatershed
+
+   COMMENTS:
+   Does not currently handle the snow band file.
+
+*******************************************************************************/
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define MAXSTRING 500
+
+char LdasSoilFile[MAXSTRING] = "/depot/phig/data/VIC_SIMS_DATA/SoilData/LDAS/ldas_us.soil.orig.maod";
+char LdasVegFile[MAXSTRING]  = "/depot/phig/data/VIC_SIMS_DATA/VegParams/ldas_lai.expanded.vegparams";
+
+/* A memory mapped input file. */
+typedef struct
+{
+  char   *data;
+  size_t size;
+} MAPPEDFILE;
+
+/* A record (one or more lines) of a parameter file. */
+typedef struct
+{
+  size_t start, end;           /* byte range in the file */
+  long   key;                  /* cell number */
+} RECORD;
+
+/* Open addressing hash from a 64 bit key to a value. */
+typedef struct
+{
+  long long *keys;
+  long      *values;
+  long      size;              /* power of 2 */
+  long      count;
+} HASH;
+
+#define EMPTYKEY (-1LL-0x7fffffffffffffffLL)
+
+/*--- Function Declaration---*/
+void   MapFile(char *name, MAPPEDFILE *m);
+void   UnmapFile(MAPPEDFILE *m);
+void   HashInit(HASH *h, long n);
+void   HashPut(HASH *h, long long key, long value);
+long   HashGet(HASH *h, long long key);
+void   HashFree(HASH *h);
+long long LatLngKey(double lat, double lng);
+HASH   *ReadMask(char *maskfile, long *ncells);
+long   IndexSoilFile(MAPPEDFILE *m, RECORD **records, HASH *index);
+long   IndexVegFile(MAPPEDFILE *m, int lai, RECORD **records, HASH *index);
+long   WriteRecords(char *outfile, MAPPEDFILE *m, RECORD *records, long nrec, char *keep);
+void   Usage(char *name);
+
+int main(int argc, char *argv[])
+{
+  char       maskfile[MAXSTRING], outdir[MAXSTRING], outfile[2*MAXSTRING];
+  int        i, lai = 1;
+  long       k, c, nmask, nsoil, nveg, nkept, *masklist;
+  char       *keepsoil, *keepveg;
+  MAPPEDFILE soil, veg;
+  RECORD     *soilrec, *vegrec;
+  HASH       *mask, soilindex, vegindex;
+
+  /*-------------read the arguments ------------------*/
+  if (argc < 3) Usage(argv[0]);
+  strcpy(maskfile, argv[1]);
+  strcpy(outdir, argv[2]);
+  for (i = 3; i < argc; i++) {
+    if ((strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "-S") == 0) && i+1 < argc)
+      strcpy(LdasSoilFile, argv[++i]);
+    else if ((strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "-V") == 0) && i+1 < argc)
+      strcpy(LdasVegFile, argv[++i]);
+    else if (strcmp(argv[i], "-nolai") == 0)
+      lai = 0;
+    else {
+      fprintf(stderr, "ERROR - No such option.\n");
+      Usage(argv[0]);
+    }
+  }
+
+  /* check for output directory */
+  if (mkdir(outdir, 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "cannot create output directory,%s\n", outdir);
+    exit(1);
+  }
+
+  /*-----------------------------------------------*/
+  /* process mask file                             */
+  /*-----------------------------------------------*/
+  mask = ReadMask(maskfile, &nmask);
+  printf("Ncells from the mask file = %ld\n", nmask);
+
+  /*-----------------------------------------------*/
+  /* process soil file                             */
+  /*-----------------------------------------------*/
+  MapFile(LdasSoilFile, &soil);
+  nsoil = IndexSoilFile(&soil, &soilrec, &soilindex);
+  printf("Ncells from the soil param file = %ld\n", nsoil);
+
+  /* Look up every mask cell in the index of the soil file. */
+  keepsoil = (char*) calloc(nsoil+1, 1);
+  masklist = (long*) calloc(mask->size, sizeof(long));
+  for (k = 0, nkept = 0; k < mask->size; k++) {
+    if (mask->keys[k] == EMPTYKEY) continue;
+    if ((c = HashGet(&soilindex, mask->keys[k])) < 0) continue;
+    if (!keepsoil[c]) {
+      keepsoil[c] = 1;
+      masklist[nkept++] = c;
+    }
+  }
+  sprintf(outfile, "%s/SoilParams", outdir);
+  WriteRecords(outfile, &soil, soilrec, nsoil, keepsoil);
+  printf("Deleted %ld cells, leaving %ld.\n", nsoil - nkept, nkept);
+
+  /*-----------------------------------------------*/
+  /* process vegetation file                       */
+  /*-----------------------------------------------*/
+  MapFile(LdasVegFile, &veg);
+  nveg = IndexVegFile(&veg, lai, &vegrec, &vegindex);
+  printf("Ncells from the veg param file = %ld\n", nveg);
+
+  keepveg = (char*) calloc(nveg+1, 1);
+  for (k = 0, c = 0; k < nkept; k++) {
+    long v = HashGet(&vegindex, soilrec[masklist[k]].key);
+    if (v >= 0 && !keepveg[v]) {
+      keepveg[v] = 1;
+      c++;
+    }
+  }
+  sprintf(outfile, "%s/VegParams", outdir);
+  WriteRecords(outfile, &veg, vegrec, nveg, keepveg);
+  printf("Deleted %ld cells, leaving %ld.\n", nveg - c, c);
+
+  UnmapFile(&soil);
+  UnmapFile(&veg);
+  HashFree(mask);
+  free(mask);
+  HashFree(&soilindex);
+  HashFree(&vegindex);
+  free(soilrec);
+  free(vegrec);
+  free(keepsoil);
+  free(keepveg);
+  free(masklist);
+
+  return (0);
+}
+
+void Usage(char *name)
+{
+  fprintf(stderr, "\nUsage: %s <mask file> <output dir> [-S <Soil Param File>] [-V <Veg Param File>] [-nolai]\n", name);
+  fprintf(stderr, "\n\tNOTE: This program uses ASCII column format soil files for input and output.\n");
+  fprintf(stderr, "\tNOTE 2: The mask file can be a list of cell centers (<lat> <lng>) or an ArcInfo grid file.\n");
+  fprintf(stderr, "\tNOTE 3: Does not currently handle the snow band file.\n\n");
+  exit(0);
+}
+
+/* ----------------------
+  Memory map a whole file read only.
+ ------------------------*/
+void MapFile(char *name, MAPPEDFILE *m)
+{
+  int         fd;
+  struct stat st;
+
+  if ((fd = open(name, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "cannot open/read file,%s\n", name);
+    exit(1);
+  }
+  m->size = st.st_size;
+  m->data = NULL;
+  if (m->size > 0) {
+    m->data = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m->data == MAP_FAILED) {
+      fprintf(stderr, "cannot map file,%s\n", name);
+      exit(1);
+    }
+    /* The files are read once from start to end. */
+    madvise(m->data, m->size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+}
+
+void UnmapFile(MAPPEDFILE *m)
+{
+  if (m->data != NULL) munmap(m->data, m->size);
+  m->data = NULL;
+}
+
+/* ----------------------
+  Hash table with room for n keys.
+ ------------------------*/
+void HashInit(HASH *h, long n)
+{
+  long k;
+
+  for (h->size = 16; h->size < 2*n; h->size *= 2);
+  h->count = 0;
+  h->keys = (long long*) malloc(h->size*sizeof(long long));
+  h->values = (long*) malloc(h->size*sizeof(long));
+  if (h->keys == NULL || h->values == NULL) {
+    printf("Cannot allocate memory to first record: hash\n");
+    exit(8);
+  }
+  for (k = 0; k < h->size; k++) h->keys[k] = EMPTYKEY;
+}
+
+static inline long HashSlot(HASH *h, long long key)
+{
+  unsigned long long x = (unsigned long long)key;
+
+  /* mix the bits (splitmix64 finalizer) */
+  x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return (long)(x & (h->size - 1));
+}
+
+/* Keeps the first value stored for a key. */
+void HashPut(HASH *h, long long key, long value)
+{
+  long k;
+
+  for (k = HashSlot(h, key); h->keys[k] != EMPTYKEY; k = (k+1) & (h->size-1))
+    if (h->keys[k] == key) return;
+  h->keys[k] = key;
+  h->values[k] = value;
+  h->count++;
+}
+
+/* Returns -1 if the key is not found. */
+long HashGet(HASH *h, long long key)
+{
+  long k;
+
+  for (k = HashSlot(h, key); h->keys[k] != EMPTYKEY; k = (k+1) & (h->size-1))
+    if (h->keys[k] == key) return h->values[k];
+  return -1;
+}
+
+void HashFree(HASH *h)
+{
+  free(h->keys);
+  free(h->values);
+}
+
+/* ----------------------
+  Key of a cell center, latitude and longitude rounded to 4 decimals
+  like the "%.4f %.4f" strings of ExtractWatershedFromLdas.py.
+ ------------------------*/
+long long LatLngKey(double lat, double lng)
+{
+  long long ilat = llround(lat*10000.), ilng = llround(lng*10000.);
+
+  return (ilat + 900000LL)*4000000LL + (ilng + 1800000LL);
+}
+
+/* ----------------------
+  Read the mask, an ArcInfo grid or a list of cell centers, into a set
+  of cell center keys.
+ ------------------------*/
+HASH *ReadMask(char *maskfile, long *ncells)
+{
+  FILE   *fm;
+  char   tempstr[MAXSTRING];
+  int    ncols, nrows, i, j;
+  double xll, yll, cellsize, nodata, value, lat, lng;
+  HASH   *h;
+
+  if ((fm = fopen(maskfile, "r")) == NULL) {
+    fprintf(stderr, "cannot open/read mask file,%s\n", maskfile);
+    exit(1);
+  }
+  h = (HASH*) malloc(sizeof(HASH));
+  *ncells = 0;
+
+  if (fscanf(fm, "%s", tempstr) == 1 && strcasecmp(tempstr, "ncols") == 0) {
+    /* process arcinfo ASCII grid mask file */
+    fscanf(fm, "%d", &ncols);
+    fscanf(fm, "%s %d", tempstr, &nrows);
+    fscanf(fm, "%s %lf", tempstr, &xll);
+    fscanf(fm, "%s %lf", tempstr, &yll);
+    fscanf(fm, "%s %lf", tempstr, &cellsize);
+    fscanf(fm, "%s %lf", tempstr, &nodata);
+    if (strcasecmp(tempstr, "NODATA_value") != 0) {
+      fprintf(stderr, "Mask grid %s has no NODATA_value line\n", maskfile);
+      exit(1);
+    }
+    HashInit(h, (long)ncols*nrows);
+    for (i = 0; i < nrows; i++)
+      for (j = 0; j < ncols; j++) {
+	if (fscanf(fm, "%lf", &value) != 1) {
+	  fprintf(stderr, "Mask grid %s is too short\n", maskfile);
+	  exit(1);
+	}
+	if (value == nodata) continue;
+	lat = yll + (nrows - i - 0.5)*cellsize;
+	lng = xll + (j + 0.5)*cellsize;
+	HashPut(h, LatLngKey(lat, lng), 1);
+      }
+  }
+  else {
+    /* process list of grid cell centers */
+    rewind(fm);
+    while (fgets(tempstr, MAXSTRING, fm) != NULL) (*ncells)++;
+    rewind(fm);
+    HashInit(h, *ncells);
+    while (fscanf(fm, "%lf %lf", &lat, &lng) == 2)
+      HashPut(h, LatLngKey(lat, lng), 1);
+  }
+  fclose(fm);
+  *ncells = h->count;
+
+  return h;
+}
+
+/* ----------------------
+  Index the soil file: one record per line, keyed by cell number, and a
+  hash from the cell center to the record.  Returns the number of cells.
+ ------------------------*/
+long IndexSoilFile(MAPPEDFILE *m, RECORD **records, HASH *index)
+{
+  char   *p = m->data, *end = m->data + m->size, *eol, *q;
+  long   n, nlines;
+  double lat, lng;
+
+  /* count lines to size the index */
+  nlines = 1;
+  for (q = p; q < end && (q = memchr(q, '\n', end - q)) != NULL; q++) nlines++;
+
+  *records = (RECORD*) malloc(nlines*sizeof(RECORD));
+  if (*records == NULL) {
+    printf("Cannot allocate memory to first record: records\n");
+    exit(8);
+  }
+  HashInit(index, nlines);
+
+  n = 0;
+  while (p < end) {
+    eol = memchr(p, '\n', end - p);
+    eol = (eol == NULL) ? end : eol + 1;
+
+    for (q = p; q < eol && isspace((unsigned char)*q); q++);
+    if (q < eol && *q != '#') {
+      strtol(q, &q, 10);                         /* run flag */
+      (*records)[n].key = strtol(q, &q, 10);     /* cell number */
+      lat = strtod(q, &q);
+      lng = strtod(q, &q);
+      (*records)[n].start = p - m->data;
+      (*records)[n].end = eol - m->data;
+      HashPut(index, LatLngKey(lat, lng), n);
+      n++;
+    }
+    p = eol;
+  }
+  return n;
+}
+
+/* ----------------------
+  Index the vegetation file: one record per cell, from its
+  "<cell number> <Nveg>" line through its vegetation (and LAI) lines,
+  and a hash from the cell number to the record.  Returns the number of
+  cells.
+ ------------------------*/
+long IndexVegFile(MAPPEDFILE *m, int lai, RECORD **records, HASH *index)
+{
+  char   *p = m->data, *end = m->data + m->size, *eol, *q;
+  long   n, nalloc, k, nveg;
+
+  nalloc = 1024;
+  *records = (RECORD*) malloc(nalloc*sizeof(RECORD));
+  if (*records == NULL) {
+    printf("Cannot allocate memory to first record: records\n");
+    exit(8);
+  }
+
+  n = 0;
+  while (p < end) {
+    for (q = p; q < end && isspace((unsigned char)*q); q++);
+    if (q >= end) break;
+    if (n == nalloc) {
+      nalloc *= 2;
+      *records = (RECORD*) realloc(*records, nalloc*sizeof(RECORD));
+      if (*records == NULL) {
+	printf("Cannot allocate memory to first record: records\n");
+	exit(8);
+      }
+    }
+    (*records)[n].start = p - m->data;
+    (*records)[n].key = strtol(q, &q, 10);
+    nveg = strtol(q, &q, 10);
+
+    /* skip the cell line and its vegetation lines */
+    for (k = 0; k < 1 + nveg*(lai ? 2 : 1) && p < end; k++) {
+      eol = memchr(p, '\n', end - p);
+      p = (eol == NULL) ? end : eol + 1;
+    }
+    (*records)[n].end = p - m->data;
+    n++;
+  }
+
+  HashInit(index, n);
+  for (k = 0; k < n; k++)
+    HashPut(index, (*records)[k].key, k);
+
+  return n;
+}
+
+/* ----------------------
+  Write the kept records, in file order, merging neighbouring records
+  into one copy.  Returns the number of records written.
+ ------------------------*/
+long WriteRecords(char *outfile, MAPPEDFILE *m, RECORD *records, long nrec, char *keep)
+{
+  FILE   *fo;
+  long   k, nkept = 0;
+  size_t start, end;
+
+  if ((fo = fopen(outfile, "w")) == NULL) {
+    fprintf(stderr, "cannot open/write output file,%s\n", outfile);
+    exit(1);
+  }
+  for (k = 0; k < nrec; k++) {
+    if (!keep[k]) continue;
+    start = records[k].start;
+    end = records[k].end;
+    while (k+1 < nrec && keep[k+1] && records[k+1].start == end) {
+      end = records[++k].end;
+      nkept++;
+    }
+    fwrite(m->data + start, 1, end - start, fo);
+    nkept++;
+  }
+  fclose(fo);
+
+  return nkept;
+}
@@ -1,1063 +1,1197 @@
 /******************************************************************************
-   SUMMARY:  
-   This program is designed to create a lake parameter file for use with the VIC
-   version 4.1.1 and higher.  It reads in both an ascii dem of a VIC grid cell 
-   (in arc/info ascii format with standard 6 line header) and a classified land 
-   use map (in arc/info ascii format with standard 6 line header) to calculate 
-   either the elevation distribution versus area (VIC 4.1.1 lake parameter 
-   format) or the topographic wetness index distribution versus area 
-   (experimental VIC 4.1.2_SEA format) for wetland areas only.
-
-   The classification code in the land cover file for wetland and open water 
-   areas must be specified here (the codes associated with all other 
-   vegetation types do not matter): */
-
-#define WETLANDCLASS 2  /* modified 12 to 141 to fit ACRE*/
-#define WATERCLASS 1    /* no water class in ACRE  */
-
-/*****   
- This code assumes that the input raster grid is NOT projected, and then
-  estimates an area for a normal grid cell.  Area of the grid cell changes
-  based on the geography of the input raster file, but does not vary within
-  the raster file, when cell area should get smaller as you move away from 
-  the equator towards the poles.
-*****/
-
-/******************************************************************************
-   NOTES: DEM and vegetation file should correspond to one VIC model grid cell.  
-   They must hve the exact same domain and resolution as specified in the header.
-
-   The program uses the method presented by Pelletier (2008) to fill sinks and 
-   eliminate errors in flat areas by calculating flow accumulation using 
-   a multiple flow direction algorithm. 
-
-   REFERENCES: Jon Pelletier (2008) Quantitative Modeling of Earth Surface Processes. 
-  
-   USAGE: CreateLakeParam <DEM file> <Grid no> <vegetation file> <SEA flag> ;
-     DEM file: Name of DEM (elevation) floating point grid with arcinfo header
-     Gridno: integer - the number of the VIC grid cell for the parameter file
-     veg file: Name of land cover integer grid with arcinfo header
-     SEA flag: "SEA" for output in SEA code file format; "LAKE" for original lake model format
+   SUMMARY:
+   This program calculates the topographic wetness index (TWI) of every pixel
+   of an ascii dem of a VIC grid cell (in arc/info ascii format with standard
+   6 line header).  The output is used to find the distribution of the
+   wetness index within the grid cell.
+
+   The projection of the dem is chosen at run time:
+     geographic - the input raster grid is NOT projected.  The cell size
+                  in meters is estimated for every row of the raster, so
+                  cell area gets smaller as you move away from the equator
+                  towards the poles.
+     equalarea  - the raster file has been projected into an equal area
+                  projection before processing, cell size is in meters.
+
+******************************************************************************
+   NOTES:
+
+   The program uses the method presented by Pelletier (2008) to fill sinks and
+   eliminate errors in flat areas by calculating flow accumulation using
+   a multiple flow direction algorithm (see TerrainEngine.c).  Only the
+   products the output columns and the thresholds need are made, e.g.
+   the slope grids are not kept unless tanbeta or contour is written.
+   TERRAIN_FILL=sweep fills the DEM by the faster sweep filler of Planchon
+   and Darboux (2001) instead, whose fill is higher on wide flats (see
+   TerrainEngine.c).  TERRAIN_MFDERR=<x> routes the flow with drop^1.1
+   computed within a relative error x by faster series instead of pow()
+   (see TerrainKernels.c, and KernelBench -mfd for the change of the
+   wetness index).  The hand and chandist columns are made from the same
+   filled dem and flow accumulation, down the D8 steepest descent path of
+   each pixel to the first pixel with a flow accumulation of at least
+   -channel.
+
+   A single DEM is reported as by the original programs: a geographic
+   DEM prints "count = <valid pixels>" on stderr, an equal area (or
+   reprojected) DEM prints "Thresholds: ..." (the wetness index exceeded
+   by 5, 10, ... 30 % of the valid pixels) on stdout.  Lines of the
+   sorted layout end with a space, as the geographic output always did.
+   Levels, halo and batch runs print the thresholds of every DEM on
+   stdout.
+
+   REFERENCES: Jon Pelletier (2008) Quantitative Modeling of Earth Surface Processes.
+
+   USAGE: FindTWI [options] <DEM file> <output file> [<min elevation>]
+          FindTWI -preview <factor> [options] <cell list> <report file> [<min elevation>]
+          FindTWI -halo <pixels> [-inflow] [options] <cell list> <output dir> [<min elevation>]
+          FindTWI -batch [-depth <n>] [-io auto|uring|threads] [options] <cell list> <output dir> [<min elevation>]
+          FindTWI -ensemble <n> [-sigma <m>] [-corrlength <pixels>] [options] <cell list> <report file> [<min elevation>]
+     DEM file: Name of DEM (elevation) floating point grid with arcinfo header,
+                    or <pack>:<cell id> for a DEM in a tile pack (PackTiles)
+     output file: Name of output file, or <pack>:<cell id> to add it to a
+                    tile pack (created if it does not exist)
+     min elevation: Elevations below this are nodata (default 0 for
+                    geographic, 0.1 for equalarea to remove empty pixels
+                    created by projection)
+     -proj geographic|equalarea : projection of the DEM (default geographic)
+     -layout sorted|grid : sorted writes valid pixels from high to low
+                    wetness index; grid writes every pixel of the DEM in
+                    row order (default sorted for geographic, grid for
+                    equalarea)
+     -cols <list> : comma separated output columns, from x, y, elev, twi,
+                    sink, flowacc, tanbeta, contour, avedelev (mean drop
+                    to the lower, wetter neighbours, as in the lake
+                    parameters), hand (height above the nearest
+                    drainage, m), chandist (flow distance to the
+                    channel, m) (default x,y,twi for geographic,
+                    x,y,elev,twi,sink for equalarea)
+     -channel <m2> : flow accumulation of the channels of hand and
+                    chandist (default CHANNELAREA, 1 km2); pixels that
+                    leave the DEM before a channel are nodata
+     -reproject laea,<lon0>,<lat0> | albers,<lon0>,<lat0>,<lat1>,<lat2> :
+                    project a geographic DEM into Lambert azimuthal or
+                    Albers equal area (WGS84) before processing; the
+                    output is then written as for equalarea
+     -cellsize <m> : cell size of the projected grid (default: size of a
+                    DEM pixel at the center of the DEM)
+     -resample nearest|bilinear : resampling of the projected grid
+                    (default bilinear)
+     -levels <list> : comma separated resolution factors, e.g. 1,3,8.333
+                    for 30, 90 and 250 m from a 30 m DEM; the DEM is
+                    resampled to every level and each level is written to
+                    <output file>.<factor>x (factor 1 to <output file>)
+     -aggregate mean|min|max|median|bilinear : resampling of the levels
+                    (default mean)
+
+   PREVIEW MODE: quick check of all the cells of a basin.
+     cell list: file with the name of one DEM file per line
+     report file: one line per cell with the preview thresholds, the
+                    estimated error and a flag for cells that need a full
+                    resolution run
+     -preview <factor> : process every cell at a resolution factor times
+                    coarser.  The cells are also processed at 2*factor,
+                    and a random sample of cells at full resolution.
+                    The sample gives the resolution bias of the wetness
+                    index distribution, which is removed from the preview,
+                    and calibrates the preview vs. 2*factor discrepancy
+                    of each cell into an estimate of its error.
+     -sample <fraction> : fraction of cells run at full resolution
+                    (default 0.02, at least 3 cells)
+     -tolerance <x> : cells with an estimated mean error of ln(TWI) over
+                    the 5..95% quantiles above x are flagged (default 0.1)
+     -seed <n> : seed of the random sample (default 1)
+
+   HALO MODE: all the cells of a basin, with the flow from the neighbours.
+     cell list: file with the name of one DEM file per line, or a tile
+                    pack of DEMs; the DEMs must have the same pixel size
+                    and be aligned
+     output dir: the output file of each cell is written here with the
+                    name of its DEM file, and its thresholds are printed;
+                    if it is a tile pack (or is named .tpk), the output of
+                    each cell is added to it with the cell id of its DEM
+     -halo <pixels> : every cell is filled and routed on a window with a
+                    ring of <pixels> pixels from the adjacent cell DEMs,
+                    so flow accumulation includes the inflow from upslope
+                    cells within the halo and the cell edges have no
+                    artificial pits.  Only the pixels of the cell are
+                    written.  The cells are processed in rows, so that
+                    the neighbour DEMs stay in the DEM cache.
+     -inflow : every cell is only filled on its halo window, then routed
+                    alone with the flow that leaves the cells upstream of
+                    it across its edges, the cells going from upstream to
+                    downstream.  Flow accumulation then includes all the
+                    upslope area of the basin whatever the halo.  The
+                    cells must not overlap, and are processed one at a
+                    time.  Flow crosses most cell edges both ways, so the
+                    cells that drain into each other are routed again
+                    until their flows settle, which costs some ten to
+                    twenty times the routing of the basin.
+     -cache <MB> : memory for the cached neighbour DEMs (default 256)
+
+   BATCH MODE: every cell of a list processed alone, as by RunTWI.scr,
+     without starting a program and reading a file at a time.
+     cell list: file with the name of one DEM file per line
+     output dir: as for the halo mode
+     -batch : the DEM files are read by the bulk reader (BulkRead.c),
+                    many at a time, and parsed and processed as they
+                    arrive.  A file that cannot be read is reported and
+                    skipped.  The reads are summarized at the end (files,
+                    I/O operations, MB, IOPS and MB/s).
+     -depth <n> : files read at a time (default 32)
+     -io auto|uring|threads : read the files through io_uring or a pool
+                    of <depth> threads (default io_uring when compiled in
+                    and available)
+     -cache <MB> : memory for the files read ahead of the processing
+                    (default 256)
+
+   ENSEMBLE MODE: uncertainty of the wetness index distribution of every
+     cell due to the vertical error of the DEM.
+     cell list: file with the name of one DEM file per line
+     report file: one line per cell and quantile (5, 10, ... 95 % of the
+                    pixels below) with the wetness index of the DEM, and
+                    the mean, standard deviation and 5, 25, 50, 75 and
+                    95 % percentiles of the realisations
+     -ensemble <n> : realisations of every cell, each the DEM plus a
+                    spatially correlated Gaussian error field, filled,
+                    routed and ranked by wetness index as the DEM; the
+                    realisations of a cell run in parallel (see
+                    TerrainEnsemble.c)
+     -sigma <m> : standard deviation of the DEM error (default VERTRES,
+                    2.3 m)
+     -corrlength <pixels> : correlation length of the DEM error (default 3)
+     -seed <n> : seed of the error fields (default 1); realisation k of
+                    the n-th cell of the list is the same in every run
 
    AUTHOR:       Chun-Mei Chiu / Laura Bowling
-   DESCRIPTION:                  
-   Usage: 
-   Compile with: gcc CreateLakeParam.c -lm -o CreateLakeParam
-                 
+   DESCRIPTION:
+   Usage:
+   Compile with: gcc -O3 -fopenmp-simd FindTWIDistribution.c TerrainEngine.c TerrainKernels.c Reproject.c Resample.c TerrainCache.c TerrainTiles.c TilePack.c BulkRead.c TerrainEnsemble.c -lpthread -lm -o FindTWI
+                 (add -fopenmp to reproject and resample with several threads,
+                 to run the cells of a preview, halo or batch run in parallel,
+                 and the realisations of an ensemble run)
+                 (add -DHAVE_ZLIB and -lz to read compressed tile packs)
+                 (add -DHAVE_IO_URING to read the cells of a batch run through io_uring)
+
    COMMENTS:
    Modified: 4/22/2011
-
+   Geographic and equal area versions merged into one program.
+   Added built in equal area reprojection.
+   Added resolution levels.
+   Added preview mode.
+   Added halo mode.
+   Added basin inflow to halo mode.
+   Added tile packs.
+   Added batch mode.
+   Added ensemble mode.
+   Added HAND and distance to the channel.
+   Products made only as the output needs them.
 
 *******************************************************************************/
+#include <ctype.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include<malloc.h>
-
-/* This part is used to check time spent in various functions. */ 
-#include <sys/param.h>
-#include <sys/times.h>
-#include <sys/types.h>
-struct tms tt,uu;
-
-#define MAXSTRING 500
-#define NNEIGHBORS  8
-#define VERTRES 2.3       /* assumed vertical resolution of the dem (m) */
-#define OUTSIDEBASIN -99
-
-#define SWAP(a,b) itemp=(a);(a)=(b);(b)=itemp;
-#define M 7
-#define NSTACK 10000000
-
-#define FREE_ARG char*
-#define NR_END 1
-#define fillincrement 0.01
-#define oneoversqrt2 0.707106781187
-double **topo,**flow,**flow1,**flow2,**flow3,**flow4,**flow5,**flow6,**flow7,**flow8;
-int *iup,*idown,*jup,*jdown;
-
-typedef struct 
+#include "TerrainEngine.h"
+
+#define LAYOUT_SORTED 0
+#define LAYOUT_GRID   1
+
+#define COL_X       0
+#define COL_Y       1
+#define COL_ELEV    2
+#define COL_TWI     3
+#define COL_SINK    4
+#define COL_FLOWACC 5
+#define COL_TANBETA 6
+#define COL_CONTOUR 7
+#define COL_AVEDELEV 8
+#define COL_HAND    9
+#define COL_CHANDIST 10
+#define NCOLTYPES   11
+#define MAXCOLS     32
+#define MAXLEVELS   16
+#define NQUANT      19        /* 5, 10, ... 95 % quantiles of the preview */
+#define MINSAMPLE   3
+#define BATCHDEPTH  32        /* files read at a time by a batch run */
+#define NBANDS      5         /* percentiles of the realisations of an ensemble run */
+
+/* How the DEMs of a preview are read and resampled. */
+typedef struct
 {
-  double Rank;
-  double x;
-  double y;
-}ITEM;
-
-
-/*--- Function Declaration---*/ 
-void quick(ITEM *item, int count);
-void qs(ITEM *item, int left, int right);
-void Topindex(double **dem, double **flowacc,int columns, int rows, double xorig, double yorig, double deltax, double deltay, double nodata, char gridno[], char option[], FILE *fo);
-double correlation(double *AREASUM, double *DEMSUM, int counter7);
-void PrintResult(FILE *file, int columns, int rows, double xorig, double yorig, double delta, double nodata);
-double **Memoryalloc(int columns, int rows);
-
-/* for contributing area */
-void fillin(double **dem, int columns, int rows, double deltax, double deltay, double nodata);
-int *ivector(long nl, long nh);
-double *vector(long nl, long nh);
-void free_ivector(int *v, long nl, long nh);
-void free_vector(double *v, long nl, long nh);
-double **matrix(int nrl, int nrh, int ncl,int nch);
-void indexx(int n,double arr[], int indx[]);
-void setupgridneighbors(int lattice_size_x,int lattice_size_y);
-void fillinpitsandflats(int i,int j, int lattice_size_x,int lattice_size_y, double nodata);
-void mfdflowroute(int i,int j, double nodata);
-double get_dist(double, double, double, double);
-
-int main(int argc ,char *argv[])  
+  int        projection;
+  double     min_elev;
+  int        reproject;
+  PROJPARAMS proj;
+  double     cellsize;
+  int        resample;
+  int        aggregate;
+} READOPTS;
+
+char *ColumnNames[NCOLTYPES] = { "x", "y", "elev", "twi", "sink", "flowacc", "tanbeta", "contour",
+				 "avedelev", "hand", "chandist" };
+/* products of each column (the filled dem is always needed) */
+int ColumnProducts[NCOLTYPES] = { 0, 0, PROD_FILLED, PROD_TWI, PROD_SINK, PROD_FLOWACC,
+				  PROD_SLOPE, PROD_SLOPE, PROD_AVEDELEV, PROD_HAND, PROD_CHANDIST };
+
+/*--- Function Declaration---*/
+int  ParseColumns(char *list, int *cols);
+int  OutputProducts(int *cols, int ncols);
+int  ParseProjection(char *list, PROJPARAMS *p);
+/* output file, or tile "<pack>:<cell id>" of a pack written when closed */
+typedef struct
 {
-  FILE   *fdem, *fo, *fv;
-  char tempstr[MAXSTRING];         
-  char   demfile[1000], option[1000], gridno[1000], outfile[1000];
-  int    columns, rows, lattice_size_x, lattice_size_y;   
-  int    i, j, cnt;  /* counters */
-  double xorig, yorig, delta, nodata;  
-  double **dem, **flowacc; 
-  double min_wetland_elev, max_wetland_elev;
-
-  /* test time in each step */
-  long time_begin,time_end;
-  float elapsed_time; 
-  long time_begin2,time_end2;
-  float elapsed_time2; 
-  int temp;
-  double deltax, deltay, celllat, celllong;
-  double newlat, newlong;
-
-  /*-------------print the usage ------------------*/  
-  if (argc != 3)
-    {
-      printf("Usage: %s <DEM file> <output file>\n", argv[0]);
-      printf("\t\t DEM file : DEM (elevation) floating point grid with arcinfo header;\n");
-      printf("\t\t output file : TWI grid file\n");
-      exit(0);
+  FILE   *fp;
+  char   *text;
+  size_t size;
+} OUTPUT;
+
+int  ParseLevels(char *list, double *factors);
+void RunTWI(TERRAIN *t, int projection, char *outfile, int layout, int *cols, int ncols, int level);
+void WriteTWI(TERRAIN *t, FILE *fo, int layout, int *cols, int ncols);
+void PrintThresholds(TERRAIN *t, FILE *file);
+int  CellQuantiles(char *demfile, READOPTS *o, int nlevels, double *factors, double lnq[][NQUANT]);
+void PreviewBasin(char *listfile, char *reportfile, READOPTS *o, double factor,
+		  double sample, double tolerance, long seed);
+void HaloBasin(char *listfile, char *outdir, int halo, int inflow, double mb, int projection,
+	       double min_elev, int layout, int *cols, int ncols);
+void WriteCell(TILESET *ts, int n, TERRAIN *t, void *arg);
+void BatchBasin(char *listfile, char *outdir, int depth, int backend, double mb, int projection,
+		double min_elev, int layout, int *cols, int ncols);
+void EnsembleBasin(char *listfile, char *reportfile, READOPTS *o, int nreal, double sigma,
+		   double corrlength, long seed);
+int  CompareDoubles(const void *a, const void *b);
+void OpenOutput(char *outfile, OUTPUT *o);
+void CloseOutput(OUTPUT *o, char *outfile, TERRAIN *t, TILEPACK *pack);
+void Usage(char *name);
+
+int main(int argc ,char *argv[])
+{
+  char   demfile[1000], outfile[1000], levelfile[1100];
+  char   *colstr = NULL;
+  int    i, narg;
+  int    projection = PROJ_GEOGRAPHIC;
+  int    layout = -1;
+  int    cols[MAXCOLS], ncols;
+  double min_elev = -1;
+  double cellsize = 0;
+  int    reproject = 0, resample = RESAMPLE_BILINEAR;
+  int    nlevels = 0, aggregate = AGG_MEAN;
+  double preview = 0, sample = 0.02, tolerance = 0.1;
+  int    halo = 0, inflow = 0;
+  int    batch = 0, depth = BATCHDEPTH, backend = IO_AUTO;
+  double mb = 256;
+  long   seed = 1;
+  int    ensemble = 0;
+  double sigma = VERTRES, corrlength = ENSCORR;
+  READOPTS ro;
+  double factors[MAXLEVELS];
+  PROJPARAMS proj;
+  TERRAIN t, levels[MAXLEVELS];
+
+  /*-------------read the arguments ------------------*/
+  narg = 0;
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-proj") == 0 && i+1 < argc) {
+      i++;
+      if (strcmp(argv[i], "geographic") == 0) projection = PROJ_GEOGRAPHIC;
+      else if (strcmp(argv[i], "equalarea") == 0) projection = PROJ_EQUALAREA;
+      else Usage(argv[0]);
     }
-  strcpy(demfile, argv[1]);
-  strcpy(outfile, argv[2]);
-  
-  /*-----------------------------------------------*/
-  /*	 OPEN FILES*/
-  /*-----------------------------------------------*/  
-  if((fdem=fopen(demfile,"r"))==NULL)
-    { 
-      fprintf(stderr, "cannot open/read dem file,%s\n",demfile);
-      exit(1);
+    else if (strcmp(argv[i], "-layout") == 0 && i+1 < argc) {
+      i++;
+      if (strcmp(argv[i], "sorted") == 0) layout = LAYOUT_SORTED;
+      else if (strcmp(argv[i], "grid") == 0) layout = LAYOUT_GRID;
+      else Usage(argv[0]);
     }
-  // else {
-  // fprintf(stderr, "Opening %s\n",demfile);
-  // }
-
-  if((fo=fopen(outfile,"w"))==NULL)
-    { 
-      fprintf(stderr, "cannot open/write dem file,%s\n",outfile);
-      exit(1);
+    else if (strcmp(argv[i], "-cols") == 0 && i+1 < argc)
+      colstr = argv[++i];
+    else if (strcmp(argv[i], "-reproject") == 0 && i+1 < argc) {
+      if (ParseProjection(argv[++i], &proj) < 0) Usage(argv[0]);
+      reproject = 1;
+    }
+    else if (strcmp(argv[i], "-cellsize") == 0 && i+1 < argc)
+      cellsize = atof(argv[++i]);
+    else if (strcmp(argv[i], "-resample") == 0 && i+1 < argc) {
+      i++;
+      if (strcmp(argv[i], "nearest") == 0) resample = RESAMPLE_NEAREST;
+      else if (strcmp(argv[i], "bilinear") == 0) resample = RESAMPLE_BILINEAR;
+      else Usage(argv[0]);
+    }
+    else if (strcmp(argv[i], "-levels") == 0 && i+1 < argc) {
+      if ((nlevels = ParseLevels(argv[++i], factors)) <= 0) Usage(argv[0]);
+    }
+    else if (strcmp(argv[i], "-preview") == 0 && i+1 < argc) {
+      if ((preview = atof(argv[++i])) < 1.0) Usage(argv[0]);
+    }
+    else if (strcmp(argv[i], "-halo") == 0 && i+1 < argc) {
+      if ((halo = atoi(argv[++i])) < 1) Usage(argv[0]);
+    }
+    else if (strcmp(argv[i], "-inflow") == 0)
+      inflow = 1;
+    else if (strcmp(argv[i], "-batch") == 0)
+      batch = 1;
+    else if (strcmp(argv[i], "-depth") == 0 && i+1 < argc) {
+      if ((depth = atoi(argv[++i])) < 1) Usage(argv[0]);
     }
-  //  else {
-  // fprintf(stderr, "Opening %s\n",demfile);
-  // }
-
-  /* check data file has data inside */ 
-  if ( getc(fdem) == EOF) {
-    fprintf(stderr, "DEM is empty\n");
-    exit(0);
+    else if (strcmp(argv[i], "-io") == 0 && i+1 < argc) {
+      i++;
+      if (strcmp(argv[i], "auto") == 0) backend = IO_AUTO;
+      else if (strcmp(argv[i], "uring") == 0) backend = IO_URING;
+      else if (strcmp(argv[i], "threads") == 0) backend = IO_THREADS;
+      else Usage(argv[0]);
+    }
+    else if (strcmp(argv[i], "-cache") == 0 && i+1 < argc)
+      mb = atof(argv[++i]);
+    else if (strcmp(argv[i], "-sample") == 0 && i+1 < argc)
+      sample = atof(argv[++i]);
+    else if (strcmp(argv[i], "-tolerance") == 0 && i+1 < argc)
+      tolerance = atof(argv[++i]);
+    else if (strcmp(argv[i], "-seed") == 0 && i+1 < argc)
+      seed = atol(argv[++i]);
+    else if (strcmp(argv[i], "-channel") == 0 && i+1 < argc) {
+      if (atof(argv[++i]) <= 0) Usage(argv[0]);
+      SetChannelArea(atof(argv[i]));
+    }
+    else if (strcmp(argv[i], "-ensemble") == 0 && i+1 < argc) {
+      if ((ensemble = atoi(argv[++i])) < 1) Usage(argv[0]);
+    }
+    else if (strcmp(argv[i], "-sigma") == 0 && i+1 < argc)
+      sigma = atof(argv[++i]);
+    else if (strcmp(argv[i], "-corrlength") == 0 && i+1 < argc)
+      corrlength = atof(argv[++i]);
+    else if (strcmp(argv[i], "-aggregate") == 0 && i+1 < argc) {
+      i++;
+      if (strcmp(argv[i], "mean") == 0) aggregate = AGG_MEAN;
+      else if (strcmp(argv[i], "min") == 0) aggregate = AGG_MIN;
+      else if (strcmp(argv[i], "max") == 0) aggregate = AGG_MAX;
+      else if (strcmp(argv[i], "median") == 0) aggregate = AGG_MEDIAN;
+      else if (strcmp(argv[i], "bilinear") == 0) aggregate = AGG_BILINEAR;
+      else Usage(argv[0]);
+    }
+    else if (argv[i][0] == '-' && !isdigit(argv[i][1]) && argv[i][1] != '.')
+      Usage(argv[0]);
+    else {
+      if (narg == 0) strcpy(demfile, argv[i]);
+      else if (narg == 1) strcpy(outfile, argv[i]);
+      else if (narg == 2) min_elev = atof(argv[i]);
+      else Usage(argv[0]);
+      narg++;
+    }
+  }
+  if (narg < 2) Usage(argv[0]);
+
+  /* Defaults of the original geographic and equal area programs. */
+  if (min_elev < 0)
+    min_elev = (projection == PROJ_EQUALAREA) ? 0.1 : 0.0;
+  if (reproject) {
+    if (projection != PROJ_GEOGRAPHIC) Usage(argv[0]);
+    projection = PROJ_EQUALAREA;
+  }
+  if (layout < 0)
+    layout = (projection == PROJ_EQUALAREA) ? LAYOUT_GRID : LAYOUT_SORTED;
+  if (colstr == NULL)
+    colstr = (projection == PROJ_EQUALAREA) ? "x,y,elev,twi,sink" : "x,y,twi";
+  if ((ncols = ParseColumns(colstr, cols)) <= 0) Usage(argv[0]);
+
+  if (inflow && halo == 0) Usage(argv[0]);
+  if (ensemble > 0 && (batch || halo > 0 || nlevels > 0 || preview > 0)) Usage(argv[0]);
+  if (batch) {
+    if (halo > 0 || reproject || nlevels > 0 || preview > 0) Usage(argv[0]);
+    BatchBasin(demfile, outfile, depth, backend, mb, projection, min_elev, layout, cols, ncols);
+    return (0);
+  }
+  if (halo > 0) {
+    if (reproject || nlevels > 0 || preview > 0) Usage(argv[0]);
+    HaloBasin(demfile, outfile, halo, inflow, mb, projection, min_elev, layout, cols, ncols);
+    return (0);
   }
-  
- 
 
-  /*----------------------------------------------*/
-  /*Scan and read in DEM's and VEG's header*/
-  /*----------------------------------------------*/  
-  fscanf(fdem,"%s %d",tempstr,&columns);
-  fscanf(fdem,"%s %d",tempstr,&rows);
-  fscanf(fdem,"%s %lf",tempstr,&xorig);
-  fscanf(fdem,"%s %lf",tempstr,&yorig);
-  fscanf(fdem,"%s %lf",tempstr,&delta);
-  fscanf(fdem,"%s %lf",tempstr,&nodata);
-
-  celllat = yorig + delta*rows/2;
-  newlat = celllat + delta;
-  celllong = xorig + delta*columns/2;
-  newlong = celllong + delta;
-
-  deltax = 1000.*get_dist(celllat, celllong, celllat, newlong);
-  deltay = 1000.*get_dist(celllat, celllong, newlat, celllong);
-
-  //  fprintf(stderr, "%lf %lf %lf %lf deltax=%lf, deltay=%lf\n",celllat,celllong,newlat, newlong, deltax, deltay);
-  lattice_size_x = columns;
-  lattice_size_y = rows;
-  //  fprintf(stderr, "DEM is %d by %d\n", rows, columns);
+  if (preview > 0 || ensemble > 0) {
+    ro.projection = projection;
+    ro.min_elev = min_elev;
+    ro.reproject = reproject;
+    if (reproject) ro.proj = proj;
+    ro.cellsize = cellsize;
+    ro.resample = resample;
+    ro.aggregate = aggregate;
+    if (ensemble > 0)
+      EnsembleBasin(demfile, outfile, &ro, ensemble, sigma, corrlength, seed);
+    else
+      PreviewBasin(demfile, outfile, &ro, preview, sample, tolerance, seed);
+    return (0);
+  }
 
   /*----------------------------------------------*/
-  /* Allocate memory to arrays for handling huge data */
-  /*----------------------------------------------*/  
- 
-  dem = Memoryalloc(columns, rows);
-  flowacc = Memoryalloc(columns, rows);
-  // fprintf(stderr, "Memory allocated.\n");
-  fflush(stderr);
-
-  /*-----------------------------------------------*/
-  /* READ IN DEM's Mask FILES                      */
-  /*---------------------------------------------- */
-  for(i=0; i<rows;i++) 
-    {
-      for(j=0; j<columns; j++)
-	{
-	  fscanf(fdem,"%lf",&dem[i][j]);
-	  //fscanf(fdem,"%d",&temp);
-	  //dem[i][j] = (double) temp;
-	  if(dem[i][j] < 0)
-	    {
-	      dem[i][j] = nodata;  //check the dem file
-	    }
-	} 
-    }
-  
-  //  fprintf(stderr, "DEM read.\n");
-  
-  /***********************************/
-  /*  fill and calculate multi flow accumulation from dem.    */
-  /*  Creates filled dem (topo) and accumulation grid (flow). */
-  /***********************************/
-  
-  fillin(dem, columns, rows, deltax, deltay, nodata);
-  //  fprintf(stderr, "DEM filled\n");
- 
-  /*************************************/
-  /* wetness index calculation         */
-  /*************************************/
-
-  /* Replace dem with filled dem. Plletier code indexes arrays starting at 1, so offset is needed. */
-  for (i = 0; i < rows; i++) {
-    for (j = 0; j < columns; j++){      
-  
-
-    dem[i][j] = topo[j+1][i+1];
-      flowacc[i][j] = flow[j+1][i+1];
-      //  fprintf(stderr,"%.2lf ",flowacc[i][j]);
-      //      fprintf(stderr,"%.0lf ",dem[i][j]);
-      if (dem[i][j] == nodata )
-	cnt++;
-    }
-    //         fprintf(stderr,"\n");
-  }
-  
-  /* Check to make sure dem contains some data. */
-  if(cnt < rows*columns)
-    { 
-      /* This will generate the 526x526 grid lake paramater */
-      //      time_begin2 = times(&tt);
-      Topindex(dem, flowacc, columns, rows, xorig, yorig, deltax, deltay, nodata, gridno, option, fo);
-      //  time_end2 = times(&uu);
-      //  elapsed_time2= (float)(time_end2-time_begin2)/HZ ;
-     }
-  else {
-    printf("No valid value in this grid %s\n", gridno);
+  /* Read the DEM and crop it to the valid data   */
+  /*----------------------------------------------*/
+  if (ReadDEM(demfile, min_elev, &t) == 0 ||
+      (reproject && ReprojectTerrain(&t, &proj, cellsize, resample) == 0)) {
+    printf("No valid value in this grid %s\n", demfile);
+    FreeTerrain(&t);
+    return (0);
   }
-  cnt = 0;
 
+  if (nlevels == 0) {
+    RunTWI(&t, projection, outfile, layout, cols, ncols, 0);
+    return (0);
+  }
 
-  /*  free memory */
-  for (i = 0; i < rows; i++)
-    {
-      free(dem[i]);
+  /*----------------------------------------------*/
+  /* Resample to every level, then process each   */
+  /*----------------------------------------------*/
+  BuildPyramid(&t, nlevels, factors, aggregate, levels);
+  FreeTerrain(&t);
+  for (i = 0; i < nlevels; i++) {
+    if (factors[i] == 1.0)
+      strcpy(levelfile, outfile);
+    else
+      sprintf(levelfile, "%s.%gx", outfile, factors[i]);
+    printf("Level %gx: ", factors[i]);
+    if (levels[i].nvalid == 0) {
+      printf("No valid value in this grid %s\n", demfile);
+      FreeTerrain(&levels[i]);
+      continue;
     }
-    free(dem);
+    RunTWI(&levels[i], projection, levelfile, layout, cols, ncols, 1);
+  }
 
-  return;
+  return (0);
 } /*END OF MAIN FUNCTION*/
 
-/*****************************************************************************/
-/*   Topindex Function                                                       */
-/*****************************************************************************/
-void Topindex(double **dem, double **flowacc, int columns, int rows, double xorig , 
-	      double yorig, double deltax, double deltay, double nodata, char gridno[],
-	      char option[], FILE *fo)
-{ 
-  int xneighbor[NNEIGHBORS] = { -1, 0, 1, 1, 1, 0, -1, -1 }; /*8 neighbor*/
-  int yneighbor[NNEIGHBORS] = { 1, 1, 1, 0, -1, -1, -1, 0 }; /*8 neighbor*/
-  int    i, j, k, x, y, n, lower, count;  /* counters */
-  double  dx, dy;  
-  double  celev;  /*celev =center elevation, Delev = the difference of elevation */
-  double  neighbor_elev[NNEIGHBORS], neighbor_twi[NNEIGHBORS], temp_slope[NNEIGHBORS];
-  double  length_diagonal;
-  double  **tanbeta, **tanbeta_pixel;
-  double  **contour_length, **Delev, **AveDelev;
-  double  **wetnessindex, **mask;  
-  ITEM    *OrderedCellsDEM;
-  ITEM    *OrderedCellsTWI;
-  int     Norow, VICrow;
-
-  long time_begin,time_end;
-  float elapsed_time; 
-  int t95, t90, t85, t80, t75, t70;
-  int VICcolumn = 5;  
-
-  double **VIC;
-
-  /*-------------- allocate memory------------*/
-  /* mask */
-  mask = Memoryalloc(columns, rows);
-
-  /* wetnessindex */
-  wetnessindex = Memoryalloc(columns, rows);
-
-  /* tanbeta */
-  tanbeta = Memoryalloc(columns, rows);
-
-  /* tanbeta_pixel */
-  tanbeta_pixel = Memoryalloc(columns, rows);
-
-  /*contour_length */
-  contour_length  = Memoryalloc(columns, rows);
-
-  /*Delev */
-  Delev = Memoryalloc(columns, rows);
-
-  /* AveDelev */
-  AveDelev = Memoryalloc(columns, rows);
-
-  VIC = Memoryalloc(rows*columns, VICcolumn);
-
-
-  /******  exclude the nodata  *********/
-   /* This was already done in main. */
-   Norow = 0;
-   for(i=0; i<rows;i++) {
-     for(j=0; j<columns; j++) {
-       if(dem[i][j] == nodata)     {
-	 Norow++;
-       }}}
-   
-   VICrow = rows*columns - Norow; 
-   //   fprintf(stderr, "Active cells = %d\n", VICrow);
-
-   /*----------------------------------------------- */
-   /*          Start calculation                     */
-   /* Set 1d array to put elevation value for ranking*/
-   /* This is not really needed since flow accumulation */
-   /*   was already calculated, but it doesn't hurt. */
-   /*------------------------------------------------*/
-
-   count = (int)(rows*columns - Norow);   /*the size of 1d array */
-
-   if(count==0)    /* There is no data in this cell*/
-     { 
-       fprintf(stderr, "ERROR: No data in current cell: %s. \n", gridno );
-       exit(0);
-     }
-
-   /** Allocate memory **/
-   if(!(OrderedCellsDEM=(ITEM*) calloc(count,sizeof(ITEM)))) 
-     { 
-       printf("Cannot allocate memory to first record: OrderedCellsDEM\n");
-       exit(1); 
-     } 
-   if(!(OrderedCellsTWI=(ITEM*) calloc(count,sizeof(ITEM)))) 
-     { 
-       printf("Cannot allocate memory to first record: OrderedCellsTWI\n");
-       exit(1); 
-     } 
-
-   /* Go through each row and column,and assign the elevation = dem[row][column] */
-   count =0;
-   for(i=0; i<rows;i++) {
-     for(j=0; j<columns; j++)
-       {
-	 if(dem[i][j] != nodata) {
-	   OrderedCellsDEM[count].Rank = dem[i][j];
-	   OrderedCellsDEM[count].y = i;
-	   OrderedCellsDEM[count].x = j;
-	   count++;  
-	 }
-       }}
-
-   /* Sort OrderedCellsfine/dems into ascending order (from low to high) */
-   quick(OrderedCellsDEM, count);
-   
-
-   //   fprintf(stderr, "count=%d\n",count);
-   /* -----------------------------------------------*/
-   /* Loop through all cells in descending order(from high to low) of elevation */
-   /* -----------------------------------------------*/ 
-   for (k = count-1; k >-1; k--) 
-     { 
-       y = (int)OrderedCellsDEM[k].y;/* y is rows*/
-       x = (int)OrderedCellsDEM[k].x;/* x is columns*/	    
-       dx = deltax;  /* meter to km */
-       dy = deltay;  /* meter to km */   
-       length_diagonal = sqrt((pow(dx, 2)) + (pow(dy, 2)));
-      
-       /* fill neighbor array*/
-       for (n = 0; n < NNEIGHBORS; n++) 
-	{
-	  int xn = x + xneighbor[n]; /* calculate the x-axis of the neighbor cell */ 
-	  int yn = y + yneighbor[n]; /* calculate the y-axis of the neighbor cell */
-	  
-	  /*Initialize neighbor_elev */
-	  neighbor_elev[n] = (double) OUTSIDEBASIN;
-	  
-	  /*check to see if xn and yn are with in dem boundries*/
-	  if(xn>=0 && yn>=0 && xn<columns && yn<rows)
-	    {
-	      neighbor_elev[n] = ((dem[yn][xn]!=nodata) ?   dem[yn][xn] :(double) OUTSIDEBASIN);
-	    }
-	}
-      
-       celev = dem[y][x]; /* the elevation of the center cell */
-       lower = 0;         /* determine landscape position     */
-       for (n = 0; n < NNEIGHBORS; n++)
-	 {
-	   if(neighbor_elev[n] == OUTSIDEBASIN) 
-	     { /* If the neighbor_elev[n] still equal OUTSIDEBASIN,that means 
-		  that it doesn't initialize  */ 
-	       neighbor_elev[n] = nodata; 
-	     }
-	   
-	   /* Calculating tanbeta as tanbeta * length of cell boundary between 
-	      the cell of interest and downsloping neighbor. */
-	   if(neighbor_elev[n] < celev && neighbor_elev[n] != nodata )
-	     {
-	       if(n==0 || n==2 || n==4 || n==6)
-		 {
-		   temp_slope[n] = (celev - neighbor_elev[n])/length_diagonal; /*slope               */
-		   contour_length[y][x] += 0.2*dx+0.2*dy;                      /*contour length      */
-		   tanbeta[y][x] += temp_slope[n]*(0.2*dx+0.2*dy);             /*tan beta            */
-		 }
-	       else if(n==1||n==5)
-		 {
-		   temp_slope[n] = (celev - neighbor_elev[n])/dy; /*slope               */
-		   contour_length[y][x] += 0.6*dx ;
-		   tanbeta[y][x] += temp_slope[n]*0.6*dx;
-		 }
-	       else if (n==3||n==7)
-		 {
-		   temp_slope[n] = (celev - neighbor_elev[n])/dx; /*slope               */
-		   contour_length[y][x] += 0.6*dy;
-		   tanbeta[y][x] += temp_slope[n]*0.6*dy;
-		 }
-	       /* Count how many neighbors are lower than current pixel. */
-	       lower++;
-	     }
-	 }/* end for (n = 0; n < NNEIGHBORS; n++)*/
-     
-       /* if this is a flat area(slope doesn't change), then tanbeta = sum of 
-	  (0.5 * vertical delta of elevation data)/ horizontal distance between 
-	  centers of neighboring grid cells  --------------------------------------*/
-       if (lower == 0) 
-	 { 
-	   tanbeta[y][x] = (4.*((0.5 * VERTRES)/length_diagonal) + 
-			    (2.0*((0.5 * VERTRES)/dx)) + (2.0*((0.5 * VERTRES)/dy)))/NNEIGHBORS ;
-	   tanbeta_pixel[y][x]= (4.*((0.5 * VERTRES)/length_diagonal) + 
-			    (2.0*((0.5 * VERTRES)/dx)) + (2.0*((0.5 * VERTRES)/dy)))/NNEIGHBORS ;
-	   contour_length[y][x] = 2.*dx + 2.*dy;
-	}            
-       else {
-	 /* Calculate weighted average tanbeta at end of loop through pixel neighbors. */
-	 tanbeta_pixel[y][x] =  tanbeta[y][x]/contour_length[y][x];
-	 contour_length[y][x] /= (double)lower;
-       }
-     
-       	 /* Add in an extra safety check. */ 
-       if(tanbeta_pixel[y][x] <  (4.*((0.5 * VERTRES)/length_diagonal) + 
-			    (2.0*((0.5 * VERTRES)/dx)) + 
-				  (2.0*((0.5 * VERTRES)/dy)))/NNEIGHBORS ) {
-
-       tanbeta_pixel[y][x] = (4.*((0.5 * VERTRES)/length_diagonal) + (2.0*((0.5 * VERTRES)/dx)) + (2.0*((0.5 * VERTRES)/dy)))/NNEIGHBORS; 
-
-       }
-
-	 /* Calculate general topographic index TI = A/(C.L.* tan B) */
-       wetnessindex[y][x] = (double)(flowacc[y][x])/(contour_length[y][x]*tanbeta_pixel[y][x]);
-
-     } /* end  for (k = 0; k < count-1; k++) { */
-  
-
-     
-  /* ----------------------------------------------- */
-  /* Rank the wetness index order. */
-  /* ----------------------------------------------- */
-  
-   count = (int)(rows*columns - Norow);   /*the size of 1d array */
-   for(i=0; i<count;i++) 
-      {
-	      OrderedCellsTWI[count].Rank = 0.0;
-	      OrderedCellsTWI[count].y = 0;
-	      OrderedCellsTWI[count].x = 0;
-      }
+/* ----------------------
+  Fill, route and calculate the wetness index of a DEM, write the
+  output file and print the thresholds (for a geographic DEM that is not
+  a level, the pixel count on stderr instead).  Frees the terrain.
+ ------------------------*/
+void RunTWI(TERRAIN *t, int projection, char *outfile, int layout, int *cols, int ncols, int level)
+{
+  OUTPUT fo;
 
-    count =0;
-    for(i=0; i<rows;i++) 
-      {
-	for(j=0; j<columns; j++)
-	  {
-	      OrderedCellsTWI[count].Rank = wetnessindex[i][j];
-	      OrderedCellsTWI[count].y = i;
-	      OrderedCellsTWI[count].x = j;
-
-	      OrderedCellsDEM[count].Rank = dem[i][j];
-	      OrderedCellsDEM[count].y = i;
-	      OrderedCellsDEM[count].x = j;
-	      count++;
-	  }
-      }
- 
-    /* Sort OrderedCellsfine/wetnessindex into ascending order 
-       (from low to high) */
-    quick(OrderedCellsTWI, count);
-    quick(OrderedCellsDEM, count);
-
-    for (k =0; k<count; k++)
-      { 
-	/* Assign values to VIC array in descending TWI order (from high to low.) */
-	y = (int)OrderedCellsTWI[count-1-k].y;
-	x = (int)OrderedCellsTWI[count-1-k].x;
- 
-	VIC[0][k]= flowacc[y][x];
-	VIC[1][k]= wetnessindex[y][x];
-	VIC[2][k]= tanbeta_pixel[y][x];
-	VIC[3][k]= AveDelev[y][x];
-
-	//	fprintf(stderr, "x=%lf y=%lf\n",xorig+(1./60.)/120. +(OrderedCellsTWI[count-1-k].x/60.)/60.,yorig+.1 - (1./60)/120. - (OrderedCellsTWI[count-1-k].y/60.)/60.);
-	fprintf(fo, "%lf %lf %lf \n",xorig+(1./60.)/120. +(OrderedCellsTWI[count-1-k].x/60.)/60.,yorig+.1 - (1./60)/120. - (OrderedCellsTWI[count-1-k].y/60.)/60., VIC[1][k]);
-
-	y = OrderedCellsDEM[k].y;
-	x = OrderedCellsDEM[k].x;
-	VIC[4][k]= dem[y][x];
+  /*-----------------------------------------------*/
+  /*	 OPEN FILES*/
+  /*-----------------------------------------------*/
+  OpenOutput(outfile, &fo);
 
-      }
-    fprintf(stderr, "count = %d\n",count);
-    t95 = (int) (0.05* (float) count);
-    t90 = (int) (0.1* (float)count);
-    t85 = (int) (0.15*(float)count);
-    t80 = (int) (0.2*(float)count);
-    t75 = (int) (0.25*(float)count);
-    t70 = (int) (0.3*(float)count);
-    //  fprintf(stderr, "Thresholds: %d %lf, %d %lf, %d %lf, %d %lf, %d %lf, %d %lf\n", t95, VIC[1][t95], t90, VIC[1][t90],t85, VIC[1][t85],t80, VIC[1][t80], t75, VIC[1][t75], t70, VIC[1][t70]);
-
-  //  time_begin = times(&tt);
-
-  //  time_end = times(&uu);
-  // elapsed_time= (float)(time_end-time_begin)/HZ ;
-  
-
-  /*This is used to free the memory that have been allocated*/ 
-  for(i=0; i< VICcolumn-1; i++)
-    {
-      free(VIC[i]);     
-   }
-  free(VIC); 
-  for(i=0; i<rows; i++)  
-    { 
-      free(mask[i]);
-      free(wetnessindex[i]);
-      free(tanbeta[i]);
-      free(tanbeta_pixel[i]);
-      free(contour_length[i]);
-      free(Delev[i]);
-      free(AveDelev[i]);
-    }  
-  free(mask);
-  free(wetnessindex); 
-  free(tanbeta);
-  free(tanbeta_pixel);
-  free(contour_length);
-  free(Delev);
-  free(AveDelev);
-  //fprintf(stdout, " here here here2 elapsed_time =%f  %d %d %d %f\n", elapsed_time, i, VICcolumn, count, VIC[3][100]); 	
-  //  free(OrderedCellsfine);
-
-
-  return;
-}/* END wetness FUNCTION*/
-
-
-/* ----------------------  
-  Allocate the memory 
+  SetCellSize(t, projection);
+
+  /***********************************/
+  /*  fill, calculate multi flow accumulation from dem and the wetness  */
+  /*  index, as far as the output needs                                 */
+  /***********************************/
+  ResolveTerrain(t, OutputProducts(cols, ncols));
+
+  WriteTWI(t, fo.fp, layout, cols, ncols);
+  /* as the original programs: the geographic one only counted the pixels */
+  if (level || projection == PROJ_EQUALAREA)
+    PrintThresholds(t, stdout);
+  else
+    fprintf(stderr, "count = %d\n", t->nvalid);
+
+  CloseOutput(&fo, outfile, t, NULL);
+  FreeTerrain(t);
+}
+
+/* ----------------------
+  Open an output file, or a memory buffer for a tile of a pack.
  ------------------------*/
-double **Memoryalloc(int columns, int rows)
+void OpenOutput(char *outfile, OUTPUT *o)
 {
-  int i;
-  double **arr2;
-  /*-------------- allocate memory------------*/
-  if(!(arr2 = (double**) calloc(rows,sizeof(double*))))
-    { printf("Cannot allocate memory to first record: arr2\n");
-      exit(8); 
+  o->text = NULL;
+  o->size = 0;
+  if (PackedTileName(outfile, NULL, NULL))
+    o->fp = open_memstream(&o->text, &o->size);
+  else
+    o->fp = fopen(outfile, "w");
+  if (o->fp == NULL)
+    {
+      fprintf(stderr, "cannot open/write output file,%s\n",outfile);
+      exit(1);
     }
-  for(i=0; i<rows;i++)
-      if(!(arr2[i] = (double*) calloc(columns,sizeof(double)))) 
-	{ printf("Cannot allocate memory to first record: arr2\n");
-	  exit(8); 
-	}
-
-  return arr2;
 }
 
-
-/*-----------------------------------------------------------------
-  Quick Sort Function: this subroutine starts the quick sort
- ------------------------------------------------------------------*/
-void quick(ITEM *item, int count)
+/* ----------------------
+  Close an output file, or add the tile to its pack with the
+  georeference of the DEM.  pack is the pack if it is already open for
+  writing (shared by the threads of a halo run), or NULL.
+ ------------------------*/
+void CloseOutput(OUTPUT *o, char *outfile, TERRAIN *t, TILEPACK *pack)
 {
-  qs(item,0,count-1);
-  return;
+  char      packname[1000];
+  PACKENTRY e;
+
+  fclose(o->fp);
+  if (o->text == NULL)
+    return;
+  memset(&e, 0, sizeof(PACKENTRY));
+  PackedTileName(outfile, packname, &e.id);
+  e.type = PACK_TEXT;
+  e.fullcols = t->fullcols;
+  e.fullrows = t->fullrows;
+  e.xorig = t->xorig;
+  e.yorig = t->yorig;
+  e.delta = t->delta;
+  e.nodata = t->nodata;
+  e.size = o->size;
+  if (pack != NULL) {
+#ifdef _OPENMP
+#pragma omp critical(packout)
+#endif
+    AddPackedTile(pack, &e, o->text);
+  }
+  else
+    PutPackedTile(packname, &e, o->text);
+  free(o->text);
 }
 
-/*----------------------------------------------------------------
- this is the quick sort subroutine - it returns the values in
- an array from high to low.
- -----------------------------------------------------------------*/
-void qs(ITEM *item, int left,  int right)  
+void Usage(char *name)
 {
-  register int i,j;
-  ITEM x,y;
-  
-  i=left;
-  j=right;
-  x=item[(left+right)/2];
-  
-  do {
-    while(item[i].Rank < x.Rank && i<right) i++;
-    while(x.Rank < item[j].Rank && j>left) j--;
-    
-    if (i<=j) 
-      {
-	y=item[i];
-	item[i]=item[j];
-	item[j]=y;
-	i++;
-	j--;
-      }
-  } while (i<=j);
-  
-  if(left<j) qs(item,left,j);
-  if(i<right) qs(item,i,right); 
-
-  return;
+  printf("Usage: %s [-proj geographic|equalarea] [-layout sorted|grid] [-cols <list>] <DEM file> <output file> [<min elevation>]\n", name);
+  printf("\t\t DEM file : DEM (elevation) floating point grid with arcinfo header;\n");
+  printf("\t\t output file : TWI file, sorted list of pixels or XYZ style grid;\n");
+  printf("\t\t min elevation : Minimum elevation to process (default = 0 geographic, 0.1 equalarea);\n");
+  printf("\t\t -cols : comma separated list of x, y, elev, twi, sink, flowacc, tanbeta, contour, avedelev, hand, chandist.\n");
+  printf("\t\t -channel <m2> : flow accumulation of the channels of hand and chandist (default 1e6).\n");
+  printf("\t\t -reproject laea,<lon0>,<lat0> | albers,<lon0>,<lat0>,<lat1>,<lat2> [-cellsize <m>] [-resample nearest|bilinear]\n");
+  printf("\t\t -levels <factor list> [-aggregate mean|min|max|median|bilinear]\n");
+  printf("Preview: %s -preview <factor> [-sample <fraction>] [-tolerance <x>] [-seed <n>] [options] <cell list> <report file> [<min elevation>]\n", name);
+  printf("Halo: %s -halo <pixels> [-inflow] [-cache <MB>] [options] <cell list> <output dir> [<min elevation>]\n", name);
+  printf("Batch: %s -batch [-depth <n>] [-io auto|uring|threads] [-cache <MB>] [options] <cell list> <output dir> [<min elevation>]\n", name);
+  printf("Ensemble: %s -ensemble <n> [-sigma <m>] [-corrlength <pixels>] [-seed <n>] [options] <cell list> <report file> [<min elevation>]\n", name);
+  exit(0);
 }
 
+/* ----------------------
+  Products of the terrain needed for the output columns and the
+  thresholds (the ranked wetness index, also used by the sorted layout).
+ ------------------------*/
+int OutputProducts(int *cols, int ncols)
+{
+  int n, products = PROD_FILLED | PROD_TWIORDER;
 
+  for (n = 0; n < ncols; n++)
+    products |= ColumnProducts[cols[n]];
+  return products;
+}
 
+/* ----------------------
+  Parse the comma separated list of output columns.  Returns the number
+  of columns, or -1 for an unknown name.
+ ------------------------*/
+int ParseColumns(char *list, int *cols)
+{
+  char tempstr[MAXSTRING], *tok;
+  int  ncols = 0, n;
+
+  strncpy(tempstr, list, MAXSTRING-1);
+  tempstr[MAXSTRING-1] = '\0';
+  for (tok = strtok(tempstr, ","); tok != NULL; tok = strtok(NULL, ",")) {
+    for (n = 0; n < NCOLTYPES; n++)
+      if (strcmp(tok, ColumnNames[n]) == 0) break;
+    if (n == NCOLTYPES || ncols == MAXCOLS) {
+      fprintf(stderr, "Unknown output column %s\n", tok);
+      return -1;
+    }
+    cols[ncols++] = n;
+  }
+  return ncols;
+}
 
+/* ----------------------
+  Parse laea,<lon0>,<lat0> or albers,<lon0>,<lat0>,<lat1>,<lat2>.
+  Returns -1 for an invalid projection.
+ ------------------------*/
+int ParseProjection(char *list, PROJPARAMS *p)
+{
+  char   name[MAXSTRING];
+  double v[4];
+  int    n;
+
+  n = sscanf(list, "%[a-z],%lf,%lf,%lf,%lf", name, &v[0], &v[1], &v[2], &v[3]);
+  if (strcmp(name, "laea") == 0 && n == 3)
+    return SetupProjection(p, REPROJ_LAEA, v[0], v[1], 0., 0., WGS84_A, WGS84_E2);
+  if (strcmp(name, "albers") == 0 && n == 5)
+    return SetupProjection(p, REPROJ_ALBERS, v[0], v[1], v[2], v[3], WGS84_A, WGS84_E2);
+  fprintf(stderr, "Unknown projection %s\n", list);
+  return -1;
+}
 
+/* ----------------------
+  Parse the comma separated list of resolution factors (>= 1).
+  Returns the number of levels, or -1 for an invalid factor.
+ ------------------------*/
+int ParseLevels(char *list, double *factors)
+{
+  char tempstr[MAXSTRING], *tok;
+  int  nlevels = 0;
+
+  strncpy(tempstr, list, MAXSTRING-1);
+  tempstr[MAXSTRING-1] = '\0';
+  for (tok = strtok(tempstr, ","); tok != NULL; tok = strtok(NULL, ",")) {
+    if (nlevels == MAXLEVELS || (factors[nlevels] = atof(tok)) < 1.0) {
+      fprintf(stderr, "Invalid resolution level %s\n", tok);
+      return -1;
+    }
+    nlevels++;
+  }
+  return nlevels;
+}
 
+/* ----------------------
+  Write one line of the selected columns for pixel row,col of the crop,
+  or for a pixel outside the crop when row < 0, ended by end.
+ ------------------------*/
+static void WritePixel(TERRAIN *t, FILE *fo, int row, int col, double x, double y,
+		       int *cols, int ncols, char *end)
+{
+  int    n;
+  double value;
+
+  for (n = 0; n < ncols; n++) {
+    if (cols[n] == COL_X) value = x;
+    else if (cols[n] == COL_Y) value = y;
+    else if (row < 0 || t->dem[row][col] == t->nodata)
+      value = (cols[n] == COL_ELEV) ? t->nodata : 0.0;
+    else if (cols[n] == COL_ELEV) value = t->dem[row][col];
+    else if (cols[n] == COL_TWI) value = t->wetnessindex[row][col];
+    else if (cols[n] == COL_SINK) value = t->sink[row][col];
+    else if (cols[n] == COL_FLOWACC) value = t->flowacc[row][col];
+    else if (cols[n] == COL_TANBETA) value = t->tanbeta[row][col];
+    else if (cols[n] == COL_AVEDELEV) value = t->avedelev[row][col];
+    else if (cols[n] == COL_HAND) value = t->hand[row][col];
+    else if (cols[n] == COL_CHANDIST) value = t->chandist[row][col];
+    else value = t->contour_length[row][col];
+    fprintf(fo, (n == 0) ? "%lf" : " %lf", value);
+  }
+  fputs(end, fo);
+}
 
-/* ------------------------------------------------------------------------
- * Function: least-squares.c and correlation
- * This program computes a linear model for a set of given data.
- *
- * PROBLEM DESCRIPTION:
- *  The method of least squares is a standard technique used to find
- *  the equation of a straight line from a set of data. Equation for a
- *  straight line is given by 
- *	 y = mx + b
- *  where m is the slope of the line and b is the y-intercept.
- *
- *  Given a set of n points {(x1,y1), x2,y2),...,xn,yn)}, let
- *      SUMx = x1 + x2 + ... + xn
- *      SUMy = y1 + y2 + ... + yn
- *      SUMxy = x1*y1 + x2*y2 + ... + xn*yn
- *      SUMxx = x1*x1 + x2*x2 + ... + xn*xn
- *
- *  The slope and y-intercept for the least-squares line can be 
- *  calculated using the following equations:
- *        slope (m) = ( n*SUMxy -SUMx*SUMy ) / ( n*SUMxx - SUMx*SUMx ) 
- *  y-intercept (b) = ( SUMy - slope*SUMx ) / n
- *  R  = ( n*SUMxy - SUMx*SUMy ) / sqrt(( n*SUMxx - SUMx*SUMx)*(n*SUMyy - SUMy*SUMy));
- *
- * AUTHOR: Dora Abdullah (Fortran version, 11/96)
- * REVISED: RYL (converted to C, 12/11/96)
- * ADAPTED: CMC (add correlation calculation)
- * ---------------------------------------------------------------------- */
-double correlation (double *x, double *y, int n)
+/* ----------------------
+  Write the TWI output file, either sorted in descending wetness index
+  order (valid pixels only, each line ending with a space as in the
+  original geographic program) or the full DEM grid in row order.
+ ------------------------*/
+void WriteTWI(TERRAIN *t, FILE *fo, int layout, int *cols, int ncols)
 {
-  double SUMx, SUMy, SUMxy, SUMxx, SUMyy, SUMres, res, slope, y_intercept, y_estimate, cor;
-  int i;
-   
-  SUMx = 0; 
-  SUMy = 0; 
-  SUMxy = 0; 
-  SUMxx = 0;
-  SUMyy = 0;
-
-  for (i=0; i<n; i++) 
-    {
-      SUMx = SUMx + x[i];
-      SUMy = SUMy + y[i];
-      SUMxy = SUMxy + x[i]*y[i];
-      SUMxx = SUMxx + x[i]*x[i];
-      SUMyy = SUMyy + y[i]*y[i];
+  ITEM   *OrderedCellsTWI;
+  int    k, x, y;
+  double xc, yc;
+
+  if (layout == LAYOUT_SORTED) {
+    ResolveTerrain(t, PROD_TWIORDER);
+    OrderedCellsTWI = t->twiorder;
+    for (k = t->nvalid-1; k >= 0; k--) {
+      y = (int)OrderedCellsTWI[k].y;
+      x = (int)OrderedCellsTWI[k].x;
+      PixelCenter(t, y, x, &xc, &yc);
+      WritePixel(t, fo, y, x, xc, yc, cols, ncols, " \n");
     }
-  slope = ( n*SUMxy -  SUMx*SUMy ) / ( n*SUMxx - SUMx*SUMx );
-  y_intercept = ( SUMy - slope*SUMx ) / n;
-  cor =   ( n*SUMxy - SUMx*SUMy ) / sqrt(( n*SUMxx - SUMx*SUMx)*(n*SUMyy - SUMy*SUMy));
-  //printf ("\n The linear equation that best fits the given data:\n");
-  //printf (" y = %6.2lfx + %6.2lf\n", slope, y_intercept);
-  //printf ("--------------------------------------------------\n");
-  //printf ("   Original (x,y)     Estimated y     Residual\n");
-      
-  SUMres = 0;
-  for (i=0; i<n ; i++) 
-    {
-      y_estimate = slope*x[i] + y_intercept;
-      res = y[i] - y_estimate;
-      SUMres = SUMres + res*res;
-      //printf ("(%6.2lf %6.2lf) %6.2lf %6.2lf\n", x[i], y[i], y_estimate, res);
+  }
+  else {
+    /* Pixels outside the crop are nodata. */
+    for (y = 0; y < t->fullrows; y++) {
+      for (x = 0; x < t->fullcols; x++) {
+	PixelCenter(t, y - t->row0, x - t->col0, &xc, &yc);
+	if (y < t->row0 || y >= t->row0+t->rows || x < t->col0 || x >= t->col0+t->columns)
+	  WritePixel(t, fo, -1, -1, xc, yc, cols, ncols, "\n");
+	else
+	  WritePixel(t, fo, y - t->row0, x - t->col0, xc, yc, cols, ncols, "\n");
+      }
     }
-  //printf("--------------------------------------------------\n");
-  //printf("Residual sum = %6.2lf  correlation = %6.2lf \n", SUMres, cor);
-
-  return (cor);
+  }
 }
 
+/* ----------------------
+  Print the wetness index exceeded by 5, 10, 15, 20, 25 and 30 % of
+  the valid pixels.
+ ------------------------*/
+void PrintThresholds(TERRAIN *t, FILE *file)
+{
+  ITEM *OrderedCellsTWI;
+  int  count = t->nvalid;
+  int  t95, t90, t85, t80, t75, t70;
+
+  ResolveTerrain(t, PROD_TWIORDER);
+  OrderedCellsTWI = t->twiorder;
+  t95 = (int) (0.05*(float)count);
+  t90 = (int) (0.1*(float)count);
+  t85 = (int) (0.15*(float)count);
+  t80 = (int) (0.2*(float)count);
+  t75 = (int) (0.25*(float)count);
+  t70 = (int) (0.3*(float)count);
+  fprintf(file, "Thresholds: %lf, %lf, %lf, %lf, %lf, %lf\n",
+	  OrderedCellsTWI[count-1-t95].Rank, OrderedCellsTWI[count-1-t90].Rank,
+	  OrderedCellsTWI[count-1-t85].Rank, OrderedCellsTWI[count-1-t80].Rank,
+	  OrderedCellsTWI[count-1-t75].Rank, OrderedCellsTWI[count-1-t70].Rank);
+}
 
+/* ----------------------
+  Quantiles (5, 10, ... 95 %) of ln(TWI) of a cell DEM at each of the
+  resolution factors.  Returns 0 when the DEM has no valid data.
+ ------------------------*/
+int CellQuantiles(char *demfile, READOPTS *o, int nlevels, double *factors, double lnq[][NQUANT])
+{
+  TERRAIN t, levels[MAXLEVELS];
+  ITEM    *ordered;
+  int     l, q, ok;
+
+  if (ReadDEM(demfile, o->min_elev, &t) == 0 ||
+      (o->reproject && ReprojectTerrain(&t, &o->proj, o->cellsize, o->resample) == 0)) {
+    FreeTerrain(&t);
+    return 0;
+  }
+  BuildPyramid(&t, nlevels, factors, o->aggregate, levels);
+  FreeTerrain(&t);
+
+  ok = 1;
+  for (l = 0; l < nlevels; l++) {
+    if (levels[l].nvalid == 0) {
+      ok = 0;
+      FreeTerrain(&levels[l]);
+      continue;
+    }
+    SetCellSize(&levels[l], o->reproject ? PROJ_EQUALAREA : o->projection);
+    ResolveTerrain(&levels[l], PROD_TWIORDER);
+    ordered = levels[l].twiorder;
+    for (q = 0; q < NQUANT; q++)
+      lnq[l][q] = log(ordered[(int)(0.05*(q+1)*(levels[l].nvalid-1) + 0.5)].Rank);
+    FreeTerrain(&levels[l]);
+  }
+  return ok;
+}
 
-
-
-
-
-
-
-/***************************************************************************/
-/*                     Fill increment                                     */
-/* Creates the global filled dem matrix (topo) and flow accumulation (flow) */
-/* size_x = columns, size_y = rows [i][j] rows:columns
-/**************************************************************************/
-void fillin(double **dem, int lattice_size_x, int lattice_size_y, double deltax, double deltay, double nodata)
+/* ----------------------
+  Preview of all the cells of a basin, see PREVIEW MODE above.
+ ------------------------*/
+void PreviewBasin(char *listfile, char *reportfile, READOPTS *o, double factor,
+		  double sample, double tolerance, long seed)
 {
-  int i,j,t,*topovecind;
-  double *topovec;
-
-  setupgridneighbors(lattice_size_x, lattice_size_y); /* The neighbor setting */
-
-  topo=matrix(1,lattice_size_x,1,lattice_size_y);
-  topovec=vector(1,lattice_size_x*lattice_size_y);
-  topovecind=ivector(1,lattice_size_x*lattice_size_y);
-  flow=matrix(1,lattice_size_x,1,lattice_size_y);
-  flow1=matrix(1,lattice_size_x,1,lattice_size_y);
-  flow2=matrix(1,lattice_size_x,1,lattice_size_y);
-  flow3=matrix(1,lattice_size_x,1,lattice_size_y);
-  flow4=matrix(1,lattice_size_x,1,lattice_size_y);
-  flow5=matrix(1,lattice_size_x,1,lattice_size_y);
-  flow6=matrix(1,lattice_size_x,1,lattice_size_y);
-  flow7=matrix(1,lattice_size_x,1,lattice_size_y);
-  flow8=matrix(1,lattice_size_x,1,lattice_size_y);
-
-  /* Indexing conventions are different than we typically use. */
-  /* topo begins indexing at 1 not zero and topo[col][row] vs. dem[row][col] */
-
-  for (j=1;j<=lattice_size_y;j++) {
-    for (i=1;i<=lattice_size_x;i++)
-      {
-	topo[i][j] = dem[j-1][i-1];
-        flow[i][j]= deltax*deltay;
-      } }
-
-  for (j=1;j<=lattice_size_y;j++) {
-    for (i=1;i<=lattice_size_x;i++)
-      {
-
-	fillinpitsandflats(i,j,lattice_size_x, lattice_size_y, nodata);
-      } }
-
-  //  fprintf(stderr, "Done with fill...\n");
-    
-  for (j=1; j<=lattice_size_y; j++){
-    for (i=1; i<=lattice_size_x; i++){
-      topovec[(j-1)*lattice_size_x+i]=topo[i][j];
-    }}
-  
-  indexx(lattice_size_x*lattice_size_y,topovec,topovecind);
-  t=lattice_size_x*lattice_size_y+1;
-
-  while (t>1)
-    {t--;
-      i=(topovecind[t])%lattice_size_x;
-      if (i==0) i=lattice_size_x;
-      j=(topovecind[t])/lattice_size_x+1;
-      if (i==lattice_size_x) j--;
-      mfdflowroute(i,j, nodata);
+  FILE   *fl, *fr;
+  char   tempstr[MAXSTRING], **cells;
+  int    ncells, nsample, c, k, q, tmp, nflag, *order, *insample, *ok;
+  double (*preview)[NQUANT], (*coarse)[NQUANT], (*full)[NQUANT];
+  double factors[3], lnq[3][NQUANT];
+  double bfull[NQUANT], bcoarse[NQUANT], *disc, *err, *est;
+  double sumed, sumdd, sume, nused, d;
+
+  if((fl=fopen(listfile,"r"))==NULL)
+    {
+      fprintf(stderr, "cannot open/read cell list,%s\n",listfile);
+      exit(1);
     }
+  ncells = 0;
+  while (fscanf(fl, "%s", tempstr) == 1) ncells++;
+  rewind(fl);
+  if (ncells == 0) {
+    fprintf(stderr, "No cells in %s\n", listfile);
+    exit(1);
+  }
 
-} /* End of fillin() */
+  cells = (char**) calloc(ncells, sizeof(char*));
+  order = (int*) calloc(ncells, sizeof(int));
+  insample = (int*) calloc(ncells, sizeof(int));
+  ok = (int*) calloc(ncells, sizeof(int));
+  preview = calloc(ncells, sizeof(*preview));
+  coarse = calloc(ncells, sizeof(*coarse));
+  full = calloc(ncells, sizeof(*full));
+  disc = (double*) calloc(ncells, sizeof(double));
+  err = (double*) calloc(ncells, sizeof(double));
+  est = (double*) calloc(ncells, sizeof(double));
+  if (cells == NULL || order == NULL || insample == NULL || ok == NULL || preview == NULL ||
+      coarse == NULL || full == NULL || disc == NULL || err == NULL || est == NULL)
+    { printf("Cannot allocate memory to first record: cells\n");
+      exit(8);
+    }
+  for (c = 0; c < ncells; c++) {
+    fscanf(fl, "%s", tempstr);
+    cells[c] = strdup(tempstr);
+    order[c] = c;
+  }
+  fclose(fl);
+
+  /* Random sample of cells for the full resolution run. */
+  nsample = (int)ceil(sample*ncells);
+  if (nsample < MINSAMPLE) nsample = MINSAMPLE;
+  if (nsample > ncells) nsample = ncells;
+  srand48(seed);
+  for (k = 0; k < nsample; k++) {
+    c = k + (int)(drand48()*(ncells - k));
+    tmp = order[k]; order[k] = order[c]; order[c] = tmp;
+    insample[order[k]] = 1;
+  }
 
+  /* Cells are independent, so they are shared between threads. */
+#pragma omp parallel for schedule(dynamic) private(factors, lnq, q)
+  for (c = 0; c < ncells; c++) {
+    factors[0] = factor;
+    factors[1] = 2.*factor;
+    factors[2] = 1.0;
+    ok[c] = CellQuantiles(cells[c], o, insample[c] ? 3 : 2, factors, lnq);
+    for (q = 0; q < NQUANT; q++) {
+      preview[c][q] = lnq[0][q];
+      coarse[c][q] = lnq[1][q];
+      full[c][q] = lnq[2][q];
+    }
+  }
 
-int *ivector(long nl,long nh)
-{ /* allocate an int vector with subscript range v[nl..nh] */
-        int *v;
+  /* Resolution bias of the preview vs. full resolution and vs. 2*factor. */
+  for (q = 0; q < NQUANT; q++) {
+    bfull[q] = bcoarse[q] = 0.0;
+    for (c = 0, nused = 0; c < ncells; c++)
+      if (ok[c] && insample[c]) { bfull[q] += full[c][q] - preview[c][q]; nused++; }
+    if (nused > 0) bfull[q] /= nused;
+    for (c = 0, nused = 0; c < ncells; c++)
+      if (ok[c]) { bcoarse[q] += preview[c][q] - coarse[c][q]; nused++; }
+    if (nused > 0) bcoarse[q] /= nused;
+  }
 
-        v=(int *)malloc((unsigned int) ((nh-nl+1+NR_END)*sizeof(int)));
-        return v-nl+NR_END;
-}
+  /* Discrepancy of every cell, error of the sampled cells, and the
+     factor that turns one into the other (least squares). */
+  sumed = sumdd = sume = nused = 0.0;
+  for (c = 0; c < ncells; c++) {
+    if (!ok[c]) continue;
+    for (q = 0; q < NQUANT; q++) {
+      disc[c] += fabs(preview[c][q] - coarse[c][q] - bcoarse[q]);
+      if (insample[c]) err[c] += fabs(full[c][q] - preview[c][q] - bfull[q]);
+    }
+    disc[c] /= NQUANT;
+    err[c] /= NQUANT;
+    if (insample[c]) {
+      sumed += err[c]*disc[c];
+      sumdd += disc[c]*disc[c];
+      sume += err[c];
+      nused++;
+    }
+  }
+  d = (sumdd > 0) ? sumed/sumdd : 0.0;
 
-double *vector(long nl, long nh)
-{ /* allocate a double vector with subscript range v[nl..nh] */
-        double *v;
+  if((fr=fopen(reportfile,"w"))==NULL)
+    {
+      fprintf(stderr, "cannot open/write report file,%s\n",reportfile);
+      exit(1);
+    }
+  fprintf(fr, "# cell t95 t90 t85 t80 t75 t70 estimated_error sample_error flag\n");
+  nflag = 0;
+  for (c = 0; c < ncells; c++) {
+    if (!ok[c]) {
+      fprintf(fr, "%s nodata\n", cells[c]);
+      continue;
+    }
+    est[c] = insample[c] ? err[c] : d*disc[c];
+    fprintf(fr, "%s", cells[c]);
+    /* bias corrected wetness index exceeded by 5, 10, ... 30 % of the pixels */
+    for (q = NQUANT-1; q >= NQUANT-6; q--)
+      fprintf(fr, " %lf", exp(preview[c][q] + bfull[q]));
+    fprintf(fr, " %.4lf %.4lf %s\n", est[c], insample[c] ? err[c] : -1.0,
+	    (est[c] > tolerance) ? "FULL" : "OK");
+    if (est[c] > tolerance) nflag++;
+  }
+  fclose(fr);
 
-        v=(double *)malloc((unsigned) ((nh-nl+1+NR_END)*sizeof(double)));
-        return v-nl+NR_END;
-}
+  printf("Preview %gx of %d cells, %d at full resolution: mean sample error %.4lf, "
+	 "error/discrepancy %.3lf, %d cells flagged for a full run\n",
+	 factor, ncells, (int)nused, (nused > 0) ? sume/nused : 0.0, d, nflag);
 
-void free_ivector(int *v, long nl, long nh)
-{ /* free an int vector allocated with ivector() */
-        free((FREE_ARG) (v+nl-NR_END));
+  for (c = 0; c < ncells; c++) free(cells[c]);
+  free(cells); free(order); free(insample); free(ok);
+  free(preview); free(coarse); free(full);
+  free(disc); free(err); free(est);
 }
 
-void free_vector(double *v, long nl, long nh)
-{ /* free an int vector allocated with ivector() */
-        free((FREE_ARG) (v+nl-NR_END));
+/* ----------------------
+  Ensemble run of all the cells of a basin, see ENSEMBLE MODE above.
+ ------------------------*/
+void EnsembleBasin(char *listfile, char *reportfile, READOPTS *o, int nreal, double sigma,
+		   double corrlength, long seed)
+{
+  static const double bands[NBANDS] = { 0.05, 0.25, 0.5, 0.75, 0.95 };
+  FILE   *fl, *fr;
+  char   tempstr[MAXSTRING];
+  int    ncells = 0, nwidth = 0, c, q, n, b;
+  double levels[NQUANT], base[NQUANT], pct[NBANDS], *real, *v, mean, var, x, width = 0.;
+  TERRAIN t;
+
+  if((fl=fopen(listfile,"r"))==NULL)
+    {
+      fprintf(stderr, "cannot open/read cell list,%s\n",listfile);
+      exit(1);
+    }
+  if((fr=fopen(reportfile,"w"))==NULL)
+    {
+      fprintf(stderr, "cannot open/write report file,%s\n",reportfile);
+      exit(1);
+    }
+  real = (double*) malloc((size_t)nreal*NQUANT*sizeof(double));
+  v = (double*) malloc(nreal*sizeof(double));
+  if (real == NULL || v == NULL)
+    { printf("Cannot allocate memory to first record: realisations\n");
+      exit(8);
+    }
+  for (q = 0; q < NQUANT; q++)
+    levels[q] = 0.05*(q+1);
+
+  fprintf(fr, "# cell quantile dem mean sd p5 p25 p50 p75 p95\n");
+  for (c = 0; fscanf(fl, "%s", tempstr) == 1; c++) {
+    if (ReadDEM(tempstr, o->min_elev, &t) == 0 ||
+	(o->reproject && ReprojectTerrain(&t, &o->proj, o->cellsize, o->resample) == 0)) {
+      fprintf(fr, "%s nodata\n", tempstr);
+      FreeTerrain(&t);
+      continue;
+    }
+    SetCellSize(&t, o->reproject ? PROJ_EQUALAREA : o->projection);
+
+    /* the realisations first, the DEM itself is then filled in place */
+    EnsembleQuantiles(&t, nreal, sigma, corrlength, (uint64_t)seed << 32 ^ (uint64_t)c,
+		      NQUANT, levels, real);
+    ResolveTerrain(&t, PROD_TWIORDER);
+    for (q = 0; q < NQUANT; q++)
+      base[q] = t.twiorder[(int)(levels[q]*(t.nvalid-1) + 0.5)].Rank;
+
+    for (q = 0; q < NQUANT; q++) {
+      for (n = 0, mean = 0.; n < nreal; n++) {
+	v[n] = real[(size_t)n*NQUANT + q];
+	mean += v[n]/nreal;
+      }
+      for (n = 0, var = 0.; n < nreal; n++)
+	var += (v[n] - mean)*(v[n] - mean);
+      qsort(v, nreal, sizeof(double), CompareDoubles);
+      for (b = 0; b < NBANDS; b++) {
+	/* percentile by linear interpolation between the ranked realisations */
+	x = bands[b]*(nreal-1);
+	n = (int)x;
+	pct[b] = (n+1 < nreal) ? v[n] + (x-n)*(v[n+1] - v[n]) : v[n];
+      }
+      fprintf(fr, "%s %.2lf %lf %lf %lf", tempstr, levels[q], base[q], mean,
+	      (nreal > 1) ? sqrt(var/(nreal-1)) : 0.);
+      for (b = 0; b < NBANDS; b++)
+	fprintf(fr, " %lf", pct[b]);
+      fprintf(fr, "\n");
+      /* the thresholds are the quantiles from 70 % up */
+      if (q >= NQUANT-6 && pct[0] > 0.) {
+	width += log(pct[NBANDS-1]/pct[0]);
+	nwidth++;
+      }
+    }
+    ncells++;
+    FreeTerrain(&t);
+  }
+  fclose(fl);
+  fclose(fr);
+
+  printf("Ensemble of %d realisations of %d cells (sigma %g m, correlation length %g pixels): "
+	 "mean 5-95%% band of ln(TWI) of the thresholds %.4lf\n", nreal, ncells, sigma, corrlength,
+	 (nwidth > 0) ? width/nwidth : 0.0);
+  free(real);
+  free(v);
 }
 
-double **matrix(int nrl,int nrh,int ncl,int nch)
-{  /* allocate a double matrix with subscript range m[nrl..nrh][ncl..nch] */
-  int i, nrow=nrh-nrl+1,ncol=nch-ncl+1;
-  double **m;
-
-    /*allocate pointers to rows */
-    m=(double **) malloc((unsigned) (nrow+1)*sizeof(double*));
-    m+=1;
-    m -= nrl;
-    
-    m[nrl]=(double *) malloc((unsigned)((nrow*ncol+1)*sizeof(double)));
-    m[nrl] += 1;
-    m[nrl] -= ncl;
-
-   /*allocate rows and set pointers to them */
-    for(i=nrl+1;i<=nrh;i++) {
-      m[i]= m[i]=m[i-1]+ncol;
-    }
-    /* return pointer to array of pointers to rows */
-    return m;
+int CompareDoubles(const void *a, const void *b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+
+  return (x > y) - (x < y);
 }
 
+/* output of the cells of a halo run */
+typedef struct
+{
+  char     *outdir;
+  TILEPACK *pack;              /* output dir is a pack */
+  int      layout, *cols, ncols;
+} CELLOUT;
 
+static void CellOutput(char *dem, TERRAIN *t, CELLOUT *out);
 
-void indexx(int n,double arr[], int indx[])
+/* ----------------------
+  Halo run of all the cells of a basin, see HALO MODE above.
+ ------------------------*/
+void HaloBasin(char *listfile, char *outdir, int halo, int inflow, double mb, int projection,
+	       double min_elev, int layout, int *cols, int ncols)
 {
-        unsigned long i,indxt,ir=n,itemp,j,k,l=1;
-        int jstack=0,*istack;
-        double a;
-
-        istack=ivector(1,NSTACK);
-        for (j=1;j<=n;j++) indx[j]=j;
-        for (;;) {
-                if (ir-l < M) {
-                        for (j=l+1;j<=ir;j++) {
-                                indxt=indx[j];
-                                a=arr[indxt];
-                                for (i=j-1;i>=1;i--) {
-                                        if (arr[indx[i]] <= a) break;
-                                        indx[i+1]=indx[i];
-                                }
-                                indx[i+1]=indxt;
-                        }
-                        if (jstack == 0) break;
-                        ir=istack[jstack--];
-                        l=istack[jstack--];
-                } else {
-                        k=(l+ir) >> 1;
-                        SWAP(indx[k],indx[l+1]);
-                        if (arr[indx[l+1]] > arr[indx[ir]]) {
-                                SWAP(indx[l+1],indx[ir])
-                        }
-                        if (arr[indx[l]] > arr[indx[ir]]) {
-                                SWAP(indx[l],indx[ir])
-                        }
-                        if (arr[indx[l+1]] > arr[indx[l]]) {
-                                SWAP(indx[l+1],indx[l])
-                        }
-                        i=l+1;
-                        j=ir;
-                        indxt=indx[l];
-                        a=arr[indxt];
-                        for (;;) {
-                                do i++; while (arr[indx[i]] < a);
-                                do j--; while (arr[indx[j]] > a);
-                                if (j < i) break;
-                                SWAP(indx[i],indx[j])
-                        }
-                        indx[l]=indx[j];
-                        indx[j]=indxt;
-                        jstack += 2;
-                        if (ir-i+1 >= j-l) {
-                                istack[jstack]=ir;
-                                istack[jstack-1]=i;
-                                ir=j-1;
-                        } else {
-                                istack[jstack]=j-1;
-                                istack[jstack-1]=l;
-                                l=i;
-                        }
-                }
-        }
-        free_ivector(istack,1,NSTACK);
-}
-#undef M
-#undef NSTACK
-#undef SWAP
-
-
-void setupgridneighbors(int lattice_size_x, int lattice_size_y)
-{    int i,j;
-
-     idown=ivector(1,lattice_size_x);
-     iup=ivector(1,lattice_size_x);
-     jup=ivector(1,lattice_size_y);
-     jdown=ivector(1,lattice_size_y);
-     
-     for (i=1;i<=lattice_size_x;i++)
-      {
-	idown[i]=i-1;
-	iup[i]=i+1;
-      }
-     idown[1]=1;
+  TILESET      ts;
+  TERRAINCACHE *cache;
+  CACHESTATS   stats;
+  CELLOUT      out;
+  int          *order, k, ncycle;
+
+  if (ReadTileSet(listfile, &ts) == 0) {
+    fprintf(stderr, "No cells in %s\n", listfile);
+    exit(1);
+  }
+  cache = NewTerrainCache((size_t)(mb*1048576.0), 8);
+  out.outdir = outdir;
+  out.pack = NULL;
+  if (IsTilePack(outdir) ||
+      (strlen(outdir) > 4 && strcmp(outdir + strlen(outdir) - 4, ".tpk") == 0))
+    out.pack = UpdateTilePack(outdir, 0);
+  out.layout = layout;
+  out.cols = cols;
+  out.ncols = ncols;
+
+  if (inflow) {
+    if ((ncycle = RouteBasin(cache, &ts, halo, min_elev, projection, WriteCell, &out)) > 0)
+      fprintf(stderr, "%d cells drain into each other and were routed together\n", ncycle);
+  }
+  else {
+    order = TileOrder(&ts);
 
-     iup[lattice_size_x]=lattice_size_x;
+    /* Threads take the cells in order, so they share their neighbours. */
+#pragma omp parallel for schedule(dynamic,1)
+    for (k = 0; k < ts.ntiles; k++) {
+      TERRAIN t;
+      int     n = order[k];
 
-     for (j=1;j<=lattice_size_y;j++)
-      {
-	jdown[j]=j-1;
-	jup[j]=j+1;
+      if (HaloTerrain(cache, &ts, n, halo, min_elev, projection, &t) == 0) {
+#ifdef _OPENMP
+#pragma omp critical(haloprint)
+#endif
+	printf("No valid value in this grid %s\n", ts.tiles[n].dem);
+	continue;
       }
-     jdown[1]=1;
-     jup[lattice_size_y]=lattice_size_y;
+      WriteCell(&ts, n, &t, &out);
+      FreeTerrain(&t);
+    }
+    free(order);
+  }
+
+  TerrainCacheStats(cache, &stats);
+  fprintf(stderr, "Halo %d pixels, %d cells: DEM cache hits %ld, misses %ld, evictions %ld\n",
+	  halo, ts.ntiles, stats.hits, stats.misses, stats.evictions);
+  if (out.pack != NULL)
+    CloseTilePack(out.pack);
+  FreeTerrainCache(cache);
+  FreeTileSet(&ts);
 }
 
-void fillinpitsandflats(int i,int j, int lattice_size_x, int lattice_size_y, double nodata)
-{    double min;
-     
-
-     if (topo[i][j] != nodata)   min=topo[i][j]; 
-     if (topo[iup[i]][j] < min && topo[iup[i]][j] != nodata ) min=topo[iup[i]][j];
-     if (topo[idown[i]][j]<min && topo[idown[i]][j] != nodata) min=topo[idown[i]][j];
-     if (topo[i][jup[j]]<min && topo[i][jup[j]]!= nodata) min=topo[i][jup[j]];
-     if (topo[i][jdown[j]]<min && topo[i][jdown[j]] != nodata) min=topo[i][jdown[j]];
-     if (topo[iup[i]][jup[j]]<min && topo[iup[i]][jup[j]] != nodata) min=topo[iup[i]][jup[j]];
-     if (topo[idown[i]][jup[j]]<min && topo[idown[i]][jup[j]] != nodata) min=topo[idown[i]][jup[j]];
-     if (topo[idown[i]][jdown[j]]<min && topo[idown[i]][jdown[j]] != nodata) min=topo[idown[i]][jdown[j]];
-     if (topo[iup[i]][jdown[j]]<min && topo[iup[i]][jdown[j]] != nodata) min=topo[iup[i]][jdown[j]];
-
-     if ((topo[i][j] <= min)&& (topo[i][j]!=nodata)&&(i>1)&&(j>1)&&(i<lattice_size_x)&&(j<lattice_size_y))
-      {
-	topo[i][j]=min+fillincrement;
-	fillinpitsandflats(i,j, lattice_size_x, lattice_size_y, nodata);
-	fillinpitsandflats(iup[i],j, lattice_size_x, lattice_size_y, nodata);
-	fillinpitsandflats(idown[i],j, lattice_size_x, lattice_size_y, nodata);
-	fillinpitsandflats(i,jup[j], lattice_size_x, lattice_size_y, nodata);
-	fillinpitsandflats(i,jdown[j], lattice_size_x, lattice_size_y, nodata);
-	fillinpitsandflats(iup[i],jup[j], lattice_size_x, lattice_size_y, nodata);
-	fillinpitsandflats(idown[i],jup[j], lattice_size_x, lattice_size_y, nodata);
-	fillinpitsandflats(idown[i],jdown[j], lattice_size_x, lattice_size_y, nodata);
-	fillinpitsandflats(iup[i],jdown[j], lattice_size_x, lattice_size_y, nodata);
-      }
-    
+/* ----------------------
+  Write the output file of cell n to the output directory (CELLOUT arg),
+  or its tile to the output pack, and print its thresholds.
+ ------------------------*/
+void WriteCell(TILESET *ts, int n, TERRAIN *t, void *arg)
+{
+  CellOutput(ts->tiles[n].dem, t, (CELLOUT*)arg);
 }
 
-void mfdflowroute(int i,int j, double nodata)
-{ 
-  double tot;
- 
-  if(topo[i][j] == nodata)
-    flow1[i][j]=flow2[i][j]=flow3[i][j]=flow4[i][j]=flow5[i][j]=flow6[i][j]=flow7[i][j]=flow8[i][j]=0.0;
+/* ----------------------
+  Write the output of the cell of a DEM file, see WriteCell().
+ ------------------------*/
+static void CellOutput(char *dem, TERRAIN *t, CELLOUT *out)
+{
+  OUTPUT  fo;
+  char    outfile[2*MAXSTRING], *base;
+  int     id;
+
+  if (out->pack != NULL) {
+    if ((id = TileCellId(dem)) < 0) {
+      fprintf(stderr, "ERROR: no cell id in the name of %s\n", dem);
+      exit(1);
+    }
+    sprintf(outfile, "%s:%d", out->outdir, id);
+  }
   else {
-     tot=0.;
-     if (topo[i][j]>topo[iup[i]][j] && topo[iup[i]][j]!= nodata) 
-      tot+=pow(topo[i][j]-topo[iup[i]][j],1.1);
-     if (topo[i][j]>topo[idown[i]][j] && topo[idown[i]][j]!= nodata) 
-      tot+=pow(topo[i][j]-topo[idown[i]][j],1.1);
-     if (topo[i][j]>topo[i][jup[j]] && topo[i][jup[j]]!= nodata) 
-      tot+=pow(topo[i][j]-topo[i][jup[j]],1.1);
-     if (topo[i][j]>topo[i][jdown[j]] && topo[i][jdown[j]]!= nodata) 
-      tot+=pow(topo[i][j]-topo[i][jdown[j]],1.1);
-     if (topo[i][j]>topo[iup[i]][jup[j]] && topo[iup[i]][jup[j]]!= nodata) 
-      tot+=pow((topo[i][j]-topo[iup[i]][jup[j]])*oneoversqrt2,1.1);
-     if (topo[i][j]>topo[iup[i]][jdown[j]] && topo[iup[i]][jdown[j]]!= nodata) 
-      tot+=pow((topo[i][j]-topo[iup[i]][jdown[j]])*oneoversqrt2,1.1);
-     if (topo[i][j]>topo[idown[i]][jup[j]] && topo[idown[i]][jup[j]]!= nodata) 
-      tot+=pow((topo[i][j]-topo[idown[i]][jup[j]])*oneoversqrt2,1.1);
-     if (topo[i][j]>topo[idown[i]][jdown[j]] && topo[idown[i]][jdown[j]]!= nodata) 
-      tot+=pow((topo[i][j]-topo[idown[i]][jdown[j]])*oneoversqrt2,1.1);
-    
-     if (topo[i][j]>topo[iup[i]][j] && topo[iup[i]][j]!= nodata) 
-       flow1[i][j]=pow(topo[i][j]-topo[iup[i]][j],1.1)/tot; 
-     else flow1[i][j]=0;
-
-     if (topo[i][j]>topo[idown[i]][j] && topo[idown[i]][j]!= nodata) 
-      flow2[i][j]=pow(topo[i][j]-topo[idown[i]][j],1.1)/tot; 
-     else flow2[i][j]=0;
-     
-     if (topo[i][j]>topo[i][jup[j]] && topo[i][jup[j]]!= nodata) 
-      flow3[i][j]=pow(topo[i][j]-topo[i][jup[j]],1.1)/tot; 
-     else flow3[i][j]=0;
-     
-     if (topo[i][j]>topo[i][jdown[j]] && topo[i][jdown[j]]!= nodata) 
-       flow4[i][j]=pow(topo[i][j]-topo[i][jdown[j]],1.1)/tot; 
-     else flow4[i][j]=0;
-     
-     if (topo[i][j]>topo[iup[i]][jup[j]] && topo[iup[i]][jup[j]]!= nodata) 
-       flow5[i][j]=pow((topo[i][j]-topo[iup[i]][jup[j]])*oneoversqrt2,1.1)/tot;
-     else flow5[i][j]=0;
-     
-     if (topo[i][j]>topo[iup[i]][jdown[j]] && topo[iup[i]][jdown[j]]!= nodata) 
-       flow6[i][j]=pow((topo[i][j]-topo[iup[i]][jdown[j]])*oneoversqrt2,1.1)/tot;
-     else flow6[i][j]=0;
-     
-     if (topo[i][j]>topo[idown[i]][jup[j]] && topo[idown[i]][jup[j]]!= nodata) 
-       flow7[i][j]=pow((topo[i][j]-topo[idown[i]][jup[j]])*oneoversqrt2,1.1)/tot;
-     else flow7[i][j]=0;
-     
-     if (topo[i][j]>topo[idown[i]][jdown[j]] && topo[idown[i]][jdown[j]]!= nodata) 
-       flow8[i][j]=pow((topo[i][j]-topo[idown[i]][jdown[j]])*oneoversqrt2,1.1)/tot;
-     else flow8[i][j]=0;
+    if ((base = strrchr(dem, '/')) == NULL) base = dem;
+    else base++;
+    sprintf(outfile, "%s/%s", out->outdir, base);
   }
-     
-     flow[iup[i]][j]+=flow[i][j]*flow1[i][j];
-     flow[idown[i]][j]+=flow[i][j]*flow2[i][j];
-     flow[i][jup[j]]+=flow[i][j]*flow3[i][j];
-     flow[i][jdown[j]]+=flow[i][j]*flow4[i][j];
-     flow[iup[i]][jup[j]]+=flow[i][j]*flow5[i][j];
-     flow[iup[i]][jdown[j]]+=flow[i][j]*flow6[i][j];
-     flow[idown[i]][jup[j]]+=flow[i][j]*flow7[i][j];
-     flow[idown[i]][jdown[j]]+=flow[i][j]*flow8[i][j];
-}
 
-#ifndef _E_RADIUS
-#define E_RADIUS 6371.0         /* average radius of the earth */
+  ResolveTerrain(t, OutputProducts(out->cols, out->ncols));
+  OpenOutput(outfile, &fo);
+  WriteTWI(t, fo.fp, out->layout, out->cols, out->ncols);
+  CloseOutput(&fo, outfile, t, out->pack);
+#ifdef _OPENMP
+#pragma omp critical(haloprint)
 #endif
+  {
+    printf("%s ", dem);
+    PrintThresholds(t, stdout);
+  }
+}
 
-#ifndef _PI
-#define PI 3.1415
+/* ----------------------
+  Batch run of the cells of a list, see BATCH MODE above.
+ ------------------------*/
+void BatchBasin(char *listfile, char *outdir, int depth, int backend, double mb, int projection,
+		double min_elev, int layout, int *cols, int ncols)
+{
+  FILE       *fl;
+  char       tempstr[MAXSTRING], **cells;
+  int        ncells, c;
+  BULKREADER *r;
+  IOSTATS    stats;
+  CELLOUT    out;
+
+  if((fl=fopen(listfile,"r"))==NULL)
+    {
+      fprintf(stderr, "cannot open/read cell list,%s\n",listfile);
+      exit(1);
+    }
+  ncells = 0;
+  while (fscanf(fl, "%s", tempstr) == 1) ncells++;
+  rewind(fl);
+  if (ncells == 0) {
+    fprintf(stderr, "No cells in %s\n", listfile);
+    exit(1);
+  }
+  if (!(cells = (char**) calloc(ncells, sizeof(char*))))
+    { printf("Cannot allocate memory to first record: cells\n");
+      exit(8);
+    }
+  for (c = 0; c < ncells; c++) {
+    fscanf(fl, "%s", tempstr);
+    cells[c] = strdup(tempstr);
+  }
+  fclose(fl);
+
+  out.outdir = outdir;
+  out.pack = NULL;
+  if (IsTilePack(outdir) ||
+      (strlen(outdir) > 4 && strcmp(outdir + strlen(outdir) - 4, ".tpk") == 0))
+    out.pack = UpdateTilePack(outdir, 0);
+  out.layout = layout;
+  out.cols = cols;
+  out.ncols = ncols;
+
+  /* The reader keeps the files coming while the threads process them. */
+  r = OpenBulkReader(cells, ncells, depth, (size_t)(mb*1048576.0), backend);
+#pragma omp parallel
+  {
+    BULKFILE f;
+    TERRAIN  t;
+    int      nvalid;
+
+    while (NextBulkFile(r, &f)) {
+      if (f.error != 0 || f.size == 0) {
+#ifdef _OPENMP
+#pragma omp critical(haloprint)
+#endif
+	fprintf(stderr, "WARNING: cannot open/read dem file,%s (%s)\n", f.name,
+		f.error != 0 ? strerror(f.error) : "DEM is empty");
+	ReleaseBulkFile(r, &f);
+	continue;
+      }
+      nvalid = ParseDEM(f.name, f.buf, f.size, min_elev, &t);
+      ReleaseBulkFile(r, &f);
+      if (nvalid == 0) {
+#ifdef _OPENMP
+#pragma omp critical(haloprint)
 #endif
+	printf("No valid value in this grid %s\n", f.name);
+	FreeTerrain(&t);
+	continue;
+      }
+      SetCellSize(&t, projection);
+      CellOutput(f.name, &t, &out);
+      FreeTerrain(&t);
+    }
+  }
 
-double get_dist(double lat1, double long1, double lat2, double long2)
-{
-  double theta1;
-  double phi1;
-  double theta2;
-  double phi2;
-  double dtor;
-  double term1;
-  double term2;
-  double term3;
-  double temp;
-  double dist;
-
-  dtor = 2.0*PI/360.0;
-  theta1 = dtor*long1;
-  phi1 = dtor*lat1;
-  theta2 = dtor*long2;
-  phi2 = dtor*lat2;
-  term1 = cos(phi1)*cos(theta1)*cos(phi2)*cos(theta2);
-  term2 = cos(phi1)*sin(theta1)*cos(phi2)*sin(theta2);
-  term3 = sin(phi1)*sin(phi2);
-  temp = term1+term2+term3;
-  temp = (double) (1.0 < temp) ? 1.0 : temp;
-  dist = E_RADIUS*acos(temp);
-
-  return dist;
-}  
-
-#undef E_RADIUS
-#undef PI
+  BulkReaderStats(r, &stats);
+  fprintf(stderr, "Batch %d cells, %s reads: %ld files, %ld I/O operations, %.1f MB in %.2f s, %.0f IOPS, %.1f MB/s\n",
+	  ncells, stats.backend == IO_URING ? "io_uring" : "thread", stats.files, stats.ops,
+	  stats.bytes/1.e6, stats.seconds, stats.iops, stats.mbps);
+  CloseBulkReader(r);
+  if (out.pack != NULL)
+    CloseTilePack(out.pack);
+  for (c = 0; c < ncells; c++) free(cells[c]);
+  free(cells);
+}
@@ -0,0 +1,374 @@
+/******************************************************************************
+   SUMMARY:
+   This program times the terrain engine kernels (TerrainKernels.c) for
+   every instruction set level supported by the processor, and reports the
+   speedup of each level over the generic copy.  It is used to check the
+   benefit of a build on a new type of node, and that TERRAIN_ISA is honored.
+
+   The kernels are run on a DEM, if one is given, or on a synthetic surface.
+
+   MfdSeries is MfdWeights with drop^1.1 by the series of TerrainKernels.c
+   within the relative error of -mfderr, instead of pow().  With -mfd, the
+   wetness index of each DEM given is computed with pow() and with the
+   series of each error bound, and the largest changes are reported.
+
+   With -fill, the two depression fillers of the engine (recursive and
+   sweep, see TerrainEngine.c) are timed on each DEM given instead, and
+   their filled surfaces are compared.
+
+******************************************************************************
+   NOTES:
+
+   USAGE: KernelBench [<DEM>] [-repeat <n>] [-mfderr <x>]
+          KernelBench -mfd <DEM> [<DEM> ...]
+          KernelBench -fill <DEM> [<DEM> ...]
+     DEM: arc/info ascii DEM (default: 1000 x 1000 synthetic surface)
+     -repeat: number of times each kernel is run (default 5), the fastest
+              time is reported
+     -mfderr: relative error of drop^1.1 for MfdSeries (default 1e-6)
+     -mfd: one line per DEM and error bound with the routing time, and the
+              largest changes from pow() of flowacc (relative), of the
+              wetness index of a pixel, and of the sorted wetness index
+              (the distribution FindTWI writes).  The DEMs are read as
+              equal area.
+     -fill: one line per DEM with its valid pixels and pits (pixels with
+              no lower neighbour), then for each filler the time, the
+              raises of the recursive filler and the sweeps of the sweep
+              filler, and the largest difference and number of pixels
+              that differ between the sweep and recursive fills.  The
+              DEMs are read as equal area.
+
+   Compile with: gcc -O3 -fopenmp-simd KernelBench.c TerrainEngine.c TerrainKernels.c TilePack.c -lpthread -lm -o KernelBench
+                 (with the flags used for the tools, to time the same code)
+
+*******************************************************************************/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "TerrainEngine.h"
+
+#define NKERNELS 6
+
+static const char *KernelNames[NKERNELS] = { "MfdWeights", "TwiRow", "GreatCircle", "ParseValues",
+					     "FillMin", "MfdSeries" };
+
+/* error bounds of -mfd */
+static const double MfdBounds[] = { 1e-3, 1e-4, 1e-6, 1e-9, 1e-12 };
+#define NMFDBOUNDS (int)(sizeof(MfdBounds)/sizeof(MfdBounds[0]))
+
+double Seconds(void);
+void   MfdBench(int ndem, char **demfiles);
+void   FillBench(int ndem, char **demfiles);
+void   Usage(char *name);
+
+int main(int argc, char *argv[])
+{
+  int     cols = 1000, rows = 1000, repeat = 5, i, j, r, isa, kn;
+  double  mfderr = 1e-6;
+  char    *demfile = NULL, *text, *p;
+  double  **dem, *flat, *w[NNEIGHBORS], *out, *lat, *lng, *lat2, *lng2;
+  double  best[NISA][NKERNELS], t0, t, nodata = -9999.;
+  double  check[NISA][NKERNELS];
+  const double *nb[NNEIGHBORS];
+  size_t  len;
+  KERNELS *k;
+
+  if(argc > 1 && strcmp(argv[1], "-mfd") == 0) {
+    if(argc < 3) Usage(argv[0]);
+    MfdBench(argc - 2, argv + 2);
+    return 0;
+  }
+  if(argc > 1 && strcmp(argv[1], "-fill") == 0) {
+    if(argc < 3) Usage(argv[0]);
+    FillBench(argc - 2, argv + 2);
+    return 0;
+  }
+
+  for(i=1; i<argc; i++) {
+    if(strcmp(argv[i], "-repeat") == 0 && i+1 < argc) repeat = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-mfderr") == 0 && i+1 < argc) mfderr = atof(argv[++i]);
+    else if(argv[i][0] == '-') Usage(argv[0]);
+    else demfile = argv[i];
+  }
+
+  /* surface, in [col][row] order as the routing arrays */
+  if(demfile != NULL) {
+    TERRAIN ter;
+
+    if(ReadDEM(demfile, 0.0, &ter) == 0) {
+      fprintf(stderr, "ERROR: %s has no valid data\n", demfile);
+      exit(1);
+    }
+    cols = ter.columns;
+    rows = ter.rows;
+    nodata = ter.nodata;
+    dem = Memoryalloc(rows + 2, cols + 2);
+    for(i=0; i<cols+2; i++)
+      for(j=0; j<rows+2; j++)
+	dem[i][j] = (i == 0 || j == 0 || i > cols || j > rows) ? nodata : ter.dem[j-1][i-1];
+    FreeTerrain(&ter);
+  }
+  else {
+    dem = Memoryalloc(rows + 2, cols + 2);
+    for(i=0; i<cols+2; i++)
+      for(j=0; j<rows+2; j++)
+	dem[i][j] = 200. + 50.*sin(0.013*i)*cos(0.021*j) + 0.01*i + 0.001*((i*7919 + j*104729) % 1000);
+  }
+  printf("Surface %d x %d, best of %d runs, MfdSeries within %g\n", cols, rows, repeat,
+	 SetMfdError(mfderr));
+
+  flat = (double*) malloc((size_t)NNEIGHBORS*cols*rows*sizeof(double));
+  out = (double*) malloc(3*(size_t)cols*rows*sizeof(double));
+  lat = (double*) malloc(4*(size_t)cols*rows*sizeof(double));
+  if(flat == NULL || out == NULL || lat == NULL) {
+    printf("Cannot allocate memory to first record: bench\n");
+    exit(8);
+  }
+  for(i=0; i<NNEIGHBORS; i++)
+    w[i] = flat + (size_t)i*cols*rows;
+  lng = lat + (size_t)cols*rows;
+  lat2 = lng + (size_t)cols*rows;
+  lng2 = lat2 + (size_t)cols*rows;
+  for(i=0; i<cols*rows; i++) {
+    lat[i] = -60. + 120.*i/(cols*rows);
+    lng[i] = -180. + 0.37*(i % 900);
+    lat2[i] = lat[i] + 0.001;
+    lng2[i] = lng[i] + 0.002;
+  }
+
+  /* the surface as DEM text */
+  len = (size_t)cols*rows*12 + 1;
+  if(!(text = (char*) malloc(len))) {
+    printf("Cannot allocate memory to first record: text\n");
+    exit(8);
+  }
+  p = text;
+  for(j=1; j<=rows; j++)
+    for(i=1; i<=cols; i++)
+      p += sprintf(p, (i == cols) ? "%.3f\n" : "%.3f ", dem[i][j]);
+
+  for(isa=0; isa<NISA; isa++) {
+    if(!SetKernels(isa))
+      continue;
+    k = Kernels();
+    for(kn=0; kn<NKERNELS; kn++) {
+      memset(out, 0, 3*(size_t)cols*rows*sizeof(double));
+      best[isa][kn] = HUGE_VAL;
+      for(r=0; r<repeat; r++) {
+	t0 = Seconds();
+	switch(kn) {
+	case 0:
+	case 5:
+	  for(i=1; i<=cols; i++) {
+	    double *wc[NNEIGHBORS];
+
+	    nb[0] = dem[i+1]+1; nb[1] = dem[i-1]+1; nb[2] = dem[i]+2; nb[3] = dem[i];
+	    nb[4] = dem[i+1]+2; nb[5] = dem[i+1]; nb[6] = dem[i-1]+2; nb[7] = dem[i-1];
+	    for(j=0; j<NNEIGHBORS; j++)
+	      wc[j] = w[j] + (size_t)(i-1)*rows;
+	    k->MfdWeights(rows, dem[i]+1, nb, nodata, (kn == 5) ? MfdPower() : NULL, wc);
+	  }
+	  break;
+	case 1:
+	  /* columns of the [col][row] surface are used as rows */
+	  for(i=1; i<=cols; i++)
+	    k->TwiRow(rows, dem[i-1]+1, dem[i]+1, dem[i+1]+1, dem[i]+1, nodata, 30., 30.,
+		      sqrt(1800.), MinTanBeta(30., 30.), out + (size_t)(i-1)*rows,
+		      out + (size_t)(cols+i-1)*rows, out + (size_t)(2*cols+i-1)*rows);
+	  break;
+	case 2:
+	  k->GreatCircle(cols*rows, lat, lng, lat2, lng2, out);
+	  break;
+	case 3:
+	  {
+	    const char *s = text;
+
+	    if(k->ParseValues(&s, p, (long)cols*rows, flat) != (long)cols*rows) {
+	      fprintf(stderr, "ERROR: ParseValues stopped early\n");
+	      exit(1);
+	    }
+	  }
+	  break;
+	case 4:
+	  for(i=1; i<=cols; i++)
+	    k->FillMin(rows, dem[i-1]+1, dem[i+1]+1, nodata, out + (size_t)(i-1)*rows);
+	  break;
+	}
+	t = Seconds() - t0;
+	if(t < best[isa][kn]) best[isa][kn] = t;
+      }
+      /* checksum, to see that the levels agree */
+      check[isa][kn] = 0.;
+      for(i=0; i<cols*rows; i++)
+	check[isa][kn] += (kn == 0 || kn == 3 || kn == 5) ? flat[i] : out[i];
+    }
+  }
+
+  printf("\n%-12s", "kernel");
+  for(isa=0; isa<NISA; isa++)
+    if(IsaSupported(isa)) printf(" %18s", IsaName(isa));
+  printf("\n");
+  for(kn=0; kn<NKERNELS; kn++) {
+    printf("%-12s", KernelNames[kn]);
+    for(isa=0; isa<NISA; isa++)
+      if(IsaSupported(isa))
+	printf(" %9.2f ms %5.2fx", 1000.*best[isa][kn], best[0][kn]/best[isa][kn]);
+    printf("\n");
+  }
+  for(kn=0; kn<NKERNELS; kn++)
+    for(isa=1; isa<NISA; isa++)
+      if(IsaSupported(isa) && check[isa][kn] != check[0][kn])
+	printf("WARNING: %s %s differs from generic (%.17g vs %.17g)\n", KernelNames[kn],
+	       IsaName(isa), check[isa][kn], check[0][kn]);
+
+  Memoryfree(dem, cols + 2);
+  free(flat);
+  free(out);
+  free(lat);
+  free(text);
+  return 0;
+}
+
+/* ----------------------
+  Wetness index of each DEM with pow() and the series of each bound.
+ ------------------------*/
+void MfdBench(int ndem, char **demfiles)
+{
+  int     d, b, i, j, k;
+  double  t0, time, dacc, dtwi, ddist, a, ref;
+  TERRAIN exact, ter;
+
+  printf("%-24s %9s %8s %10s %12s %12s %12s\n", "DEM", "pixels", "maxerr", "route ms",
+	 "flowacc rel", "twi abs", "twi dist abs");
+  for(d=0; d<ndem; d++) {
+    if(ReadDEM(demfiles[d], 0.0, &ter) == 0) {
+      fprintf(stderr, "WARNING: %s has no valid data\n", demfiles[d]);
+      FreeTerrain(&ter);
+      continue;
+    }
+    FreeTerrain(&ter);
+    for(b=-1; b<NMFDBOUNDS; b++) {
+      ReadDEM(demfiles[d], 0.0, &ter);
+      SetCellSize(&ter, PROJ_EQUALAREA);
+      SetMfdError((b < 0) ? 0. : MfdBounds[b]);
+      ResolveTerrain(&ter, PROD_FILLED);
+      t0 = Seconds();
+      ResolveTerrain(&ter, PROD_FLOWACC);
+      time = Seconds() - t0;
+      ResolveTerrain(&ter, PROD_TWI | PROD_TWIORDER);
+      if(b < 0) {
+	exact = ter;
+	continue;
+      }
+
+      dacc = dtwi = 0.;
+      for(i=0; i<ter.rows; i++)
+	for(j=0; j<ter.columns; j++) {
+	  if(ter.dem[i][j] == ter.nodata)
+	    continue;
+	  ref = exact.flowacc[i][j];
+	  if((a = fabs(ter.flowacc[i][j] - ref)/((ref > 0.) ? ref : 1.)) > dacc) dacc = a;
+	  if((a = fabs(ter.wetnessindex[i][j] - exact.wetnessindex[i][j])) > dtwi) dtwi = a;
+	}
+      ddist = 0.;
+      for(k=0; k<ter.nvalid; k++)
+	if((a = fabs(ter.twiorder[k].Rank - exact.twiorder[k].Rank)) > ddist) ddist = a;
+
+      printf("%-24s %9d %8.0e %10.2f %12.3e %12.3e %12.3e\n", demfiles[d], ter.nvalid,
+	     MfdError(), 1000.*time, dacc, dtwi, ddist);
+      FreeTerrain(&ter);
+    }
+    FreeTerrain(&exact);
+    printf("\n");
+  }
+  SetMfdError(0.);
+}
+
+/* ----------------------
+  Time the fillers on each DEM and compare the sweep and recursive fills.
+ ------------------------*/
+void FillBench(int ndem, char **demfiles)
+{
+  static const int fillers[NFILLERS] = { FILL_RECURSIVE, FILL_SWEEP };
+  int      d, f, i, j, di, dj, pits, ndiff, sweeps = 0;
+  long     raises = 0;
+  double   t0, time[NFILLERS], maxdiff, **fill[2], z, low, a;
+  TERRAIN  ter;
+  FLOWGRID g;
+
+  printf("%-24s %9s %7s %12s %12s %9s %8s %10s %8s\n", "DEM", "pixels", "pits",
+	 "recursive ms", "sweep ms", "raises", "sweeps", "maxdiff", "ndiff");
+  for(d=0; d<ndem; d++) {
+    if(ReadDEM(demfiles[d], 0.0, &ter) == 0) {
+      fprintf(stderr, "WARNING: %s has no valid data\n", demfiles[d]);
+      continue;
+    }
+    SetCellSize(&ter, PROJ_EQUALAREA);
+
+    pits = 0;
+    for(i=1; i<ter.rows-1; i++)
+      for(j=1; j<ter.columns-1; j++) {
+	if((z = ter.dem[i][j]) == ter.nodata)
+	  continue;
+	low = HUGE_VAL;
+	for(di=-1; di<=1; di++)
+	  for(dj=-1; dj<=1; dj++)
+	    if((a = ter.dem[i+di][j+dj]) != ter.nodata && (di != 0 || dj != 0) && a < low)
+	      low = a;
+	if(z <= low) pits++;
+      }
+
+    for(f=0; f<NFILLERS; f++) {
+      SetFiller(fillers[f]);
+      g.lattice_size_x = ter.columns;
+      g.lattice_size_y = ter.rows;
+      g.nodata = ter.nodata;
+      fillpits(&g, ter.dem, ter.dx, ter.dy);
+      t0 = Seconds();
+      fillsurface(&g, ter.valid, ter.nvalid);
+      time[f] = Seconds() - t0;
+      if(fillers[f] == FILL_RECURSIVE) raises = g.raises;
+      if(fillers[f] == FILL_SWEEP) sweeps = g.sweeps;
+      fill[f] = g.topo;
+      g.topo = matrix(1, g.lattice_size_x, 1, g.lattice_size_y);
+      free_flowgrid(&g);
+    }
+
+    maxdiff = 0.;
+    ndiff = 0;
+    for(i=1; i<=ter.columns; i++)
+      for(j=1; j<=ter.rows; j++)
+	if(fill[0][i][j] != fill[1][i][j]) {
+	  ndiff++;
+	  if(fabs(fill[1][i][j] - fill[0][i][j]) > maxdiff)
+	    maxdiff = fabs(fill[1][i][j] - fill[0][i][j]);
+	}
+
+    printf("%-24s %9d %7d %12.2f %12.2f %9ld %8d %10.4f %8d\n", demfiles[d], ter.nvalid, pits,
+	   1000.*time[0], 1000.*time[1], raises, sweeps, maxdiff, ndiff);
+    for(f=0; f<2; f++)
+      free_matrix(fill[f], 1, ter.columns, 1, ter.rows);
+    FreeTerrain(&ter);
+  }
+}
+
+double Seconds(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1.e-9*ts.tv_nsec;
+}
+
+void Usage(char *name)
+{
+  fprintf(stderr, "\nUsage: %s [<DEM>] [-repeat <n>] [-mfderr <x>]\n", name);
+  fprintf(stderr, "       %s -mfd <DEM> [<DEM> ...]\n", name);
+  fprintf(stderr, "       %s -fill <DEM> [<DEM> ...]\n", name);
+  fprintf(stderr, "\n\tTimes the terrain kernels for every instruction set level of this processor,\n");
+  fprintf(stderr, "\tor compares the wetness index with drop^1.1 by series (-mfd), or the\n");
+  fprintf(stderr, "\tdepression fillers (-fill), on each DEM.\n\n");
+  exit(0);
+}
@@ -0,0 +1,296 @@
+/******************************************************************************
+   SUMMARY:
+   This program computes the fraction of every land use class in each VIC
+   model cell in one pass over the land use raster.  It replaces
+   CalculateLandUseFractions.py, which runs one ArcGIS zonal sum over the
+   whole raster for each class, and writes the class fraction grids read by
+   CreateVegparamFileWithPonding.py (LURasterFormat).
+
+   The VIC cell of a land use pixel is the cell of the VIC cell number grid
+   that contains the pixel center (both grids in the same coordinates), or
+   is given by a zone raster of cell numbers on the land use grid.  Each
+   thread counts the pixels of its rows in a dense matrix of cells by
+   classes, the VIC cell numbers being mapped to the rows of the matrix by
+   a table indexed by cell number, and the matrices are summed at the end.
+
+******************************************************************************
+   NOTES:
+
+   USAGE: LandUseFractions <land use grid> <VIC cell number grid> <output table>
+                           [-nclasses <K>] [-classes <class csv>]
+                           [-zones <cell number grid>] [-format <grid format>]
+     land use grid: ascii or float (.flt) grid of classes 0 to K-1
+     VIC cell number grid: ascii grid of the VIC cells (ClimCellNum_GCS_AR.asc)
+     output table: tab delimited, one line per cell: cell number, land use
+                   pixels and the fraction of each class
+     -nclasses: number of classes (default 17, IGBP)
+     -classes: class table (IGBP_Land_Use_Classes.csv), one class per line
+               after the header, instead of -nclasses
+     -zones: VIC cell number of every land use pixel, instead of the cell
+             containing it
+     -format: also write one grid of fractions per class, on the VIC cell
+              number grid, named by the format with the class number
+              (such as landusefract_mcd12q1_2005_igbp_%03i_gcs_ar.asc)
+
+   Compile with: gcc -O3 -fopenmp LandUseFractions.c RasterIO.c -lm -o LandUseFractions
+
+   COMMENTS:
+   As in CalculateLandUseFractions.py, fractions are of the pixels with a
+   class of 0 or more (classes of K and more, such as 254 and 255 for
+   unclassified pixels, are only counted in the total).
+
+*******************************************************************************/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "RasterIO.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define MAXSTRING 500
+#define ROWBLOCK 256
+
+void Usage(char *name);
+int  CountClasses(char *classfile);
+
+int main(int argc, char *argv[])
+{
+  char     *zonefile = NULL, *format = NULL, outname[2*MAXSTRING];
+  int      i, n, r, nclasses = 17, nthreads = 1, width, *viccol;
+  long     k, c, ncells, mincell, maxcell, *index, ignored = 0;
+  double   *vic, *values, *zones = NULL, *row;
+  unsigned int *counts;        /* thread x cell x (classes + total) */
+  RASTER   lu, vicgrid, zonegrid, out;
+  FILE     *fo;
+
+  if(argc < 4)
+    Usage(argv[0]);
+  for(i=4; i<argc; i++) {
+    if(i+1 < argc && strcmp(argv[i], "-nclasses") == 0) nclasses = atoi(argv[++i]);
+    else if(i+1 < argc && strcmp(argv[i], "-classes") == 0) nclasses = CountClasses(argv[++i]);
+    else if(i+1 < argc && strcmp(argv[i], "-zones") == 0) zonefile = argv[++i];
+    else if(i+1 < argc && strcmp(argv[i], "-format") == 0) format = argv[++i];
+    else {
+      fprintf(stderr, "ERROR - No such option.\n");
+      Usage(argv[0]);
+    }
+  }
+  if(nclasses <= 0) {
+    fprintf(stderr, "ERROR: no land use classes\n");
+    exit(1);
+  }
+  width = nclasses + 1;
+
+  /* VIC cell number grid, and the table from cell number to matrix row */
+  memset(&vicgrid, 0, sizeof(RASTER));
+  OpenRaster(argv[2], &vicgrid);
+  vic = (double*) malloc((size_t)vicgrid.ncols*vicgrid.nrows*sizeof(double));
+  if(vic == NULL) {
+    printf("Cannot allocate memory to first record: VIC grid\n");
+    exit(8);
+  }
+  ReadRasterRows(&vicgrid, vicgrid.nrows, vic);
+  CloseRaster(&vicgrid);
+  mincell = 0x7fffffffffffffffL;
+  maxcell = -1;
+  for(k=0; k<(long)vicgrid.ncols*vicgrid.nrows; k++)
+    if(vic[k] != vicgrid.nodata && vic[k] >= 0) {
+      if((long)vic[k] < mincell) mincell = (long)vic[k];
+      if((long)vic[k] > maxcell) maxcell = (long)vic[k];
+    }
+  if(maxcell < 0) {
+    fprintf(stderr, "ERROR: %s has no cell numbers\n", argv[2]);
+    exit(1);
+  }
+  index = (long*) malloc((maxcell - mincell + 1)*sizeof(long));
+  if(index == NULL) {
+    printf("Cannot allocate memory to first record: cell index\n");
+    exit(8);
+  }
+  for(c=0; c<=maxcell-mincell; c++)
+    index[c] = -1;
+  for(k=0, ncells=0; k<(long)vicgrid.ncols*vicgrid.nrows; k++)
+    if(vic[k] != vicgrid.nodata && vic[k] >= 0 && index[(long)vic[k] - mincell] < 0)
+      index[(long)vic[k] - mincell] = ncells++;
+
+  /* land use grid, and the VIC column of every land use column */
+  memset(&lu, 0, sizeof(RASTER));
+  OpenRaster(argv[1], &lu);
+  if(zonefile != NULL) {
+    memset(&zonegrid, 0, sizeof(RASTER));
+    OpenRaster(zonefile, &zonegrid);
+    if(zonegrid.ncols != lu.ncols || zonegrid.nrows != lu.nrows) {
+      fprintf(stderr, "ERROR: %s is %d x %d but %s is %d x %d\n", argv[1], lu.ncols, lu.nrows,
+	      zonefile, zonegrid.ncols, zonegrid.nrows);
+      exit(1);
+    }
+    zones = (double*) malloc((size_t)ROWBLOCK*lu.ncols*sizeof(double));
+  }
+  viccol = (int*) malloc(lu.ncols*sizeof(int));
+  values = (double*) malloc((size_t)ROWBLOCK*lu.ncols*sizeof(double));
+#ifdef _OPENMP
+  nthreads = omp_get_max_threads();
+#endif
+  counts = (unsigned int*) calloc((size_t)nthreads*ncells*width, sizeof(unsigned int));
+  if(viccol == NULL || values == NULL || counts == NULL || (zonefile != NULL && zones == NULL)) {
+    printf("Cannot allocate memory to first record: counts\n");
+    exit(8);
+  }
+  for(i=0; i<lu.ncols; i++) {
+    double x = lu.xllcorner + lu.cellsize*(i + 0.5);
+
+    viccol[i] = (int)floor((x - vicgrid.xllcorner)/vicgrid.cellsize);
+    if(viccol[i] >= vicgrid.ncols) viccol[i] = -1;
+  }
+
+  /* one pass, rows of a block shared between threads */
+  while((n = ReadRasterRows(&lu, ROWBLOCK, values)) > 0) {
+    long first = lu.row - n;
+
+    if(zonefile != NULL)
+      ReadRasterRows(&zonegrid, n, zones);
+#pragma omp parallel for schedule(dynamic) reduction(+:ignored)
+    for(r=0; r<n; r++) {
+      double       y = lu.yllcorner + lu.cellsize*(lu.nrows - (first + r) - 0.5);
+      long         vr = vicgrid.nrows - 1 - (long)floor((y - vicgrid.yllcorner)/vicgrid.cellsize);
+      const double *v = values + (long)r*lu.ncols;
+      unsigned int *m;
+      int          col, th = 0;
+
+#ifdef _OPENMP
+      th = omp_get_thread_num();
+#endif
+      m = counts + (size_t)th*ncells*width;
+      for(col=0; col<lu.ncols; col++) {
+	double cell;
+	long   cls, at;
+
+	if(v[col] == lu.nodata || v[col] < 0)
+	  continue;
+	if(zonefile != NULL)
+	  cell = (zones[(long)r*lu.ncols + col] == zonegrid.nodata) ? -1 : zones[(long)r*lu.ncols + col];
+	else if(vr < 0 || vr >= vicgrid.nrows || viccol[col] < 0)
+	  cell = -1;
+	else
+	  cell = vic[vr*vicgrid.ncols + viccol[col]];
+	if(cell < mincell || cell > maxcell || cell == vicgrid.nodata || index[(long)cell - mincell] < 0) {
+	  ignored++;
+	  continue;
+	}
+	at = index[(long)cell - mincell]*width;
+	cls = (long)v[col];
+	if(cls < nclasses)
+	  m[at + cls]++;
+	m[at + nclasses]++;
+      }
+    }
+  }
+  CloseRaster(&lu);
+  if(zonefile != NULL)
+    CloseRaster(&zonegrid);
+  if(ignored > 0)
+    fprintf(stderr, "WARNING: %ld land use pixels are not in a VIC cell\n", ignored);
+
+  /* sum of the threads, in the matrix of the first */
+  for(i=1; i<nthreads; i++)
+#pragma omp parallel for
+    for(k=0; k<ncells*width; k++)
+      counts[k] += counts[(size_t)i*ncells*width + k];
+
+  /* fraction table, in cell number order */
+  if((fo = fopen(argv[3], "w")) == NULL) {
+    fprintf(stderr, "cannot open output file,%s\n", argv[3]);
+    exit(1);
+  }
+  fprintf(fo, "cell\tnpixels");
+  for(i=0; i<nclasses; i++)
+    fprintf(fo, "\t%d", i);
+  fprintf(fo, "\n");
+  for(c=0; c<=maxcell-mincell; c++) {
+    unsigned int *m;
+
+    if(index[c] < 0)
+      continue;
+    m = counts + index[c]*width;
+    fprintf(fo, "%ld\t%u", c + mincell, m[nclasses]);
+    for(i=0; i<nclasses; i++)
+      fprintf(fo, "\t%.6f", (m[nclasses] > 0) ? (double)m[i]/m[nclasses] : 0.);
+    fprintf(fo, "\n");
+  }
+  fclose(fo);
+  printf("Counted %d x %d land use pixels in %ld VIC cells\n", lu.ncols, lu.nrows, ncells);
+
+  /* fraction grids, cells without land use pixels are nodata */
+  if(format != NULL) {
+    row = (double*) malloc(vicgrid.ncols*sizeof(double));
+    for(i=0; i<nclasses; i++) {
+      snprintf(outname, sizeof(outname), format, i);
+      out = vicgrid;
+      out.precision = 6;
+      CreateRaster(outname, &out);
+      for(r=0; r<vicgrid.nrows; r++) {
+	int col;
+
+	for(col=0; col<vicgrid.ncols; col++) {
+	  double       cell = vic[(long)r*vicgrid.ncols + col];
+	  unsigned int *m;
+
+	  row[col] = vicgrid.nodata;
+	  if(cell == vicgrid.nodata || cell < 0)
+	    continue;
+	  m = counts + index[(long)cell - mincell]*width;
+	  if(m[nclasses] > 0)
+	    row[col] = (double)m[i]/m[nclasses];
+	}
+	WriteRasterRows(&out, 1, row);
+      }
+      CloseRaster(&out);
+    }
+    printf("Wrote %d fraction grids\n", nclasses);
+    free(row);
+  }
+
+  free(vic);
+  free(index);
+  free(viccol);
+  free(values);
+  free(zones);
+  free(counts);
+  return 0;
+}
+
+/*****************************************************************************/
+/*   CountClasses: number of classes of the class table, its lines after     */
+/*   the header.                                                             */
+/*****************************************************************************/
+int CountClasses(char *classfile)
+{
+  FILE   *fp;
+  char   *line = NULL;
+  size_t size = 0;
+  int    n = 0;
+
+  if((fp = fopen(classfile, "r")) == NULL) {
+    fprintf(stderr, "cannot open/read class table,%s\n", classfile);
+    exit(1);
+  }
+  if(getline(&line, &size, fp) >= 0)
+    while(getline(&line, &size, fp) >= 0)
+      if(strspn(line, " \t\r\n,") != strlen(line))
+	n++;
+  fclose(fp);
+  free(line);
+  return n;
+}
+
+void Usage(char *name)
+{
+  fprintf(stderr, "\nUsage: %s <land use grid> <VIC cell number grid> <output table> [-nclasses <K>]\n", name);
+  fprintf(stderr, "\t\t[-classes <class csv>] [-zones <cell number grid>] [-format <grid format>]\n");
+  fprintf(stderr, "\n\tNOTE: Classes are 0 to K-1, fractions are of the pixels with a class of 0 or more.\n");
+  fprintf(stderr, "\tNOTE 2: The grid format has a %%i (such as %%03i), replaced by the class.\n\n");
+  exit(0);
+}
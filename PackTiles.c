@@ -0,0 +1,291 @@
+/******************************************************************************
+   SUMMARY:
+   This program packs the cell DEMs of a basin (./CellDems/<cell>.txt), or
+   the output tables of FindTWI (./CellTWI/<cell>.txt), into one tile pack,
+   and unpacks and lists packs.  The tools read a DEM from a pack as
+   "<pack>:<cell id>" instead of a file name, and FindTWI writes its output
+   tables to a pack given as "<pack>:<cell id>" (or as the output dir of a
+   halo run), so a batch of thousands of cells opens one file instead of
+   thousands (see TilePack.c for the format).
+
+******************************************************************************
+   NOTES:
+
+   USAGE: PackTiles -pack [-z] [-capacity <n>] <pack> <file list>
+          PackTiles -unpack <pack> <output dir> [<cell id> ...]
+          PackTiles -list <pack>
+     pack: the tile pack, e.g. CellDems.tpk
+     file list: one file per line, "<file>" with the cell id as the name
+            of the file (e.g. ./CellDems/320.txt) or "<cell id> <file>".
+            Grids (arc/info ascii or ESRI float grids) are packed as grids,
+            other files as text.
+     -z: deflate the tiles (needs zlib)
+     -capacity: tiles the index of the pack can hold (default the number
+            of files, at least 8192), so that more tiles can be added later
+     output dir: every tile is written there as <cell id>.txt, grids as
+            arc/info ascii grids
+     -list: one line per tile with its cell id, type, georeference and
+            sizes; the checksum of every tile is checked
+     Damaged tiles are reported and skipped, and the exit status is 1.
+
+   Compile with: gcc -O3 PackTiles.c TilePack.c RasterIO.c -lpthread -lm -o PackTiles
+                 (add -DHAVE_ZLIB and -lz for compressed tiles)
+
+   COMMENTS:
+   A pack is packed again (unpack, then pack) to drop the payloads of tiles
+   that were written more than once.
+
+*******************************************************************************/
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "TerrainEngine.h"
+#include "RasterIO.h"
+
+#define ROWBLOCK 256        /* rows of a grid read or written at a time */
+
+void Usage(char *name);
+void Pack(char *packfile, char *listfile, int capacity, int compress);
+int  Unpack(char *packfile, char *outdir, int nids, char **ids);
+int  List(char *packfile);
+void *ReadTile(char *file, PACKENTRY *e);
+
+int main(int argc, char *argv[])
+{
+  int i, compress = 0, capacity = 0, damaged = 0;
+
+  if(argc < 3)
+    Usage(argv[0]);
+
+  if(strcmp(argv[1], "-pack") == 0) {
+    for(i = 2; i < argc && argv[i][0] == '-'; i++) {
+      if(strcmp(argv[i], "-z") == 0)
+	compress = 1;
+      else if(strcmp(argv[i], "-capacity") == 0 && i+1 < argc)
+	capacity = atoi(argv[++i]);
+      else
+	Usage(argv[0]);
+    }
+    if(argc - i != 2)
+      Usage(argv[0]);
+    Pack(argv[i], argv[i+1], capacity, compress);
+  }
+  else if(strcmp(argv[1], "-unpack") == 0 && argc >= 4)
+    damaged = Unpack(argv[2], argv[3], argc - 4, argv + 4);
+  else if(strcmp(argv[1], "-list") == 0 && argc == 3)
+    damaged = List(argv[2]);
+  else
+    Usage(argv[0]);
+
+  return (damaged > 0);
+}
+
+/* ----------------------
+  Read a grid or text file as a tile.  Returns the payload, e is set but
+  for its cell id.
+ ------------------------*/
+void *ReadTile(char *file, PACKENTRY *e)
+{
+  RASTER g;
+  FILE   *fp;
+  char   *text;
+  double *grid;
+  long   size;
+  int    n;
+
+  if(IsRaster(file)) {
+    memset(&g, 0, sizeof(RASTER));
+    OpenRaster(file, &g);
+    e->type = PACK_GRID;
+    e->fullcols = g.ncols;
+    e->fullrows = g.nrows;
+    e->xorig = g.xllcorner;
+    e->yorig = g.yllcorner;
+    e->delta = g.cellsize;
+    e->nodata = g.nodata;
+    e->size = (int64_t)g.ncols*g.nrows*sizeof(double);
+    if(!(grid = (double*) malloc(e->size)))
+      { printf("Cannot allocate memory to first record: grid\n");
+	exit(8);
+      }
+    for(n = 0; n < g.nrows; n += ROWBLOCK)
+      ReadRasterRows(&g, ROWBLOCK, grid + (size_t)n*g.ncols);
+    CloseRaster(&g);
+    return grid;
+  }
+
+  if((fp = fopen(file, "rb")) == NULL)
+    {
+      fprintf(stderr, "cannot open/read file,%s\n", file);
+      exit(1);
+    }
+  fseek(fp, 0, SEEK_END);
+  size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  if(!(text = (char*) malloc(size > 0 ? size : 1)))
+    { printf("Cannot allocate memory to first record: text\n");
+      exit(8);
+    }
+  if((long)fread(text, 1, size, fp) != size)
+    {
+      fprintf(stderr, "cannot open/read file,%s\n", file);
+      exit(1);
+    }
+  fclose(fp);
+  e->type = PACK_TEXT;
+  e->size = size;
+  return text;
+}
+
+/* ----------------------
+  Pack the files of a list.
+ ------------------------*/
+void Pack(char *packfile, char *listfile, int capacity, int compress)
+{
+  FILE      *fl;
+  char      line[2*MAXSTRING], a[2*MAXSTRING], b[2*MAXSTRING], *file;
+  int       nfiles = 0, ntiles = 0;
+  long      bytes = 0;
+  void      *data;
+  PACKENTRY e;
+  TILEPACK  *p;
+
+  if((fl = fopen(listfile, "r")) == NULL)
+    {
+      fprintf(stderr, "cannot open/read file list,%s\n", listfile);
+      exit(1);
+    }
+  while(fgets(line, sizeof(line), fl) != NULL)
+    if(sscanf(line, "%s", a) == 1)
+      nfiles++;
+  rewind(fl);
+  if(capacity <= 0)
+    capacity = (nfiles > PACKCAPACITY) ? nfiles : PACKCAPACITY;
+  p = CreateTilePack(packfile, capacity, compress);
+
+  while(fgets(line, sizeof(line), fl) != NULL) {
+    memset(&e, 0, sizeof(PACKENTRY));
+    switch(sscanf(line, "%s %s", a, b)) {
+    case 1:
+      file = a;
+      if((e.id = TileCellId(file)) < 0) {
+	fprintf(stderr, "ERROR: no cell id in the name of %s, give it as <cell id> <file>\n", file);
+	exit(1);
+      }
+      break;
+    case 2:
+      file = b;
+      e.id = atoi(a);
+      break;
+    default:
+      continue;
+    }
+    data = ReadTile(file, &e);
+    AddPackedTile(p, &e, data);
+    free(data);
+    bytes += e.length;
+    ntiles++;
+  }
+  fclose(fl);
+  CloseTilePack(p);
+  printf("%d tiles, %ld bytes packed into %s\n", ntiles, bytes, packfile);
+}
+
+/* ----------------------
+  Write the tiles of a pack (or the cell ids given) to a directory.
+  Returns the number of damaged tiles, which are skipped.
+ ------------------------*/
+int Unpack(char *packfile, char *outdir, int nids, char **ids)
+{
+  TILEPACK  *p = OpenTilePack(packfile);
+  PACKENTRY *e;
+  RASTER    g;
+  FILE      *fo;
+  char      outfile[2*MAXSTRING];
+  void      *data;
+  int       k, n, damaged = 0;
+
+  for(k = 0; k < (nids > 0 ? nids : p->ntiles); k++) {
+    if(nids == 0)
+      e = &p->index[k];
+    else if((e = FindPackedTile(p, atoi(ids[k]))) == NULL) {
+      fprintf(stderr, "WARNING: cell %s is not in %s\n", ids[k], packfile);
+      continue;
+    }
+    sprintf(outfile, "%s/%d.txt", outdir, e->id);
+    if((data = LoadPackedTile(p, e)) == NULL) {
+      damaged++;
+      continue;
+    }
+    if((e->type & ~PACK_ZLIB) == PACK_GRID) {
+      memset(&g, 0, sizeof(RASTER));
+      g.ncols = e->fullcols;
+      g.nrows = e->fullrows;
+      g.xllcorner = e->xorig;
+      g.yllcorner = e->yorig;
+      g.cellsize = e->delta;
+      g.nodata = e->nodata;
+      CreateRaster(outfile, &g);
+      for(n = 0; n < g.nrows; n += ROWBLOCK)
+	WriteRasterRows(&g, (g.nrows - n < ROWBLOCK) ? g.nrows - n : ROWBLOCK,
+			(double*)data + (size_t)n*g.ncols);
+      CloseRaster(&g);
+    }
+    else {
+      if((fo = fopen(outfile, "wb")) == NULL)
+	{
+	  fprintf(stderr, "cannot open/write output file,%s\n", outfile);
+	  exit(1);
+	}
+      if((int64_t)fwrite(data, 1, e->size, fo) != e->size || fclose(fo) != 0)
+	{
+	  fprintf(stderr, "cannot write output file,%s\n", outfile);
+	  exit(1);
+	}
+    }
+    FreePackedTile(e, data);
+  }
+  CloseTilePack(p);
+  return damaged;
+}
+
+/* ----------------------
+  List the tiles of a pack and check them.  Returns the number of
+  damaged tiles.
+ ------------------------*/
+int List(char *packfile)
+{
+  TILEPACK  *p = OpenTilePack(packfile);
+  PACKENTRY *e;
+  void      *data;
+  int       k, damaged = 0;
+
+  printf("cell type columns rows xllcorner yllcorner cellsize nodata bytes packed\n");
+  for(k = 0; k < p->ntiles; k++) {
+    e = &p->index[k];
+    if((data = LoadPackedTile(p, e)) == NULL)
+      damaged++;
+    else
+      FreePackedTile(e, data);
+    printf("%d %s%s %d %d %.12g %.12g %.12g %g %lld %lld\n", e->id,
+	   (e->type & ~PACK_ZLIB) == PACK_GRID ? "grid" : "text",
+	   (e->type & PACK_ZLIB) ? "+zlib" : "", e->fullcols, e->fullrows,
+	   e->xorig, e->yorig, e->delta, e->nodata, (long long)e->size, (long long)e->length);
+  }
+  printf("%d tiles of %d, %lld bytes\n", p->ntiles, p->capacity, (long long)p->end);
+  if(damaged > 0)
+    printf("%d damaged tiles\n", damaged);
+  CloseTilePack(p);
+  return damaged;
+}
+
+void Usage(char *name)
+{
+  fprintf(stderr, "\nUsage: %s -pack [-z] [-capacity <n>] <pack> <file list>\n", name);
+  fprintf(stderr, "       %s -unpack <pack> <output dir> [<cell id> ...]\n", name);
+  fprintf(stderr, "       %s -list <pack>\n", name);
+  fprintf(stderr, "\n\tNOTE: the file list has one \"<file>\" (named by its cell id) or \"<cell id> <file>\" per line.\n");
+  fprintf(stderr, "\tNOTE 2: the tools read the DEM of a cell in a pack as <pack>:<cell id>.\n\n");
+  exit(0);
+}
@@ -0,0 +1,234 @@
+/******************************************************************************
+   SUMMARY:
+   This program runs the whole preprocessing chain of a basin, one stage
+   after the other, and reports the wall clock and cpu time and the peak
+   memory of every stage, so that speedups of the pipeline as a whole (and
+   not only of its kernels, see KernelBench.c) can be measured offline on
+   the synthetic basins of SynthBasin.c.
+
+******************************************************************************
+   NOTES:
+   The pipeline file has one stage per line, "<stage> <shell command>"
+   (lines starting with # are comments), e.g. as written by SynthBasin:
+     twi FindTWI -batch CellDems.lst CellTWI
+     lake for c in $(cat CellIds.lst); do CreateLakeParamTisza CellDems/$c.txt $c SEA; done > LakeParams.txt
+     veg LandUseFractions LandUse.asc CellNum.asc LandUseFract.txt
+   The commands are run by /bin/sh in the directory of the pipeline file,
+   with the tool dir first in PATH and in $PIPELINE_BIN (for the python
+   scripts).  The output of a stage goes to PipelineLogs/<stage>.log.
+   A stage that fails is reported with its exit status (or signal) and the
+   next stages are still run.
+
+   USAGE: PipelineBench [-bin <dir>] [-stages <list>] [-report <file>] <pipeline file>
+     -bin: dir of the tools and scripts (default the dir of PipelineBench)
+     -stages: comma separated stages to run (default all)
+     -report: also write the table, tab delimited, to this file
+
+   Compile with: gcc -O2 PipelineBench.c -o PipelineBench
+
+   COMMENTS:
+   The times and peak resident memory of a stage are those of wait4() for
+   its shell, which include every process of the stage (the maximum
+   resident size of any of them, not their sum).  Memory is in MB.
+
+*******************************************************************************/
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAXSTRING 500
+#define MAXLINE 8192
+#define LOGDIR "PipelineLogs"
+
+void   Usage(char *name);
+int    Selected(char *stages, char *stage);
+int    RunStage(char *stage, char *command, double *wall, struct rusage *ru);
+double Seconds(struct timeval t);
+
+int main(int argc, char *argv[])
+{
+  char   *bindir = NULL, *stages = NULL, *report = NULL, *pipeline, *p, *stage, *command;
+  char   line[MAXLINE], path[PATH_MAX], dir[PATH_MAX], bin[PATH_MAX], status[64], *env;
+  int    i, code, nstages = 0, nfailed = 0;
+  double wall, totalwall = 0., totalcpu = 0., peak = 0., mb;
+  struct rusage ru;
+  FILE   *fp, *fr = NULL;
+
+  for(i=1; i<argc-1; i++) {
+    if(i+1 < argc-1 && strcmp(argv[i], "-bin") == 0) bindir = argv[++i];
+    else if(i+1 < argc-1 && strcmp(argv[i], "-stages") == 0) stages = argv[++i];
+    else if(i+1 < argc-1 && strcmp(argv[i], "-report") == 0) report = argv[++i];
+    else {
+      fprintf(stderr, "ERROR - No such option.\n");
+      Usage(argv[0]);
+    }
+  }
+  if(argc < 2 || argv[argc-1][0] == '-')
+    Usage(argv[0]);
+  pipeline = argv[argc-1];
+
+  /* the tool dir, absolute since the stages run in the pipeline dir */
+  if(bindir == NULL) {
+    if(strchr(argv[0], '/') == NULL || realpath(argv[0], path) == NULL)
+      strcpy(path, "./PipelineBench");
+    if((p = strrchr(path, '/')) != NULL)
+      *p = '\0';
+    bindir = path;
+  }
+  if(realpath(bindir, bin) == NULL) {
+    fprintf(stderr, "cannot find tool directory,%s\n", bindir);
+    exit(1);
+  }
+  if(report != NULL && (fr = fopen(report, "w")) == NULL) {
+    fprintf(stderr, "cannot open/write report file,%s\n", report);
+    exit(1);
+  }
+  if((fp = fopen(pipeline, "r")) == NULL) {
+    fprintf(stderr, "cannot open/read pipeline file,%s\n", pipeline);
+    exit(1);
+  }
+  strncpy(dir, pipeline, sizeof(dir) - 1);
+  dir[sizeof(dir) - 1] = '\0';
+  if((p = strrchr(dir, '/')) != NULL) {
+    *p = '\0';
+    if(chdir(dir[0] ? dir : "/") != 0) {
+      fprintf(stderr, "cannot change to pipeline directory,%s\n", dir);
+      exit(1);
+    }
+  }
+  if(mkdir(LOGDIR, 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "cannot create directory,%s\n", LOGDIR);
+    exit(1);
+  }
+  env = getenv("PATH");
+  snprintf(line, sizeof(line), "%s:%s", bin, env ? env : "/usr/bin:/bin");
+  setenv("PATH", line, 1);
+  setenv("PIPELINE_BIN", bin, 1);
+
+  printf("%-10s %-12s %10s %10s %10s %10s\n", "stage", "status", "wall s", "user s", "sys s", "peak MB");
+  if(fr)
+    fprintf(fr, "stage\tstatus\twall_s\tuser_s\tsys_s\tpeak_MB\n");
+  while(fgets(line, sizeof(line), fp) != NULL) {
+    line[strcspn(line, "\r\n")] = '\0';
+    for(stage = line; *stage == ' ' || *stage == '\t'; stage++);
+    if(*stage == '\0' || *stage == '#')
+      continue;
+    for(command = stage; *command && *command != ' ' && *command != '\t'; command++);
+    if(*command)
+      *command++ = '\0';
+    while(*command == ' ' || *command == '\t')
+      command++;
+    if(*command == '\0') {
+      fprintf(stderr, "WARNING: stage %s has no command\n", stage);
+      continue;
+    }
+    if(!Selected(stages, stage))
+      continue;
+
+    fflush(stdout);
+    code = RunStage(stage, command, &wall, &ru);
+    if(code == 0)
+      strcpy(status, "ok");
+    else if(code > 0)
+      sprintf(status, "exit %d", code);
+    else
+      sprintf(status, "signal %d", -code);
+    nstages++;
+    nfailed += (code != 0);
+    mb = ru.ru_maxrss/1024.;
+    totalwall += wall;
+    totalcpu += Seconds(ru.ru_utime) + Seconds(ru.ru_stime);
+    if(mb > peak)
+      peak = mb;
+    printf("%-10s %-12s %10.3f %10.3f %10.3f %10.1f\n", stage, status, wall,
+	   Seconds(ru.ru_utime), Seconds(ru.ru_stime), mb);
+    if(fr)
+      fprintf(fr, "%s\t%s\t%.3f\t%.3f\t%.3f\t%.1f\n", stage, status, wall,
+	      Seconds(ru.ru_utime), Seconds(ru.ru_stime), mb);
+  }
+  fclose(fp);
+  printf("%d stages, %d failed (logs in %s), %.3f s wall, %.3f s cpu, peak %.1f MB\n",
+	 nstages, nfailed, LOGDIR, totalwall, totalcpu, peak);
+  if(fr)
+    fclose(fr);
+  return (nfailed > 0);
+}
+
+/* ----------------------
+  Is stage in the comma separated list (all stages without a list)?
+ ------------------------*/
+int Selected(char *stages, char *stage)
+{
+  size_t n = strlen(stage);
+  char   *p;
+
+  if(stages == NULL)
+    return 1;
+  for(p = stages; (p = strstr(p, stage)) != NULL; p += n)
+    if((p == stages || p[-1] == ',') && (p[n] == ',' || p[n] == '\0'))
+      return 1;
+  return 0;
+}
+
+/* ----------------------
+  Run the command of a stage through /bin/sh, its output to the log of the
+  stage.  Returns the exit status, or minus the signal that killed it, and
+  sets the wall clock time and the resource usage of the stage.
+ ------------------------*/
+int RunStage(char *stage, char *command, double *wall, struct rusage *ru)
+{
+  struct timespec t0, t1;
+  char   log[2*MAXSTRING];
+  pid_t  pid;
+  int    fd, status;
+
+  snprintf(log, sizeof(log), "%s/%s.log", LOGDIR, stage);
+  memset(ru, 0, sizeof(struct rusage));
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  if((pid = fork()) < 0) {
+    fprintf(stderr, "ERROR: cannot start stage %s\n", stage);
+    exit(1);
+  }
+  if(pid == 0) {
+    if((fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0) {
+      dup2(fd, 1);
+      dup2(fd, 2);
+      close(fd);
+    }
+    execl("/bin/sh", "sh", "-c", command, (char*)NULL);
+    _exit(127);
+  }
+  while(wait4(pid, &status, 0, ru) < 0)
+    if(errno != EINTR) {
+      fprintf(stderr, "ERROR: lost stage %s\n", stage);
+      exit(1);
+    }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  *wall = (t1.tv_sec - t0.tv_sec) + 1e-9*(t1.tv_nsec - t0.tv_nsec);
+  if(WIFSIGNALED(status))
+    return -WTERMSIG(status);
+  return WEXITSTATUS(status);
+}
+
+double Seconds(struct timeval t)
+{
+  return t.tv_sec + 1e-6*t.tv_usec;
+}
+
+void Usage(char *name)
+{
+  fprintf(stderr, "\nUsage: %s [-bin <dir>] [-stages <list>] [-report <file>] <pipeline file>\n", name);
+  fprintf(stderr, "\n\tNOTE: the pipeline file has one \"<stage> <shell command>\" per line, run in its directory.\n");
+  fprintf(stderr, "\tNOTE 2: SynthBasin writes a synthetic basin and its pipeline file.\n\n");
+  exit(0);
+}
@@ -0,0 +1,596 @@
+/******************************************************************************
+   SUMMARY:
+   Streaming input and output of rasters and XYZ tables (see RasterIO.h).
+
+   Compile with -fopenmp to parse and format in parallel.
+*******************************************************************************/
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "RasterIO.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define MAXSTRING 500
+#define DEFAULTPRECISION 10
+
+static void  *Alloc(size_t size, char *what);
+static char  *SiblingName(const char *name, const char *ext);
+static int   HasExtension(const char *name, const char *ext);
+static void  ReadHeader(FILE *fp, char *name, RASTER *r, int binary);
+static int   LittleEndian(void);
+static int   FormatValue(char *s, double v, RASTER *r);
+static int   ParseXyzLine(const char *s, const int *cols, double *v);
+
+static void *Alloc(size_t size, char *what)
+{
+  void *p;
+
+  if((p = malloc(size > 0 ? size : 1)) == NULL) {
+    printf("Cannot allocate memory to first record: %s\n", what);
+    exit(8);
+  }
+  return p;
+}
+
+static int HasExtension(const char *name, const char *ext)
+{
+  size_t n = strlen(name), e = strlen(ext);
+
+  return n > e && strcasecmp(name + n - e, ext) == 0;
+}
+
+/* name with its .flt or .hdr extension replaced by ext */
+static char *SiblingName(const char *name, const char *ext)
+{
+  char *s = (char*) Alloc(strlen(name) + strlen(ext) + 1, "name");
+
+  strcpy(s, name);
+  if(HasExtension(s, ".flt") || HasExtension(s, ".hdr"))
+    s[strlen(s) - 4] = '\0';
+  strcat(s, ext);
+  return s;
+}
+
+static int LittleEndian(void)
+{
+  int one = 1;
+
+  return *(char*)&one == 1;
+}
+
+/*****************************************************************************/
+/*   IsBinaryRaster: 1 if name is an ESRI float grid, named .flt or .hdr.    */
+/*****************************************************************************/
+int IsBinaryRaster(const char *name)
+{
+  return HasExtension(name, ".flt") || HasExtension(name, ".hdr");
+}
+
+/*****************************************************************************/
+/*   IsRaster: 1 if name is a float grid or an ascii grid (starts ncols).    */
+/*****************************************************************************/
+int IsRaster(const char *name)
+{
+  FILE *fp;
+  char key[6];
+  int  ok;
+
+  if(IsBinaryRaster(name))
+    return 1;
+  if((fp = fopen(name, "r")) == NULL)
+    return 0;
+  ok = fscanf(fp, " %5s", key) == 1 && strcasecmp(key, "ncols") == 0;
+  fclose(fp);
+  return ok;
+}
+
+/* ----------------------
+  Read the "key value" lines of an ascii grid (up to the first line of
+  numbers) or of a .hdr file.
+ ------------------------*/
+static void ReadHeader(FILE *fp, char *name, RASTER *r, int binary)
+{
+  char   line[MAXSTRING], key[MAXSTRING], value[MAXSTRING];
+  int    c, xcenter = 0, ycenter = 0, got = 0;
+
+  r->ncols = r->nrows = 0;
+  r->xllcorner = r->yllcorner = 0.;
+  r->cellsize = 0.;
+  r->nodata = -9999.;
+  r->swap = 0;
+  for(;;) {
+    while((c = fgetc(fp)) != EOF && isspace(c));
+    if(c == EOF)
+      break;
+    ungetc(c, fp);
+    if(!isalpha(c))
+      break;
+    if(fgets(line, MAXSTRING, fp) == NULL || sscanf(line, "%s %s", key, value) != 2)
+      continue;
+    if(strcasecmp(key, "ncols") == 0) { r->ncols = atoi(value); got |= 1; }
+    else if(strcasecmp(key, "nrows") == 0) { r->nrows = atoi(value); got |= 2; }
+    else if(strcasecmp(key, "xllcorner") == 0) { r->xllcorner = atof(value); got |= 4; }
+    else if(strcasecmp(key, "xllcenter") == 0) { r->xllcorner = atof(value); xcenter = 1; got |= 4; }
+    else if(strcasecmp(key, "yllcorner") == 0) { r->yllcorner = atof(value); got |= 8; }
+    else if(strcasecmp(key, "yllcenter") == 0) { r->yllcorner = atof(value); ycenter = 1; got |= 8; }
+    else if(strcasecmp(key, "cellsize") == 0) { r->cellsize = atof(value); got |= 16; }
+    else if(strcasecmp(key, "NODATA_value") == 0 || strcasecmp(key, "nodata") == 0) r->nodata = atof(value);
+    else if(strcasecmp(key, "byteorder") == 0)
+      r->swap = (toupper(value[0]) == 'M') == LittleEndian();
+    else if(strcasecmp(key, "nbits") == 0 && atoi(value) != 32) {
+      fprintf(stderr, "ERROR: %s has %s bit values, only 32 bit floats are read\n", name, value);
+      exit(1);
+    }
+  }
+  if(got != 31 || r->ncols <= 0 || r->nrows <= 0 || r->cellsize <= 0.) {
+    fprintf(stderr, "ERROR: %s is not an %s\n", name, binary ? "ESRI float grid header" : "ArcInfo ascii grid");
+    exit(1);
+  }
+  if(xcenter) r->xllcorner -= 0.5*r->cellsize;
+  if(ycenter) r->yllcorner -= 0.5*r->cellsize;
+  /* the pixels of a float grid are compared with nodata as floats */
+  if(binary) r->nodata = (float)r->nodata;
+}
+
+/*****************************************************************************/
+/*   OpenRaster: open a raster for reading and read its header.              */
+/*****************************************************************************/
+void OpenRaster(char *name, RASTER *r)
+{
+  FILE *fp;
+
+  r->binary = IsBinaryRaster(name);
+  r->name = r->binary ? SiblingName(name, ".flt") : strdup(name);
+  if(r->binary) {
+    char *hdr = SiblingName(name, ".hdr");
+
+    if((fp = fopen(hdr, "r")) == NULL) {
+      fprintf(stderr, "cannot open/read grid header,%s\n", hdr);
+      exit(1);
+    }
+    ReadHeader(fp, hdr, r, 1);
+    fclose(fp);
+    free(hdr);
+    fp = fopen(r->name, "rb");
+  }
+  else if((fp = fopen(r->name, "r")) != NULL)
+    ReadHeader(fp, r->name, r, 0);
+  if(fp == NULL) {
+    fprintf(stderr, "cannot open/read grid file,%s\n", r->name);
+    exit(1);
+  }
+  r->fp = fp;
+  r->row = 0;
+  if(r->precision <= 0)
+    r->precision = DEFAULTPRECISION;
+}
+
+/*****************************************************************************/
+/*   CreateRaster: create a raster with the header in r and write the        */
+/*   header.  r->precision digits are written for ascii values (default 10). */
+/*****************************************************************************/
+void CreateRaster(char *name, RASTER *r)
+{
+  FILE *fp;
+  char nodata[64];
+
+  if(r->precision <= 0)
+    r->precision = DEFAULTPRECISION;
+  r->binary = IsBinaryRaster(name);
+  r->name = r->binary ? SiblingName(name, ".flt") : strdup(name);
+  r->swap = 0;
+  r->row = 0;
+  FormatValue(nodata, r->nodata, r);
+  if(r->binary) {
+    char *hdr = SiblingName(name, ".hdr");
+
+    /* nodata as the float the pixels are written as, with the digits to
+       read it back exactly (e.g. -FLT_MAX) */
+    r->nodata = (float)r->nodata;
+    sprintf(nodata, "%.9g", r->nodata);
+
+    if((fp = fopen(hdr, "w")) == NULL) {
+      fprintf(stderr, "cannot open output file,%s\n", hdr);
+      exit(1);
+    }
+    fprintf(fp, "ncols %d\nnrows %d\nxllcorner %.12g\nyllcorner %.12g\ncellsize %.12g\nNODATA_value %s\nbyteorder %s\n",
+	    r->ncols, r->nrows, r->xllcorner, r->yllcorner, r->cellsize, nodata,
+	    LittleEndian() ? "LSBFIRST" : "MSBFIRST");
+    fclose(fp);
+    free(hdr);
+    r->fp = fopen(r->name, "wb");
+  }
+  else
+    r->fp = fopen(r->name, "w");
+  if(r->fp == NULL) {
+    fprintf(stderr, "cannot open output file,%s\n", r->name);
+    exit(1);
+  }
+  if(!r->binary)
+    fprintf(r->fp, "ncols %d\nnrows %d\nxllcorner %.12g\nyllcorner %.12g\ncellsize %.12g\nNODATA_value %s\n",
+	    r->ncols, r->nrows, r->xllcorner, r->yllcorner, r->cellsize, nodata);
+}
+
+/* ----------------------
+  Write v as an ascii grid value, returns the number of characters.
+ ------------------------*/
+static int FormatValue(char *s, double v, RASTER *r)
+{
+  return sprintf(s, "%.*g", r->precision, v);
+}
+
+/*****************************************************************************/
+/*   ReadRasterRows: read the next n rows (or the rows left) into rows, in   */
+/*   row order, ncols values per row.  Returns the number of rows read.      */
+/*****************************************************************************/
+int ReadRasterRows(RASTER *r, int n, double *rows)
+{
+  long  k, bad = -1;
+  int   i;
+
+  if(n > r->nrows - r->row)
+    n = r->nrows - r->row;
+  if(n <= 0)
+    return 0;
+
+  if(r->binary) {
+    float *f = (float*) Alloc((size_t)n*r->ncols*sizeof(float), "raster rows");
+
+    if(fread(f, sizeof(float), (size_t)n*r->ncols, r->fp) != (size_t)n*r->ncols) {
+      fprintf(stderr, "ERROR: grid file %s ends before row %ld\n", r->name, r->row + n);
+      exit(1);
+    }
+#pragma omp parallel for
+    for(k=0; k<(long)n*r->ncols; k++) {
+      if(r->swap) {
+	unsigned char *b = (unsigned char*)&f[k], t;
+
+	t = b[0]; b[0] = b[3]; b[3] = t;
+	t = b[1]; b[1] = b[2]; b[2] = t;
+      }
+      rows[k] = f[k];
+    }
+    free(f);
+  }
+  else {
+    /* read the lines, then parse them in parallel */
+    char   **lines = (char**) Alloc(n*sizeof(char*), "raster lines");
+    size_t size;
+
+    for(i=0; i<n; i++) {
+      lines[i] = NULL;
+      size = 0;
+      do {
+	if(getline(&lines[i], &size, r->fp) < 0) {
+	  fprintf(stderr, "ERROR: grid file %s ends before row %ld\n", r->name, r->row + i + 1);
+	  exit(1);
+	}
+      } while(strspn(lines[i], " \t\r\n") == strlen(lines[i]));
+    }
+#pragma omp parallel for schedule(dynamic)
+    for(i=0; i<n; i++) {
+      char   *p = lines[i], *stop;
+      double *out = rows + (long)i*r->ncols;
+      int    c;
+
+      for(c=0; c<r->ncols; c++, p=stop) {
+	out[c] = strtod(p, &stop);
+	if(stop == p)
+	  break;
+      }
+      if(c < r->ncols || strspn(p, " \t\r\n") != strlen(p)) {
+#pragma omp critical(rasterio)
+	if(bad < 0 || r->row + i < bad)
+	  bad = r->row + i;
+      }
+      free(lines[i]);
+    }
+    free(lines);
+    if(bad >= 0) {
+      fprintf(stderr, "ERROR: row %ld of grid file %s does not have %d values\n", bad + 1, r->name, r->ncols);
+      exit(1);
+    }
+  }
+  r->row += n;
+  return n;
+}
+
+/*****************************************************************************/
+/*   WriteRasterRows: write n rows of ncols values.                          */
+/*****************************************************************************/
+void WriteRasterRows(RASTER *r, int n, const double *rows)
+{
+  long k;
+  int  i;
+
+  if(r->row + n > r->nrows) {
+    fprintf(stderr, "ERROR: more than %d rows written to %s\n", r->nrows, r->name);
+    exit(1);
+  }
+  if(r->binary) {
+    float *f = (float*) Alloc((size_t)n*r->ncols*sizeof(float), "raster rows");
+
+#pragma omp parallel for
+    for(k=0; k<(long)n*r->ncols; k++)
+      f[k] = (float)rows[k];
+    fwrite(f, sizeof(float), (size_t)n*r->ncols, r->fp);
+    free(f);
+  }
+  else {
+    /* format the rows in parallel, then write them in order */
+    size_t rowmax = (size_t)r->ncols*(r->precision + 9) + 2;
+    char   *text = (char*) Alloc(n*rowmax, "raster text");
+    size_t *len = (size_t*) Alloc(n*sizeof(size_t), "raster text");
+
+#pragma omp parallel for schedule(dynamic)
+    for(i=0; i<n; i++) {
+      char         *s = text + i*rowmax;
+      const double *v = rows + (long)i*r->ncols;
+      int          c;
+
+      for(c=0; c<r->ncols; c++) {
+	s += FormatValue(s, v[c], r);
+	*s++ = (c == r->ncols-1) ? '\n' : ' ';
+      }
+      len[i] = s - (text + i*rowmax);
+    }
+    for(i=0; i<n; i++)
+      fwrite(text + i*rowmax, 1, len[i], r->fp);
+    free(text);
+    free(len);
+  }
+  r->row += n;
+}
+
+/*****************************************************************************/
+/*   CloseRaster: close the raster.                                          */
+/*****************************************************************************/
+void CloseRaster(RASTER *r)
+{
+  if(r->fp != NULL && fclose(r->fp) != 0) {
+    fprintf(stderr, "ERROR: cannot write %s\n", r->name);
+    exit(1);
+  }
+  r->fp = NULL;
+  free(r->name);
+  r->name = NULL;
+}
+
+/*****************************************************************************/
+/*   OpenXyz: open an XYZ table, with x, y and z in columns cols (from 0).   */
+/*   Binary tables are records of doubles, as many as the last column.      */
+/*****************************************************************************/
+void OpenXyz(char *name, int binary, const int *cols, XYZREADER *t)
+{
+  int i;
+
+  memset(t, 0, sizeof(XYZREADER));
+  if((t->fp = fopen(name, binary ? "rb" : "r")) == NULL) {
+    fprintf(stderr, "cannot open/read XYZ file,%s\n", name);
+    exit(1);
+  }
+  t->name = strdup(name);
+  t->binary = binary;
+  t->reclen = 0;
+  for(i=0; i<3; i++) {
+    t->cols[i] = cols[i];
+    if(cols[i] + 1 > t->reclen)
+      t->reclen = cols[i] + 1;
+  }
+  t->cap = XYZCHUNK + 1;
+  t->buf = (char*) Alloc(t->cap + 1, "XYZ chunk");
+}
+
+/* ----------------------
+  Parse the x, y and z columns of the line at s (ending with a newline),
+  fields are separated by whitespace or one comma.  Returns 0 if one of
+  them is missing or not a number, -1 for a blank line.
+ ------------------------*/
+static int ParseXyzLine(const char *s, const int *cols, double *v)
+{
+  int  field, k, found = 0, last = cols[0];
+  char *stop;
+
+  for(k=1; k<3; k++)
+    if(cols[k] > last) last = cols[k];
+  while(*s == ' ' || *s == '\t' || *s == '\r')
+    s++;
+  if(*s == '\n')
+    return -1;
+  for(field=0; field<=last; field++) {
+    const char *f = s;
+
+    while(*s != ',' && *s != ' ' && *s != '\t' && *s != '\r' && *s != '\n')
+      s++;
+    for(k=0; k<3; k++)
+      if(cols[k] == field) {
+	if(s == f)
+	  return 0;
+	v[k] = strtod(f, &stop);
+	if(stop != s)
+	  return 0;
+	found++;
+      }
+    while(*s == ' ' || *s == '\t' || *s == '\r')
+      s++;
+    if(*s == ',')
+      for(s++; *s == ' ' || *s == '\t' || *s == '\r'; s++);
+    if(*s == '\n')
+      break;
+  }
+  return found == 3;
+}
+
+/*****************************************************************************/
+/*   ReadXyz: read the next block of records into t->x, t->y and t->z.       */
+/*   Returns the number of records, 0 at the end of the table.  A header     */
+/*   line is skipped, other lines without numbers are counted in skipped.    */
+/*****************************************************************************/
+long ReadXyz(XYZREADER *t)
+{
+  long   nlines, n, k, *first;
+  size_t end, got;
+  int    nthreads = 1, th;
+  size_t *cut;
+  char   *ok;
+
+  if(t->binary) {
+    long   maxrec = XYZCHUNK/(8*t->reclen);
+    double *rec = (double*) t->buf;
+
+    n = fread(rec, 8*t->reclen, maxrec, t->fp);
+    if(n > t->max) {
+      free(t->x);
+      t->max = n;
+      t->x = (double*) Alloc(3*n*sizeof(double), "XYZ records");
+      t->y = t->x + n;
+      t->z = t->y + n;
+    }
+#pragma omp parallel for
+    for(k=0; k<n; k++) {
+      t->x[k] = rec[k*t->reclen + t->cols[0]];
+      t->y[k] = rec[k*t->reclen + t->cols[1]];
+      t->z[k] = rec[k*t->reclen + t->cols[2]];
+    }
+    t->line += n;
+    return n;
+  }
+
+  /* fill the chunk after the partial line left by the last call, until it
+     has a complete line */
+  for(;;) {
+    char *nl;
+
+    if(!t->eof && t->len < t->cap) {
+      got = fread(t->buf + t->len, 1, t->cap - t->len, t->fp);
+      t->len += got;
+      if(got == 0 || t->len < t->cap)
+	t->eof = feof(t->fp) || got == 0;
+    }
+    if(t->eof && t->len > 0 && t->buf[t->len-1] != '\n')
+      t->buf[t->len++] = '\n';
+    if(t->len == 0)
+      return 0;
+    for(nl=t->buf + t->len - 1; nl >= t->buf && *nl != '\n'; nl--);
+    if(nl >= t->buf) {
+      end = nl - t->buf + 1;
+      break;
+    }
+    /* a line longer than the chunk */
+    t->cap *= 2;
+    if((t->buf = (char*) realloc(t->buf, t->cap + 1)) == NULL) {
+      printf("Cannot allocate memory to first record: XYZ chunk\n");
+      exit(8);
+    }
+  }
+
+  /* the chunk is split between the threads at line ends */
+#ifdef _OPENMP
+  nthreads = omp_get_max_threads();
+#endif
+  cut = (size_t*) Alloc((nthreads+1)*sizeof(size_t), "XYZ split");
+  first = (long*) Alloc((nthreads+1)*sizeof(long), "XYZ split");
+  cut[0] = 0;
+  for(th=1; th<nthreads; th++) {
+    size_t c = end*th/nthreads;
+
+    if(c < cut[th-1]) c = cut[th-1];
+    while(c < end && c > 0 && t->buf[c-1] != '\n')
+      c++;
+    cut[th] = c;
+  }
+  cut[nthreads] = end;
+
+#pragma omp parallel for
+  for(th=0; th<nthreads; th++) {
+    const char *p = t->buf + cut[th], *e = t->buf + cut[th+1];
+    long       c = 0;
+
+    while(p < e && (p = memchr(p, '\n', e - p)) != NULL) {
+      c++;
+      p++;
+    }
+    first[th+1] = c;
+  }
+  first[0] = 0;
+  for(th=0; th<nthreads; th++)
+    first[th+1] += first[th];
+  nlines = first[nthreads];
+
+  if(nlines > t->max) {
+    free(t->x);
+    t->max = nlines;
+    t->x = (double*) Alloc(3*nlines*sizeof(double), "XYZ records");
+    t->y = t->x + nlines;
+    t->z = t->y + nlines;
+  }
+  ok = (char*) Alloc(nlines, "XYZ records");
+
+#pragma omp parallel for
+  for(th=0; th<nthreads; th++) {
+    const char *p = t->buf + cut[th];
+    long       l;
+    double     v[3];
+
+    for(l=first[th]; l<first[th+1]; l++) {
+      ok[l] = (char)ParseXyzLine(p, t->cols, v);
+      t->x[l] = v[0];
+      t->y[l] = v[1];
+      t->z[l] = v[2];
+      p = (const char*)memchr(p, '\n', t->buf + end - p) + 1;
+    }
+  }
+
+  /* keep the records in file order */
+  for(k=0, n=0; k<nlines; k++) {
+    if(ok[k] == 1) {
+      t->x[n] = t->x[k];
+      t->y[n] = t->y[k];
+      t->z[n] = t->z[k];
+      n++;
+    }
+    else if(ok[k] == 0 && t->line + k > 0) {
+      if(t->skipped == 0)
+	fprintf(stderr, "WARNING: line %ld of %s does not have x, y and z numbers, skipped\n",
+		t->line + k + 1, t->name);
+      t->skipped++;
+    }
+  }
+  t->line += nlines;
+  memmove(t->buf, t->buf + end, t->len - end);
+  t->len -= end;
+  free(ok);
+  free(cut);
+  free(first);
+
+  /* a chunk of header or blank lines only */
+  if(n == 0)
+    return ReadXyz(t);
+  return n;
+}
+
+/*****************************************************************************/
+/*   RewindXyz: go back to the start of the table, for another pass.         */
+/*****************************************************************************/
+void RewindXyz(XYZREADER *t)
+{
+  rewind(t->fp);
+  t->len = 0;
+  t->line = 0;
+  t->skipped = 0;
+  t->eof = 0;
+}
+
+void CloseXyz(XYZREADER *t)
+{
+  fclose(t->fp);
+  free(t->buf);
+  free(t->x);
+  free(t->name);
+  memset(t, 0, sizeof(XYZREADER));
+}
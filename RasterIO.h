@@ -0,0 +1,69 @@
+/******************************************************************************
+   SUMMARY:
+   Streaming input and output of rasters and XYZ tables, shared by XyzRaster
+   and the tools that work on grids too large to be read whole.
+
+   Rasters are arc/info ascii grids or ESRI binary float grids (<name>.flt
+   with its <name>.hdr header), read and written a block of rows at a time.
+   The rows of ascii blocks are parsed and formatted in parallel when
+   compiled with -fopenmp.
+
+   XYZ tables are text, with whitespace or comma separated columns and an
+   optional header line, or binary records of doubles.  They are read in
+   chunks of XYZCHUNK bytes that are split between threads at line ends, so
+   the records of a chunk are parsed in parallel and returned in file order.
+*******************************************************************************/
+#ifndef RASTERIO_H
+#define RASTERIO_H
+
+#include <stdio.h>
+
+#define XYZCHUNK (16L<<20)   /* bytes of an XYZ table parsed per block */
+#define MAXXYZCOLS 64
+
+typedef struct
+{
+  int    ncols, nrows;
+  double xllcorner, yllcorner;   /* lower left corner of the grid */
+  double cellsize;
+  double nodata;
+  int    binary;                 /* ESRI float grid (.flt + .hdr) */
+  int    swap;                   /* the .flt byte order is not that of this machine */
+  int    precision;              /* significant digits of ascii values */
+  long   row;                    /* next row to read or write */
+  FILE   *fp;
+  char   *name;
+} RASTER;
+
+typedef struct
+{
+  FILE   *fp;
+  char   *name;
+  int    binary;                 /* records of reclen doubles */
+  int    reclen;
+  int    cols[3];                /* columns of x, y and z */
+  char   *buf;                   /* text of the current chunk */
+  size_t len, cap;
+  long   line;                   /* lines read before the current chunk */
+  long   skipped;                /* lines that are not x y z numbers */
+  int    eof;
+  long   max;                    /* size of the record arrays */
+  double *x, *y, *z;
+} XYZREADER;
+
+/* rasters */
+int  IsBinaryRaster(const char *name);
+int  IsRaster(const char *name);
+void OpenRaster(char *name, RASTER *r);
+void CreateRaster(char *name, RASTER *r);
+int  ReadRasterRows(RASTER *r, int n, double *rows);
+void WriteRasterRows(RASTER *r, int n, const double *rows);
+void CloseRaster(RASTER *r);
+
+/* XYZ tables */
+void OpenXyz(char *name, int binary, const int *cols, XYZREADER *t);
+long ReadXyz(XYZREADER *t);
+void RewindXyz(XYZREADER *t);
+void CloseXyz(XYZREADER *t);
+
+#endif
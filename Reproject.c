@@ -0,0 +1,291 @@
+/******************************************************************************
+   SUMMARY:
+   Reprojection of geographic DEMs into an equal area projection, so that the
+   terrain engine can work on cell sizes in meters without projecting the
+   DEMs in a GIS first.
+
+   Supported projections (ellipsoidal forms from Snyder, 1987):
+     REPROJ_LAEA   - Lambert azimuthal equal area, centered on lon0, lat0
+     REPROJ_ALBERS - Albers conic equal area, origin lon0, lat0 and
+                     standard parallels lat1, lat2
+
+   The DEM is resampled onto the projected grid with nearest neighbour or
+   bilinear interpolation.  Output rows are processed in blocks, and the
+   blocks are shared between threads when compiled with -fopenmp.
+
+   REFERENCES: Snyder, J.P. (1987) Map Projections - A Working Manual.
+               USGS Professional Paper 1395.
+*******************************************************************************/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "TerrainEngine.h"
+
+#define ROWBLOCK 32        /* output rows per thread work unit */
+#define MAXITER  15        /* iterations of the inverse latitude */
+#define DTOR     (M_PI/180.)
+
+/* ----------------------
+  Authalic function q of latitude (Snyder eq. 3-12).
+ ------------------------*/
+static inline double qfunc(double sinphi, double e, double e2)
+{
+  double esin = e*sinphi;
+
+  return (1.-e2)*(sinphi/(1.-esin*esin) - (1./(2.*e))*log((1.-esin)/(1.+esin)));
+}
+
+/* ----------------------
+  Latitude from q by iteration (Snyder eq. 3-16).
+ ------------------------*/
+static inline double phifromq(double q, double e, double e2)
+{
+  double phi, sinphi, cosphi, esin, dphi;
+  int    k;
+
+  phi = asin(q/2.);
+  for(k=0; k<MAXITER; k++) {
+    sinphi = sin(phi);
+    cosphi = cos(phi);
+    esin = e*sinphi;
+    dphi = (1.-esin*esin)*(1.-esin*esin)/(2.*cosphi) *
+      (q/(1.-e2) - sinphi/(1.-esin*esin) + (1./(2.*e))*log((1.-esin)/(1.+esin)));
+    phi += dphi;
+    if(fabs(dphi) < 1.e-12) break;
+  }
+  return phi;
+}
+
+/*****************************************************************************/
+/*   SetupProjection: compute the constants of a projection.  Angles are in  */
+/*   degrees, a is the semi major axis (m) and e2 the squared eccentricity   */
+/*   of the ellipsoid.  Returns 0 on success, -1 for invalid parameters.     */
+/*****************************************************************************/
+int SetupProjection(PROJPARAMS *p, int type, double lon0, double lat0,
+		    double lat1, double lat2, double a, double e2)
+{
+  double sin0, sin1, sin2, m1, m2, q0, q1, q2;
+
+  memset(p, 0, sizeof(PROJPARAMS));
+  p->type = type;
+  p->lon0 = lon0*DTOR;
+  p->lat0 = lat0*DTOR;
+  p->a = a;
+  p->e2 = e2;
+  p->e = sqrt(e2);
+
+  sin0 = sin(p->lat0);
+  q0 = qfunc(sin0, p->e, e2);
+  p->qp = qfunc(1., p->e, e2);
+
+  if(type == REPROJ_LAEA) {
+    if(fabs(lat0) >= 90.) return -1;
+    m1 = cos(p->lat0)/sqrt(1.-e2*sin0*sin0);
+    p->rq = a*sqrt(p->qp/2.);
+    p->beta1 = asin(q0/p->qp);
+    p->d = a*m1/(p->rq*cos(p->beta1));
+  }
+  else if(type == REPROJ_ALBERS) {
+    if(fabs(lat1 + lat2) < 1.e-10) return -1;
+    sin1 = sin(lat1*DTOR);
+    sin2 = sin(lat2*DTOR);
+    m1 = cos(lat1*DTOR)/sqrt(1.-e2*sin1*sin1);
+    q1 = qfunc(sin1, p->e, e2);
+    if(fabs(lat1 - lat2) > 1.e-10) {
+      m2 = cos(lat2*DTOR)/sqrt(1.-e2*sin2*sin2);
+      q2 = qfunc(sin2, p->e, e2);
+      p->n = (m1*m1 - m2*m2)/(q2 - q1);
+    }
+    else
+      p->n = sin1;
+    p->c = m1*m1 + p->n*q1;
+    p->rho0 = a*sqrt(p->c - p->n*q0)/p->n;
+  }
+  else
+    return -1;
+
+  return 0;
+}
+
+/*****************************************************************************/
+/*   ProjForward: longitude, latitude (degrees) to projected x, y (m) for    */
+/*   n points.                                                               */
+/*****************************************************************************/
+void ProjForward(PROJPARAMS *p, int n, double *lon, double *lat, double *x, double *y)
+{
+  int    k;
+  double e = p->e, e2 = p->e2;
+  double dlam, q, sinb, cosb, b, rho, theta;
+  double sinb1 = sin(p->beta1), cosb1 = cos(p->beta1);
+
+  if(p->type == REPROJ_LAEA) {
+    for(k=0; k<n; k++) {
+      dlam = lon[k]*DTOR - p->lon0;
+      q = qfunc(sin(lat[k]*DTOR), e, e2);
+      sinb = q/p->qp;
+      cosb = sqrt(1.-sinb*sinb);
+      b = p->rq*sqrt(2./(1. + sinb1*sinb + cosb1*cosb*cos(dlam)));
+      x[k] = b*p->d*cosb*sin(dlam);
+      y[k] = (b/p->d)*(cosb1*sinb - sinb1*cosb*cos(dlam));
+    }
+  }
+  else {
+    for(k=0; k<n; k++) {
+      q = qfunc(sin(lat[k]*DTOR), e, e2);
+      rho = p->a*sqrt(p->c - p->n*q)/p->n;
+      theta = p->n*(lon[k]*DTOR - p->lon0);
+      x[k] = rho*sin(theta);
+      y[k] = p->rho0 - rho*cos(theta);
+    }
+  }
+}
+
+/*****************************************************************************/
+/*   ProjInverse: projected x, y (m) to longitude, latitude (degrees) for    */
+/*   n points.                                                               */
+/*****************************************************************************/
+void ProjInverse(PROJPARAMS *p, int n, double *x, double *y, double *lon, double *lat)
+{
+  int    k;
+  double e = p->e, e2 = p->e2;
+  double rho, ce, since, cosce, q, theta, dy;
+  double sinb1 = sin(p->beta1), cosb1 = cos(p->beta1), d = p->d;
+
+  if(p->type == REPROJ_LAEA) {
+    for(k=0; k<n; k++) {
+      rho = sqrt((x[k]/d)*(x[k]/d) + (d*y[k])*(d*y[k]));
+      if(rho < 1.e-10) {
+	lon[k] = p->lon0/DTOR;
+	lat[k] = p->lat0/DTOR;
+	continue;
+      }
+      ce = 2.*asin(rho/(2.*p->rq));
+      since = sin(ce);
+      cosce = cos(ce);
+      q = p->qp*(cosce*sinb1 + d*y[k]*since*cosb1/rho);
+      lon[k] = (p->lon0 + atan2(x[k]*since, d*rho*cosb1*cosce - d*d*y[k]*sinb1*since))/DTOR;
+      lat[k] = phifromq(q, e, e2)/DTOR;
+    }
+  }
+  else {
+    for(k=0; k<n; k++) {
+      dy = p->rho0 - y[k];
+      rho = sqrt(x[k]*x[k] + dy*dy);
+      if(p->n < 0) {
+	rho = -rho;
+	theta = atan2(-x[k], -dy);
+      }
+      else
+	theta = atan2(x[k], dy);
+      q = (p->c - (rho*p->n/p->a)*(rho*p->n/p->a))/p->n;
+      lon[k] = (p->lon0 + theta/p->n)/DTOR;
+      lat[k] = phifromq(q, e, e2)/DTOR;
+    }
+  }
+}
+
+/*****************************************************************************/
+/*   ReprojectTerrain: resample a geographic DEM read by ReadDEM() onto an   */
+/*   equal area grid of the given cell size (m), or of the size of a pixel   */
+/*   at the center of the DEM when cellsize <= 0.  The terrain is then       */
+/*   cropped again, and SetCellSize(t, PROJ_EQUALAREA) should follow.        */
+/*   Returns the number of valid pixels.                                     */
+/*****************************************************************************/
+int ReprojectTerrain(TERRAIN *t, PROJPARAMS *p, double cellsize, int method)
+{
+  int    i, j, k, n, nedge, ncols, nrows, block;
+  double *lon, *lat, *x, *y;
+  double xmin, xmax, ymin, ymax, xorig, yorig, celllat, celllong;
+  double **out;
+
+  if(t->nvalid == 0) return 0;
+
+  if(cellsize <= 0.) {
+    celllat = t->yorig + t->delta*(t->fullrows - t->row0 - t->rows/2.);
+    celllong = t->xorig + t->delta*(t->col0 + t->columns/2.);
+    cellsize = 1000.*sqrt(get_dist(celllat, celllong, celllat, celllong + t->delta) *
+			  get_dist(celllat, celllong, celllat + t->delta, celllong));
+  }
+
+  /* Extent of the projected grid from the edges of the crop. */
+  nedge = 2*(t->columns + t->rows) + 4;
+  lon = (double*) calloc(nedge, sizeof(double));
+  lat = (double*) calloc(nedge, sizeof(double));
+  x = (double*) calloc(nedge, sizeof(double));
+  y = (double*) calloc(nedge, sizeof(double));
+  if(lon == NULL || lat == NULL || x == NULL || y == NULL)
+    { printf("Cannot allocate memory to first record: edge\n");
+      exit(8);
+    }
+  n = 0;
+  for(j=0; j<=t->columns; j++) {
+    lon[n] = lon[n+1] = t->xorig + t->delta*(t->col0 + j);
+    lat[n++] = t->yorig + t->delta*(t->fullrows - t->row0);
+    lat[n++] = t->yorig + t->delta*(t->fullrows - t->row0 - t->rows);
+  }
+  for(i=0; i<=t->rows; i++) {
+    lat[n] = lat[n+1] = t->yorig + t->delta*(t->fullrows - t->row0 - i);
+    lon[n++] = t->xorig + t->delta*t->col0;
+    lon[n++] = t->xorig + t->delta*(t->col0 + t->columns);
+  }
+  ProjForward(p, n, lon, lat, x, y);
+  xmin = xmax = x[0];
+  ymin = ymax = y[0];
+  for(k=1; k<n; k++) {
+    if(x[k] < xmin) xmin = x[k];
+    if(x[k] > xmax) xmax = x[k];
+    if(y[k] < ymin) ymin = y[k];
+    if(y[k] > ymax) ymax = y[k];
+  }
+  free(lon); free(lat); free(x); free(y);
+
+  /* Snap the grid to multiples of the cell size. */
+  xorig = floor(xmin/cellsize)*cellsize;
+  yorig = floor(ymin/cellsize)*cellsize;
+  ncols = (int)ceil((xmax - xorig)/cellsize);
+  nrows = (int)ceil((ymax - yorig)/cellsize);
+
+  out = Memoryalloc(ncols, nrows);
+
+  /* Each block of output rows is inverse projected one row at a time. */
+#pragma omp parallel for schedule(dynamic) private(i, j, lon, lat, x, y)
+  for(block=0; block<nrows; block+=ROWBLOCK) {
+    lon = (double*) malloc(ncols*sizeof(double));
+    lat = (double*) malloc(ncols*sizeof(double));
+    x = (double*) malloc(ncols*sizeof(double));
+    y = (double*) malloc(ncols*sizeof(double));
+    if(lon == NULL || lat == NULL || x == NULL || y == NULL)
+      { printf("Cannot allocate memory to first record: row\n");
+	exit(8);
+      }
+    for(i=block; i<block+ROWBLOCK && i<nrows; i++) {
+      for(j=0; j<ncols; j++) {
+	x[j] = xorig + cellsize*(j + 0.5);
+	y[j] = yorig + cellsize*(nrows - i - 0.5);
+      }
+      ProjInverse(p, ncols, x, y, lon, lat);
+      for(j=0; j<ncols; j++)
+	out[i][j] = SampleDEM(t->dem, t->columns, t->rows, t->nodata,
+			      (t->yorig + t->delta*t->fullrows - lat[j])/t->delta - 0.5 - t->row0,
+			      (lon[j] - t->xorig)/t->delta - 0.5 - t->col0, method);
+    }
+    free(lon); free(lat); free(x); free(y);
+  }
+
+  /* Replace the geographic grid with the projected one. */
+  Memoryfree(t->dem, t->rows);
+  free(t->valid);
+  t->valid = NULL;
+  t->fullcols = t->columns = ncols;
+  t->fullrows = t->rows = nrows;
+  t->xorig = xorig;
+  t->yorig = yorig;
+  t->delta = cellsize;
+  t->nvalid = CropToValid(&out, &t->columns, &t->rows, &t->col0, &t->row0, t->nodata);
+  t->dem = out;
+  if(t->nvalid > 0)
+    t->valid = ValidPixels(out, t->columns, t->rows, t->nodata, t->nvalid);
+
+  return t->nvalid;
+}
@@ -0,0 +1,237 @@
+/******************************************************************************
+   SUMMARY:
+   Resampling of a DEM to coarser resolutions, to test the sensitivity of the
+   wetness index distribution to DEM resolution without going through a GIS.
+
+   A coarse pixel is found from the fine pixels whose centers fall inside it
+   (block mean, minimum, maximum or median of the valid pixels), or by
+   bilinear interpolation at its center.  The resolution factor does not
+   need to be an integer, so 30 m data gives 90 m (3) and 250 m (8.333)
+   levels.
+
+   BuildPyramid() produces all levels from the full resolution DEM in one
+   parallel sweep: blocks of output rows of every level are the work units
+   shared between threads when compiled with -fopenmp.  The inner loops run
+   along DEM rows without branches so that the compiler can vectorise them.
+*******************************************************************************/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "TerrainEngine.h"
+
+#define ROWBLOCK 16        /* output rows per thread work unit */
+
+/* ----------------------
+  First fine row (or column) with its center inside coarse row k.
+ ------------------------*/
+static inline int FirstFine(int k, double factor)
+{
+  return (int)ceil(k*factor - 0.5 - 1.e-9);
+}
+
+/* ----------------------
+  k-th smallest of n values (quickselect), reorders the values.
+ ------------------------*/
+static double Select(double *v, int n, int k)
+{
+  int    left = 0, right = n-1, i, j;
+  double pivot, tmp;
+
+  while(left < right) {
+    pivot = v[(left+right)/2];
+    i = left;
+    j = right;
+    do {
+      while(v[i] < pivot) i++;
+      while(pivot < v[j]) j--;
+      if(i <= j) {
+	tmp = v[i]; v[i] = v[j]; v[j] = tmp;
+	i++;
+	j--;
+      }
+    } while(i <= j);
+    if(k <= j) right = j;
+    else if(k >= i) left = i;
+    else break;
+  }
+  return v[k];
+}
+
+/* ----------------------
+  Geometry of the coarse grid and the window of it that covers the crop
+  of the fine grid.
+ ------------------------*/
+static void LevelGeometry(TERRAIN *src, TERRAIN *dst, double factor)
+{
+  int c1, r1;
+
+  memset(dst, 0, sizeof(TERRAIN));
+  dst->nodata = src->nodata;
+  dst->delta = src->delta*factor;
+  dst->fullcols = (int)ceil(src->fullcols/factor - 1.e-9);
+  dst->fullrows = (int)ceil(src->fullrows/factor - 1.e-9);
+  dst->xorig = src->xorig;
+  /* Keep the north edge, rows are counted from the north. */
+  dst->yorig = src->yorig + src->delta*src->fullrows - dst->delta*dst->fullrows;
+
+  dst->col0 = (int)floor((src->col0 + 0.5)/factor);
+  dst->row0 = (int)floor((src->row0 + 0.5)/factor);
+  c1 = (int)floor((src->col0 + src->columns - 0.5)/factor);
+  r1 = (int)floor((src->row0 + src->rows - 0.5)/factor);
+  if(c1 > dst->fullcols-1) c1 = dst->fullcols-1;
+  if(r1 > dst->fullrows-1) r1 = dst->fullrows-1;
+  dst->columns = c1 - dst->col0 + 1;
+  dst->rows = r1 - dst->row0 + 1;
+  dst->dem = Memoryalloc(dst->columns, dst->rows);
+}
+
+/* ----------------------
+  Fill coarse rows r0 <= row < r1 of dst from src.
+ ------------------------*/
+static void AggregateRows(TERRAIN *src, TERRAIN *dst, double factor, int method,
+			  int r0, int r1)
+{
+  int    i, j, r, c, fr0, fr1, fc0, fc1, cnt, n, nbuf;
+  double nodata = src->nodata;
+  double sum, mn, mx, *row, *buf = NULL;
+
+  if(method == AGG_MEDIAN) {
+    nbuf = ((int)ceil(factor)+1)*((int)ceil(factor)+1);
+    if(!(buf = (double*) malloc(nbuf*sizeof(double))))
+      { printf("Cannot allocate memory to first record: buf\n");
+	exit(8);
+      }
+  }
+
+  for(i=r0; i<r1; i++) {
+    if(method == AGG_BILINEAR) {
+      for(j=0; j<dst->columns; j++)
+	dst->dem[i][j] = SampleDEM(src->dem, src->columns, src->rows, nodata,
+				   (dst->row0 + i + 0.5)*factor - 0.5 - src->row0,
+				   (dst->col0 + j + 0.5)*factor - 0.5 - src->col0,
+				   RESAMPLE_BILINEAR);
+      continue;
+    }
+
+    /* fine rows with their centers in this coarse row, on the crop */
+    fr0 = FirstFine(dst->row0 + i, factor) - src->row0;
+    fr1 = FirstFine(dst->row0 + i + 1, factor) - src->row0;
+    if(fr0 < 0) fr0 = 0;
+    if(fr1 > src->rows) fr1 = src->rows;
+
+    for(j=0; j<dst->columns; j++) {
+      fc0 = FirstFine(dst->col0 + j, factor) - src->col0;
+      fc1 = FirstFine(dst->col0 + j + 1, factor) - src->col0;
+      if(fc0 < 0) fc0 = 0;
+      if(fc1 > src->columns) fc1 = src->columns;
+
+      sum = 0.0;
+      cnt = 0;
+      mn = HUGE_VAL;
+      mx = -HUGE_VAL;
+      n = 0;
+      for(r=fr0; r<fr1; r++) {
+	row = src->dem[r];
+	if(method == AGG_MEDIAN) {
+	  for(c=fc0; c<fc1; c++)
+	    if(row[c] != nodata) buf[n++] = row[c];
+	  continue;
+	}
+#pragma omp simd reduction(+:sum,cnt) reduction(min:mn) reduction(max:mx)
+	for(c=fc0; c<fc1; c++) {
+	  double v = row[c];
+	  double ok = (v != nodata);
+	  sum += ok*v;
+	  cnt += (int)ok;
+	  mn = (ok && v < mn) ? v : mn;
+	  mx = (ok && v > mx) ? v : mx;
+	}
+      }
+
+      if(method == AGG_MEDIAN)
+	dst->dem[i][j] = (n == 0) ? nodata :
+	  ((n % 2) ? Select(buf, n, n/2) : 0.5*(Select(buf, n, n/2-1) + Select(buf, n, n/2)));
+      else if(cnt == 0)
+	dst->dem[i][j] = nodata;
+      else if(method == AGG_MIN)
+	dst->dem[i][j] = mn;
+      else if(method == AGG_MAX)
+	dst->dem[i][j] = mx;
+      else
+	dst->dem[i][j] = sum/cnt;
+    }
+  }
+  free(buf);
+}
+
+/* ----------------------
+  Crop a level to its valid data and list the valid pixels.
+ ------------------------*/
+static int CropLevel(TERRAIN *dst)
+{
+  int c0, r0;
+
+  dst->nvalid = CropToValid(&dst->dem, &dst->columns, &dst->rows, &c0, &r0, dst->nodata);
+  dst->col0 += c0;
+  dst->row0 += r0;
+  if(dst->nvalid > 0)
+    dst->valid = ValidPixels(dst->dem, dst->columns, dst->rows, dst->nodata, dst->nvalid);
+  return dst->nvalid;
+}
+
+/*****************************************************************************/
+/*   BuildPyramid: resample the DEM of src, as read by ReadDEM() or          */
+/*   ReprojectTerrain(), to nlevels resolutions factors[] times coarser.     */
+/*   Each level is computed from src, not from the level before, and is      */
+/*   cropped to its valid data.  SetCellSize() should follow for each level. */
+/*****************************************************************************/
+void BuildPyramid(TERRAIN *src, int nlevels, double *factors, int method, TERRAIN *levels)
+{
+  int l, k, nwork, *wlevel, *wrow;
+
+  nwork = 0;
+  for(l=0; l<nlevels; l++) {
+    LevelGeometry(src, &levels[l], factors[l]);
+    nwork += (levels[l].rows + ROWBLOCK - 1)/ROWBLOCK;
+  }
+
+  /* Work units are blocks of output rows of every level. */
+  wlevel = (int*) calloc(nwork, sizeof(int));
+  wrow = (int*) calloc(nwork, sizeof(int));
+  if(wlevel == NULL || wrow == NULL)
+    { printf("Cannot allocate memory to first record: work\n");
+      exit(8);
+    }
+  nwork = 0;
+  for(l=0; l<nlevels; l++)
+    for(k=0; k<levels[l].rows; k+=ROWBLOCK) {
+      wlevel[nwork] = l;
+      wrow[nwork++] = k;
+    }
+
+#pragma omp parallel for schedule(dynamic)
+  for(k=0; k<nwork; k++) {
+    TERRAIN *dst = &levels[wlevel[k]];
+    int r1 = wrow[k] + ROWBLOCK;
+
+    AggregateRows(src, dst, factors[wlevel[k]], method, wrow[k],
+		  (r1 < dst->rows) ? r1 : dst->rows);
+  }
+
+  free(wlevel);
+  free(wrow);
+
+  for(l=0; l<nlevels; l++)
+    CropLevel(&levels[l]);
+}
+
+/*****************************************************************************/
+/*   ResampleTerrain: one level of BuildPyramid().  Returns the number of    */
+/*   valid pixels of dst.                                                    */
+/*****************************************************************************/
+int ResampleTerrain(TERRAIN *src, TERRAIN *dst, double factor, int method)
+{
+  BuildPyramid(src, 1, &factor, method, dst);
+  return dst->nvalid;
+}
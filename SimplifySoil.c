@@ -0,0 +1,965 @@
+/******************************************************************************
+   SUMMARY:
+   This program simplifies the Harmonized World Soil Database (HWSD) to the
+   majority soil type of each VIC model simulation cell.  It does the same job
+   as SimplifySoilDatabase.py and reads the same JSON control file (built by
+   CreateSoilSimplifyControlFile.py), but the soil MUID grid and the high
+   resolution grid of VIC cell numbers are read together in a single pass,
+   so continental 30 arc-second grids are processed in seconds.
+
+   Rows of the two grids are parsed in blocks, each thread counting the pixels
+   of every (VIC cell, MUID) pair in its own hash table.  The tables are then
+   merged into one sorted list of MUID counts per VIC cell, and the
+   simplification rules are applied to every output cell in parallel when
+   compiled with -fopenmp.  The work is proportional to the number of pixels.
+
+******************************************************************************
+   NOTES:
+
+   Simplification rules (see SimplifySoilDatabase.py):
+   - a MUID maps to one or more soil units, each covering SHARE percent of
+     the MUID, and the area of each soil unit code in the VIC cell is the sum
+     of SHARE/100 times the fraction of the cell pixels with the MUID.
+   - MUIDs that are not soils (ISSOIL = 0) or not in the table are skipped.
+   - the majority soil code is kept, ties are broken by the lowest SEQ.
+   - if minSoilDepth is set in the control file, soil codes with a reference
+     depth less than minSoilDepth (cm) are only kept when the cell has no
+     deeper soil.  The depth and parameters of a soil code are those of its
+     first soil unit in the cell.
+
+   Control file keys, in addition to those of SimplifySoilDatabase.py:
+     inSoilSeq     column with the rank of the soil unit in the MUID (SEQ)
+     inSoilDepth   column with the reference soil depth (REF_DEPTH)
+     minSoilDepth  shallow soil depth in cm (default 0, no depth rule)
+
+   Output, one file per parameter named with outSoilNameFmt, for the soil
+   code (inSoilID), its fraction (inSoilFract), NUM_TYPES and every outParams
+   column: ArcInfo grids on the outCellNum grid if outCellNumGrid is true,
+   else "<index> <lng> <lat> <value>" tab delimited files with one line per
+   cell of the outCellNum table.  Cells without soil are left out of the
+   tables and set to NODATA in the grids.
+
+   USAGE: SimplifySoil <control file>
+
+   Compile with: gcc -O2 SimplifySoil.c -lm -o SimplifySoil
+   Multi-threaded: gcc -O2 -fopenmp SimplifySoil.c -lm -o SimplifySoil
+
+   COMMENTS:
+   The input grids must be ArcInfo ascii grids with one grid row per line.
+   Filtering of fractions under 5% and averaging of similar soils are not
+   implemented, as in the python script.
+
+*******************************************************************************/
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#else
+#define omp_get_max_threads() 1
+#define omp_get_thread_num() 0
+#endif
+
+#define MAXSTRING 500
+#define MAXPARAMS 100
+#define CHUNKROWS 256      /* grid rows parsed per parallel block */
+
+typedef struct
+{
+  char   inSoilGrid[MAXSTRING], inCellNum[MAXSTRING], outCellNum[MAXSTRING];
+  char   inSoilTable[MAXSTRING], outSoilNameFmt[MAXSTRING];
+  char   inSoilID[MAXSTRING], inSoilCode[MAXSTRING], inSoilFract[MAXSTRING];
+  char   inSoilSeq[MAXSTRING], inSoilDepth[MAXSTRING];
+  int    outCellNumGrid;
+  double minSoilDepth;
+  int    nparams;
+  char   *outParams[MAXPARAMS];
+} CONTROL;
+
+typedef struct
+{
+  int    ncols, nrows;
+  double xllcorner, yllcorner, cellsize, nodata;
+} GRIDHEADER;
+
+/* Open addressing hash from a 64 bit key to a count or index. */
+typedef struct
+{
+  long long *keys;
+  long      *values;
+  long      size;              /* power of 2 */
+  long      count;
+} HASH;
+
+#define EMPTYKEY (-1LL-0x7fffffffffffffffLL)
+
+/* Pixel count of one (VIC cell, MUID) pair, MUID 0 for pixels without soil. */
+typedef struct
+{
+  long long key;
+  long      count;
+} PAIR;
+
+/* One soil unit (line) of the soil table. */
+typedef struct
+{
+  long   muid;
+  long   line;
+  int    code;                 /* index in the list of soil codes */
+  double share, seq, depth;
+  char   **params;             /* output columns as written in the table */
+} SOILUNIT;
+
+typedef struct
+{
+  long     nunits, ncodes;
+  SOILUNIT *units;             /* sorted by MUID, then table order */
+  char     **codes;
+  HASH     muidindex;          /* MUID -> first unit */
+} SOILTABLE;
+
+/* Majority soil of one output cell. */
+typedef struct
+{
+  long   cell;
+  char   lat[40], lng[40];
+  int    unit;                 /* soil unit giving the parameters, -1 if none */
+  double fract;
+  int    ntypes;
+} OUTCELL;
+
+/*--- Function Declaration---*/
+void   ReadControlFile(char *name, CONTROL *ctrl);
+FILE   *OpenGrid(char *name, GRIDHEADER *h);
+void   HashInit(HASH *h, long n);
+void   HashAdd(HASH *h, long long key, long n);
+long   HashGet(HASH *h, long long key);
+void   HashFree(HASH *h);
+long   CountPairs(CONTROL *ctrl, PAIR **pairs);
+void   ReadSoilTable(CONTROL *ctrl, SOILTABLE *tab);
+long   ReadOutCells(CONTROL *ctrl, GRIDHEADER *h, OUTCELL **cells, double **grid);
+long   MajoritySoil(PAIR *pairs, long first, long npairs, SOILTABLE *tab,
+		    double mindepth, OUTCELL *out);
+void   WriteOutput(CONTROL *ctrl, SOILTABLE *tab, OUTCELL *cells, long ncells,
+		   GRIDHEADER *h, double *grid);
+int    SplitCSV(char *line, char **fields, int maxfields);
+void   Usage(char *name);
+
+#define KEY(cell, muid) (((long long)(cell) << 32) | (unsigned int)(muid))
+#define KEYCELL(key) ((long)((key) >> 32))
+#define KEYMUID(key) ((long)(int)((key) & 0xffffffffLL))
+
+int main(int argc, char *argv[])
+{
+  CONTROL    ctrl;
+  SOILTABLE  tab;
+  GRIDHEADER outheader;
+  HASH       cellindex;
+  PAIR       *pairs;
+  OUTCELL    *cells;
+  double     *outgrid = NULL;
+  long       npairs, ncells, nonsoil, i, k;
+  int        removed;
+
+  if(argc != 2)
+    Usage(argv[0]);
+
+  ReadControlFile(argv[1], &ctrl);
+  ReadSoilTable(&ctrl, &tab);
+  printf("Read %ld soil units with %ld soil codes from %s\n", tab.nunits, tab.ncodes, ctrl.inSoilTable);
+
+  npairs = CountPairs(&ctrl, &pairs);
+  ncells = ReadOutCells(&ctrl, &outheader, &cells, &outgrid);
+
+  /* first pair of every VIC cell */
+  HashInit(&cellindex, npairs);
+  for(k=0; k<npairs; k++)
+    if(k == 0 || KEYCELL(pairs[k].key) != KEYCELL(pairs[k-1].key))
+      HashAdd(&cellindex, KEYCELL(pairs[k].key), k+1);
+
+  nonsoil = 0;
+  removed = 0;
+#pragma omp parallel for schedule(dynamic,64) reduction(+:nonsoil,removed)
+  for(i=0; i<ncells; i++) {
+    long first;
+
+    cells[i].unit = -1;
+    if(outgrid != NULL && cells[i].cell == (long)outheader.nodata)
+      continue;
+    if((first = HashGet(&cellindex, cells[i].cell)) < 0) {
+      fprintf(stderr, "WARNING: Current output cell, %ld (%s,%s): Cell Number %ld, was not found in the high resolution grid of output cells.  That suggests you need to regenerate one or the other to match!\n",
+	      i, cells[i].lat, cells[i].lng, cells[i].cell);
+      removed++;
+      continue;
+    }
+    nonsoil += MajoritySoil(pairs, first-1, npairs, &tab, ctrl.minSoilDepth, &cells[i]);
+    if(cells[i].unit < 0) {
+      fprintf(stderr, "No valid soil types found in cell %ld (%s,%s): Cell Number %ld\n",
+	      i, cells[i].lat, cells[i].lng, cells[i].cell);
+      removed++;
+    }
+  }
+  printf("%d cells removed, %ld pixels with non-soil MUIDs\n", removed, nonsoil);
+
+  WriteOutput(&ctrl, &tab, cells, ncells, &outheader, outgrid);
+
+  HashFree(&cellindex);
+  free(pairs);
+  free(cells);
+  free(outgrid);
+  return 0;
+}
+
+void Usage(char *name)
+{
+  fprintf(stderr, "\nUsage: %s <filename>\n\n\tThis program simplifies the full harmonized world soils database (HWSD)\n\tfor use in setting up the VIC model.\n\n", name);
+  fprintf(stderr, "\t<filename> is the name of the control file, use the script\n\t\tCreateSoilSimplifyControlFile.py to build a control file.\n\n");
+  exit(0);
+}
+
+/* ----------------------
+  Four hex digits of a \u escape at p, -1 if they are not all there.
+ ------------------------*/
+static long HexEscape(const char *p)
+{
+  long c = 0;
+  int  k;
+
+  for(k=0; k<4; k++) {
+    if(!isxdigit((unsigned char)p[k])) return -1;
+    c = 16*c + (isdigit((unsigned char)p[k]) ? p[k] - '0' : tolower((unsigned char)p[k]) - 'a' + 10);
+  }
+  return c;
+}
+
+/* ----------------------
+  Read a JSON string starting at the opening quote, returns the position
+  after the closing quote.  \u escapes are written as UTF-8, a string
+  that is not terminated or has a bad \u escape (cut short, a lone
+  surrogate or \u0000) is an error.
+ ------------------------*/
+static char *JsonString(char *p, char *out, int maxlen)
+{
+  char utf[4];
+  long c, lo;
+  int  n = 0, len, k;
+
+  for(p++; *p && *p != '"'; p++) {
+    if(*p == '\\' && p[1]) {
+      p++;
+      if(*p == 'n') *p = '\n';
+      else if(*p == 't') *p = '\t';
+      else if(*p == 'u') {
+	if((c = HexEscape(p+1)) <= 0 || (c >= 0xdc00 && c < 0xe000))
+	  break;
+	p += 4;
+	if(c >= 0xd800 && c < 0xdc00) {
+	  /* high surrogate, the low one must follow */
+	  if(p[1] != '\\' || p[2] != 'u' || (lo = HexEscape(p+3)) < 0xdc00 || lo >= 0xe000)
+	    break;
+	  c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+	  p += 6;
+	}
+	if(c < 0x80) { utf[0] = c; len = 1; }
+	else if(c < 0x800) { utf[0] = 0xc0 | (c >> 6); utf[1] = 0x80 | (c & 0x3f); len = 2; }
+	else if(c < 0x10000) {
+	  utf[0] = 0xe0 | (c >> 12); utf[1] = 0x80 | ((c >> 6) & 0x3f);
+	  utf[2] = 0x80 | (c & 0x3f); len = 3;
+	}
+	else {
+	  utf[0] = 0xf0 | (c >> 18); utf[1] = 0x80 | ((c >> 12) & 0x3f);
+	  utf[2] = 0x80 | ((c >> 6) & 0x3f); utf[3] = 0x80 | (c & 0x3f); len = 4;
+	}
+	if(n + len < maxlen)
+	  for(k=0; k<len; k++) out[n++] = utf[k];
+	continue;
+      }
+    }
+    if(n < maxlen-1) out[n++] = *p;
+  }
+  out[n] = '\0';
+  if(*p != '"') {
+    fprintf(stderr, "ERROR: unterminated string or bad \\u escape in control file\n");
+    exit(1);
+  }
+  return p+1;
+}
+
+/* ----------------------
+  Read the flat JSON control file of SimplifySoilDatabase.py.
+ ------------------------*/
+void ReadControlFile(char *name, CONTROL *ctrl)
+{
+  FILE *fp;
+  char *text, *p, key[MAXSTRING], value[MAXSTRING];
+  long size;
+
+  if((fp = fopen(name, "r")) == NULL) {
+    fprintf(stderr, "cannot open/read control file,%s\n", name);
+    exit(1);
+  }
+  fseek(fp, 0, SEEK_END);
+  size = ftell(fp);
+  rewind(fp);
+  text = (char*) calloc(size+1, 1);
+  if(text == NULL || fread(text, 1, size, fp) != (size_t)size) {
+    fprintf(stderr, "cannot open/read control file,%s\n", name);
+    exit(1);
+  }
+  fclose(fp);
+
+  memset(ctrl, 0, sizeof(CONTROL));
+  strcpy(ctrl->inSoilID, "MU_GLOBAL");
+  strcpy(ctrl->inSoilCode, "SU_CODE74");
+  strcpy(ctrl->inSoilFract, "SHARE");
+  strcpy(ctrl->inSoilSeq, "SEQ");
+  strcpy(ctrl->inSoilDepth, "REF_DEPTH");
+
+  for(p=text; *p; ) {
+    if(*p != '"') { p++; continue; }
+    p = JsonString(p, key, MAXSTRING);
+    while(isspace(*p) || *p == ':') p++;
+
+    if(*p == '[') {
+      /* list of strings, only outParams */
+      for(p++; *p && *p != ']'; ) {
+	if(*p == '"') {
+	  p = JsonString(p, value, MAXSTRING);
+	  if(strcmp(key, "outParams") == 0 && ctrl->nparams < MAXPARAMS)
+	    ctrl->outParams[ctrl->nparams++] = strdup(value);
+	}
+	else p++;
+      }
+      if(*p) p++;
+      continue;
+    }
+    if(*p == '"')
+      p = JsonString(p, value, MAXSTRING);
+    else {
+      int n = 0;
+      while(*p && *p != ',' && *p != '}' && !isspace(*p) && n < MAXSTRING-1)
+	value[n++] = *p++;
+      value[n] = '\0';
+    }
+
+    if(strcmp(key, "inSoilGrid") == 0) strcpy(ctrl->inSoilGrid, value);
+    else if(strcmp(key, "inCellNum") == 0) strcpy(ctrl->inCellNum, value);
+    else if(strcmp(key, "outCellNum") == 0) strcpy(ctrl->outCellNum, value);
+    else if(strcmp(key, "inSoilTable") == 0) strcpy(ctrl->inSoilTable, value);
+    else if(strcmp(key, "outSoilNameFmt") == 0) strcpy(ctrl->outSoilNameFmt, value);
+    else if(strcmp(key, "inSoilID") == 0) strcpy(ctrl->inSoilID, value);
+    else if(strcmp(key, "inSoilCode") == 0) strcpy(ctrl->inSoilCode, value);
+    else if(strcmp(key, "inSoilFract") == 0) strcpy(ctrl->inSoilFract, value);
+    else if(strcmp(key, "inSoilSeq") == 0) strcpy(ctrl->inSoilSeq, value);
+    else if(strcmp(key, "inSoilDepth") == 0) strcpy(ctrl->inSoilDepth, value);
+    else if(strcmp(key, "minSoilDepth") == 0) ctrl->minSoilDepth = atof(value);
+    else if(strcmp(key, "outCellNumGrid") == 0)
+      ctrl->outCellNumGrid = (strcmp(value, "true") == 0 || strcasecmp(value, "True") == 0);
+  }
+  free(text);
+
+  if(ctrl->inSoilGrid[0] == '\0' || ctrl->inCellNum[0] == '\0' || ctrl->outCellNum[0] == '\0'
+     || ctrl->inSoilTable[0] == '\0' || ctrl->outSoilNameFmt[0] == '\0') {
+    fprintf(stderr, "ERROR: control file %s must set inSoilGrid, inCellNum, outCellNum, inSoilTable and outSoilNameFmt\n", name);
+    exit(1);
+  }
+}
+
+/* ----------------------
+  Open an ArcInfo ascii grid and read its header.
+ ------------------------*/
+FILE *OpenGrid(char *name, GRIDHEADER *h)
+{
+  FILE *fp;
+  char key[MAXSTRING];
+  int  i;
+
+  if((fp = fopen(name, "r")) == NULL) {
+    fprintf(stderr, "cannot open/read grid file,%s\n", name);
+    exit(1);
+  }
+  if(fscanf(fp, "%s %d", key, &h->ncols) != 2 || fscanf(fp, "%s %d", key, &h->nrows) != 2
+     || fscanf(fp, "%s %lf", key, &h->xllcorner) != 2 || fscanf(fp, "%s %lf", key, &h->yllcorner) != 2
+     || fscanf(fp, "%s %lf", key, &h->cellsize) != 2 || fscanf(fp, "%s %lf", key, &h->nodata) != 2) {
+    fprintf(stderr, "ERROR: %s is not an ArcInfo ascii grid\n", name);
+    exit(1);
+  }
+  /* rest of the NODATA line */
+  while((i = fgetc(fp)) != EOF && i != '\n');
+  return fp;
+}
+
+/* ----------------------
+  Hash table with room for n keys, grows when half full.
+ ------------------------*/
+void HashInit(HASH *h, long n)
+{
+  long k;
+
+  for(h->size = 16; h->size < 2*n; h->size *= 2);
+  h->count = 0;
+  h->keys = (long long*) malloc(h->size*sizeof(long long));
+  h->values = (long*) malloc(h->size*sizeof(long));
+  if(h->keys == NULL || h->values == NULL) {
+    printf("Cannot allocate memory to first record: hash\n");
+    exit(8);
+  }
+  for(k = 0; k < h->size; k++) h->keys[k] = EMPTYKEY;
+}
+
+static inline long HashSlot(HASH *h, long long key)
+{
+  unsigned long long x = (unsigned long long)key;
+
+  /* mix the bits (splitmix64 finalizer) */
+  x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return (long)(x & (h->size - 1));
+}
+
+/* Adds n to the value of a key, new keys start at 0. */
+void HashAdd(HASH *h, long long key, long n)
+{
+  long k;
+
+  if(2*(h->count+1) > h->size) {
+    HASH big;
+
+    HashInit(&big, h->size);
+    for(k = 0; k < h->size; k++)
+      if(h->keys[k] != EMPTYKEY) HashAdd(&big, h->keys[k], h->values[k]);
+    HashFree(h);
+    *h = big;
+  }
+  for(k = HashSlot(h, key); h->keys[k] != EMPTYKEY; k = (k+1) & (h->size-1))
+    if(h->keys[k] == key) {
+      h->values[k] += n;
+      return;
+    }
+  h->keys[k] = key;
+  h->values[k] = n;
+  h->count++;
+}
+
+/* Returns -1 if the key is not found. */
+long HashGet(HASH *h, long long key)
+{
+  long k;
+
+  for(k = HashSlot(h, key); h->keys[k] != EMPTYKEY; k = (k+1) & (h->size-1))
+    if(h->keys[k] == key) return h->values[k];
+  return -1;
+}
+
+void HashFree(HASH *h)
+{
+  free(h->keys);
+  free(h->values);
+}
+
+static int ComparePairs(const void *a, const void *b)
+{
+  long long ka = ((PAIR*)a)->key, kb = ((PAIR*)b)->key;
+
+  return (ka > kb) - (ka < kb);
+}
+
+/* ----------------------
+  Count one block of grid rows, parsing both lines of each row.
+ ------------------------*/
+static void CountRows(char **soillines, char **celllines, int nlines, GRIDHEADER *sh,
+		      GRIDHEADER *ch, HASH *h, long firstrow)
+{
+  int  i, j;
+  char *ps, *pc, *end;
+  double muid, cell;
+
+  for(i=0; i<nlines; i++) {
+    ps = soillines[i];
+    pc = celllines[i];
+    for(j=0; j<sh->ncols; j++) {
+      muid = strtod(ps, &end);
+      if(end == ps) break;
+      ps = end;
+      cell = strtod(pc, &end);
+      if(end == pc) break;
+      pc = end;
+      if(cell == ch->nodata)
+	continue;
+      HashAdd(h, KEY((long)cell, (muid > 0 && muid != sh->nodata) ? (long)muid : 0), 1);
+    }
+    if(j < sh->ncols) {
+      fprintf(stderr, "ERROR: grid row %ld has less than %d values, the grids must have one row per line\n",
+	      firstrow+i+1, sh->ncols);
+      exit(1);
+    }
+  }
+}
+
+/*****************************************************************************/
+/*   CountPairs: read the soil MUID grid and the grid of VIC cell numbers    */
+/*   at the same resolution in one pass, and count the pixels of every       */
+/*   (VIC cell, MUID) pair.  Returns the number of pairs, sorted by cell.    */
+/*****************************************************************************/
+long CountPairs(CONTROL *ctrl, PAIR **pairs)
+{
+  FILE       *fs, *fc;
+  GRIDHEADER sh, ch;
+  HASH       *hashes;
+  char       *soillines[CHUNKROWS], *celllines[CHUNKROWS];
+  size_t     soilsize[CHUNKROWS], cellsize[CHUNKROWS];
+  long       row, npairs, k;
+  int        i, t, nthreads, nlines;
+
+  fs = OpenGrid(ctrl->inSoilGrid, &sh);
+  fc = OpenGrid(ctrl->inCellNum, &ch);
+  if(sh.ncols != ch.ncols || sh.nrows != ch.nrows) {
+    fprintf(stderr, "ERROR: Soils (%d x %d) and input cell number (%d x %d) grids are not the same resolution, this analysis will stop.\n",
+	    sh.ncols, sh.nrows, ch.ncols, ch.nrows);
+    exit(1);
+  }
+
+  nthreads = omp_get_max_threads();
+  hashes = (HASH*) malloc(nthreads*sizeof(HASH));
+  for(t=0; t<nthreads; t++)
+    HashInit(&hashes[t], 1024);
+  for(i=0; i<CHUNKROWS; i++) {
+    soillines[i] = celllines[i] = NULL;
+    soilsize[i] = cellsize[i] = 0;
+  }
+
+  for(row=0; row<sh.nrows; row+=nlines) {
+    for(nlines=0; nlines<CHUNKROWS && row+nlines<sh.nrows; nlines++)
+      if(getline(&soillines[nlines], &soilsize[nlines], fs) < 0
+	 || getline(&celllines[nlines], &cellsize[nlines], fc) < 0) {
+	fprintf(stderr, "ERROR: grids end before row %ld\n", row+nlines+1);
+	exit(1);
+      }
+
+#pragma omp parallel for schedule(static,8)
+    for(i=0; i<nlines; i++)
+      CountRows(&soillines[i], &celllines[i], 1, &sh, &ch,
+		&hashes[omp_get_thread_num()], row+i);
+  }
+  fclose(fs);
+  fclose(fc);
+  for(i=0; i<CHUNKROWS; i++) {
+    free(soillines[i]);
+    free(celllines[i]);
+  }
+
+  /* merge the tables of the threads */
+  npairs = 0;
+  for(t=0; t<nthreads; t++)
+    npairs += hashes[t].count;
+  if((*pairs = (PAIR*) malloc((npairs+1)*sizeof(PAIR))) == NULL) {
+    printf("Cannot allocate memory to first record: pairs\n");
+    exit(8);
+  }
+  npairs = 0;
+  for(t=0; t<nthreads; t++) {
+    for(k=0; k<hashes[t].size; k++)
+      if(hashes[t].keys[k] != EMPTYKEY) {
+	(*pairs)[npairs].key = hashes[t].keys[k];
+	(*pairs)[npairs++].count = hashes[t].values[k];
+      }
+    HashFree(&hashes[t]);
+  }
+  free(hashes);
+
+  qsort(*pairs, npairs, sizeof(PAIR), ComparePairs);
+  for(k=0, i=0; k<npairs; k++) {
+    if(i > 0 && (*pairs)[k].key == (*pairs)[i-1].key)
+      (*pairs)[i-1].count += (*pairs)[k].count;
+    else
+      (*pairs)[i++] = (*pairs)[k];
+  }
+  printf("Counted %d (cell, MUID) pairs in %d x %d grids\n", i, sh.ncols, sh.nrows);
+  return i;
+}
+
+/* ----------------------
+  Split a line of a CSV file in place, quoted fields may hold commas.
+  Returns the number of fields.
+ ------------------------*/
+int SplitCSV(char *line, char **fields, int maxfields)
+{
+  int  n = 0;
+  char *p = line, *q;
+
+  line[strcspn(line, "\r\n")] = '\0';
+  while(n < maxfields) {
+    if(*p == '"') {
+      fields[n++] = q = ++p;
+      while(*p && !(*p == '"' && p[1] != '"')) {
+	if(*p == '"') p++;
+	*q++ = *p++;
+      }
+      if(*p) p++;
+      *q = '\0';
+      p += strcspn(p, ",");
+    }
+    else {
+      fields[n++] = p;
+      p += strcspn(p, ",");
+    }
+    if(*p != ',') {
+      *p = '\0';
+      break;
+    }
+    *p++ = '\0';
+  }
+  return n;
+}
+
+static int CompareUnits(const void *a, const void *b)
+{
+  const SOILUNIT *ua = (SOILUNIT*)a, *ub = (SOILUNIT*)b;
+
+  if(ua->muid != ub->muid) return (ua->muid > ub->muid) - (ua->muid < ub->muid);
+  return (ua->line > ub->line) - (ua->line < ub->line);
+}
+
+static int FindColumn(char **names, int n, char *name, int required)
+{
+  int i;
+
+  for(i=0; i<n; i++)
+    if(strcmp(names[i], name) == 0) return i;
+  if(required) {
+    fprintf(stderr, "ERROR: column %s not found in the soil table\n", name);
+    exit(1);
+  }
+  return -1;
+}
+
+/*****************************************************************************/
+/*   ReadSoilTable: read the soil units of the CSV soil table, leaving out   */
+/*   the non-soils (ISSOIL = 0), and index them by MUID.                     */
+/*****************************************************************************/
+void ReadSoilTable(CONTROL *ctrl, SOILTABLE *tab)
+{
+  FILE   *fp;
+  char   *line = NULL, *header, **names, **fields;
+  size_t size = 0;
+  long   n, maxunits, k;
+  int    nnames, nf, i, cid, ccode, cfract, cseq, cdepth, cissoil, cparam[MAXPARAMS];
+  HASH   codeindex;
+  unsigned long long hash;
+
+  if((fp = fopen(ctrl->inSoilTable, "r")) == NULL) {
+    fprintf(stderr, "cannot open/read soil table,%s\n", ctrl->inSoilTable);
+    exit(1);
+  }
+  if(getline(&line, &size, fp) < 0) {
+    fprintf(stderr, "ERROR: soil table %s is empty\n", ctrl->inSoilTable);
+    exit(1);
+  }
+  header = strdup(line);
+  names = (char**) malloc(strlen(header)*sizeof(char*));
+  fields = (char**) malloc(strlen(header)*sizeof(char*));
+  nnames = SplitCSV(header, names, strlen(header));
+
+  cid = FindColumn(names, nnames, ctrl->inSoilID, 1);
+  ccode = FindColumn(names, nnames, ctrl->inSoilCode, 1);
+  cfract = FindColumn(names, nnames, ctrl->inSoilFract, 1);
+  cseq = FindColumn(names, nnames, ctrl->inSoilSeq, 0);
+  cdepth = FindColumn(names, nnames, ctrl->inSoilDepth, ctrl->minSoilDepth > 0);
+  cissoil = FindColumn(names, nnames, "ISSOIL", 0);
+  for(i=0; i<ctrl->nparams; i++)
+    cparam[i] = FindColumn(names, nnames, ctrl->outParams[i], 1);
+
+  maxunits = 1024;
+  tab->units = (SOILUNIT*) malloc(maxunits*sizeof(SOILUNIT));
+  tab->codes = (char**) malloc(maxunits*sizeof(char*));
+  tab->nunits = tab->ncodes = 0;
+  HashInit(&codeindex, 1024);
+
+  for(n=1; getline(&line, &size, fp) >= 0; n++) {
+    SOILUNIT *u;
+
+    if((nf = SplitCSV(line, fields, nnames)) < nnames) {
+      if(nf > 1)
+	fprintf(stderr, "WARNING: line %ld of the soil table has %d of %d columns and is skipped\n", n+1, nf, nnames);
+      continue;
+    }
+    if(cissoil >= 0 && atof(fields[cissoil]) == 0)
+      continue;
+
+    if(tab->nunits == maxunits) {
+      maxunits *= 2;
+      tab->units = (SOILUNIT*) realloc(tab->units, maxunits*sizeof(SOILUNIT));
+      tab->codes = (char**) realloc(tab->codes, maxunits*sizeof(char*));
+      if(tab->units == NULL || tab->codes == NULL) {
+	printf("Cannot allocate memory to first record: soil table\n");
+	exit(8);
+      }
+    }
+    u = &tab->units[tab->nunits++];
+    u->muid = atol(fields[cid]);
+    u->line = n;
+    u->share = atof(fields[cfract]);
+    u->seq = (cseq >= 0) ? atof(fields[cseq]) : 0;
+    u->depth = (cdepth >= 0) ? atof(fields[cdepth]) : 0;
+    u->params = (char**) malloc((ctrl->nparams+1)*sizeof(char*));
+    for(i=0; i<ctrl->nparams; i++)
+      u->params[i] = strdup(fields[cparam[i]]);
+
+    /* soil codes are numbered in the order they are found (FNV-1a key) */
+    hash = 14695981039346656037ULL;
+    for(i=0; fields[ccode][i]; i++)
+      hash = (hash ^ (unsigned char)fields[ccode][i])*1099511628211ULL;
+    hash &= 0x7fffffffffffffffULL;
+    if((k = HashGet(&codeindex, (long long)hash)) < 0) {
+      k = tab->ncodes;
+      tab->codes[tab->ncodes++] = strdup(fields[ccode]);
+      HashAdd(&codeindex, (long long)hash, k);
+    }
+    else if(strcmp(tab->codes[k], fields[ccode]) != 0) {
+      fprintf(stderr, "ERROR: soil codes %s and %s have the same hash key\n", tab->codes[k], fields[ccode]);
+      exit(1);
+    }
+    u->code = (int)k;
+  }
+  fclose(fp);
+  free(line);
+  free(header);
+  free(names);
+  free(fields);
+  HashFree(&codeindex);
+
+  /* soil units of a MUID are contiguous, in table order */
+  qsort(tab->units, tab->nunits, sizeof(SOILUNIT), CompareUnits);
+  HashInit(&tab->muidindex, tab->nunits);
+  for(k=0; k<tab->nunits; k++)
+    if(k == 0 || tab->units[k].muid != tab->units[k-1].muid)
+      HashAdd(&tab->muidindex, tab->units[k].muid, k);
+}
+
+/*****************************************************************************/
+/*   ReadOutCells: read the output cells, an ArcInfo grid of cell numbers or */
+/*   a whitespace delimited table with lat, lng and value columns.           */
+/*****************************************************************************/
+long ReadOutCells(CONTROL *ctrl, GRIDHEADER *h, OUTCELL **cells, double **grid)
+{
+  FILE *fp;
+  char *line = NULL, *p, *tok, *names[MAXPARAMS];
+  size_t size = 0;
+  long n, maxcells;
+  int  nnames, i, clat, clng, cvalue;
+
+  if(ctrl->outCellNumGrid) {
+    fp = OpenGrid(ctrl->outCellNum, h);
+    n = (long)h->ncols*h->nrows;
+    *cells = (OUTCELL*) calloc(n, sizeof(OUTCELL));
+    *grid = (double*) malloc(n*sizeof(double));
+    if(*cells == NULL || *grid == NULL) {
+      printf("Cannot allocate memory to first record: cells\n");
+      exit(8);
+    }
+    for(i=0; i<n; i++) {
+      if(fscanf(fp, "%lf", &(*grid)[i]) != 1) {
+	fprintf(stderr, "ERROR: grid file %s ends after %d values\n", ctrl->outCellNum, i);
+	exit(1);
+      }
+      (*cells)[i].cell = (long)(*grid)[i];
+      sprintf((*cells)[i].lat, "%f", h->yllcorner + h->cellsize*(h->nrows - i/h->ncols - 0.5));
+      sprintf((*cells)[i].lng, "%f", h->xllcorner + h->cellsize*(i%h->ncols + 0.5));
+    }
+    fclose(fp);
+    return n;
+  }
+
+  if((fp = fopen(ctrl->outCellNum, "r")) == NULL || getline(&line, &size, fp) < 0) {
+    fprintf(stderr, "cannot open/read cell file,%s\n", ctrl->outCellNum);
+    exit(1);
+  }
+  nnames = 0;
+  for(p=line; nnames<MAXPARAMS && (tok = strtok(p, " \t\r\n")) != NULL; p=NULL)
+    names[nnames++] = strdup(tok);
+  clat = clng = cvalue = -1;
+  for(i=0; i<nnames; i++) {
+    if(strcmp(names[i], "lat") == 0) clat = i;
+    else if(strcmp(names[i], "lng") == 0) clng = i;
+    else if(strcmp(names[i], "value") == 0) cvalue = i;
+    free(names[i]);
+  }
+  if(clat < 0 || clng < 0 || cvalue < 0) {
+    fprintf(stderr, "ERROR: cell file %s must have lat, lng and value headers\n", ctrl->outCellNum);
+    exit(1);
+  }
+
+  maxcells = 1024;
+  *cells = (OUTCELL*) malloc(maxcells*sizeof(OUTCELL));
+  for(n=0; getline(&line, &size, fp) >= 0; ) {
+    if(n == maxcells) {
+      maxcells *= 2;
+      if((*cells = (OUTCELL*) realloc(*cells, maxcells*sizeof(OUTCELL))) == NULL) {
+	printf("Cannot allocate memory to first record: cells\n");
+	exit(8);
+      }
+    }
+    memset(&(*cells)[n], 0, sizeof(OUTCELL));
+    for(i=0, p=line; (tok = strtok(p, " \t\r\n")) != NULL; i++, p=NULL) {
+      if(i == clat) strncpy((*cells)[n].lat, tok, 39);
+      else if(i == clng) strncpy((*cells)[n].lng, tok, 39);
+      else if(i == cvalue) (*cells)[n].cell = (long)atof(tok);
+    }
+    if(i > cvalue && i > clat && i > clng) n++;
+  }
+  fclose(fp);
+  free(line);
+  *grid = NULL;
+  return n;
+}
+
+/*****************************************************************************/
+/*   MajoritySoil: apply the simplification rules to the MUID counts of one  */
+/*   VIC cell, starting at pairs[first].  Returns the number of pixels with  */
+/*   MUIDs that are not soils.                                               */
+/*****************************************************************************/
+long MajoritySoil(PAIR *pairs, long first, long npairs, SOILTABLE *tab,
+		  double mindepth, OUTCELL *out)
+{
+  long   k, last, u, u0, total, nonsoil;
+  int    nunits, n, i, best, deep;
+  int    *code, *unit;
+  double *area, *seq, *depth;
+
+  total = 0;
+  nunits = 0;
+  for(last=first; last<npairs && KEYCELL(pairs[last].key) == out->cell; last++) {
+    total += pairs[last].count;
+    if(KEYMUID(pairs[last].key) > 0 && (u0 = HashGet(&tab->muidindex, KEYMUID(pairs[last].key))) >= 0)
+      for(u=u0; u<tab->nunits && tab->units[u].muid == tab->units[u0].muid; u++)
+	nunits++;
+  }
+
+  out->unit = -1;
+  nonsoil = 0;
+  for(k=first; k<last; k++)
+    if(KEYMUID(pairs[k].key) > 0 && HashGet(&tab->muidindex, KEYMUID(pairs[k].key)) < 0)
+      nonsoil += pairs[k].count;
+  if(nunits == 0)
+    return nonsoil;
+
+  code = (int*) malloc(nunits*sizeof(int));
+  unit = (int*) malloc(nunits*sizeof(int));
+  area = (double*) malloc(nunits*sizeof(double));
+  seq = (double*) malloc(nunits*sizeof(double));
+  depth = (double*) malloc(nunits*sizeof(double));
+
+  /* area of every soil code in the cell, MUIDs in increasing order */
+  n = 0;
+  for(k=first; k<last; k++) {
+    if(KEYMUID(pairs[k].key) <= 0 || (u0 = HashGet(&tab->muidindex, KEYMUID(pairs[k].key))) < 0)
+      continue;
+    for(u=u0; u<tab->nunits && tab->units[u].muid == tab->units[u0].muid; u++) {
+      SOILUNIT *s = &tab->units[u];
+
+      for(i=0; i<n && code[i] != s->code; i++);
+      if(i == n) {
+	code[n] = s->code;
+	unit[n] = (int)u;
+	area[n] = 0.0;
+	seq[n] = s->seq;
+	depth[n++] = s->depth;
+      }
+      area[i] += s->share/100./total*pairs[k].count;
+      if(s->seq < seq[i]) seq[i] = s->seq;
+    }
+  }
+
+  /* shallow soils only win if there is no deeper soil */
+  deep = 0;
+  if(mindepth > 0)
+    for(i=0; i<n; i++)
+      if(depth[i] >= mindepth) deep = 1;
+
+  best = -1;
+  for(i=0; i<n; i++) {
+    if(deep && depth[i] < mindepth)
+      continue;
+    if(best < 0 || area[i] > area[best] + 1.e-12
+       || (fabs(area[i] - area[best]) <= 1.e-12 && seq[i] < seq[best]))
+      best = i;
+  }
+
+  out->unit = unit[best];
+  out->fract = area[best];
+  out->ntypes = n;
+
+  free(code);
+  free(unit);
+  free(area);
+  free(seq);
+  free(depth);
+  return nonsoil;
+}
+
+/* ----------------------
+  Output file name for a parameter, outSoilNameFmt with "%s" (or the "\%s"
+  written by CreateSoilSimplifyControlFile.py) replaced by the name.
+ ------------------------*/
+static void OutputName(char *fmt, char *param, char *name)
+{
+  char *p = strstr(fmt, "%s");
+  int  n;
+
+  if(p == NULL) {
+    sprintf(name, "%s%s", fmt, param);
+    return;
+  }
+  n = (int)(p - fmt);
+  if(n > 0 && fmt[n-1] == '\\') n--;
+  sprintf(name, "%.*s%s%s", n, fmt, param, p+2);
+}
+
+/*****************************************************************************/
+/*   WriteOutput: write one file per output parameter.                       */
+/*****************************************************************************/
+void WriteOutput(CONTROL *ctrl, SOILTABLE *tab, OUTCELL *cells, long ncells,
+		 GRIDHEADER *h, double *grid)
+{
+  FILE *fp;
+  char name[2*MAXSTRING], value[MAXSTRING], nodata[MAXSTRING];
+  long i;
+  int  p;
+
+  sprintf(nodata, "%g", h->nodata);
+  for(p=-3; p<ctrl->nparams; p++) {
+    char *param = (p == -3) ? ctrl->inSoilID : (p == -2) ? ctrl->inSoilFract :
+      (p == -1) ? "NUM_TYPES" : ctrl->outParams[p];
+
+    OutputName(ctrl->outSoilNameFmt, param, name);
+    printf("Writing file %s\n", name);
+    if((fp = fopen(name, "w")) == NULL) {
+      fprintf(stderr, "cannot open output file,%s\n", name);
+      exit(1);
+    }
+    if(grid != NULL)
+      fprintf(fp, "ncols %d\nnrows %d\nxllcorner %f\nyllcorner %f\ncellsize %f\nNODATA_value %s\n",
+	      h->ncols, h->nrows, h->xllcorner, h->yllcorner, h->cellsize, nodata);
+
+    for(i=0; i<ncells; i++) {
+      OUTCELL *c = &cells[i];
+
+      if(c->unit >= 0) {
+	if(p == -3) strcpy(value, tab->codes[tab->units[c->unit].code]);
+	else if(p == -2) sprintf(value, "%.10g", c->fract);
+	else if(p == -1) sprintf(value, "%d", c->ntypes);
+	else strcpy(value, tab->units[c->unit].params[p]);
+      }
+
+      if(grid != NULL)
+	fprintf(fp, "%s%c", (c->unit >= 0) ? value : nodata,
+		((i+1) % h->ncols == 0) ? '\n' : ' ');
+      else if(c->unit >= 0)
+	fprintf(fp, "%ld\t%s\t%s\t%s\n", i, c->lng, c->lat, value);
+    }
+    fclose(fp);
+  }
+}
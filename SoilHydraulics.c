@@ -0,0 +1,132 @@
+/******************************************************************************
+   SUMMARY:
+   Saxton and Rawls (2006) soil water characteristics for arrays of soil
+   layers.  See SoilHydraulics.h for the inputs and outputs.
+
+   The layers are processed in chunks of CHUNK values: every equation is a
+   loop over the chunk without branches, so that the compiler vectorises it,
+   and chunks are shared between threads when compiled with -fopenmp.  The
+   loops call log() and exp(); glibc provides vector versions of them when
+   compiled with -O3 -ffast-math (libmvec), otherwise only the arithmetic is
+   vectorised.
+
+   Compile with: gcc -O3 -c SoilHydraulics.c
+   Shared library for SoilHydraulics.py:
+     gcc -O3 -ffast-math -fopenmp -fPIC -shared SoilHydraulics.c -lm -o libSoilHydraulics.so
+
+   COMMENTS:
+   Ksat is converted from mm/h (Saxton and Rawls) to mm/day (VIC).  The
+   critical and wilting point moistures are swapped if the critical point is
+   lower, as CalculatePerSoilDBLayer.py does.
+*******************************************************************************/
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "SoilHydraulics.h"
+
+#define CHUNK 256
+
+const char *SoilHydraulicsNames[SH_NOUT] = {
+  "Theta_1500", "Theta_33", "Theta_S33", "Theta_S", "Psi_e", "B", "Lambda",
+  "Ksat", "Bulk_Density", "Dsmax", "Expt", "Bubble", "Wcr_FRACT", "Wpwp_FRACT"
+};
+
+/* ----------------------
+  All outputs for n <= CHUNK layers.
+ ------------------------*/
+static void Kernel(int n, const double *restrict S, const double *restrict C,
+		   const double *restrict OM, const double *restrict slope,
+		   double o[SH_NOUT][CHUNK])
+{
+  const double lnratio = log(1500.) - log(33.);
+  int i;
+
+#pragma omp simd
+  for(i=0; i<n; i++) {
+    double s = S[i], c = C[i], om = OM[i];
+    double t1500, t33, ts33, ts, pe, b, lambda, ksat, wcr, wpwp;
+
+    /* moisture at 1500 kPa (eq. 1) */
+    t1500 = -0.024*s + 0.487*c + 0.006*om + 0.005*s*om - 0.013*c*om + 0.068*s*c + 0.031;
+    t1500 = t1500 + (0.14*t1500 - 0.02);
+
+    /* moisture at 33 kPa (eq. 2) */
+    t33 = -0.251*s + 0.195*c + 0.011*om + 0.006*s*om - 0.027*c*om + 0.452*s*c + 0.299;
+    t33 = t33 + (1.283*t33*t33 - 0.374*t33 - 0.015);
+
+    /* saturation - 33 kPa moisture (eq. 3) */
+    ts33 = 0.278*s + 0.034*c + 0.022*om - 0.018*s*om - 0.027*c*om - 0.584*s*c + 0.078;
+    ts33 = ts33 + (0.636*ts33 - 0.107);
+
+    /* tension at air entry (eq. 4) */
+    pe = -21.67*s - 27.93*c - 81.97*ts33 + 71.12*s*ts33 + 8.29*c*ts33 + 14.05*s*c + 27.16;
+    pe = pe + (0.02*pe*pe - 0.113*pe - 0.70);
+
+    /* saturated moisture and normal density (eq. 5, 6) */
+    ts = t33 + ts33 - 0.097*s + 0.043;
+
+    /* moisture - tension coefficients (eq. 15, 18) */
+    b = lnratio/(log(t33) - log(t1500));
+    lambda = 1./b;
+
+    /* saturated conductivity (eq. 16), mm/h to mm/day */
+    ksat = 24.*1930.*exp((3. - lambda)*log(ts - t33));
+
+    wcr = 0.7*t33/ts;
+    wpwp = t1500/ts;
+
+    o[SH_THETA_1500][i] = t1500;
+    o[SH_THETA_33][i] = t33;
+    o[SH_THETA_S33][i] = ts33;
+    o[SH_THETA_S][i] = ts;
+    o[SH_PSI_E][i] = pe;
+    o[SH_B][i] = b;
+    o[SH_LAMBDA][i] = lambda;
+    o[SH_KSAT][i] = ksat;
+    o[SH_BULK_DENSITY][i] = (1. - ts)*2650.;
+    o[SH_DSMAX][i] = ksat*slope[i];
+    o[SH_EXPT][i] = 3. + 2./lambda;
+    o[SH_BUBBLE][i] = 0.32*(3. + 2./lambda) + 4.3;
+    o[SH_WCR_FRACT][i] = (wcr > wpwp) ? wcr : wpwp;
+    o[SH_WPWP_FRACT][i] = (wcr > wpwp) ? wpwp : wcr;
+  }
+}
+
+/*****************************************************************************/
+/*   SaxtonRawls: soil water characteristics of n soil layers.  Outputs      */
+/*   with a NULL array in h are not stored.  slope may be NULL if Dsmax is   */
+/*   not needed.                                                             */
+/*****************************************************************************/
+void SaxtonRawls(long n, const double *sand, const double *clay, const double *om,
+		 const double *slope, SOILHYDRAULICS *h)
+{
+  long k;
+
+#pragma omp parallel for schedule(static)
+  for(k=0; k<n; k+=CHUNK) {
+    double o[SH_NOUT][CHUNK], zero[CHUNK];
+    int    m = (n - k < CHUNK) ? (int)(n - k) : CHUNK, v;
+
+    if(slope == NULL) memset(zero, 0, sizeof(zero));
+    Kernel(m, sand+k, clay+k, om+k, (slope == NULL) ? zero : slope+k, o);
+    for(v=0; v<SH_NOUT; v++)
+      if(h->out[v] != NULL)
+	memcpy(h->out[v]+k, o[v], m*sizeof(double));
+  }
+}
+
+/*****************************************************************************/
+/*   SaxtonRawlsBlock: as SaxtonRawls(), with all outputs stored in one      */
+/*   block of SH_NOUT rows of n values (block[v*n + i]).  This is the entry  */
+/*   point used from Python.                                                 */
+/*****************************************************************************/
+void SaxtonRawlsBlock(long n, const double *sand, const double *clay, const double *om,
+		      const double *slope, double *block)
+{
+  SOILHYDRAULICS h;
+  int v;
+
+  for(v=0; v<SH_NOUT; v++)
+    h.out[v] = block + v*n;
+  SaxtonRawls(n, sand, clay, om, slope, &h);
+}
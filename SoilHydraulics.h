@@ -0,0 +1,53 @@
+/******************************************************************************
+   SUMMARY:
+   Saxton and Rawls (2006) soil water characteristics, and the VIC model soil
+   parameters derived from them, for arrays of soil layers.  These are the
+   equations used by CalculatePerSoilDBLayer.py (SoilWaterEquations.py).
+
+   The inputs and outputs are separate arrays (one per variable) over all
+   cells and layers, so the kernel loops vectorise.  The same functions are
+   used by CalcSoilHydraulics and, through ctypes, by SoilHydraulics.py.
+
+   Inputs, per cell and layer:
+     sand, clay  fraction by weight (0-1)
+     om          organic matter (% by weight, should not exceed 8%)
+     slope       slope of the cell (fraction), only used for Dsmax
+
+   REFERENCES: Saxton, K.E. and W.J. Rawls (2006) Soil water characteristic
+               estimates by texture and organic matter for hydrologic
+               solutions.  Soil Sci. Soc. Am. J. 70:1569-1578.
+*******************************************************************************/
+#ifndef SOILHYDRAULICS_H
+#define SOILHYDRAULICS_H
+
+/* outputs, in the order of the rows of the block used by SaxtonRawlsBlock() */
+#define SH_THETA_1500   0   /* moisture at 1500 kPa, wilting point (m3/m3) */
+#define SH_THETA_33     1   /* moisture at 33 kPa, field capacity (m3/m3) */
+#define SH_THETA_S33    2   /* saturation minus 33 kPa moisture (m3/m3) */
+#define SH_THETA_S      3   /* saturated moisture (m3/m3) */
+#define SH_PSI_E        4   /* tension at air entry (kPa) */
+#define SH_B            5   /* Campbell B, slope of ln(tension) vs ln(moisture) */
+#define SH_LAMBDA       6   /* pore size distribution index, 1/B */
+#define SH_KSAT         7   /* saturated hydraulic conductivity (mm/day) */
+#define SH_BULK_DENSITY 8   /* normal density (kg/m3) */
+#define SH_DSMAX        9   /* maximum baseflow velocity, Ksat*slope (mm/day) */
+#define SH_EXPT        10   /* Campbell exponent for conductivity, 3+2/lambda */
+#define SH_BUBBLE      11   /* bubbling pressure (cm) */
+#define SH_WCR_FRACT   12   /* critical point, 70% of field capacity (fraction of theta_s) */
+#define SH_WPWP_FRACT  13   /* wilting point (fraction of theta_s) */
+#define SH_NOUT        14
+
+extern const char *SoilHydraulicsNames[SH_NOUT];
+
+/* One array of n values per output, NULL arrays are not computed. */
+typedef struct
+{
+  double *out[SH_NOUT];
+} SOILHYDRAULICS;
+
+void SaxtonRawls(long n, const double *sand, const double *clay, const double *om,
+		 const double *slope, SOILHYDRAULICS *h);
+void SaxtonRawlsBlock(long n, const double *sand, const double *clay, const double *om,
+		      const double *slope, double *block);
+
+#endif
@@ -0,0 +1,121 @@
+#!/bin/env python
+# Created on October 18, 2026
+#
+# Python interface to the Saxton and Rawls (2006) soil water characteristic
+# kernels in SoilHydraulics.c, so that CalculatePerSoilDBLayer.py can compute
+# all cells and layers in one call instead of looping over cells.  The compiled
+# library is loaded with ctypes (as pypyodbc.py loads libodbc), build it with:
+#
+#   gcc -O3 -ffast-math -fopenmp -fPIC -shared SoilHydraulics.c -lm -o libSoilHydraulics.so
+#
+# The library is searched for next to this script, then on the library path
+# (LD_LIBRARY_PATH).  If it is not found, the numpy version of the equations
+# below (SaxtonRawlsReference) is used, which is also the reference used to
+# check the kernels:
+#
+#   python SoilHydraulics.py
+#
+# Inputs are sand and clay fractions, organic matter in percent by weight and
+# slope as a fraction, in arrays of any (matching) shape.  The result is a
+# dictionary of arrays named as the columns of CalculatePerSoilDBLayer.py,
+# units are given in SoilHydraulics.h.
+
+import os, sys, ctypes
+from ctypes.util import find_library
+import numpy as np
+
+Names = [ 'Theta_1500', 'Theta_33', 'Theta_S33', 'Theta_S', 'Psi_e', 'B', 'Lambda',
+          'Ksat', 'Bulk_Density', 'Dsmax', 'Expt', 'Bubble', 'Wcr_FRACT', 'Wpwp_FRACT' ]
+
+def LoadLibrary():
+    # look next to the script first, then on the library path
+    libname = os.path.join( os.path.dirname( os.path.abspath( __file__ ) ), 'libSoilHydraulics.so' )
+    if not os.path.isfile( libname ):
+        libname = find_library( 'SoilHydraulics' )
+    if libname is None:
+        return None
+    try:
+        lib = ctypes.cdll.LoadLibrary( libname )
+    except OSError:
+        return None
+    dptr = ctypes.POINTER( ctypes.c_double )
+    lib.SaxtonRawlsBlock.argtypes = [ ctypes.c_long, dptr, dptr, dptr, dptr, dptr ]
+    lib.SaxtonRawlsBlock.restype = None
+    return lib
+
+SoilLib = LoadLibrary()
+
+def SaxtonRawlsReference( sand, clay, om, slope=None ):
+    # numpy version of the equations, same order as SoilHydraulics.c
+    S = np.asarray( sand, dtype=float )
+    C = np.asarray( clay, dtype=float )
+    OM = np.asarray( om, dtype=float )
+    if slope is None: slope = np.zeros( S.shape )
+    out = {}
+    t1500 = -0.024*S + 0.487*C + 0.006*OM + 0.005*S*OM - 0.013*C*OM + 0.068*S*C + 0.031
+    out['Theta_1500'] = t1500 + ( 0.14*t1500 - 0.02 )
+    t33 = -0.251*S + 0.195*C + 0.011*OM + 0.006*S*OM - 0.027*C*OM + 0.452*S*C + 0.299
+    out['Theta_33'] = t33 + ( 1.283*t33**2 - 0.374*t33 - 0.015 )
+    ts33 = 0.278*S + 0.034*C + 0.022*OM - 0.018*S*OM - 0.027*C*OM - 0.584*S*C + 0.078
+    out['Theta_S33'] = ts33 + ( 0.636*ts33 - 0.107 )
+    pe = -21.67*S - 27.93*C - 81.97*out['Theta_S33'] + 71.12*S*out['Theta_S33'] + 8.29*C*out['Theta_S33'] + 14.05*S*C + 27.16
+    out['Psi_e'] = pe + ( 0.02*pe**2 - 0.113*pe - 0.70 )
+    out['Theta_S'] = out['Theta_33'] + out['Theta_S33'] - 0.097*S + 0.043
+    out['B'] = ( np.log(1500.) - np.log(33.) ) / ( np.log(out['Theta_33']) - np.log(out['Theta_1500']) )
+    out['Lambda'] = 1. / out['B']
+    out['Ksat'] = 24. * 1930. * ( out['Theta_S'] - out['Theta_33'] )**( 3. - out['Lambda'] ) # mm/h to mm/day
+    out['Bulk_Density'] = ( 1. - out['Theta_S'] ) * 2650.
+    out['Dsmax'] = out['Ksat'] * np.asarray( slope, dtype=float )
+    out['Expt'] = 3. + 2. / out['Lambda']
+    out['Bubble'] = 0.32 * out['Expt'] + 4.3
+    wcr = 0.7 * out['Theta_33'] / out['Theta_S']
+    wpwp = out['Theta_1500'] / out['Theta_S']
+    out['Wcr_FRACT'] = np.maximum( wcr, wpwp ) # switch if Wcr is less than Wpwp
+    out['Wpwp_FRACT'] = np.minimum( wcr, wpwp )
+    return out
+
+def SaxtonRawls( sand, clay, om, slope=None ):
+    # soil water characteristics of all layers, using the compiled kernels if available
+    if SoilLib is None:
+        return SaxtonRawlsReference( sand, clay, om, slope )
+    shape = np.shape( sand )
+    S = np.ascontiguousarray( sand, dtype=np.float64 ).ravel()
+    C = np.ascontiguousarray( clay, dtype=np.float64 ).ravel()
+    OM = np.ascontiguousarray( om, dtype=np.float64 ).ravel()
+    if len(C) != len(S) or len(OM) != len(S):
+        raise ValueError( "sand, clay and om must have the same shape" )
+    dptr = ctypes.POINTER( ctypes.c_double )
+    if slope is None:
+        slopeptr = None
+    else:
+        slope = np.ascontiguousarray( slope, dtype=np.float64 ).ravel()
+        slopeptr = slope.ctypes.data_as( dptr )
+    block = np.empty( ( len(Names), len(S) ) )
+    SoilLib.SaxtonRawlsBlock( len(S), S.ctypes.data_as( dptr ), C.ctypes.data_as( dptr ),
+                              OM.ctypes.data_as( dptr ), slopeptr, block.ctypes.data_as( dptr ) )
+    out = {}
+    for idx in range(len(Names)):
+        out[Names[idx]] = block[idx].reshape( shape )
+    return out
+
+if __name__ == "__main__":
+    # compare the compiled kernels with the numpy reference
+    if SoilLib is None:
+        sys.stderr.write( "ERROR: libSoilHydraulics.so not found, nothing to check.\n" )
+        sys.exit(1)
+    np.random.seed( 1 )
+    N = 100000
+    S = np.random.uniform( 0.05, 0.90, N )
+    C = np.random.uniform( 0.05, 0.60, N ) * ( 1. - S )
+    OM = np.random.uniform( 0., 8., N )
+    slope = np.random.uniform( 0., 0.3, N )
+    ref = SaxtonRawlsReference( S, C, OM, slope )
+    new = SaxtonRawls( S, C, OM, slope )
+    worst = 0.
+    for name in Names:
+        err = np.nanmax( np.abs( new[name] - ref[name] ) / np.maximum( np.abs( ref[name] ), 1.e-12 ) )
+        print( "%-14s max relative difference %.3g" % ( name, err ) )
+        worst = max( worst, err )
+    if worst > 1.e-9:
+        sys.stderr.write( "ERROR: kernels differ from the reference by more than 1e-9.\n" )
+        sys.exit(1)
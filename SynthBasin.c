@@ -0,0 +1,630 @@
+/******************************************************************************
+   SUMMARY:
+   This program synthesises a consistent fake basin with every input of the
+   preprocessing chain, at any scale, so that the whole pipeline can be run
+   and timed offline (see PipelineBench.c).  The basin is a rectangle of VIC
+   cells clipped to an ellipse, each cell covered by a square of DEM pixels;
+   the elevation, land use and soil of a pixel are smooth functions of its
+   position (seeded value noise), so the grids agree with each other and the
+   same seed always gives the same basin.
+
+******************************************************************************
+   NOTES:
+   Files written to the output dir:
+     DEM.asc                  basin DEM (nodata outside the basin cells)
+     CellDems/<cell>.txt      DEM of every VIC cell, listed in CellDems.lst
+                              (and the cell numbers in CellIds.lst)
+     CellNum.asc              VIC cell numbers, row * ncells x + col + 1
+     CellNumFine.asc          VIC cell number of every DEM pixel
+     LandUse.asc              IGBP classes 0-16 (0 water, 11 wetlands)
+     SoilMuid.asc             HWSD-like soil mapping units
+     SoilTable.csv            HWSD-like soil unit table of the MUIDs
+     SoilControl.json         SimplifySoil control file
+     SoilLayers.txt           cell, layer, sand, clay, om and slope table
+                              for CalcSoilHydraulics
+     TravelTime.asc           travel time to the outlet (hours)
+     ClimateData/PredtandfilaGrid.dat   id, lon and lat of the climate cells
+     ClimateData/CARPATGRID_<VAR>_D.ser daily PREC TMAX TMIN WS2 PVAP RH
+                              PAIR RG of every cell from January 1st 1961,
+                              in the fixed width layout read by
+                              BuildVicForcingFiles.py
+     Forcing.lst              the forcing files it writes, for ClimateStats.py
+     Stations.txt             id, lon, lat and elevation of the stations
+     pipeline.txt             the stages of the preprocessing chain
+   The climate cells are the VIC cells, so the forcing files of the chain
+   are those of the basin.
+
+   USAGE: SynthBasin [-cells <nx> <ny>] [-pixels <n>] [-cellsize <deg>]
+                     [-origin <lon> <lat>] [-relief <m>] [-years <n>]
+                     [-stations <n>] [-soils <n>] [-seed <n>] <output dir>
+     -cells: VIC cells of the basin rectangle (default 8 6)
+     -pixels: DEM pixels along the side of a VIC cell (default 120)
+     -cellsize: VIC cell size in degrees (default 0.125)
+     -origin: lower left corner of the basin (default 20 46)
+     -relief: elevation range of the basin in m (default 600)
+     -years: years of daily climate (default 3)
+     -stations: climate stations (default 12)
+     -soils: soil mapping units (default 16)
+     -seed: seed of the noise (default 1)
+
+   Compile with: gcc -O3 -fopenmp SynthBasin.c RasterIO.c -lm -o SynthBasin
+
+   COMMENTS:
+   Elevations are rounded to whole metres, as in SRTM, so the lowlands have
+   the wide flats and pits of real DEMs.  The grids are written a band of
+   VIC cell rows at a time, so the size of the basin is only limited by the
+   disk.
+
+*******************************************************************************/
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "RasterIO.h"
+
+#define MAXSTRING 500
+#define NODATA -9999.
+#define FIRSTYEAR 1961
+#define MUIDBASE 4501       /* MU_GLOBAL of the first soil mapping unit */
+#define WATERMUID 7001      /* MU_GLOBAL of open water (ISSOIL 0) */
+#define NFINE 5             /* DEM, cell number, land use, soil, travel time */
+#define NVARS 8
+
+typedef struct
+{
+  int      nx, ny, npix;       /* VIC cells, and DEM pixels per cell side */
+  double   cellsize, lon0, lat0, relief, base;
+  int      nsoils;
+  uint64_t seed;
+} BASIN;
+
+static const char *VarNames[NVARS] = { "PREC", "TMAX", "TMIN", "WS2", "PVAP", "RH", "PAIR", "RG" };
+static const char *SoilCodes[] = { "Lo", "Be", "Gl", "Je", "Vc", "Od", "Hh", "Lg", "Bd", "Re" };
+#define NCODES (int)(sizeof(SoilCodes)/sizeof(SoilCodes[0]))
+
+void     Usage(char *name);
+void     MakeDir(char *dir, char *sub);
+FILE     *OpenOutput(char *dir, char *name);
+int      InBasin(BASIN *b, int r, int c);
+double   Elevation(BASIN *b, double u, double v);
+int      LandUse(BASIN *b, double u, double v, double z);
+int      SoilMuid(BASIN *b, double u, double v, int landuse);
+void     WriteGrids(BASIN *b, char *dir, double *cellz, double *cellslope);
+void     WriteSoil(BASIN *b, char *dir, double *cellslope);
+void     WriteClimate(BASIN *b, char *dir, double *cellz, int years);
+void     WriteStations(BASIN *b, char *dir, int nstations);
+void     WritePipeline(BASIN *b, char *dir);
+uint64_t Mix(uint64_t x);
+double   Uniform(uint64_t seed, uint64_t a, uint64_t b);
+double   Gauss(uint64_t seed, uint64_t a, uint64_t b);
+double   Noise(uint64_t seed, double x, double y);
+
+int main(int argc, char *argv[])
+{
+  BASIN  b;
+  int    i, years = 3, nstations = 12;
+  double *cellz, *cellslope;
+  char   *dir;
+
+  b.nx = 8;
+  b.ny = 6;
+  b.npix = 120;
+  b.cellsize = 0.125;
+  b.lon0 = 20.;
+  b.lat0 = 46.;
+  b.relief = 600.;
+  b.base = 80.;
+  b.nsoils = 16;
+  b.seed = 1;
+  for(i=1; i<argc-1; i++) {
+    if(i+2 < argc-1 && strcmp(argv[i], "-cells") == 0) {
+      b.nx = atoi(argv[++i]);
+      b.ny = atoi(argv[++i]);
+    }
+    else if(i+1 < argc-1 && strcmp(argv[i], "-pixels") == 0) b.npix = atoi(argv[++i]);
+    else if(i+1 < argc-1 && strcmp(argv[i], "-cellsize") == 0) b.cellsize = atof(argv[++i]);
+    else if(i+2 < argc-1 && strcmp(argv[i], "-origin") == 0) {
+      b.lon0 = atof(argv[++i]);
+      b.lat0 = atof(argv[++i]);
+    }
+    else if(i+1 < argc-1 && strcmp(argv[i], "-relief") == 0) b.relief = atof(argv[++i]);
+    else if(i+1 < argc-1 && strcmp(argv[i], "-years") == 0) years = atoi(argv[++i]);
+    else if(i+1 < argc-1 && strcmp(argv[i], "-stations") == 0) nstations = atoi(argv[++i]);
+    else if(i+1 < argc-1 && strcmp(argv[i], "-soils") == 0) b.nsoils = atoi(argv[++i]);
+    else if(i+1 < argc-1 && strcmp(argv[i], "-seed") == 0) b.seed = strtoull(argv[++i], NULL, 10);
+    else {
+      fprintf(stderr, "ERROR - No such option.\n");
+      Usage(argv[0]);
+    }
+  }
+  if(argc < 2 || argv[argc-1][0] == '-')
+    Usage(argv[0]);
+  if(b.nx <= 0 || b.ny <= 0 || b.npix < 4 || b.cellsize <= 0. || b.relief <= 0. || years <= 0
+     || b.nsoils <= 0) {
+    fprintf(stderr, "ERROR: the basin needs cells, at least 4 pixels per cell, relief, soils and a year\n");
+    exit(1);
+  }
+  dir = argv[argc-1];
+  MakeDir(dir, NULL);
+  MakeDir(dir, "CellDems");
+  MakeDir(dir, "CellTWI");
+  MakeDir(dir, "ClimateData");
+  MakeDir(dir, "Forcing");
+  MakeDir(dir, "Soil");
+  MakeDir(dir, "Routing");
+
+  cellz = (double*) calloc((size_t)b.nx*b.ny, sizeof(double));
+  cellslope = (double*) calloc((size_t)b.nx*b.ny, sizeof(double));
+  if(cellz == NULL || cellslope == NULL) {
+    printf("Cannot allocate memory to first record: cell statistics\n");
+    exit(8);
+  }
+  WriteGrids(&b, dir, cellz, cellslope);
+  WriteSoil(&b, dir, cellslope);
+  WriteClimate(&b, dir, cellz, years);
+  WriteStations(&b, dir, nstations);
+  WritePipeline(&b, dir);
+  return (0);
+}
+
+/* ----------------------
+  Create dir (or dir/sub) if it does not exist.
+ ------------------------*/
+void MakeDir(char *dir, char *sub)
+{
+  char path[2*MAXSTRING];
+
+  if(sub == NULL)
+    snprintf(path, sizeof(path), "%s", dir);
+  else
+    snprintf(path, sizeof(path), "%s/%s", dir, sub);
+  if(mkdir(path, 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "cannot create directory,%s\n", path);
+    exit(1);
+  }
+}
+
+/* ----------------------
+  Open dir/name for writing.
+ ------------------------*/
+FILE *OpenOutput(char *dir, char *name)
+{
+  char path[3*MAXSTRING];
+  FILE *fo;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  if((fo = fopen(path, "w")) == NULL) {
+    fprintf(stderr, "cannot open/write output file,%s\n", path);
+    exit(1);
+  }
+  return fo;
+}
+
+/* ----------------------
+  Counter based random numbers: the same (seed, a, b) always give the same
+  number, whatever the thread or the order of the calls.
+ ------------------------*/
+uint64_t Mix(uint64_t x)
+{
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+double Uniform(uint64_t seed, uint64_t a, uint64_t b)
+{
+  return (Mix(Mix(Mix(seed) ^ a) ^ b) >> 11) * (1.0/9007199254740992.0);
+}
+
+double Gauss(uint64_t seed, uint64_t a, uint64_t b)
+{
+  double u1 = Uniform(seed, a, 2*b), u2 = Uniform(seed, a, 2*b+1);
+
+  return sqrt(-2.*log(1. - u1))*cos(2.*M_PI*u2);
+}
+
+/* ----------------------
+  Value noise in [0,1]: uniform values on the integer lattice, smoothly
+  interpolated.
+ ------------------------*/
+double Noise(uint64_t seed, double x, double y)
+{
+  double i = floor(x), j = floor(y), fx = x - i, fy = y - j, v00, v01, v10, v11;
+  uint64_t a = (uint64_t)(int64_t)i, c = (uint64_t)(int64_t)j;
+
+  fx = fx*fx*(3. - 2.*fx);
+  fy = fy*fy*(3. - 2.*fy);
+  v00 = Uniform(seed, a, c);
+  v10 = Uniform(seed, a+1, c);
+  v01 = Uniform(seed, a, c+1);
+  v11 = Uniform(seed, a+1, c+1);
+  return (v00*(1.-fx) + v10*fx)*(1.-fy) + (v01*(1.-fx) + v11*fx)*fy;
+}
+
+/* ----------------------
+  Is VIC cell (r, c), rows from the top, in the basin ellipse?
+ ------------------------*/
+int InBasin(BASIN *b, int r, int c)
+{
+  double x = (c + 0.5 - 0.5*b->nx)/(0.5*b->nx + 0.5), y = (r + 0.5 - 0.5*b->ny)/(0.5*b->ny + 0.5);
+
+  return (b->nx <= 2 || b->ny <= 2 || x*x + y*y <= 1.);
+}
+
+/* ----------------------
+  Elevation at (u, v), in VIC cells from the top left corner: a slope up
+  from the outlet at the middle of the bottom edge, fractal noise, and
+  flat lowlands, rounded to whole metres.
+ ------------------------*/
+double Elevation(BASIN *b, double u, double v)
+{
+  double d, z, f = 0., amp = 1., scale = 0.7, low;
+  int    k;
+
+  d = hypot(u - 0.5*b->nx, b->ny - v)/hypot(0.5*b->nx, b->ny);
+  for(k=0; k<5; k++, amp *= 0.5, scale *= 2.3)
+    f += amp*(Noise(b->seed + k, u*scale, v*scale) - 0.5);
+  z = b->relief*(0.75*pow(d, 1.3) + 0.25*(f + 0.5));
+  low = 0.25*b->relief;
+  if(z < low)
+    z = low - 0.1*(low - z) + 2.*Noise(b->seed + 7, u*4., v*4.);
+  return floor(b->base + z + 0.5);
+}
+
+/* ----------------------
+  IGBP class of a pixel from its relative elevation and wetness.
+ ------------------------*/
+int LandUse(BASIN *b, double u, double v, double z)
+{
+  double h = (z - b->base)/b->relief, w = Noise(b->seed + 10, u*3., v*3.);
+
+  if(h < 0.26) {
+    if(w > 0.82) return 0;
+    if(w > 0.68) return 11;
+  }
+  if(h < 0.4 && Noise(b->seed + 11, u*6., v*6.) > 0.85)
+    return 13;
+  if(h < 0.26) return (w < 0.25) ? 14 : 12;
+  if(h < 0.35) return 12;
+  if(h < 0.55) return 4;
+  if(h < 0.75) return 5;
+  if(h < 0.9) return 1;
+  return 10;
+}
+
+int SoilMuid(BASIN *b, double u, double v, int landuse)
+{
+  int m;
+
+  if(landuse == 0)
+    return WATERMUID;
+  m = (int)((Noise(b->seed + 20, u*1.3, v*1.3)*1.4 - 0.2)*b->nsoils);
+  return MUIDBASE + (m < 0 ? 0 : (m >= b->nsoils ? b->nsoils - 1 : m));
+}
+
+/* ----------------------
+  Write the DEM, cell DEMs and the fine resolution grids a band of VIC cell
+  rows at a time, and the VIC cell number grid.  Returns the mean elevation
+  and slope of every cell.
+ ------------------------*/
+void WriteGrids(BASIN *b, char *dir, double *cellz, double *cellslope)
+{
+  static char *names[NFINE] = { "DEM.asc", "CellNumFine.asc", "LandUse.asc", "SoilMuid.asc", "TravelTime.asc" };
+  RASTER  fine[NFINE], vic, cell;
+  double  *band[NFINE], *row, delta = b->cellsize/b->npix, dx, dy, lat, gx, gy, s;
+  long    ncols = (long)b->nx*b->npix, k;
+  int     r, c, i, j, g, n, vr, vc;
+  char    path[2*MAXSTRING];
+  FILE    *fl, *fi;
+
+  for(g=0; g<NFINE; g++) {
+    memset(&fine[g], 0, sizeof(RASTER));
+    fine[g].ncols = ncols;
+    fine[g].nrows = b->ny*b->npix;
+    fine[g].xllcorner = b->lon0;
+    fine[g].yllcorner = b->lat0;
+    fine[g].cellsize = delta;
+    fine[g].nodata = NODATA;
+    fine[g].precision = (g == 4) ? 6 : 10;
+    snprintf(path, sizeof(path), "%s/%s", dir, names[g]);
+    CreateRaster(path, &fine[g]);
+    if((band[g] = (double*) malloc((size_t)b->npix*ncols*sizeof(double))) == NULL) {
+      printf("Cannot allocate memory to first record: grid band\n");
+      exit(8);
+    }
+  }
+  memset(&vic, 0, sizeof(RASTER));
+  vic.ncols = b->nx;
+  vic.nrows = b->ny;
+  vic.xllcorner = b->lon0;
+  vic.yllcorner = b->lat0;
+  vic.cellsize = b->cellsize;
+  vic.nodata = NODATA;
+  snprintf(path, sizeof(path), "%s/CellNum.asc", dir);
+  CreateRaster(path, &vic);
+  row = (double*) malloc(((size_t)b->npix*b->npix + b->nx)*sizeof(double));
+  if(row == NULL) {
+    printf("Cannot allocate memory to first record: cell DEM\n");
+    exit(8);
+  }
+  fl = OpenOutput(dir, "CellDems.lst");
+  fi = OpenOutput(dir, "CellIds.lst");
+
+  for(vr=0; vr<b->ny; vr++) {
+#pragma omp parallel for private(c, vc, k, g) schedule(dynamic)
+    for(r=0; r<b->npix; r++) {
+      double u, v, z, d;
+      int    lu;
+      for(c=0; c<ncols; c++) {
+	vc = c/b->npix;
+	k = (long)r*ncols + c;
+	if(!InBasin(b, vr, vc)) {
+	  for(g=0; g<NFINE; g++)
+	    band[g][k] = NODATA;
+	  continue;
+	}
+	u = (c + 0.5)/b->npix;
+	v = vr + (r + 0.5)/b->npix;
+	z = Elevation(b, u, v);
+	lu = LandUse(b, u, v, z);
+	/* 1.4 sinuosity, 0.5 m/s */
+	d = hypot((u - 0.5*b->nx)*cos((b->lat0 + (b->ny - v)*b->cellsize)*M_PI/180.), b->ny - v)
+	  *b->cellsize*111320.;
+	band[0][k] = z;
+	band[1][k] = (double)vr*b->nx + vc + 1;
+	band[2][k] = lu;
+	band[3][k] = SoilMuid(b, u, v, lu);
+	band[4][k] = 1.4*d/0.5/3600.;
+      }
+    }
+    for(g=0; g<NFINE; g++)
+      WriteRasterRows(&fine[g], b->npix, band[g]);
+
+    /* cell DEMs, and the mean elevation and slope of the cells */
+    lat = b->lat0 + (b->ny - vr - 0.5)*b->cellsize;
+    dx = delta*111320.*cos(lat*M_PI/180.);
+    dy = delta*110574.;
+    for(vc=0; vc<b->nx; vc++) {
+      row[(size_t)b->npix*b->npix + vc] = InBasin(b, vr, vc) ? (double)vr*b->nx + vc + 1 : NODATA;
+      if(!InBasin(b, vr, vc))
+	continue;
+      for(i=0, s=0.; i<b->npix; i++)
+	for(j=0; j<b->npix; j++) {
+	  row[(size_t)i*b->npix + j] = band[0][(long)i*ncols + (long)vc*b->npix + j];
+	  cellz[vr*b->nx + vc] += row[(size_t)i*b->npix + j];
+	}
+      for(i=1, n=0; i<b->npix-1; i++)
+	for(j=1; j<b->npix-1; j++, n++) {
+	  gx = (row[(size_t)i*b->npix + j+1] - row[(size_t)i*b->npix + j-1])/(2.*dx);
+	  gy = (row[(size_t)(i+1)*b->npix + j] - row[(size_t)(i-1)*b->npix + j])/(2.*dy);
+	  s += sqrt(gx*gx + gy*gy);
+	}
+      cellz[vr*b->nx + vc] /= (double)b->npix*b->npix;
+      cellslope[vr*b->nx + vc] = s/n;
+      memset(&cell, 0, sizeof(RASTER));
+      cell.ncols = cell.nrows = b->npix;
+      cell.xllcorner = b->lon0 + vc*b->cellsize;
+      cell.yllcorner = b->lat0 + (b->ny - vr - 1)*b->cellsize;
+      cell.cellsize = delta;
+      cell.nodata = NODATA;
+      snprintf(path, sizeof(path), "%s/CellDems/%d.txt", dir, vr*b->nx + vc + 1);
+      CreateRaster(path, &cell);
+      WriteRasterRows(&cell, b->npix, row);
+      CloseRaster(&cell);
+      fprintf(fl, "CellDems/%d.txt\n", vr*b->nx + vc + 1);
+      fprintf(fi, "%d\n", vr*b->nx + vc + 1);
+    }
+    WriteRasterRows(&vic, 1, row + (size_t)b->npix*b->npix);
+  }
+  for(g=0; g<NFINE; g++) {
+    CloseRaster(&fine[g]);
+    free(band[g]);
+  }
+  CloseRaster(&vic);
+  fclose(fl);
+  fclose(fi);
+  free(row);
+}
+
+/* ----------------------
+  HWSD-like soil table (one to three soil units per MUID, and open water),
+  SimplifySoil control file and the soil layer table of the cells.
+ ------------------------*/
+void WriteSoil(BASIN *b, char *dir, double *cellslope)
+{
+  FILE   *fo;
+  int    m, n, nunits, share, left, r, c, layer, muid;
+  double sand[2], clay[2], oc[2];
+
+  fo = OpenOutput(dir, "SoilTable.csv");
+  fprintf(fo, "ID,MU_GLOBAL,SEQ,ISSOIL,SHARE,SU_CODE74,REF_DEPTH,T_SAND,T_SILT,T_CLAY,T_OC,T_BULK_DENSITY,S_SAND,S_SILT,S_CLAY,S_OC,S_BULK_DENSITY\n");
+  for(m=0, r=1; m<b->nsoils; m++) {
+    nunits = 1 + (int)(3.*Uniform(b->seed, 30, m));
+    for(n=0, left=100; n<nunits; n++, left -= share, r++) {
+      share = (n == nunits-1) ? left : 10*(int)(left*(0.5 + 0.3*Uniform(b->seed, 31, m*4+n))/10.);
+      sand[0] = 10. + 70.*Uniform(b->seed, 32, m*4+n);
+      clay[0] = 5. + (90. - sand[0])*0.6*Uniform(b->seed, 33, m*4+n);
+      sand[1] = sand[0]*(0.8 + 0.2*Uniform(b->seed, 34, m*4+n));
+      clay[1] = clay[0]*(1.0 + 0.3*Uniform(b->seed, 35, m*4+n));
+      oc[0] = 0.3 + 2.*Uniform(b->seed, 36, m*4+n);
+      fprintf(fo, "%d,%d,%d,1,%d,%s,%d,%.0f,%.0f,%.0f,%.2f,%.2f,%.0f,%.0f,%.0f,%.2f,%.2f\n", r,
+	      MUIDBASE + m, n+1, share, SoilCodes[(int)(NCODES*Uniform(b->seed, 37, m*4+n))],
+	      Uniform(b->seed, 38, m*4+n) < 0.15 ? 30 : 100, sand[0], 100. - sand[0] - clay[0],
+	      clay[0], oc[0], 1.2 + 0.4*sand[0]/100., sand[1], 100. - sand[1] - clay[1], clay[1],
+	      oc[0]*0.4, 1.3 + 0.4*sand[1]/100.);
+    }
+  }
+  fprintf(fo, "%d,%d,1,0,100,WR,0,0,0,0,0,0,0,0,0,0,0\n", r, WATERMUID);
+  fclose(fo);
+
+  fo = OpenOutput(dir, "SoilControl.json");
+  fprintf(fo, "{\n  \"inSoilGrid\": \"SoilMuid.asc\",\n  \"inCellNum\": \"CellNumFine.asc\",\n"
+	  "  \"outCellNum\": \"CellNum.asc\",\n  \"outCellNumGrid\": true,\n"
+	  "  \"inSoilTable\": \"SoilTable.csv\",\n  \"outSoilNameFmt\": \"Soil/SoilProperty_%%s.asc\",\n"
+	  "  \"inSoilID\": \"MU_GLOBAL\",\n  \"inSoilCode\": \"SU_CODE74\",\n  \"inSoilFract\": \"SHARE\",\n"
+	  "  \"outParams\": [\"REF_DEPTH\", \"T_SAND\", \"T_SILT\", \"T_CLAY\", \"T_OC\", \"T_BULK_DENSITY\",\n"
+	  "                \"S_SAND\", \"S_SILT\", \"S_CLAY\", \"S_OC\", \"S_BULK_DENSITY\"]\n}\n");
+  fclose(fo);
+
+  /* the soil of a cell is the first soil unit of the MUID at its center */
+  fo = OpenOutput(dir, "SoilLayers.txt");
+  fprintf(fo, "cell\tlayer\tsand\tclay\tom\tslope\n");
+  for(r=0; r<b->ny; r++)
+    for(c=0; c<b->nx; c++) {
+      if(!InBasin(b, r, c))
+	continue;
+      muid = SoilMuid(b, c + 0.5, r + 0.5, 12);
+      m = muid - MUIDBASE;
+      sand[0] = 10. + 70.*Uniform(b->seed, 32, m*4);
+      clay[0] = 5. + (90. - sand[0])*0.6*Uniform(b->seed, 33, m*4);
+      sand[1] = sand[0]*(0.8 + 0.2*Uniform(b->seed, 34, m*4));
+      clay[1] = clay[0]*(1.0 + 0.3*Uniform(b->seed, 35, m*4));
+      oc[0] = 0.3 + 2.*Uniform(b->seed, 36, m*4);
+      oc[1] = oc[0]*0.4;
+      for(layer=0; layer<3; layer++)
+	fprintf(fo, "%d\t%d\t%.3f\t%.3f\t%.3f\t%.5f\n", r*b->nx + c + 1, layer + 1,
+		sand[layer > 0]/100., clay[layer > 0]/100., 1.724*oc[layer > 0], cellslope[r*b->nx + c]);
+    }
+  fclose(fo);
+}
+
+/* ----------------------
+  Daily climate of every basin cell: a seasonal cycle, lapse rates and a
+  weather noise shared by all cells plus a small noise of each cell.
+ ------------------------*/
+void WriteClimate(BASIN *b, char *dir, double *cellz, int years)
+{
+  static const int mdays[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+  FILE   *fo[NVARS], *fg;
+  char   name[2*MAXSTRING];
+  int    v, r, c, n, ncells, y, m, d, day = 0, doy, *cells, wet;
+  double lat, lon, z, s, tmax, tmin, rh, prec, w, values[NVARS];
+
+  cells = (int*) malloc((size_t)b->nx*b->ny*sizeof(int));
+  if(cells == NULL) {
+    printf("Cannot allocate memory to first record: climate cells\n");
+    exit(8);
+  }
+  fg = OpenOutput(dir, "ClimateData/PredtandfilaGrid.dat");
+  fprintf(fg, "%6s %10s %10s\n", "id", "lon", "lat");
+  for(r=0, ncells=0; r<b->ny; r++)
+    for(c=0; c<b->nx; c++)
+      if(InBasin(b, r, c)) {
+	cells[ncells++] = r*b->nx + c;
+	fprintf(fg, "%6d %10.5f %10.5f\n", ncells, b->lon0 + (c + 0.5)*b->cellsize,
+		b->lat0 + (b->ny - r - 0.5)*b->cellsize);
+      }
+  fclose(fg);
+
+  fg = OpenOutput(dir, "Forcing.lst");
+  for(n=0; n<ncells; n++)
+    fprintf(fg, "Forcing/data_%.4f_%.4f\n", b->lat0 + (b->ny - cells[n]/b->nx - 0.5)*b->cellsize,
+	    b->lon0 + (cells[n]%b->nx + 0.5)*b->cellsize);
+  fclose(fg);
+
+  for(v=0; v<NVARS; v++) {
+    snprintf(name, sizeof(name), "ClimateData/CARPATGRID_%s_D.ser", VarNames[v]);
+    fo[v] = OpenOutput(dir, name);
+    fprintf(fo[v], "YEARMONDAY");
+    for(n=0; n<ncells; n++)
+      fprintf(fo[v], "%8d", n+1);
+    fprintf(fo[v], "\n");
+  }
+  for(y=FIRSTYEAR; y<FIRSTYEAR+years; y++)
+    for(m=0, doy=0; m<12; m++)
+      for(d=1; d<=mdays[m] + (m == 1 && y%4 == 0 && (y%100 != 0 || y%400 == 0)); d++, doy++, day++) {
+	s = sin(2.*M_PI*(doy - 105)/365.25);
+	w = Gauss(b->seed, 40, day);
+	wet = Uniform(b->seed, 41, day) < 0.3 + 0.1*w;
+	for(v=0; v<NVARS; v++)
+	  fprintf(fo[v], "%4d%3d%3d", y, m+1, d);
+	for(n=0; n<ncells; n++) {
+	  z = cellz[cells[n]];
+	  lat = b->lat0 + (b->ny - cells[n]/b->nx - 0.5)*b->cellsize;
+	  lon = b->lon0 + (cells[n]%b->nx + 0.5)*b->cellsize;
+	  tmax = 16. + 12.*s - 0.0065*(z - b->base) + 3.*w + Gauss(b->seed, 64 + 8*cells[n] + 0, day)
+	    - 0.5*(lat - 46.) + 0.1*(lon - 20.) - (wet ? 3. : 0.);
+	  tmin = tmax - 8. - 3.*Uniform(b->seed, 64 + 8*cells[n] + 1, day) + (wet ? 3. : 0.);
+	  prec = wet ? -log(1. - Uniform(b->seed, 64 + 8*cells[n] + 2, day))*5.*(1. + (z - b->base)/1500.) : 0.;
+	  rh = (wet ? 75. : 55.) + 20.*Uniform(b->seed, 64 + 8*cells[n] + 3, day);
+	  values[0] = prec;
+	  values[1] = tmax;
+	  values[2] = tmin;
+	  values[3] = 1.5 + 2.*Uniform(b->seed, 64 + 8*cells[n] + 4, day);
+	  values[4] = rh/100.*0.6108*exp(17.27*0.5*(tmax + tmin)/(0.5*(tmax + tmin) + 237.3));
+	  values[5] = rh;
+	  values[6] = 101.3*pow((293. - 0.0065*z)/293., 5.26);
+	  values[7] = (4. + 20.*(0.5 + 0.5*s))*(wet ? 0.5 : 1.);
+	  for(v=0; v<NVARS; v++)
+	    fprintf(fo[v], "%8.2f", values[v]);
+	}
+	for(v=0; v<NVARS; v++)
+	  fprintf(fo[v], "\n");
+      }
+  for(v=0; v<NVARS; v++)
+    if(fclose(fo[v]) != 0) {
+      fprintf(stderr, "cannot write output file,%s\n", VarNames[v]);
+      exit(1);
+    }
+  printf("%d cells, %d pixels per cell, %d days of climate written to %s\n", ncells,
+	 b->npix*b->npix, day, dir);
+  free(cells);
+}
+
+/* ----------------------
+  Stations at random pixels of the basin.
+ ------------------------*/
+void WriteStations(BASIN *b, char *dir, int nstations)
+{
+  FILE   *fo = OpenOutput(dir, "Stations.txt");
+  int    n, k, r, c;
+  double u, v;
+
+  fprintf(fo, "id\tlon\tlat\telev\n");
+  for(n=0, k=0; n<nstations && k<1000*nstations; k++) {
+    u = b->nx*Uniform(b->seed, 50, k);
+    v = b->ny*Uniform(b->seed, 51, k);
+    r = (int)v;
+    c = (int)u;
+    if(!InBasin(b, r, c))
+      continue;
+    n++;
+    fprintf(fo, "%d\t%.5f\t%.5f\t%.0f\n", n, b->lon0 + u*b->cellsize, b->lat0 + (b->ny - v)*b->cellsize,
+	    Elevation(b, u, v));
+  }
+  fclose(fo);
+}
+
+/* ----------------------
+  The stages of the preprocessing chain, "<stage> <shell command>", run in
+  the output dir.  $PIPELINE_BIN is the dir of the tools and scripts (set by
+  PipelineBench), $PYTHON the python 2 interpreter.
+ ------------------------*/
+void WritePipeline(BASIN *b, char *dir)
+{
+  FILE *fo = OpenOutput(dir, "pipeline.txt");
+
+  fprintf(fo, "# synthetic basin of %d x %d cells, %d pixels per cell, seed %llu\n", b->nx, b->ny,
+	  b->npix, (unsigned long long)b->seed);
+  fprintf(fo, "# <stage> <shell command>, run in this directory by PipelineBench\n");
+  fprintf(fo, "twi FindTWI -batch CellDems.lst CellTWI\n");
+  fprintf(fo, "lake for c in $(cat CellIds.lst); do CreateLakeParamTisza CellDems/$c.txt $c SEA; done > LakeParams.txt\n");
+  fprintf(fo, "forcing ${PYTHON:-python} $PIPELINE_BIN/BuildVicForcingFiles.py ClimateData Forcing\n");
+  fprintf(fo, "stats ${PYTHON:-python} $PIPELINE_BIN/ClimateStats.py Forcing.lst ClimateStats\n");
+  fprintf(fo, "soil SimplifySoil SoilControl.json && CalcSoilHydraulics SoilLayers.txt SoilHydraulics.txt\n");
+  fprintf(fo, "veg LandUseFractions LandUse.asc CellNum.asc LandUseFract.txt\n");
+  fprintf(fo, "routing BuildRoutingGrids Synth TravelTime.asc Routing CellNum.asc -zones CellNumFine.asc\n");
+  fclose(fo);
+}
+
+void Usage(char *name)
+{
+  fprintf(stderr, "\nUsage: %s [-cells <nx> <ny>] [-pixels <n>] [-cellsize <deg>] [-origin <lon> <lat>]\n", name);
+  fprintf(stderr, "\t[-relief <m>] [-years <n>] [-stations <n>] [-soils <n>] [-seed <n>] <output dir>\n");
+  fprintf(stderr, "\n\tNOTE: run the chain on the basin with PipelineBench <output dir>/pipeline.txt\n\n");
+  exit(0);
+}
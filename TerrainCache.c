@@ -0,0 +1,394 @@
+/******************************************************************************
+   SUMMARY:
+   In-process cache of cell DEMs for programs that use the same DEMs several
+   times in one run (several products or parameter sets of a cell, the
+   neighbouring cells of a halo, the server mode).  The DEMs are kept at
+   three stages, each made from a copy of the one before:
+
+     STAGE_PARSED  ReadDEM and SetCellSize
+     STAGE_ROUTED  FillAndRoute: filled dem, sink and flow accumulation
+     STAGE_TWI     WetnessIndex: tanbeta, contour length and wetness index
+
+   An entry is found by DEM file, minimum elevation, projection and stage,
+   and is used again as long as the file (for a tile of a pack, the pack)
+   is the same (device, inode, size and modification time).  The cache is
+   bounded by a byte budget: the least recently used entries that are not
+   in use are dropped when it is exceeded.
+
+   The entries are spread over shards by a hash of the key, each shard with
+   its own lock, list and share of the budget, so threads working on
+   different cells rarely wait for each other.  Use few shards when the
+   DEMs are large compared with the budget.  Threads asking for an entry
+   that another thread is making wait for it instead of making it again.
+   The TERRAIN returned by CachedTerrain() is shared and must not be
+   modified; it stays valid until ReleaseTerrain().
+*******************************************************************************/
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "TerrainEngine.h"
+
+typedef struct ENTRY
+{
+  char    *dem;
+  double  min_elev;
+  int     projection, stage;
+  unsigned long hash;
+  dev_t   dev;
+  ino_t   ino;
+  off_t   size;
+  struct timespec mtime;
+  size_t  bytes;
+  int     loading;             /* being made by a thread */
+  int     refs;                /* users */
+  int     detached;            /* out of the cache, freed by the last user */
+  TERRAIN t;
+  struct ENTRY *prev, *next;   /* most to least recently used */
+} ENTRY;
+
+typedef struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t  loaded;
+  ENTRY   *head, *tail;
+  long    n, hits, misses, evictions;
+  size_t  bytes, budget;
+} SHARD;
+
+struct TERRAINCACHE
+{
+  int     nshards;
+  SHARD   *shards;
+};
+
+/* ----------------------
+  Hash of the key (FNV-1a of the file name, mixed with the parameters).
+ ------------------------*/
+static unsigned long KeyHash(char *demfile, double min_elev, int projection)
+{
+  unsigned long h = 1469598103934665603UL;
+  unsigned char *p;
+
+  for(p = (unsigned char*)demfile; *p; p++) {
+    h ^= *p;
+    h *= 1099511628211UL;
+  }
+  for(p = (unsigned char*)&min_elev; p < (unsigned char*)(&min_elev+1); p++) {
+    h ^= *p;
+    h *= 1099511628211UL;
+  }
+  h ^= (unsigned long)projection;
+  h ^= h >> 29;
+  h *= 0xbf58476d1ce4e5b9UL;
+  return h ^ (h >> 32);
+}
+
+/* Remove an entry from the list of its shard, with the shard locked. */
+static void Unlink(SHARD *s, ENTRY *e)
+{
+  if(e->prev) e->prev->next = e->next;
+  else s->head = e->next;
+  if(e->next) e->next->prev = e->prev;
+  else s->tail = e->prev;
+  e->prev = e->next = NULL;
+  s->n--;
+  s->bytes -= e->bytes;
+}
+
+static void PushFront(SHARD *s, ENTRY *e)
+{
+  e->prev = NULL;
+  e->next = s->head;
+  if(s->head) s->head->prev = e;
+  s->head = e;
+  if(s->tail == NULL) s->tail = e;
+  s->n++;
+  s->bytes += e->bytes;
+}
+
+static void FreeEntry(ENTRY *e)
+{
+  FreeTerrain(&e->t);
+  free(e->dem);
+  free(e);
+}
+
+/* Drop the least recently used entries not in use, down to the budget.
+   The most recently used entry is kept even if it alone is over budget. */
+static void Evict(SHARD *s)
+{
+  ENTRY *e, *prev;
+
+  for(e = s->tail; s->bytes > s->budget && e != NULL && e != s->head; e = prev) {
+    prev = e->prev;
+    if(e->refs == 0 && !e->loading) {
+      Unlink(s, e);
+      FreeEntry(e);
+      s->evictions++;
+    }
+  }
+}
+
+/* ----------------------
+  Cache of at most budget bytes, in nshards shards (at least 1).
+ ------------------------*/
+TERRAINCACHE *NewTerrainCache(size_t budget, int nshards)
+{
+  TERRAINCACHE *c;
+  int i;
+
+  if(nshards < 1) nshards = 1;
+  if(!(c = (TERRAINCACHE*) calloc(1, sizeof(TERRAINCACHE))) ||
+     !(c->shards = (SHARD*) calloc(nshards, sizeof(SHARD))))
+    { printf("Cannot allocate memory to first record: cache\n");
+      exit(8);
+    }
+  c->nshards = nshards;
+  for(i=0; i<nshards; i++) {
+    pthread_mutex_init(&c->shards[i].lock, NULL);
+    pthread_cond_init(&c->shards[i].loaded, NULL);
+    c->shards[i].budget = budget / nshards;
+  }
+  return c;
+}
+
+/* ----------------------
+  DEM of a cell at a stage, from the cache or made now.  *hit is set to 1
+  when the entry was cached.  Returns NULL if the file cannot be read; a
+  DEM without valid pixels is returned (and cached) with nvalid 0.
+ ------------------------*/
+TERRAIN *CachedTerrain(TERRAINCACHE *c, char *demfile, double min_elev, int projection,
+		       int stage, int *hit)
+{
+  struct stat st;
+  unsigned long h;
+  SHARD   *s;
+  ENTRY   *e;
+  TERRAIN *prev;
+  int     dummy, id;
+  char    pack[MAXSTRING];
+  TILEPACK *tp;
+
+  if(hit == NULL) hit = &dummy;
+  *hit = 0;
+  /* A tile of a pack is as new as its pack. */
+  if(strlen(demfile) < MAXSTRING && PackedTileName(demfile, pack, NULL)) {
+    if(stat(pack, &st) != 0 || (tp = SharedTilePack(demfile, &id)) == NULL ||
+       FindPackedTile(tp, id) == NULL)
+      return NULL;
+  }
+  else if(stat(demfile, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    return NULL;
+
+  h = KeyHash(demfile, min_elev, projection);
+  s = &c->shards[(h ^ (unsigned long)stage) % c->nshards];
+
+  pthread_mutex_lock(&s->lock);
+  for(e = s->head; e != NULL; e = e->next)
+    if(e->hash == h && e->stage == stage && e->min_elev == min_elev &&
+       e->projection == projection && strcmp(e->dem, demfile) == 0)
+      break;
+
+  /* A modified file is read again. */
+  if(e != NULL && !e->loading &&
+     (e->dev != st.st_dev || e->ino != st.st_ino || e->size != st.st_size ||
+      e->mtime.tv_sec != st.st_mtim.tv_sec || e->mtime.tv_nsec != st.st_mtim.tv_nsec)) {
+    Unlink(s, e);
+    if(e->refs == 0) FreeEntry(e);
+    else e->detached = 1;
+    e = NULL;
+  }
+
+  if(e != NULL) {
+    s->hits++;
+    e->refs++;
+    Unlink(s, e);
+    PushFront(s, e);
+    while(e->loading)
+      pthread_cond_wait(&s->loaded, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+    *hit = 1;
+    return &e->t;
+  }
+
+  s->misses++;
+  if(!(e = (ENTRY*) calloc(1, sizeof(ENTRY))) || !(e->dem = strdup(demfile)))
+    { printf("Cannot allocate memory to first record: cache entry\n");
+      exit(8);
+    }
+  e->min_elev = min_elev;
+  e->projection = projection;
+  e->stage = stage;
+  e->hash = h;
+  e->dev = st.st_dev;
+  e->ino = st.st_ino;
+  e->size = st.st_size;
+  e->mtime = st.st_mtim;
+  e->loading = 1;
+  e->refs = 1;
+  PushFront(s, e);
+  pthread_mutex_unlock(&s->lock);
+
+  /* Made outside of the lock, from the stage before. */
+  if(stage == STAGE_PARSED) {
+    if(ReadDEM(demfile, min_elev, &e->t) > 0)
+      SetCellSize(&e->t, projection);
+  }
+  else if((prev = CachedTerrain(c, demfile, min_elev, projection, stage-1, NULL)) != NULL) {
+    CopyTerrain(prev, &e->t);
+    ReleaseTerrain(c, prev);
+    if(e->t.nvalid > 0) {
+      if(stage == STAGE_ROUTED) FillAndRoute(&e->t);
+      else WetnessIndex(&e->t);
+    }
+  }
+
+  /* Made last, so the entry is ahead of the stages it was made from. */
+  pthread_mutex_lock(&s->lock);
+  e->loading = 0;
+  Unlink(s, e);
+  e->bytes = TerrainBytes(&e->t);
+  PushFront(s, e);
+  pthread_cond_broadcast(&s->loaded);
+  Evict(s);
+  pthread_mutex_unlock(&s->lock);
+  return &e->t;
+}
+
+/* ----------------------
+  Done with a DEM of CachedTerrain().
+ ------------------------*/
+void ReleaseTerrain(TERRAINCACHE *c, TERRAIN *t)
+{
+  ENTRY *e = (ENTRY*) ((char*)t - offsetof(ENTRY, t));
+  SHARD *s = &c->shards[(e->hash ^ (unsigned long)e->stage) % c->nshards];
+
+  pthread_mutex_lock(&s->lock);
+  e->refs--;
+  if(e->refs == 0 && e->detached)
+    FreeEntry(e);
+  else
+    Evict(s);
+  pthread_mutex_unlock(&s->lock);
+}
+
+void TerrainCacheStats(TERRAINCACHE *c, CACHESTATS *stats)
+{
+  int i;
+
+  memset(stats, 0, sizeof(CACHESTATS));
+  for(i=0; i<c->nshards; i++) {
+    SHARD *s = &c->shards[i];
+
+    pthread_mutex_lock(&s->lock);
+    stats->hits += s->hits;
+    stats->misses += s->misses;
+    stats->evictions += s->evictions;
+    stats->entries += s->n;
+    stats->bytes += s->bytes;
+    stats->budget += s->budget;
+    pthread_mutex_unlock(&s->lock);
+  }
+}
+
+/* ----------------------
+  Free the cache.  The DEMs must have been released.
+ ------------------------*/
+void FreeTerrainCache(TERRAINCACHE *c)
+{
+  ENTRY *e, *next;
+  int   i;
+
+  for(i=0; i<c->nshards; i++) {
+    for(e = c->shards[i].head; e != NULL; e = next) {
+      next = e->next;
+      FreeEntry(e);
+    }
+    pthread_mutex_destroy(&c->shards[i].lock);
+    pthread_cond_destroy(&c->shards[i].loaded);
+  }
+  free(c->shards);
+  free(c);
+}
+
+/* ----------------------
+  Memory used by the arrays of a TERRAIN.
+ ------------------------*/
+size_t TerrainBytes(TERRAIN *t)
+{
+  size_t grid = (size_t)t->rows * (t->columns*sizeof(double) + sizeof(double*));
+  size_t bytes = sizeof(TERRAIN) + (size_t)t->nvalid*sizeof(int);
+
+  if(t->dx) bytes += 2*t->rows*sizeof(double);
+  if(t->dem) bytes += grid;
+  if(t->sink) bytes += grid;
+  if(t->flowacc) bytes += grid;
+  if(t->tanbeta) bytes += grid;
+  if(t->contour_length) bytes += grid;
+  if(t->wetnessindex) bytes += grid;
+  if(t->avedelev) bytes += grid;
+  if(t->hand) bytes += grid;
+  if(t->chandist) bytes += grid;
+  if(t->twiorder) bytes += (size_t)t->nvalid*sizeof(ITEM);
+  return bytes;
+}
+
+static double **CopyGrid(double **src, int columns, int rows)
+{
+  double **dst;
+  int    i;
+
+  if(src == NULL) return NULL;
+  dst = Memoryalloc(columns, rows);
+  for(i=0; i<rows; i++)
+    memcpy(dst[i], src[i], columns*sizeof(double));
+  return dst;
+}
+
+/* ----------------------
+  Deep copy of a TERRAIN, with the arrays it has.
+ ------------------------*/
+void CopyTerrain(TERRAIN *src, TERRAIN *dst)
+{
+  *dst = *src;
+  dst->dem = CopyGrid(src->dem, src->columns, src->rows);
+  dst->sink = CopyGrid(src->sink, src->columns, src->rows);
+  dst->flowacc = CopyGrid(src->flowacc, src->columns, src->rows);
+  dst->tanbeta = CopyGrid(src->tanbeta, src->columns, src->rows);
+  dst->contour_length = CopyGrid(src->contour_length, src->columns, src->rows);
+  dst->wetnessindex = CopyGrid(src->wetnessindex, src->columns, src->rows);
+  dst->avedelev = CopyGrid(src->avedelev, src->columns, src->rows);
+  dst->hand = CopyGrid(src->hand, src->columns, src->rows);
+  dst->chandist = CopyGrid(src->chandist, src->columns, src->rows);
+  dst->twiorder = NULL;
+  if(src->twiorder != NULL) {
+    if(!(dst->twiorder = (ITEM*) malloc(src->nvalid*sizeof(ITEM))))
+      { printf("Cannot allocate memory to first record: twiorder\n");
+	exit(8);
+      }
+    memcpy(dst->twiorder, src->twiorder, src->nvalid*sizeof(ITEM));
+  }
+  dst->valid = NULL;
+  dst->dx = dst->dy = NULL;
+  if(src->nvalid > 0) {
+    if(!(dst->valid = (int*) malloc(src->nvalid*sizeof(int))))
+      { printf("Cannot allocate memory to first record: valid\n");
+	exit(8);
+      }
+    memcpy(dst->valid, src->valid, src->nvalid*sizeof(int));
+  }
+  if(src->dx != NULL) {
+    dst->dx = (double*) malloc(src->rows*sizeof(double));
+    dst->dy = (double*) malloc(src->rows*sizeof(double));
+    if(dst->dx == NULL || dst->dy == NULL)
+      { printf("Cannot allocate memory to first record: dx\n");
+	exit(8);
+      }
+    memcpy(dst->dx, src->dx, src->rows*sizeof(double));
+    memcpy(dst->dy, src->dy, src->rows*sizeof(double));
+  }
+}
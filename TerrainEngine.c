@@ -0,0 +1,1581 @@
+/******************************************************************************
+   SUMMARY:
+   Terrain engine shared by the TWI and lake parameter tools.  See
+   TerrainEngine.h for a description of the grid structures.
+
+   The program uses the method presented by Pelletier (2008) to fill sinks and
+   eliminate errors in flat areas by calculating flow accumulation using
+   a multiple flow direction algorithm.
+
+   Sinks are filled by Pelletier's recursive filler, or by the sweep filler
+   of Planchon and Darboux (2001).  Both leave every pixel that is not an
+   outlet (a pixel on the edge of the grid) with a lower neighbour, by
+   raising pixels to fillincrement above their lowest neighbour.  The
+   sweeps give the lowest surface in which every raised pixel is
+   fillincrement above its lowest neighbour, so a filled flat rises by
+   fillincrement a pixel away from its outlet; the recursive filler can
+   leave raised pixels closer to their neighbours, and its fill is lower
+   by up to a few tenths on wide flats.  The recursive filler raises a
+   depression fillincrement at a time, so its work grows with the depth
+   and area of the depressions, while the sweeps cost a few passes over
+   the grid whatever they have to fill.  The fills are the same only when
+   every depression is a single pit, so the recursive filler is used
+   unless the sweeps are asked for, by the environment variable
+   TERRAIN_FILL (recursive or sweep) or SetFiller(); KernelBench -fill
+   compares them.
+
+   The height above the nearest drainage (HAND) and the flow distance to
+   the channel are made from the filled dem and flow accumulation of the
+   same run.  The channels are the pixels with a flow accumulation of at
+   least ChannelArea(), and every other pixel drains to its steepest lower
+   neighbour (D8).  The pixels are reached from the channels up the D8
+   tree, each once, so the products cost one pass over the grid; the
+   channel pixels are shared between threads.  Pixels that leave the grid
+   before reaching a channel are nodata.
+
+   REFERENCES: Jon Pelletier (2008) Quantitative Modeling of Earth Surface Processes.
+               Planchon, O. and F. Darboux (2001) A fast, simple and versatile
+               algorithm to fill the depressions of digital elevation models,
+               Catena 46, 159-176.
+
+   AUTHOR:       Chun-Mei Chiu / Laura Bowling
+   COMMENTS:     Collected from FindTWIDistribution.c,
+                 FindTWIDistribution.equalarea.c and CreateLakeParamTisza.c
+                 so that the tools share one copy of the code.
+*******************************************************************************/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "TerrainEngine.h"
+
+#define SWAP(a,b) itemp=(a);(a)=(b);(b)=itemp;
+#define M 7
+#define NSTACK 10000000
+
+#define FREE_ARG char*
+#define NR_END 1
+
+static void columnweights(FLOWGRID *g, int i, int j, int n, int dup, int ddown);
+static int  ReadPackedDEM(char *demfile, double min_elev, TERRAIN *t);
+static int  CropDEM(double **dem, TERRAIN *t);
+static void filldem(TERRAIN *t, int sink);
+static void slopewetness(TERRAIN *t, int keep);
+static void avedrop(TERRAIN *t);
+static void dropgrid(TERRAIN *t, double ***grid, int product);
+static void sweepfill(FLOWGRID *g, double **z);
+static void handdist(TERRAIN *t, int keep);
+static int  sweepblock(FLOWGRID *g, double **z, int i, int j0, int n, int reverse, double *m);
+
+static int FillerSet = -1;
+static double ChannelAreaSet = CHANNELAREA;
+static const char *FillerNames[NFILLERS] = { "recursive", "sweep" };
+
+/* Product graph: the products each product is made from.  The filled
+   dem replaces the dem, so the sink depth can only be made with it. */
+static const int ProductNeeds[NPRODUCTS] = {
+  0,                           /* PROD_FILLED */
+  PROD_FILLED,                 /* PROD_SINK */
+  PROD_FILLED,                 /* PROD_FLOWACC */
+  PROD_FILLED,                 /* PROD_SLOPE */
+  PROD_FLOWACC | PROD_SLOPE,   /* PROD_TWI */
+  PROD_FILLED | PROD_TWI,      /* PROD_AVEDELEV */
+  PROD_TWI,                    /* PROD_TWIORDER */
+  PROD_FILLED | PROD_FLOWACC,  /* PROD_HAND */
+  PROD_FILLED | PROD_FLOWACC   /* PROD_CHANDIST */
+};
+
+/*****************************************************************************/
+/*   ReadDEM: read an arc/info ascii DEM and crop it to the valid data.      */
+/*   Elevations below min_elev are set to nodata.  Returns the number of     */
+/*   valid pixels.  demfile may be a tile of a pack, "<pack file>:<cell id>" */
+/*   (TilePack.c).                                                           */
+/*****************************************************************************/
+int ReadDEM(char *demfile, double min_elev, TERRAIN *t)
+{
+  FILE   *fdem;
+  char   *buf;
+  int    nvalid;
+  long   size;
+
+  memset(t, 0, sizeof(TERRAIN));
+
+  if(PackedTileName(demfile, NULL, NULL))
+    return ReadPackedDEM(demfile, min_elev, t);
+
+  if((fdem=fopen(demfile,"r"))==NULL)
+    {
+      fprintf(stderr, "cannot open/read dem file,%s\n",demfile);
+      exit(1);
+    }
+
+  /* The file is read in one block and parsed in memory. */
+  fseek(fdem, 0, SEEK_END);
+  size = ftell(fdem);
+  fseek(fdem, 0, SEEK_SET);
+  if(!(buf = (char*) malloc(size+1)))
+    { printf("Cannot allocate memory to first record: buf\n");
+      exit(8);
+    }
+  size = fread(buf, 1, size, fdem);
+  buf[size] = '\0';
+  fclose(fdem);
+
+  nvalid = ParseDEM(demfile, buf, size, min_elev, t);
+  free(buf);
+  return nvalid;
+}
+
+/*****************************************************************************/
+/*   ParseDEM: ReadDEM() of a DEM file already in memory (buf, size bytes,   */
+/*   NUL terminated), e.g. from the bulk reader (BulkRead.c).                */
+/*****************************************************************************/
+int ParseDEM(char *demfile, const char *buf, size_t size, double min_elev, TERRAIN *t)
+{
+  char   tempstr[MAXSTRING];
+  const char *p;
+  int    i, j, n;
+  double **dem;
+  long   (*parse)(const char **, const char *, long, double *);
+
+  memset(t, 0, sizeof(TERRAIN));
+
+  /* check data file has data inside */
+  if (size == 0) {
+    fprintf(stderr, "DEM is empty\n");
+    exit(0);
+  }
+
+  /*----------------------------------------------*/
+  /*Scan and read in DEM's header*/
+  /*----------------------------------------------*/
+  p = buf;
+  n = 0; sscanf(p,"%s %d%n",tempstr,&t->fullcols,&n); p += n;
+  n = 0; sscanf(p,"%s %d%n",tempstr,&t->fullrows,&n); p += n;
+  n = 0; sscanf(p,"%s %lf%n",tempstr,&t->xorig,&n); p += n;
+  n = 0; sscanf(p,"%s %lf%n",tempstr,&t->yorig,&n); p += n;
+  n = 0; sscanf(p,"%s %lf%n",tempstr,&t->delta,&n); p += n;
+  n = 0; sscanf(p,"%s %lf%n",tempstr,&t->nodata,&n); p += n;
+
+  dem = Memoryalloc(t->fullcols, t->fullrows);
+
+  /* The elevations are parsed by the kernel. */
+  parse = Kernels()->ParseValues;
+  for(i=0; i<t->fullrows;i++)
+    {
+      if(parse(&p, buf+size, t->fullcols, dem[i]) < t->fullcols)
+	{
+	  fprintf(stderr, "WARNING: %s ends before the end of row %d\n", demfile, i+1);
+	  break;
+	}
+      for(j=0; j<t->fullcols; j++)
+	{
+	  if(dem[i][j] < min_elev)
+	    {
+	      dem[i][j] = t->nodata;  //check the dem file
+	    }
+	}
+    }
+
+  return CropDEM(dem, t);
+}
+
+/* ----------------------
+  ReadDEM() of a tile of a pack.  The grid is copied from the mapped pack.
+  A damaged tile (LoadPackedTile()) is read as a DEM without valid data.
+ ------------------------*/
+static int ReadPackedDEM(char *demfile, double min_elev, TERRAIN *t)
+{
+  TILEPACK  *pack;
+  PACKENTRY *e;
+  double    *data, **dem;
+  int       i, j, id;
+
+  if((pack = SharedTilePack(demfile, &id)) == NULL || (e = FindPackedTile(pack, id)) == NULL)
+    {
+      fprintf(stderr, "cannot open/read dem file,%s\n",demfile);
+      exit(1);
+    }
+  if((e->type & ~PACK_ZLIB) != PACK_GRID ||
+     e->size != (int64_t)((size_t)e->fullcols*e->fullrows*sizeof(double)))
+    {
+      fprintf(stderr, "ERROR: %s is not a DEM\n", demfile);
+      exit(1);
+    }
+  t->fullcols = e->fullcols;
+  t->fullrows = e->fullrows;
+  t->xorig = e->xorig;
+  t->yorig = e->yorig;
+  t->delta = e->delta;
+  t->nodata = e->nodata;
+
+  /* a damaged tile is a DEM without data, not the end of a server */
+  if((data = (double*) LoadPackedTile(pack, e)) == NULL)
+    return 0;
+  dem = Memoryalloc(t->fullcols, t->fullrows);
+  for(i=0; i<t->fullrows; i++)
+    for(j=0; j<t->fullcols; j++) {
+      dem[i][j] = data[(size_t)i*t->fullcols + j];
+      if(dem[i][j] < min_elev)
+	dem[i][j] = t->nodata;
+    }
+  FreePackedTile(e, data);
+
+  return CropDEM(dem, t);
+}
+
+/* ----------------------
+  Crop a DEM read by ReadDEM() to its valid data.
+ ------------------------*/
+static int CropDEM(double **dem, TERRAIN *t)
+{
+  /* Cells on the basin boundary are mostly nodata, so every later
+     phase works on the bounding box of the valid pixels and on a
+     compact list of them. */
+  t->columns = t->fullcols;
+  t->rows = t->fullrows;
+  t->nvalid = CropToValid(&dem, &t->columns, &t->rows, &t->col0, &t->row0, t->nodata);
+  t->dem = dem;
+  if(t->nvalid > 0)
+    t->valid = ValidPixels(dem, t->columns, t->rows, t->nodata, t->nvalid);
+
+  return t->nvalid;
+}
+
+/*****************************************************************************/
+/*   SetCellSize: cell size in meters for each row of the crop.              */
+/*****************************************************************************/
+void SetCellSize(TERRAIN *t, int projection)
+{
+  int    i;
+  double *lat, *lng, *newlat, *newlng;
+
+  t->projection = projection;
+  t->dx = (double*) calloc(t->rows, sizeof(double));
+  t->dy = (double*) calloc(t->rows, sizeof(double));
+  if(t->dx == NULL || t->dy == NULL)
+    { printf("Cannot allocate memory to first record: dx\n");
+      exit(8);
+    }
+
+  if(projection != PROJ_GEOGRAPHIC) {
+    for(i=0; i<t->rows; i++)
+      t->dx[i] = t->dy[i] = t->delta;
+    return;
+  }
+
+  /* Cell size shrinks away from the equator, so it is found at the
+     center of every row. */
+  lat = (double*) malloc(4*t->rows*sizeof(double));
+  if(lat == NULL)
+    { printf("Cannot allocate memory to first record: lat\n");
+      exit(8);
+    }
+  lng = lat + t->rows;
+  newlat = lng + t->rows;
+  newlng = newlat + t->rows;
+  for(i=0; i<t->rows; i++) {
+    lat[i] = t->yorig + t->delta*(t->fullrows - (t->row0 + i) - 0.5);
+    lng[i] = t->xorig + t->delta*t->fullcols/2;
+    newlat[i] = lat[i] + t->delta;
+    newlng[i] = lng[i] + t->delta;
+  }
+  Kernels()->GreatCircle(t->rows, lat, lng, lat, newlng, t->dx);
+  Kernels()->GreatCircle(t->rows, lat, lng, newlat, lng, t->dy);
+  for(i=0; i<t->rows; i++) {
+    t->dx[i] *= 1000.;
+    t->dy[i] *= 1000.;
+  }
+  free(lat);
+}
+
+/*****************************************************************************/
+/*   FillAndRoute: fill sinks and calculate multi flow accumulation.         */
+/*   Replaces dem with the filled dem and creates sink and flowacc.          */
+/*****************************************************************************/
+void FillAndRoute(TERRAIN *t)
+{
+  int      i, j;
+  FLOWGRID g;
+
+  g.lattice_size_x = t->columns;
+  g.lattice_size_y = t->rows;
+  g.nodata = t->nodata;
+
+  fillin(&g, t->dem, t->valid, t->nvalid, t->dx, t->dy);
+
+  t->sink = Memoryalloc(t->columns, t->rows);
+  t->flowacc = Memoryalloc(t->columns, t->rows);
+
+  /* Replace dem with filled dem. Plletier code indexes arrays starting at 1, so offset is needed. */
+  for (i = 0; i < t->rows; i++) {
+    for (j = 0; j < t->columns; j++){
+      t->sink[i][j] = g.topo[j+1][i+1] - t->dem[i][j];
+      t->dem[i][j] = g.topo[j+1][i+1];
+      t->flowacc[i][j] = g.flow[j+1][i+1];
+    }
+  }
+  t->products |= PROD_FILLED | PROD_SINK | PROD_FLOWACC;
+
+  free_flowgrid(&g);
+}
+
+/*****************************************************************************/
+/*   FillTerrain: fill sinks only.  Replaces dem with the filled dem and     */
+/*   creates sink, for RouteTerrain().                                       */
+/*****************************************************************************/
+void FillTerrain(TERRAIN *t)
+{
+  filldem(t, 1);
+}
+
+/* ----------------------
+  Fill sinks, and keep the depth of fill if sink is set.
+ ------------------------*/
+static void filldem(TERRAIN *t, int sink)
+{
+  int      i, j;
+  FLOWGRID g;
+
+  g.lattice_size_x = t->columns;
+  g.lattice_size_y = t->rows;
+  g.nodata = t->nodata;
+
+  fillpits(&g, t->dem, t->dx, t->dy);
+  fillsurface(&g, t->valid, t->nvalid);
+
+  if (sink) {
+    t->sink = Memoryalloc(t->columns, t->rows);
+    t->products |= PROD_SINK;
+  }
+  for (i = 0; i < t->rows; i++) {
+    for (j = 0; j < t->columns; j++){
+      if (sink) t->sink[i][j] = g.topo[j+1][i+1] - t->dem[i][j];
+      t->dem[i][j] = g.topo[j+1][i+1];
+    }
+  }
+  t->products |= PROD_FILLED;
+
+  free_flowgrid(&g);
+}
+
+/*****************************************************************************/
+/*   RouteTerrain: multi flow accumulation of a filled dem.  Only the valid  */
+/*   pixels are routed, each starting with its area plus inflow[row][col]    */
+/*   (if inflow is not NULL).  Pixels with data that are not in the valid    */
+/*   list only receive flow, so flowacc gives the flow leaving the valid     */
+/*   pixels into them.  Creates flowacc.                                     */
+/*****************************************************************************/
+void RouteTerrain(TERRAIN *t, double **inflow)
+{
+  int      i, j, k;
+  FLOWGRID g;
+
+  g.lattice_size_x = t->columns;
+  g.lattice_size_y = t->rows;
+  g.nodata = t->nodata;
+
+  fillpits(&g, t->dem, t->dx, t->dy);
+  for (i = 1; i <= t->columns; i++)
+    for (j = 1; j <= t->rows; j++)
+      g.flow[i][j] = (inflow != NULL) ? inflow[j-1][i-1] : 0.0;
+  for (k = 0; k < t->nvalid; k++) {
+    i = t->valid[k]%t->columns;
+    j = t->valid[k]/t->columns;
+    g.flow[i+1][j+1] += t->dx[j]*t->dy[j];
+  }
+  routeflow(&g, t->valid, t->nvalid);
+
+  t->flowacc = Memoryalloc(t->columns, t->rows);
+  for (i = 0; i < t->rows; i++)
+    for (j = 0; j < t->columns; j++)
+      t->flowacc[i][j] = g.flow[j+1][i+1];
+  t->products |= PROD_FLOWACC;
+
+  free_flowgrid(&g);
+}
+
+/* ----------------------
+  Lowest allowed tanbeta: 0.5 * vertical resolution of the dem over the
+  distance between centers of neighboring grid cells.
+ ------------------------*/
+double MinTanBeta(double dx, double dy)
+{
+  double length_diagonal = sqrt((pow(dx, 2)) + (pow(dy, 2)));
+
+  return (4.*((0.5 * VERTRES)/length_diagonal) +
+	  (2.0*((0.5 * VERTRES)/dx)) + (2.0*((0.5 * VERTRES)/dy)))/NNEIGHBORS;
+}
+
+/*****************************************************************************/
+/*   WetnessIndex: tanbeta, contour length and wetness index of all valid    */
+/*   pixels.  Needs FillAndRoute() first.                                    */
+/*****************************************************************************/
+void WetnessIndex(TERRAIN *t)
+{
+  slopewetness(t, PROD_SLOPE | PROD_TWI);
+}
+
+/* ----------------------
+  tanbeta, contour length and wetness index in one pass over the rows.
+  Only the products in keep (PROD_SLOPE, PROD_TWI) are stored, the others
+  go to scratch rows.  Without PROD_TWI flow accumulation is not needed.
+ ------------------------*/
+static void slopewetness(TERRAIN *t, int keep)
+{
+  KERNELS *k = Kernels();
+  int     y;
+
+  if(keep & PROD_SLOPE) {
+    if(t->tanbeta == NULL) t->tanbeta = Memoryalloc(t->columns, t->rows);
+    if(t->contour_length == NULL) t->contour_length = Memoryalloc(t->columns, t->rows);
+  }
+  if((keep & PROD_TWI) && t->wetnessindex == NULL)
+    t->wetnessindex = Memoryalloc(t->columns, t->rows);
+
+#pragma omp parallel
+  {
+    double *pad, *rows[3], *scratch;
+    int    r, x;
+
+    /* three rows padded with nodata, so the stencil needs no edge tests,
+       and scratch rows for the products not kept (and no flow) */
+    if(!(pad = (double*) malloc(3*(t->columns+2)*sizeof(double))) ||
+       !(scratch = (double*) calloc(4*t->columns, sizeof(double))))
+      { printf("Cannot allocate memory to first record: pad\n");
+	exit(8);
+      }
+    for(r=0; r<3; r++)
+      rows[r] = pad + r*(t->columns+2) + 1;
+
+#pragma omp for schedule(dynamic,16)
+    for(y=0; y<t->rows; y++) {
+      double dx = t->dx[y], dy = t->dy[y];
+
+      for(r=0; r<3; r++) {
+	rows[r][-1] = rows[r][t->columns] = t->nodata;
+	if(y+r-1 < 0 || y+r-1 >= t->rows)
+	  for(x=0; x<t->columns; x++) rows[r][x] = t->nodata;
+	else
+	  memcpy(rows[r], t->dem[y+r-1], t->columns*sizeof(double));
+      }
+      k->TwiRow(t->columns, rows[0], rows[1], rows[2],
+		(keep & PROD_TWI) ? t->flowacc[y] : scratch + 3*t->columns, t->nodata,
+		dx, dy, sqrt((pow(dx, 2)) + (pow(dy, 2))), MinTanBeta(dx, dy),
+		(keep & PROD_SLOPE) ? t->tanbeta[y] : scratch,
+		(keep & PROD_SLOPE) ? t->contour_length[y] : scratch + t->columns,
+		(keep & PROD_TWI) ? t->wetnessindex[y] : scratch + 2*t->columns);
+    }
+    free(scratch);
+    free(pad);
+  }
+  t->products |= keep;
+}
+
+/* ----------------------
+  Mean drop (elevation difference over distance) to the lower neighbours
+  with a higher wetness index, 0 where there is none.
+ ------------------------*/
+static void avedrop(TERRAIN *t)
+{
+  int xneighbor[NNEIGHBORS] = { -1, 0, 1, 1, 1, 0, -1, -1 }; /*8 neighbor*/
+  int yneighbor[NNEIGHBORS] = { 1, 1, 1, 0, -1, -1, -1, 0 }; /*8 neighbor*/
+  int    k, x, y, n, xn, yn, lower;
+  double dx, dy, length_diagonal, Delev;
+  double **dem = t->dem, **wetnessindex = t->wetnessindex;
+
+  t->avedelev = Memoryalloc(t->columns, t->rows);
+  for (k = 0; k < t->nvalid; k++)
+    {
+      y = t->valid[k] / t->columns;
+      x = t->valid[k] % t->columns;
+      dx = t->dx[y];
+      dy = t->dy[y];
+      length_diagonal = sqrt((pow(dx, 2)) + (pow(dy, 2)));
+
+      Delev = 0.0;
+      lower = 0;
+      for (n = 0; n < NNEIGHBORS; n++)
+	{
+	  xn = x + xneighbor[n];
+	  yn = y + yneighbor[n];
+	  if(xn<0 || yn<0 || xn>=t->columns || yn>=t->rows || dem[yn][xn] == t->nodata)
+	    continue;
+	  if(dem[yn][xn] < dem[y][x] && wetnessindex[yn][xn] != t->nodata &&
+	     wetnessindex[yn][xn] > wetnessindex[y][x])
+	    {
+	      if(n==0 || n==2 || n==4 || n==6)
+		Delev += (dem[y][x] - dem[yn][xn])/length_diagonal;
+	      else if(n==1||n==5)
+		Delev += (dem[y][x] - dem[yn][xn])/dy;
+	      else
+		Delev += (dem[y][x] - dem[yn][xn])/dx;
+	      lower++;
+	    }
+	}
+      t->avedelev[y][x] = (lower == 0) ? 0 : Delev/((double)lower);
+    }
+  t->products |= PROD_AVEDELEV;
+}
+
+/* ----------------------
+  Height above the nearest drainage and flow distance to the channel (the
+  products in keep, PROD_HAND and PROD_CHANDIST).  Each pixel drains to
+  its steepest lower neighbour; from every channel pixel the pixels that
+  drain to it are visited up the tree with a stack, stopping at other
+  channel pixels, so the trees of the channel pixels are disjoint.
+ ------------------------*/
+static void handdist(TERRAIN *t, int keep)
+{
+  int    xneighbor[NNEIGHBORS] = { -1, 0, 1, 1, 1, 0, -1, -1 }; /*8 neighbor*/
+  int    yneighbor[NNEIGHBORS] = { 1, 1, 1, 0, -1, -1, -1, 0 }; /*8 neighbor*/
+  double area = ChannelArea(), **dem = t->dem, **hand = NULL, **dist = NULL;
+  signed char *down;
+  int    *channel, nchannel = 0, k, y;
+
+  if(keep & PROD_HAND) t->hand = hand = Memoryalloc(t->columns, t->rows);
+  if(keep & PROD_CHANDIST) t->chandist = dist = Memoryalloc(t->columns, t->rows);
+  down = (signed char*) malloc((size_t)t->columns*t->rows);
+  channel = (int*) malloc((t->nvalid > 0 ? t->nvalid : 1)*sizeof(int));
+  if(down == NULL || channel == NULL)
+    { printf("Cannot allocate memory to first record: drainage\n");
+      exit(8);
+    }
+
+  /* steepest lower neighbour (-1 for none) of every pixel */
+#pragma omp parallel for schedule(dynamic,16)
+  for(y=0; y<t->rows; y++) {
+    double length[NNEIGHBORS], slope, best;
+    int    x, n, xn, yn;
+
+    for(n=0; n<NNEIGHBORS; n++)
+      length[n] = (n%2 == 0) ? sqrt(t->dx[y]*t->dx[y] + t->dy[y]*t->dy[y])
+	: (n == 1 || n == 5) ? t->dy[y] : t->dx[y];
+    for(x=0; x<t->columns; x++) {
+      if(hand) hand[y][x] = t->nodata;
+      if(dist) dist[y][x] = t->nodata;
+      down[(size_t)y*t->columns + x] = -1;
+      if(dem[y][x] == t->nodata)
+	continue;
+      for(n=0, best=0.; n<NNEIGHBORS; n++) {
+	xn = x + xneighbor[n];
+	yn = y + yneighbor[n];
+	if(xn<0 || yn<0 || xn>=t->columns || yn>=t->rows || dem[yn][xn] == t->nodata)
+	  continue;
+	if((slope = (dem[y][x] - dem[yn][xn])/length[n]) > best) {
+	  best = slope;
+	  down[(size_t)y*t->columns + x] = n;
+	}
+      }
+    }
+  }
+  for(k=0; k<t->nvalid; k++)
+    if(t->flowacc[t->valid[k]/t->columns][t->valid[k]%t->columns] >= area)
+      channel[nchannel++] = t->valid[k];
+
+#pragma omp parallel
+  {
+    int    *stack, size = 1024, top, p, q, n, x, y, xn, yn;
+    double z, d;
+
+    if(!(stack = (int*) malloc(size*sizeof(int))))
+      { printf("Cannot allocate memory to first record: drainage\n");
+	exit(8);
+      }
+#pragma omp for schedule(dynamic,64)
+    for(k=0; k<nchannel; k++) {
+      p = channel[k];
+      z = dem[p/t->columns][p%t->columns];
+      if(hand) hand[p/t->columns][p%t->columns] = 0.;
+      if(dist) dist[p/t->columns][p%t->columns] = 0.;
+      stack[0] = p;
+      top = 1;
+      while(top > 0) {
+	p = stack[--top];
+	y = p/t->columns;
+	x = p%t->columns;
+	d = dist ? dist[y][x] : 0.;
+	for(n=0; n<NNEIGHBORS; n++) {
+	  xn = x + xneighbor[n];
+	  yn = y + yneighbor[n];
+	  if(xn<0 || yn<0 || xn>=t->columns || yn>=t->rows)
+	    continue;
+	  q = yn*t->columns + xn;
+	  /* q drains to p, its neighbour in the opposite direction */
+	  if(down[q] != (n+4)%NNEIGHBORS || t->flowacc[yn][xn] >= area)
+	    continue;
+	  if(hand) hand[yn][xn] = dem[yn][xn] - z;
+	  if(dist) dist[yn][xn] = d + ((n%2 == 0) ? sqrt(t->dx[yn]*t->dx[yn] + t->dy[yn]*t->dy[yn])
+				       : (n == 1 || n == 5) ? t->dy[yn] : t->dx[yn]);
+	  if(top == size && !(stack = (int*) realloc(stack, (size *= 2)*sizeof(int))))
+	    { printf("Cannot allocate memory to first record: drainage\n");
+	      exit(8);
+	    }
+	  stack[top++] = q;
+	}
+      }
+    }
+    free(stack);
+  }
+  free(down);
+  free(channel);
+  t->products |= keep;
+}
+
+/*****************************************************************************/
+/*   SetChannelArea: flow accumulation (m^2) from which a pixel is a         */
+/*   channel for the HAND and channel distance products (CHANNELAREA by      */
+/*   default).  Returns the area set before.                                 */
+/*****************************************************************************/
+double SetChannelArea(double area)
+{
+  double old;
+
+#ifdef _OPENMP
+#pragma omp critical(terrainchannel)
+#endif
+  {
+    old = ChannelAreaSet;
+    if (area > 0.)
+      ChannelAreaSet = area;
+  }
+  return old;
+}
+
+double ChannelArea(void)
+{
+  double area;
+
+#ifdef _OPENMP
+#pragma omp critical(terrainchannel)
+#endif
+  area = ChannelAreaSet;
+  return area;
+}
+
+/*****************************************************************************/
+/*   ResolveTerrain: make the products asked for (PROD_* flags) that are    */
+/*   not made yet, and the products they are made from.  Only the buffers   */
+/*   of these are allocated, and the products that were only needed to      */
+/*   make others are freed as soon as their last consumer is made, e.g. a   */
+/*   run that only needs the thresholds (PROD_TWIORDER) keeps no grid but   */
+/*   the filled dem.  Products made before are kept.                        */
+/*****************************************************************************/
+void ResolveTerrain(TERRAIN *t, int products)
+{
+  int need = products, make, drop, p, n;
+
+  /* everything the products are made from, down the graph */
+  do {
+    n = need;
+    for(p=0; p<NPRODUCTS; p++)
+      if(need & (1<<p)) need |= ProductNeeds[p];
+  } while(need != n);
+  make = need & ~t->products;
+  drop = make & ~products;
+  if(make == 0 || t->nvalid == 0) return;
+
+  if((make & PROD_SINK) && (t->products & PROD_FILLED)) {
+    fprintf(stderr, "ERROR: the sink depth is only made with the filled dem\n");
+    exit(1);
+  }
+
+  /* Filled and routed in one pass when both are made. */
+  if((make & PROD_FILLED) && (make & PROD_FLOWACC))
+    FillAndRoute(t);
+  else if(make & PROD_FILLED)
+    filldem(t, make & PROD_SINK);
+  else if(make & PROD_FLOWACC)
+    RouteTerrain(t, NULL);
+  if((make & PROD_FILLED) && !(need & PROD_SINK))
+    dropgrid(t, &t->sink, PROD_SINK);
+
+  /* The slope is kept only when asked for, the wetness index until its
+     consumers are made. */
+  if(make & (PROD_SLOPE | PROD_TWI))
+    slopewetness(t, (make & PROD_TWI) | (make & ~drop & PROD_SLOPE));
+  if(make & (PROD_HAND | PROD_CHANDIST))
+    handdist(t, make & (PROD_HAND | PROD_CHANDIST));
+  if(drop & PROD_FLOWACC)
+    dropgrid(t, &t->flowacc, PROD_FLOWACC);
+
+  if(make & PROD_AVEDELEV)
+    avedrop(t);
+  if(make & PROD_TWIORDER) {
+    t->twiorder = RankValid(t, t->wetnessindex);
+    t->products |= PROD_TWIORDER;
+  }
+  if(drop & PROD_TWI)
+    dropgrid(t, &t->wetnessindex, PROD_TWI);
+}
+
+/* ----------------------
+  Free a product grid.
+ ------------------------*/
+static void dropgrid(TERRAIN *t, double ***grid, int product)
+{
+  Memoryfree(*grid, t->rows);
+  *grid = NULL;
+  t->products &= ~product;
+}
+
+/* ----------------------
+  Rank the valid pixels by value[row][column], in ascending order
+  (from low to high).
+ ------------------------*/
+ITEM *RankValid(TERRAIN *t, double **value)
+{
+  int  k, i, j;
+  ITEM *Ordered;
+
+  if(!(Ordered=(ITEM*) calloc(t->nvalid,sizeof(ITEM))))
+    {
+      printf("Cannot allocate memory to first record: Ordered\n");
+      exit(1);
+    }
+  for(k=0; k<t->nvalid; k++) {
+    i = t->valid[k] / t->columns;
+    j = t->valid[k] % t->columns;
+    Ordered[k].Rank = value[i][j];
+    Ordered[k].y = i;
+    Ordered[k].x = j;
+  }
+  quick(Ordered, t->nvalid);
+
+  return Ordered;
+}
+
+/* ----------------------
+  Map coordinates of the center of a pixel of the crop.
+ ------------------------*/
+void PixelCenter(TERRAIN *t, int row, int col, double *x, double *y)
+{
+  *x = t->xorig + t->delta*(t->col0 + col + 0.5);
+  *y = t->yorig + t->delta*(t->fullrows - (t->row0 + row) - 0.5);
+}
+
+void FreeTerrain(TERRAIN *t)
+{
+  Memoryfree(t->dem, t->rows);
+  Memoryfree(t->sink, t->rows);
+  Memoryfree(t->flowacc, t->rows);
+  Memoryfree(t->tanbeta, t->rows);
+  Memoryfree(t->contour_length, t->rows);
+  Memoryfree(t->wetnessindex, t->rows);
+  Memoryfree(t->avedelev, t->rows);
+  Memoryfree(t->hand, t->rows);
+  Memoryfree(t->chandist, t->rows);
+  free(t->twiorder);
+  free(t->valid);
+  free(t->dx);
+  free(t->dy);
+  memset(t, 0, sizeof(TERRAIN));
+}
+
+
+/* ----------------------
+  Allocate the memory
+ ------------------------*/
+double **Memoryalloc(int columns, int rows)
+{
+  int i;
+  double **arr2;
+  /*-------------- allocate memory------------*/
+  if(!(arr2 = (double**) calloc(rows,sizeof(double*))))
+    { printf("Cannot allocate memory to first record: arr2\n");
+      exit(8);
+    }
+  for(i=0; i<rows;i++)
+      if(!(arr2[i] = (double*) calloc(columns,sizeof(double))))
+	{ printf("Cannot allocate memory to first record: arr2\n");
+	  exit(8);
+	}
+
+  return arr2;
+}
+
+void Memoryfree(double **arr2, int rows)
+{
+  int i;
+
+  if(arr2 == NULL) return;
+  for(i=0; i<rows; i++)
+    free(arr2[i]);
+  free(arr2);
+}
+
+
+/* ----------------------
+  Crop the dem to the bounding box of its valid pixels, keeping a one
+  pixel nodata border where the original grid has one so that edge
+  handling in fillin() is unchanged.  Returns the number of valid pixels
+  and the offset of the crop in the original grid.
+ ------------------------*/
+int CropToValid(double ***dem, int *columns, int *rows, int *col0, int *row0, double nodata)
+{
+  int i, j, nvalid;
+  int rmin, rmax, cmin, cmax, newcols, newrows;
+  double **crop, **arr2 = *dem;
+
+  nvalid = 0;
+  rmin = *rows; rmax = -1;
+  cmin = *columns; cmax = -1;
+  for(i=0; i<*rows; i++)
+    for(j=0; j<*columns; j++)
+      if(arr2[i][j] != nodata) {
+	if(i < rmin) rmin = i;
+	if(i > rmax) rmax = i;
+	if(j < cmin) cmin = j;
+	if(j > cmax) cmax = j;
+	nvalid++;
+      }
+
+  *col0 = *row0 = 0;
+  if(nvalid == 0) return 0;
+
+  if(rmin > 0) rmin--;
+  if(cmin > 0) cmin--;
+  if(rmax < *rows-1) rmax++;
+  if(cmax < *columns-1) cmax++;
+  newrows = rmax - rmin + 1;
+  newcols = cmax - cmin + 1;
+
+  if(newrows < *rows || newcols < *columns) {
+    crop = Memoryalloc(newcols, newrows);
+    for(i=0; i<newrows; i++)
+      memcpy(crop[i], &arr2[i+rmin][cmin], newcols*sizeof(double));
+    Memoryfree(arr2, *rows);
+    *dem = crop;
+    *rows = newrows;
+    *columns = newcols;
+  }
+  *row0 = rmin;
+  *col0 = cmin;
+
+  return nvalid;
+}
+
+
+/* ----------------------
+  Sample a dem at fractional row r, column c with nearest neighbour or
+  bilinear interpolation.  Bilinear weights of nodata neighbours are
+  dropped.
+ ------------------------*/
+double SampleDEM(double **dem, int columns, int rows, double nodata,
+		 double r, double c, int method)
+{
+  int    i, j, ii, jj;
+  double fr, fc, w, wsum, vsum;
+
+  if(method == RESAMPLE_NEAREST) {
+    i = (int)floor(r + 0.5);
+    j = (int)floor(c + 0.5);
+    if(i < 0 || j < 0 || i >= rows || j >= columns) return nodata;
+    return dem[i][j];
+  }
+
+  i = (int)floor(r);
+  j = (int)floor(c);
+  fr = r - i;
+  fc = c - j;
+  wsum = vsum = 0.0;
+  for(ii=0; ii<2; ii++)
+    for(jj=0; jj<2; jj++) {
+      if(i+ii < 0 || j+jj < 0 || i+ii >= rows || j+jj >= columns) continue;
+      if(dem[i+ii][j+jj] == nodata) continue;
+      w = (ii ? fr : 1.-fr)*(jj ? fc : 1.-fc);
+      wsum += w;
+      vsum += w*dem[i+ii][j+jj];
+    }
+  if(wsum < 1.e-6) return nodata;
+  return vsum/wsum;
+}
+
+
+/* ----------------------
+  Build the row major list (row*columns+column) of valid pixels
+ ------------------------*/
+int *ValidPixels(double **dem, int columns, int rows, double nodata, int nvalid)
+{
+  int i, j, n;
+  int *valid;
+
+  if(!(valid = (int*) calloc(nvalid,sizeof(int))))
+    { printf("Cannot allocate memory to first record: valid\n");
+      exit(8);
+    }
+  n = 0;
+  for(i=0; i<rows;i++)
+    for(j=0; j<columns; j++)
+      if(dem[i][j] != nodata)
+	valid[n++] = i*columns + j;
+
+  return valid;
+}
+
+
+/*-----------------------------------------------------------------
+  Quick Sort Function: this subroutine starts the quick sort
+ ------------------------------------------------------------------*/
+void quick(ITEM *item, int count)
+{
+  qs(item,0,count-1);
+  return;
+}
+
+/*----------------------------------------------------------------
+ this is the quick sort subroutine - it returns the values in
+ an array from low to high.
+ -----------------------------------------------------------------*/
+void qs(ITEM *item, int left,  int right)
+{
+  register int i,j;
+  ITEM x,y;
+
+  i=left;
+  j=right;
+  x=item[(left+right)/2];
+
+  do {
+    while(item[i].Rank < x.Rank && i<right) i++;
+    while(x.Rank < item[j].Rank && j>left) j--;
+
+    if (i<=j)
+      {
+	y=item[i];
+	item[i]=item[j];
+	item[j]=y;
+	i++;
+	j--;
+      }
+  } while (i<=j);
+
+  if(left<j) qs(item,left,j);
+  if(i<right) qs(item,i,right);
+
+  return;
+}
+
+
+/* ------------------------------------------------------------------------
+ * Function: least-squares.c and correlation
+ * This program computes a linear model for a set of given data.
+ *
+ * PROBLEM DESCRIPTION:
+ *  The method of least squares is a standard technique used to find
+ *  the equation of a straight line from a set of data. Equation for a
+ *  straight line is given by
+ *	 y = mx + b
+ *  where m is the slope of the line and b is the y-intercept.
+ *
+ *  Given a set of n points {(x1,y1), x2,y2),...,xn,yn)}, let
+ *      SUMx = x1 + x2 + ... + xn
+ *      SUMy = y1 + y2 + ... + yn
+ *      SUMxy = x1*y1 + x2*y2 + ... + xn*yn
+ *      SUMxx = x1*x1 + x2*x2 + ... + xn*xn
+ *
+ *  The slope and y-intercept for the least-squares line can be
+ *  calculated using the following equations:
+ *        slope (m) = ( n*SUMxy -SUMx*SUMy ) / ( n*SUMxx - SUMx*SUMx )
+ *  y-intercept (b) = ( SUMy - slope*SUMx ) / n
+ *  R  = ( n*SUMxy - SUMx*SUMy ) / sqrt(( n*SUMxx - SUMx*SUMx)*(n*SUMyy - SUMy*SUMy));
+ *
+ * AUTHOR: Dora Abdullah (Fortran version, 11/96)
+ * REVISED: RYL (converted to C, 12/11/96)
+ * ADAPTED: CMC (add correlation calculation)
+ * ---------------------------------------------------------------------- */
+double correlation (double *x, double *y, int n)
+{
+  double SUMx, SUMy, SUMxy, SUMxx, SUMyy, SUMres, res, slope, y_intercept, y_estimate, cor;
+  int i;
+
+  SUMx = 0;
+  SUMy = 0;
+  SUMxy = 0;
+  SUMxx = 0;
+  SUMyy = 0;
+
+  for (i=0; i<n; i++)
+    {
+      SUMx = SUMx + x[i];
+      SUMy = SUMy + y[i];
+      SUMxy = SUMxy + x[i]*y[i];
+      SUMxx = SUMxx + x[i]*x[i];
+      SUMyy = SUMyy + y[i]*y[i];
+    }
+  slope = ( n*SUMxy -  SUMx*SUMy ) / ( n*SUMxx - SUMx*SUMx );
+  y_intercept = ( SUMy - slope*SUMx ) / n;
+  cor =   ( n*SUMxy - SUMx*SUMy ) / sqrt(( n*SUMxx - SUMx*SUMx)*(n*SUMyy - SUMy*SUMy));
+
+  SUMres = 0;
+  for (i=0; i<n ; i++)
+    {
+      y_estimate = slope*x[i] + y_intercept;
+      res = y[i] - y_estimate;
+      SUMres = SUMres + res*res;
+    }
+
+  return (cor);
+}
+
+
+/***************************************************************************/
+/*                     Fill increment                                     */
+/* Creates the filled dem matrix (topo) and flow accumulation (flow)      */
+/* size_x = columns, size_y = rows [i][j] rows:columns                    */
+/* Nodata pixels are never filled or routed, so only the valid pixels     */
+/* are visited (in row major order).                                      */
+/**************************************************************************/
+void fillin(FLOWGRID *g, double **dem, int *valid, int nvalid, double *dx, double *dy)
+{
+
+  fillpits(g, dem, dx, dy);
+  fillsurface(g, valid, nvalid);
+  routeflow(g, valid, nvalid);
+} /* End of fillin() */
+
+/* ----------------------
+  Set up the grid neighbors and the topo and flow matrices of fillin():
+  topo is the dem and flow the area of each pixel.
+ ------------------------*/
+void fillpits(FLOWGRID *g, double **dem, double *dx, double *dy)
+{
+  int i,j;
+  int lattice_size_x = g->lattice_size_x;
+  int lattice_size_y = g->lattice_size_y;
+
+  setupgridneighbors(g); /* The neighbor setting */
+
+  g->topo=matrix(1,lattice_size_x,1,lattice_size_y);
+  g->flow=matrix(1,lattice_size_x,1,lattice_size_y);
+
+  for (j=1;j<=lattice_size_y;j++) {
+    for (i=1;i<=lattice_size_x;i++)
+      {
+	g->topo[i][j] = dem[j-1][i-1];
+        g->flow[i][j]= dx[j-1]*dy[j-1];
+      } }
+}
+
+/* ----------------------
+  Route the flow of the valid pixels from the highest to the lowest of
+  the (filled) topo, adding to the flow already in the flow matrix.
+ ------------------------*/
+void routeflow(FLOWGRID *g, int *valid, int nvalid)
+{
+  int i,j,k,t,*topovecind;
+  double *topovec;
+  int lattice_size_x = g->lattice_size_x;
+  int lattice_size_y = g->lattice_size_y;
+
+  topovec=vector(1,nvalid);
+  topovecind=ivector(1,nvalid);
+
+  for (k=0; k<nvalid; k++){
+    i = valid[k]%lattice_size_x + 1;
+    j = valid[k]/lattice_size_x + 1;
+    topovec[k+1]=g->topo[i][j];
+  }
+
+  indexx(nvalid,topovec,topovecind);
+
+  /* The filled dem does not change while routing, so the flow fractions
+     of all pixels are computed first, a column at a time. */
+  if(!(g->weight[0] = (double*) malloc((size_t)NNEIGHBORS*lattice_size_x*lattice_size_y*sizeof(double))))
+    { printf("Cannot allocate memory to first record: weight\n");
+      exit(8);
+    }
+  for (k=1; k<NNEIGHBORS; k++)
+    g->weight[k] = g->weight[k-1] + (size_t)lattice_size_x*lattice_size_y;
+#pragma omp parallel for schedule(dynamic,16)
+  for (i=1;i<=lattice_size_x;i++)
+    {
+      if (lattice_size_y > 2)
+	columnweights(g, i, 2, lattice_size_y-2, 1, -1);
+      columnweights(g, i, 1, 1, g->jup[1]-1, 0);
+      if (lattice_size_y > 1)
+	columnweights(g, i, lattice_size_y, 1, 0, -1);
+    }
+
+  t=nvalid+1;
+
+  while (t>1)
+    {t--;
+      k=topovecind[t]-1;
+      i=valid[k]%lattice_size_x + 1;
+      j=valid[k]/lattice_size_x + 1;
+      mfdflowroute(g,i,j);
+    }
+
+  free(g->weight[0]);
+  free_vector(topovec,1,nvalid);
+  free_ivector(topovecind,1,nvalid);
+}
+
+
+void free_flowgrid(FLOWGRID *g)
+{
+  free_matrix(g->topo,1,g->lattice_size_x,1,g->lattice_size_y);
+  free_matrix(g->flow,1,g->lattice_size_x,1,g->lattice_size_y);
+  free_ivector(g->idown,1,g->lattice_size_x);
+  free_ivector(g->iup,1,g->lattice_size_x);
+  free_ivector(g->jup,1,g->lattice_size_y);
+  free_ivector(g->jdown,1,g->lattice_size_y);
+}
+
+
+int *ivector(long nl,long nh)
+{ /* allocate an int vector with subscript range v[nl..nh] */
+        int *v;
+
+        v=(int *)malloc((size_t) ((nh-nl+1+NR_END)*sizeof(int)));
+        return v-nl+NR_END;
+}
+
+double *vector(long nl, long nh)
+{ /* allocate a double vector with subscript range v[nl..nh] */
+        double *v;
+
+        v=(double *)malloc((size_t) ((nh-nl+1+NR_END)*sizeof(double)));
+        return v-nl+NR_END;
+}
+
+void free_ivector(int *v, long nl, long nh)
+{ /* free an int vector allocated with ivector() */
+        free((FREE_ARG) (v+nl-NR_END));
+}
+
+void free_vector(double *v, long nl, long nh)
+{ /* free a double vector allocated with vector() */
+        free((FREE_ARG) (v+nl-NR_END));
+}
+
+double **matrix(int nrl,int nrh,int ncl,int nch)
+{  /* allocate a double matrix with subscript range m[nrl..nrh][ncl..nch] */
+  int i, nrow=nrh-nrl+1,ncol=nch-ncl+1;
+  double **m;
+
+    /*allocate pointers to rows */
+    m=(double **) malloc((size_t) (nrow+1)*sizeof(double*));
+    m+=1;
+    m -= nrl;
+
+    m[nrl]=(double *) malloc((size_t)((nrow*ncol+1)*sizeof(double)));
+    m[nrl] += 1;
+    m[nrl] -= ncl;
+
+   /*allocate rows and set pointers to them */
+    for(i=nrl+1;i<=nrh;i++) {
+      m[i]=m[i-1]+ncol;
+    }
+    /* return pointer to array of pointers to rows */
+    return m;
+}
+
+void free_matrix(double **m, int nrl, int nrh, int ncl, int nch)
+{ /* free a double matrix allocated by matrix() */
+        free((FREE_ARG) (m[nrl]+ncl-NR_END));
+        free((FREE_ARG) (m+nrl-NR_END));
+}
+
+
+void indexx(int n,double arr[], int indx[])
+{
+        unsigned long i,indxt,ir=n,itemp,j,k,l=1;
+        int jstack=0,*istack;
+        double a;
+
+        istack=ivector(1,NSTACK);
+        for (j=1;j<=n;j++) indx[j]=j;
+        for (;;) {
+                if (ir-l < M) {
+                        for (j=l+1;j<=ir;j++) {
+                                indxt=indx[j];
+                                a=arr[indxt];
+                                for (i=j-1;i>=1;i--) {
+                                        if (arr[indx[i]] <= a) break;
+                                        indx[i+1]=indx[i];
+                                }
+                                indx[i+1]=indxt;
+                        }
+                        if (jstack == 0) break;
+                        ir=istack[jstack--];
+                        l=istack[jstack--];
+                } else {
+                        k=(l+ir) >> 1;
+                        SWAP(indx[k],indx[l+1]);
+                        if (arr[indx[l+1]] > arr[indx[ir]]) {
+                                SWAP(indx[l+1],indx[ir])
+                        }
+                        if (arr[indx[l]] > arr[indx[ir]]) {
+                                SWAP(indx[l],indx[ir])
+                        }
+                        if (arr[indx[l+1]] > arr[indx[l]]) {
+                                SWAP(indx[l+1],indx[l])
+                        }
+                        i=l+1;
+                        j=ir;
+                        indxt=indx[l];
+                        a=arr[indxt];
+                        for (;;) {
+                                do i++; while (arr[indx[i]] < a);
+                                do j--; while (arr[indx[j]] > a);
+                                if (j < i) break;
+                                SWAP(indx[i],indx[j])
+                        }
+                        indx[l]=indx[j];
+                        indx[j]=indxt;
+                        jstack += 2;
+                        if (ir-i+1 >= j-l) {
+                                istack[jstack]=ir;
+                                istack[jstack-1]=i;
+                                ir=j-1;
+                        } else {
+                                istack[jstack]=j-1;
+                                istack[jstack-1]=l;
+                                l=i;
+                        }
+                }
+        }
+        free_ivector(istack,1,NSTACK);
+}
+#undef M
+#undef NSTACK
+#undef SWAP
+
+
+void setupgridneighbors(FLOWGRID *g)
+{    int i,j;
+     int lattice_size_x = g->lattice_size_x;
+     int lattice_size_y = g->lattice_size_y;
+
+     g->idown=ivector(1,lattice_size_x);
+     g->iup=ivector(1,lattice_size_x);
+     g->jup=ivector(1,lattice_size_y);
+     g->jdown=ivector(1,lattice_size_y);
+
+     for (i=1;i<=lattice_size_x;i++)
+      {
+	g->idown[i]=i-1;
+	g->iup[i]=i+1;
+      }
+     g->idown[1]=1;
+
+     g->iup[lattice_size_x]=lattice_size_x;
+
+     for (j=1;j<=lattice_size_y;j++)
+      {
+	g->jdown[j]=j-1;
+	g->jup[j]=j+1;
+      }
+     g->jdown[1]=1;
+     g->jup[lattice_size_y]=lattice_size_y;
+}
+
+void fillinpitsandflats(FLOWGRID *g, int i, int j)
+{    double min;
+     double **topo = g->topo;
+     double nodata = g->nodata;
+     int *iup = g->iup, *idown = g->idown, *jup = g->jup, *jdown = g->jdown;
+
+     /* Nothing should happen if topo cell is equal to nodata.    KAC */
+     if (topo[i][j] == nodata) return;
+
+     min=topo[i][j];
+     if (topo[iup[i]][j] < min && topo[iup[i]][j] != nodata ) min=topo[iup[i]][j];
+     if (topo[idown[i]][j]<min && topo[idown[i]][j] != nodata) min=topo[idown[i]][j];
+     if (topo[i][jup[j]]<min && topo[i][jup[j]]!= nodata) min=topo[i][jup[j]];
+     if (topo[i][jdown[j]]<min && topo[i][jdown[j]] != nodata) min=topo[i][jdown[j]];
+     if (topo[iup[i]][jup[j]]<min && topo[iup[i]][jup[j]] != nodata) min=topo[iup[i]][jup[j]];
+     if (topo[idown[i]][jup[j]]<min && topo[idown[i]][jup[j]] != nodata) min=topo[idown[i]][jup[j]];
+     if (topo[idown[i]][jdown[j]]<min && topo[idown[i]][jdown[j]] != nodata) min=topo[idown[i]][jdown[j]];
+     if (topo[iup[i]][jdown[j]]<min && topo[iup[i]][jdown[j]] != nodata) min=topo[iup[i]][jdown[j]];
+
+     if ((topo[i][j] <= min)&&(i>1)&&(j>1)&&(i<g->lattice_size_x)&&(j<g->lattice_size_y))
+      {
+	topo[i][j]=min+fillincrement;
+	g->raises++;
+	fillinpitsandflats(g,i,j);
+	fillinpitsandflats(g,iup[i],j);
+	fillinpitsandflats(g,idown[i],j);
+	fillinpitsandflats(g,i,jup[j]);
+	fillinpitsandflats(g,i,jdown[j]);
+	fillinpitsandflats(g,iup[i],jup[j]);
+	fillinpitsandflats(g,idown[i],jup[j]);
+	fillinpitsandflats(g,idown[i],jdown[j]);
+	fillinpitsandflats(g,iup[i],jdown[j]);
+      }
+
+}
+
+/* ----------------------
+  Fill the pits and flats of the topo of the valid pixels with the filler
+  selected (Filler()).  Returns the filler used, FILL_RECURSIVE or
+  FILL_SWEEP.
+ ------------------------*/
+int fillsurface(FLOWGRID *g, int *valid, int nvalid)
+{
+  int    i, j, k, filler = Filler();
+  double **z;
+
+  g->raises = 0;
+  g->sweeps = 0;
+  if (filler == FILL_SWEEP) {
+    z = matrix(1,g->lattice_size_x,1,g->lattice_size_y);
+    memcpy(&z[1][1], &g->topo[1][1],
+	   (size_t)g->lattice_size_x*g->lattice_size_y*sizeof(double));
+    sweepfill(g, z);
+    free_matrix(z,1,g->lattice_size_x,1,g->lattice_size_y);
+    return filler;
+  }
+
+  for (k=0;k<nvalid;k++)
+    {
+      i = valid[k]%g->lattice_size_x + 1;
+      j = valid[k]/g->lattice_size_x + 1;
+      fillinpitsandflats(g,i,j);
+    }
+  return FILL_RECURSIVE;
+}
+
+/* ----------------------
+  Planchon-Darboux filler.  The surface w starts at the dem z at the
+  outlets (edge and nodata pixels) and infinitely high elsewhere, and is
+  lowered by sweeps over the grid, in turn in four directions, until a
+  sweep lowers nothing: a pixel is lowered to z where z is above its
+  lowest neighbour m in w, otherwise to m+fillincrement.  A line of the
+  topo (a column of the dem) is swept in blocks of FILLBLOCK pixels, the
+  neighbours in the next and last line by the FillMin kernel, then the
+  neighbours in the line in order.  The blocks run in parallel along a
+  wavefront, block b of line l at step 2l+b, which sees the same
+  neighbours as a sweep in order, so the result does not depend on the
+  threads.  Pixels no outlet drains (valid pixels surrounded by nodata)
+  are left at z.
+ ------------------------*/
+static void sweepfill(FLOWGRID *g, double **z)
+{
+  int    i, j, n, t, dir, changed, nlines, nblocks;
+  int    nx = g->lattice_size_x, ny = g->lattice_size_y;
+  double **w = g->topo;
+
+  if (nx < 3 || ny < 3)
+    return;
+  nlines = nx - 2;
+  n = ny - 2;
+  nblocks = (n + FILLBLOCK - 1)/FILLBLOCK;
+
+  for (i=2;i<nx;i++)
+    for (j=2;j<ny;j++)
+      if (w[i][j] != g->nodata)
+	w[i][j] = HUGE_VAL;
+
+  dir = 0;
+  do {
+    changed = 0;
+#pragma omp parallel private(t) reduction(+:changed)
+    {
+      double *m = (double*) malloc(FILLBLOCK*sizeof(double));
+      int    b, l, lines, inline_back;
+
+      if (m == NULL)
+	{ printf("Cannot allocate memory to first record: m\n");
+	  exit(8);
+	}
+      lines = (dir == 1 || dir == 3);
+      inline_back = (dir == 1 || dir == 2);
+      for (t=0;t<2*(nlines-1)+nblocks;t++) {
+#pragma omp for schedule(static)
+	for (b=0;b<nblocks;b++) {
+	  l = t - b;
+	  if (l < 0 || l%2 != 0 || l/2 >= nlines)
+	    continue;
+	  l /= 2;
+	  changed += sweepblock(g, z, lines ? nx-1-l : 2+l,
+				2 + (inline_back ? nblocks-1-b : b)*FILLBLOCK,
+				n, inline_back, m);
+	}
+      }
+      free(m);
+    }
+    g->sweeps++;
+    dir = (dir + 1)%4;
+  } while (changed > 0);
+
+  for (i=2;i<nx;i++)
+    for (j=2;j<ny;j++)
+      if (w[i][j] == HUGE_VAL)
+	w[i][j] = z[i][j];
+}
+
+/* ----------------------
+  One block of a sweep, the pixels of line i from j0 (up to FILLBLOCK of
+  the n inner pixels of the line), backwards if reverse.  m is scratch
+  for FILLBLOCK values.  Returns the number of pixels lowered.
+ ------------------------*/
+static int sweepblock(FLOWGRID *g, double **z, int i, int j0, int n, int reverse, double *m)
+{
+  int    j, k, len, changed = 0;
+  double **w = g->topo, nodata = g->nodata, low, a, v;
+
+  len = (n - (j0-2) < FILLBLOCK) ? n - (j0-2) : FILLBLOCK;
+  Kernels()->FillMin(len, &w[i-1][j0], &w[i+1][j0], nodata, m);
+
+  for (k=0;k<len;k++) {
+    j = reverse ? j0+len-1-k : j0+k;
+    if (z[i][j] == nodata || w[i][j] == z[i][j])
+      continue;
+    low = m[j-j0];
+    a = w[i][j-1];
+    if (a != nodata && a < low) low = a;
+    a = w[i][j+1];
+    if (a != nodata && a < low) low = a;
+    if (low == HUGE_VAL)
+      continue;
+    v = (z[i][j] > low) ? z[i][j] : low + fillincrement;
+    if (v < w[i][j]) {
+      w[i][j] = v;
+      changed++;
+    }
+  }
+  return changed;
+}
+
+/*****************************************************************************/
+/*   SetFiller: fill depressions with filler (FILL_RECURSIVE or FILL_SWEEP). */
+/*   Returns 0, and keeps the current filler, if it is not one of them.      */
+/*****************************************************************************/
+int SetFiller(int filler)
+{
+  if (filler < 0 || filler >= NFILLERS)
+    return 0;
+#ifdef _OPENMP
+#pragma omp critical(terrainfiller)
+#endif
+  FillerSet = filler;
+  return 1;
+}
+
+/*****************************************************************************/
+/*   Filler: the filler set, or the one named by TERRAIN_FILL on the first   */
+/*   call (FILL_RECURSIVE by default).                                       */
+/*****************************************************************************/
+int Filler(void)
+{
+  int filler;
+
+#ifdef _OPENMP
+#pragma omp critical(terrainfiller)
+#endif
+  {
+    if (FillerSet < 0) {
+      char *env = getenv("TERRAIN_FILL");
+
+      FillerSet = FILL_RECURSIVE;
+      if (env != NULL && env[0] != '\0') {
+	for (filler=0; filler<NFILLERS && strcmp(env, FillerNames[filler]) != 0; filler++);
+	if (filler == NFILLERS)
+	  fprintf(stderr, "WARNING: TERRAIN_FILL=%s is not one of recursive, sweep, using recursive\n", env);
+	else
+	  FillerSet = filler;
+      }
+    }
+    filler = FillerSet;
+  }
+  return filler;
+}
+
+const char *FillerName(int filler)
+{
+  return (filler >= 0 && filler < NFILLERS) ? FillerNames[filler] : "unknown";
+}
+
+/* ----------------------
+  Flow fractions of the n pixels of column i starting at row j, whose
+  up and down neighbors are dup and ddown rows away (0 at the edges).
+ ------------------------*/
+static void columnweights(FLOWGRID *g, int i, int j, int n, int dup, int ddown)
+{
+  double *zl = g->topo[g->idown[i]] + j, *zc = g->topo[i] + j, *zr = g->topo[g->iup[i]] + j;
+  const double *nb[NNEIGHBORS];
+  double *w[NNEIGHBORS];
+  size_t p = (size_t)(i-1)*g->lattice_size_y + (j-1);
+  int    k;
+
+  /* neighbors in the order of the original flow1..flow8 */
+  nb[0] = zr;        nb[1] = zl;
+  nb[2] = zc + dup;  nb[3] = zc + ddown;
+  nb[4] = zr + dup;  nb[5] = zr + ddown;
+  nb[6] = zl + dup;  nb[7] = zl + ddown;
+  for (k = 0; k < NNEIGHBORS; k++)
+    w[k] = g->weight[k] + p;
+
+  Kernels()->MfdWeights(n, zc, nb, g->nodata, MfdPower(), w);
+}
+
+/* ----------------------
+  Route the flow of pixel i,j to its lower neighbors, in proportion to
+  (drop)^1.1 with diagonal drops scaled by 1/sqrt(2).  The fractions
+  are computed by columnweights() before routing, with pow() or the
+  series of MfdPower().
+ ------------------------*/
+void mfdflowroute(FLOWGRID *g, int i, int j)
+{
+  double **flow = g->flow;
+  int    ni[NNEIGHBORS], nj[NNEIGHBORS];
+  size_t p = (size_t)(i-1)*g->lattice_size_y + (j-1);
+  double w;
+  int    n;
+
+  /* neighbors in the order of the original flow1..flow8 */
+  ni[0]=g->iup[i];   nj[0]=j;
+  ni[1]=g->idown[i]; nj[1]=j;
+  ni[2]=i;           nj[2]=g->jup[j];
+  ni[3]=i;           nj[3]=g->jdown[j];
+  ni[4]=g->iup[i];   nj[4]=g->jup[j];
+  ni[5]=g->iup[i];   nj[5]=g->jdown[j];
+  ni[6]=g->idown[i]; nj[6]=g->jup[j];
+  ni[7]=g->idown[i]; nj[7]=g->jdown[j];
+
+  for (n = 0; n < NNEIGHBORS; n++)
+    if ((w = g->weight[n][p]) > 0.)
+      flow[ni[n]][nj[n]]+=flow[i][j]*w;
+}
+
+#ifndef _E_RADIUS
+#define E_RADIUS 6371.0         /* average radius of the earth */
+#endif
+
+#ifndef _PI
+#define PI 3.1415
+#endif
+
+double get_dist(double lat1, double long1, double lat2, double long2)
+{
+  double theta1;
+  double phi1;
+  double theta2;
+  double phi2;
+  double dtor;
+  double term1;
+  double term2;
+  double term3;
+  double temp;
+  double dist;
+
+  dtor = 2.0*PI/360.0;
+  theta1 = dtor*long1;
+  phi1 = dtor*lat1;
+  theta2 = dtor*long2;
+  phi2 = dtor*lat2;
+  term1 = cos(phi1)*cos(theta1)*cos(phi2)*cos(theta2);
+  term2 = cos(phi1)*sin(theta1)*cos(phi2)*sin(theta2);
+  term3 = sin(phi1)*sin(phi2);
+  temp = term1+term2+term3;
+  temp = (double) (1.0 < temp) ? 1.0 : temp;
+  dist = E_RADIUS*acos(temp);
+
+  return dist;
+}
+
+#undef E_RADIUS
+#undef PI
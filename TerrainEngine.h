@@ -0,0 +1,372 @@
+/******************************************************************************
+   SUMMARY:
+   Shared terrain engine used by FindTWIDistribution and CreateLakeParamTisza.
+   It reads an arc/info ascii DEM of one VIC grid cell, crops it to the valid
+   data, fills sinks and calculates multiple flow direction accumulation
+   following Pelletier (2008), and computes the topographic wetness index.
+
+   The engine does not use global state, so several grids can be processed
+   in one program.
+
+   The projection of the DEM is chosen at run time:
+     PROJ_GEOGRAPHIC - DEM is in geographic coordinates (degrees), the cell
+                       size in meters is computed for every row from the
+                       great circle distance.
+     PROJ_EQUALAREA  - DEM has been projected into an equal area projection
+                       with the cell size given in meters.
+
+   REFERENCES: Jon Pelletier (2008) Quantitative Modeling of Earth Surface Processes.
+*******************************************************************************/
+#ifndef TERRAINENGINE_H
+#define TERRAINENGINE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define MAXSTRING 500
+#define NNEIGHBORS  8
+#define VERTRES 2.3       /* assumed vertical resolution of the dem (m) */
+#define OUTSIDEBASIN -99
+
+#define fillincrement 0.01
+#define oneoversqrt2 0.707106781187
+
+#define PROJ_GEOGRAPHIC 0
+#define PROJ_EQUALAREA  1
+
+/* equal area reprojection of geographic DEMs (Reproject.c) */
+#define REPROJ_LAEA    1   /* Lambert azimuthal equal area */
+#define REPROJ_ALBERS  2   /* Albers conic equal area */
+#define RESAMPLE_NEAREST  0
+#define RESAMPLE_BILINEAR 1
+#define WGS84_A  6378137.0
+#define WGS84_E2 0.00669437999014
+
+/* resampling to coarser resolutions (Resample.c) */
+#define AGG_MEAN     0
+#define AGG_MIN      1
+#define AGG_MAX      2
+#define AGG_MEDIAN   3
+#define AGG_BILINEAR 4
+
+/* instruction set levels of the kernels (TerrainKernels.c) */
+#define ISA_GENERIC 0
+#define ISA_SSE42   1
+#define ISA_AVX2    2
+#define ISA_AVX512  3
+#define NISA        4
+
+/* drop^1.1 of the MFD flow fractions by series, within a relative error
+   (SetMfdError()) */
+#define MFDTERMS    10       /* most terms of each series */
+
+/* depression fillers (TerrainEngine.c) */
+#define FILL_RECURSIVE 0     /* Pelletier, fillinpitsandflats() (default) */
+#define FILL_SWEEP     1     /* Planchon-Darboux sweeps */
+#define NFILLERS       2
+#define FILLBLOCK      512   /* pixels of a line in a block of the sweeps */
+
+/* products of a TERRAIN, as flags (ResolveTerrain()) */
+#define PROD_FILLED   0x01   /* filled dem */
+#define PROD_SINK     0x02   /* depth of fill, made with the filled dem */
+#define PROD_FLOWACC  0x04   /* flow accumulation */
+#define PROD_SLOPE    0x08   /* tanbeta and contour length */
+#define PROD_TWI      0x10   /* wetness index */
+#define PROD_AVEDELEV 0x20   /* mean drop to the lower, wetter neighbours */
+#define PROD_TWIORDER 0x40   /* valid pixels ranked by wetness index */
+#define PROD_HAND     0x80   /* height above the nearest drainage */
+#define PROD_CHANDIST 0x100  /* flow distance to the channel */
+#define NPRODUCTS     9
+#define CHANNELAREA   1.0e6  /* default flow accumulation of the channels (m^2) */
+
+/* stages of the cached DEMs (TerrainCache.c) */
+#define STAGE_PARSED 0   /* ReadDEM and SetCellSize */
+#define STAGE_ROUTED 1   /* FillAndRoute */
+#define STAGE_TWI    2   /* WetnessIndex */
+
+/* packed cell tiles (TilePack.c) */
+#define PACK_GRID    0       /* grid of doubles in row order */
+#define PACK_TEXT    1       /* text, e.g. an output table */
+#define PACK_ZLIB    0x100   /* flag: the payload is deflated */
+#define PACKCAPACITY 8192    /* tiles of a pack created by UpdateTilePack() */
+
+/* DEM error ensembles (TerrainEnsemble.c) */
+#define ENSCORR     3.0      /* default correlation length of the DEM error (pixels) */
+
+/* backends of the bulk reader (BulkRead.c) */
+#define IO_AUTO    0
+#define IO_URING   1
+#define IO_THREADS 2
+
+typedef struct
+{
+  double Rank;
+  double x;
+  double y;
+}ITEM;
+
+/* Working arrays of the Pelletier fill and route code.  Indexing
+   conventions are different than we typically use: topo begins
+   indexing at 1 not zero and topo[col][row] vs. dem[row][col]. */
+typedef struct
+{
+  int     lattice_size_x, lattice_size_y;
+  double  nodata;
+  double  **topo, **flow;
+  int     *iup, *idown, *jup, *jdown;
+  double  *weight[NNEIGHBORS]; /* flow fractions, [(i-1)*lattice_size_y + j-1] */
+  long    raises;              /* of fillinpitsandflats() */
+  int     sweeps;              /* of the sweep filler */
+} FLOWGRID;
+
+typedef struct
+{
+  /* grid as stored in the DEM file */
+  int     fullcols, fullrows;
+  double  xorig, yorig, delta, nodata;
+
+  /* working grid, cropped to the valid data */
+  int     columns, rows;       /* size of the crop */
+  int     col0, row0;          /* offset of the crop in the file grid */
+  int     nvalid, *valid;      /* row major (row*columns+column) valid pixels */
+
+  int     projection;          /* PROJ_GEOGRAPHIC or PROJ_EQUALAREA */
+  double  *dx, *dy;            /* cell size (m) of each row of the crop */
+
+  /* products, all [row][column] on the crop, NULL until made */
+  int     products;            /* PROD_* flags of the products made */
+  double  **dem;               /* elevation, filled by FillAndRoute() */
+  double  **sink;              /* depth of fill */
+  double  **flowacc;           /* upslope contributing area (m^2) */
+  double  **tanbeta;           /* local slope (tanbeta_pixel) */
+  double  **contour_length;    /* contour length */
+  double  **wetnessindex;      /* topographic wetness index */
+  double  **avedelev;          /* mean drop to the lower, wetter neighbours */
+  ITEM    *twiorder;           /* valid pixels by ascending wetness index */
+  double  **hand;              /* height above the channel the pixel drains to */
+  double  **chandist;          /* flow distance to that channel (m) */
+} TERRAIN;
+
+typedef struct
+{
+  int     type;                /* REPROJ_LAEA or REPROJ_ALBERS */
+  double  lon0, lat0;          /* projection origin (radians) */
+  double  a, e, e2;            /* ellipsoid */
+  double  qp, rq, beta1, d;    /* Lambert azimuthal constants */
+  double  n, c, rho0;          /* Albers constants */
+} PROJPARAMS;
+
+/* Series for drop^1.1 = drop*2^(0.1*log2(drop)): log2 of the mantissa by
+   the atanh series, 2^x by Taylor (TerrainKernels.c). */
+typedef struct
+{
+  double maxerr;               /* bound on the relative error of drop^1.1 */
+  int    level;                /* of the levels of TerrainKernels.c */
+  int    nlog, nexp;           /* terms of the series */
+  double clog[MFDTERMS];       /* 2/(ln 2 (2k+1)) */
+  double cexp[MFDTERMS];       /* 1/(k+1) */
+} MFDPOW;
+
+/* Hot loops compiled for one instruction set level (TerrainKernels.inc). */
+typedef struct
+{
+  int  isa;
+  void (*MfdWeights)(int n, const double *z, const double *const *nb,
+		     double nodata, const MFDPOW *pw, double *const *w);
+  void (*TwiRow)(int n, const double *up, const double *mid, const double *down,
+		 const double *flowacc, double nodata, double dx, double dy,
+		 double length_diagonal, double mintanbeta,
+		 double *tanbeta, double *contour, double *wet);
+  void (*GreatCircle)(int n, const double *lat1, const double *long1,
+		      const double *lat2, const double *long2, double *dist);
+  long (*ParseValues)(const char **s, const char *end, long n, double *out);
+  void (*FillMin)(int n, const double *up, const double *down, double nodata, double *m);
+} KERNELS;
+
+typedef struct TERRAINCACHE TERRAINCACHE;
+
+/* index entry of a packed tile, as stored in the pack (80 bytes) */
+typedef struct
+{
+  int32_t  id;                 /* cell id */
+  int32_t  type;               /* PACK_GRID or PACK_TEXT, and PACK_ZLIB */
+  int32_t  fullcols, fullrows;
+  double   xorig, yorig, delta, nodata;
+  int64_t  offset, length;     /* payload as stored in the pack */
+  int64_t  size;               /* bytes of the payload when unpacked */
+  uint32_t checksum;           /* CRC-32 of the payload as stored */
+  int32_t  unused;
+} PACKENTRY;
+
+typedef struct
+{
+  char          *name;
+  int           fd, writing, compress;
+  unsigned char *map;          /* the pack, when opened for reading */
+  size_t        mapsize;
+  int           ntiles, capacity;
+  int64_t       end;           /* end of the payloads */
+  PACKENTRY     *index;        /* sorted by cell id */
+} TILEPACK;
+
+typedef struct BULKREADER BULKREADER;
+
+/* a file of the bulk reader */
+typedef struct
+{
+  char    *name;
+  char    *buf;                /* the file, NUL terminated */
+  size_t  size;
+  int     index;               /* in the list of the bulk reader */
+  int     error;               /* errno if the file could not be read */
+} BULKFILE;
+
+typedef struct
+{
+  int     backend;             /* IO_URING or IO_THREADS */
+  long    files, ops;          /* files read, I/O operations done */
+  double  bytes, seconds;
+  double  iops, mbps;          /* achieved operations/s and MB/s */
+} IOSTATS;
+
+/* a cell DEM of a basin mosaic (TerrainTiles.c) */
+typedef struct
+{
+  char    *dem;
+  int     fullcols, fullrows;
+  double  xorig, yorig, delta, nodata;
+} TILE;
+
+typedef struct
+{
+  int     ntiles;
+  TILE    *tiles;
+  double  delta;               /* pixel size, the same for all tiles */
+  double  xmin, ymin, xmax, ymax;  /* extent of the mosaic */
+} TILESET;
+
+typedef struct
+{
+  long    hits, misses, evictions, entries;
+  size_t  bytes, budget;
+} CACHESTATS;
+
+/*--- Function Declaration---*/
+/* engine */
+int    ReadDEM(char *demfile, double min_elev, TERRAIN *t);
+int    ParseDEM(char *demfile, const char *buf, size_t size, double min_elev, TERRAIN *t);
+void   SetCellSize(TERRAIN *t, int projection);
+void   FillAndRoute(TERRAIN *t);
+void   FillTerrain(TERRAIN *t);
+void   RouteTerrain(TERRAIN *t, double **inflow);
+void   WetnessIndex(TERRAIN *t);
+void   ResolveTerrain(TERRAIN *t, int products);
+ITEM   *RankValid(TERRAIN *t, double **value);
+void   PixelCenter(TERRAIN *t, int row, int col, double *x, double *y);
+void   FreeTerrain(TERRAIN *t);
+double MinTanBeta(double dx, double dy);
+
+/* equal area reprojection */
+int    SetupProjection(PROJPARAMS *p, int type, double lon0, double lat0,
+		       double lat1, double lat2, double a, double e2);
+void   ProjForward(PROJPARAMS *p, int n, double *lon, double *lat, double *x, double *y);
+void   ProjInverse(PROJPARAMS *p, int n, double *x, double *y, double *lon, double *lat);
+int    ReprojectTerrain(TERRAIN *t, PROJPARAMS *p, double cellsize, int method);
+
+/* resolution pyramid */
+void   BuildPyramid(TERRAIN *src, int nlevels, double *factors, int method, TERRAIN *levels);
+int    ResampleTerrain(TERRAIN *src, TERRAIN *dst, double factor, int method);
+
+/* instruction set dispatch */
+KERNELS *Kernels(void);
+int    SetKernels(int isa);
+int    IsaSupported(int isa);
+const char *IsaName(int isa);
+double SetMfdError(double maxerr);
+double MfdError(void);
+const MFDPOW *MfdPower(void);
+
+/* cache of parsed, routed and wetness index DEMs */
+TERRAINCACHE *NewTerrainCache(size_t budget, int nshards);
+TERRAIN *CachedTerrain(TERRAINCACHE *c, char *demfile, double min_elev, int projection,
+		       int stage, int *hit);
+void   ReleaseTerrain(TERRAINCACHE *c, TERRAIN *t);
+void   TerrainCacheStats(TERRAINCACHE *c, CACHESTATS *stats);
+void   FreeTerrainCache(TERRAINCACHE *c);
+size_t TerrainBytes(TERRAIN *t);
+void   CopyTerrain(TERRAIN *src, TERRAIN *dst);
+
+/* packed cell tiles */
+TILEPACK *OpenTilePack(char *name);
+TILEPACK *CreateTilePack(char *name, int capacity, int compress);
+TILEPACK *UpdateTilePack(char *name, int compress);
+void   CloseTilePack(TILEPACK *p);
+PACKENTRY *FindPackedTile(TILEPACK *p, int id);
+void   *LoadPackedTile(TILEPACK *p, PACKENTRY *e);
+void   FreePackedTile(PACKENTRY *e, void *data);
+void   AddPackedTile(TILEPACK *p, PACKENTRY *e, const void *data);
+void   PutPackedTile(char *name, PACKENTRY *e, const void *data);
+int    IsTilePack(const char *name);
+int    PackedTileName(const char *name, char *pack, int *id);
+TILEPACK *SharedTilePack(const char *name, int *id);
+int    TileCellId(const char *name);
+
+/* bulk reader of many small files */
+BULKREADER *OpenBulkReader(char **names, int n, int depth, size_t budget, int backend);
+int    NextBulkFile(BULKREADER *r, BULKFILE *f);
+void   ReleaseBulkFile(BULKREADER *r, BULKFILE *f);
+void   BulkReaderStats(BULKREADER *r, IOSTATS *stats);
+void   CloseBulkReader(BULKREADER *r);
+
+/* DEM error ensembles */
+size_t NoiseBufferSize(int columns, int rows, double corrlength);
+void   NoiseField(int columns, int rows, double sigma, double corrlength, uint64_t seed,
+		  double *field, double *buf);
+void   EnsembleQuantiles(TERRAIN *t, int nreal, double sigma, double corrlength, uint64_t seed,
+			 int nlevels, const double *levels, double *q);
+
+/* halo processing of the cell DEMs of a basin */
+int    ReadTileSet(char *listfile, TILESET *ts);
+void   FreeTileSet(TILESET *ts);
+int    *TileNeighbors(TILESET *ts, int n, int halo, int *count);
+int    *TileOrder(TILESET *ts);
+int    HaloTerrain(TERRAINCACHE *c, TILESET *ts, int n, int halo, double min_elev,
+		   int projection, TERRAIN *t);
+int    RouteBasin(TERRAINCACHE *c, TILESET *ts, int halo, double min_elev, int projection,
+		  void (*done)(TILESET *ts, int n, TERRAIN *t, void *arg), void *arg);
+
+/* Pelletier fill and route */
+void   fillin(FLOWGRID *g, double **dem, int *valid, int nvalid, double *dx, double *dy);
+void   fillpits(FLOWGRID *g, double **dem, double *dx, double *dy);
+void   routeflow(FLOWGRID *g, int *valid, int nvalid);
+void   setupgridneighbors(FLOWGRID *g);
+void   fillinpitsandflats(FLOWGRID *g, int i, int j);
+int    fillsurface(FLOWGRID *g, int *valid, int nvalid);
+int    SetFiller(int filler);
+int    Filler(void);
+const char *FillerName(int filler);
+double SetChannelArea(double area);
+double ChannelArea(void);
+void   mfdflowroute(FLOWGRID *g, int i, int j);
+void   free_flowgrid(FLOWGRID *g);
+
+/* utilities */
+double **Memoryalloc(int columns, int rows);
+void   Memoryfree(double **arr2, int rows);
+int    CropToValid(double ***dem, int *columns, int *rows, int *col0, int *row0, double nodata);
+int    *ValidPixels(double **dem, int columns, int rows, double nodata, int nvalid);
+double SampleDEM(double **dem, int columns, int rows, double nodata,
+		 double r, double c, int method);
+void   quick(ITEM *item, int count);
+void   qs(ITEM *item, int left, int right);
+int    *ivector(long nl, long nh);
+double *vector(long nl, long nh);
+void   free_ivector(int *v, long nl, long nh);
+void   free_vector(double *v, long nl, long nh);
+double **matrix(int nrl, int nrh, int ncl,int nch);
+void   free_matrix(double **m, int nrl, int nrh, int ncl, int nch);
+void   indexx(int n,double arr[], int indx[]);
+double correlation(double *x, double *y, int n);
+double get_dist(double, double, double, double);
+
+#endif
@@ -0,0 +1,253 @@
+/******************************************************************************
+   SUMMARY:
+   Monte Carlo ensembles of the wetness index of a DEM with vertical error.
+   Every realisation adds a spatially correlated Gaussian error field to the
+   DEM, and is filled, routed and ranked by wetness index as the DEM itself,
+   so the uncertainty of the TWI distribution of a cell due to the DEM error
+   (VERTRES) is found in one run instead of one run per perturbed DEM.
+
+   The error fields are white Gaussian noise smoothed by three passes of a
+   box filter along the rows and then the columns (close to a Gaussian
+   kernel with a standard deviation of the correlation length), with running
+   sums, so a field costs the same whatever its correlation length.  The
+   noise is computed on a grid padded by the reach of the filter, so the
+   field is stationary up to the edges, and is scaled to the standard
+   deviation asked for with the exact variance of the filter.  The noise of
+   a pixel is a hash of the seed, the realisation and the pixel, so a
+   realisation does not depend on the threads or the order of the runs.
+
+   The realisations are shared between threads when compiled with -fopenmp,
+   each thread reusing one copy of the DEM and one noise buffer for all its
+   realisations (the parallel loops of the engine then run within the
+   thread).
+*******************************************************************************/
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "TerrainEngine.h"
+
+static inline uint64_t mix(uint64_t x)
+{
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+/* ----------------------
+  Box filter of width 2r+1 along a row of n values, in place, with the
+  first and last r values left as they are.  tmp holds n values.
+ ------------------------*/
+static void rowpass(double *v, int n, int r, double *tmp)
+{
+  double sum = 0., scale = 1./(2*r+1);
+  int    k;
+
+  if(n < 2*r+1) return;
+  memcpy(tmp, v, n*sizeof(double));
+  for(k=0; k<2*r+1; k++)
+    sum += tmp[k];
+  for(k=r; k<n-r; k++) {
+    v[k] = sum*scale;
+    if(k+r+1 < n) sum += tmp[k+r+1] - tmp[k-r];
+  }
+}
+
+/* ----------------------
+  Box filter of width 2r+1 down the columns of w x h values, in place, a
+  row at a time: the original rows in the window are kept in a ring of
+  2r+2 rows, and the running sums of all columns in sum.
+ ------------------------*/
+static void colpass(double *v, int w, int h, int r, double *ring, double *sum)
+{
+  double scale = 1./(2*r+1), *in, *out;
+  int    x, y, nring = 2*r+2;
+
+  if(h < 2*r+1) return;
+  memset(sum, 0, w*sizeof(double));
+  for(y=0; y<2*r+1; y++) {
+    memcpy(ring + (size_t)(y%nring)*w, v + (size_t)y*w, w*sizeof(double));
+    for(x=0; x<w; x++)
+      sum[x] += v[(size_t)y*w + x];
+  }
+  for(y=r; y<h-r; y++) {
+    out = v + (size_t)y*w;
+    for(x=0; x<w; x++)
+      out[x] = sum[x]*scale;
+    if(y+r+1 < h) {
+      in = ring + (size_t)((y+r+1)%nring)*w;
+      memcpy(in, v + (size_t)(y+r+1)*w, w*sizeof(double));
+      out = ring + (size_t)((y-r)%nring)*w;
+      for(x=0; x<w; x++)
+	sum[x] += in[x] - out[x];
+    }
+  }
+}
+
+/* ----------------------
+  Box radius whose three passes have a variance of about corrlength^2.
+  Sets the standard deviation of the 2D filter applied to unit white
+  noise, the sum of the squared weights of the three passes along a line.
+ ------------------------*/
+static int boxradius(double corrlength, double *sd)
+{
+  int    r = (int)floor(0.5*(sqrt(4.*corrlength*corrlength + 1.) - 1.) + 0.5), n, k, m, b;
+  double *w, *c;
+
+  *sd = 1.;
+  if(r < 1)
+    return 0;
+  n = 6*r + 1;
+  w = (double*) calloc(n, sizeof(double));
+  c = (double*) calloc(n, sizeof(double));
+  if(w == NULL || c == NULL)
+    { printf("Cannot allocate memory to first record: box weights\n");
+      exit(8);
+    }
+  for(k=0; k<2*r+1; k++)
+    w[k] = 1./(2*r+1);
+  for(m=1; m<3; m++) {
+    memset(c, 0, n*sizeof(double));
+    for(k=0; k<n; k++)
+      for(b=0; b<2*r+1 && k+b<n; b++)
+	c[k+b] += w[k]/(2*r+1);
+    memcpy(w, c, n*sizeof(double));
+  }
+  for(k=0, *sd=0.; k<n; k++)
+    *sd += w[k]*w[k];
+  free(w);
+  free(c);
+  return r;
+}
+
+/*****************************************************************************/
+/*   NoiseBufferSize: doubles of the scratch buffer of NoiseField().         */
+/*****************************************************************************/
+size_t NoiseBufferSize(int columns, int rows, double corrlength)
+{
+  double sd;
+  int    r = boxradius(corrlength, &sd), w = columns + 6*r;
+
+  return (size_t)w*(rows + 6*r) + (size_t)(2*r+4)*w;
+}
+
+/*****************************************************************************/
+/*   NoiseField: Gaussian error field of standard deviation sigma and        */
+/*   correlation length corrlength (pixels) on a columns x rows grid, in     */
+/*   row order.  buf holds NoiseBufferSize() values (NULL to allocate it     */
+/*   here).                                                                  */
+/*****************************************************************************/
+void NoiseField(int columns, int rows, double sigma, double corrlength, uint64_t seed,
+		double *field, double *buf)
+{
+  double   sd, *noise, *ring, *sum, scale, u1, u2;
+  int      r = boxradius(corrlength, &sd), p = 3*r, w = columns + 2*p, h = rows + 2*p, x, y, k;
+  uint64_t key = mix(seed), b;
+  double   *own = NULL;
+
+  if(buf == NULL &&
+     !(buf = own = (double*) malloc(NoiseBufferSize(columns, rows, corrlength)*sizeof(double))))
+    { printf("Cannot allocate memory to first record: noise\n");
+      exit(8);
+    }
+  noise = buf;
+  ring = buf + (size_t)w*h;
+  sum = ring + (size_t)(2*r+2)*w;
+
+  /* white noise, Box-Muller on the hash of the padded pixel */
+  for(y=0; y<h; y++)
+    for(x=0; x<w; x++) {
+      b = mix(key ^ ((uint64_t)y << 32 | (uint32_t)x));
+      u1 = ((b >> 11) + 0.5)*(1.0/9007199254740992.0);
+      u2 = ((mix(b) >> 11) + 0.5)*(1.0/9007199254740992.0);
+      noise[(size_t)y*w + x] = sqrt(-2.*log(u1))*cos(2.*M_PI*u2);
+    }
+
+  /* the padding is the reach of the three passes, so the field is all
+     filtered noise */
+  for(k=0; k<3 && r>0; k++) {
+    for(y=0; y<h; y++)
+      rowpass(noise + (size_t)y*w, w, r, sum);
+    colpass(noise, w, h, r, ring, sum + w);
+  }
+
+  scale = sigma/sd;
+  for(y=0; y<rows; y++)
+    for(x=0; x<columns; x++)
+      field[(size_t)y*columns + x] = scale*noise[(size_t)(y+p)*w + x + p];
+  free(own);
+}
+
+/* ----------------------
+  Free the products of a realisation, keeping its dem.
+ ------------------------*/
+static void dropproducts(TERRAIN *t)
+{
+  Memoryfree(t->sink, t->rows);
+  Memoryfree(t->flowacc, t->rows);
+  Memoryfree(t->tanbeta, t->rows);
+  Memoryfree(t->contour_length, t->rows);
+  Memoryfree(t->wetnessindex, t->rows);
+  Memoryfree(t->avedelev, t->rows);
+  Memoryfree(t->hand, t->rows);
+  Memoryfree(t->chandist, t->rows);
+  free(t->twiorder);
+  t->sink = t->flowacc = t->tanbeta = t->contour_length = t->wetnessindex = t->avedelev = NULL;
+  t->hand = t->chandist = NULL;
+  t->twiorder = NULL;
+  t->products = 0;
+}
+
+/*****************************************************************************/
+/*   EnsembleQuantiles: wetness index quantiles of nreal realisations of     */
+/*   the DEM of t (read, with its cell size set, not yet filled) with an     */
+/*   error field of standard deviation sigma (m) and correlation length      */
+/*   corrlength (pixels).  The quantile k of realisation n, the wetness      */
+/*   index above a fraction levels[k] of the valid pixels, is set in         */
+/*   q[n*nlevels + k].  t is not changed.                                    */
+/*****************************************************************************/
+void EnsembleQuantiles(TERRAIN *t, int nreal, double sigma, double corrlength, uint64_t seed,
+		       int nlevels, const double *levels, double *q)
+{
+  int n;
+
+  if(t->nvalid == 0 || nreal <= 0) return;
+
+#pragma omp parallel
+  {
+    TERRAIN r = *t;
+    double  *field, *buf;
+    int     i, j, k;
+
+    r.dem = Memoryalloc(t->columns, t->rows);
+    r.sink = r.flowacc = r.tanbeta = r.contour_length = r.wetnessindex = r.avedelev = NULL;
+    r.hand = r.chandist = NULL;
+    r.twiorder = NULL;
+    field = (double*) malloc((size_t)t->columns*t->rows*sizeof(double));
+    buf = (double*) malloc(NoiseBufferSize(t->columns, t->rows, corrlength)*sizeof(double));
+    if(field == NULL || buf == NULL)
+      { printf("Cannot allocate memory to first record: noise\n");
+	exit(8);
+      }
+
+#pragma omp for schedule(dynamic)
+    for(n=0; n<nreal; n++) {
+      NoiseField(t->columns, t->rows, sigma, corrlength, seed ^ mix((uint64_t)n + 1), field, buf);
+      for(i=0; i<t->rows; i++)
+	for(j=0; j<t->columns; j++)
+	  r.dem[i][j] = (t->dem[i][j] == t->nodata) ? t->nodata
+	    : t->dem[i][j] + field[(size_t)i*t->columns + j];
+      r.products = 0;
+      ResolveTerrain(&r, PROD_TWIORDER);
+      for(k=0; k<nlevels; k++)
+	q[(size_t)n*nlevels + k] = r.twiorder[(int)(levels[k]*(t->nvalid-1) + 0.5)].Rank;
+      dropproducts(&r);
+    }
+
+    Memoryfree(r.dem, t->rows);
+    free(field);
+    free(buf);
+  }
+}
@@ -0,0 +1,264 @@
+/******************************************************************************
+   SUMMARY:
+   Run time selection of the instruction set used by the hot loops of the
+   terrain engine (TerrainKernels.inc): MFD flow fractions, the wetness index
+   stencil, DEM number parsing, great circle distances and the line stencil
+   of the sweep filler.
+
+   The kernels are compiled for each x86 instruction set level from the same
+   source, and the best level supported by the processor (cpuid, through
+   __builtin_cpu_supports) is selected the first time Kernels() is called,
+   so one binary runs on SSE4-only nodes and uses AVX2 or AVX-512 where they
+   are available.  Other processors use the generic (compiler default) copy.
+
+   The environment variable TERRAIN_ISA (generic, sse4.2, avx2 or avx512)
+   forces a level, for testing; a level the processor does not support is
+   refused with a warning.  KernelBench times every level.
+
+   Fused multiply-add is turned off for the AVX levels so that all levels give
+   the same results as the generic copy.  Compiled with -ffast-math, the
+   compiler may use the vector pow(), cos() and acos() of glibc, which can
+   change the last bits.
+
+   The drop^1.1 of the MFD flow fractions, the dominant arithmetic of the
+   routing, is pow() by default.  SetMfdError(), or the environment
+   variable TERRAIN_MFDERR, sets a relative error (1e-3 to 1e-12) that is
+   allowed instead, and the shortest log2 and exp2 series within it
+   (MfdLevels, errors measured over drops of 1e-9 to 5000) are used; the
+   series vectorise without -ffast-math.  KernelBench -mfd gives their
+   effect on the wetness index.
+
+   Compile with -O3 -fopenmp-simd (or -fopenmp) so that the loops are
+   vectorised; -ffast-math is also needed to vectorise the MFD weights
+   with pow().
+*******************************************************************************/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "TerrainEngine.h"
+
+#define KFN(name) name##_generic
+#include "TerrainKernels.inc"
+#undef KFN
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define X86_DISPATCH
+
+#pragma GCC push_options
+#pragma GCC target("sse4.2,popcnt")
+#pragma GCC optimize("no-trapping-math")
+#define KFN(name) name##_sse42
+#include "TerrainKernels.inc"
+#undef KFN
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#pragma GCC optimize("fp-contract=off")
+#pragma GCC optimize("no-trapping-math")
+#define KFN(name) name##_avx2
+#include "TerrainKernels.inc"
+#undef KFN
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512dq,avx512vl,avx2,fma")
+#pragma GCC optimize("fp-contract=off")
+#pragma GCC optimize("no-trapping-math")
+#define KFN(name) name##_avx512
+#include "TerrainKernels.inc"
+#undef KFN
+#pragma GCC pop_options
+
+#define KERNELSET(isa, sfx) { isa, MfdWeights_##sfx, TwiRow_##sfx, GreatCircle_##sfx, ParseValues_##sfx, \
+				FillMin_##sfx }
+#else
+#define KERNELSET(isa, sfx) { isa, MfdWeights_generic, TwiRow_generic, GreatCircle_generic, ParseValues_generic, \
+				FillMin_generic }
+#endif
+
+static KERNELS KernelTable[NISA] = {
+  KERNELSET(ISA_GENERIC, generic),
+  KERNELSET(ISA_SSE42, sse42),
+  KERNELSET(ISA_AVX2, avx2),
+  KERNELSET(ISA_AVX512, avx512)
+};
+
+static const char *IsaNames[NISA] = { "generic", "sse4.2", "avx2", "avx512" };
+
+static KERNELS *Selected = NULL;
+
+/* series terms (log2, exp2) for each bound on the relative error of
+   drop^1.1, from the coarsest.  MfdWeights() has a loop for each level
+   with the same terms, so that the series are unrolled. */
+static const struct { double maxerr; int nlog, nexp; } MfdLevels[] = {
+  { 1e-3, 1, 4 },  { 1e-4, 2, 4 },  { 1e-6, 3, 6 },  { 1e-9, 5, 8 },  { 1e-12, 7, 10 }
+};
+#define NMFDLEVELS (int)(sizeof(MfdLevels)/sizeof(MfdLevels[0]))
+
+static MFDPOW MfdSeries;
+static int    MfdSet = 0;      /* MfdSeries (or pow() if maxerr is 0) set */
+
+static void mfdseries(double maxerr);
+
+const char *IsaName(int isa)
+{
+  return (isa >= 0 && isa < NISA) ? IsaNames[isa] : "unknown";
+}
+
+/*****************************************************************************/
+/*   IsaSupported: 1 if the processor runs the kernels of level isa.         */
+/*****************************************************************************/
+int IsaSupported(int isa)
+{
+  if(isa == ISA_GENERIC)
+    return 1;
+#ifdef X86_DISPATCH
+  __builtin_cpu_init();
+  switch(isa) {
+  case ISA_SSE42:
+    return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt");
+  case ISA_AVX2:
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  case ISA_AVX512:
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")
+      && __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx2")
+      && __builtin_cpu_supports("fma");
+  }
+#endif
+  return 0;
+}
+
+/*****************************************************************************/
+/*   SetKernels: use the kernels of level isa.  Returns 0, and keeps the     */
+/*   current kernels, if the processor does not support it.                  */
+/*****************************************************************************/
+int SetKernels(int isa)
+{
+  if(isa < 0 || isa >= NISA || !IsaSupported(isa))
+    return 0;
+#ifdef _OPENMP
+#pragma omp critical(terrainkernels)
+#endif
+  Selected = &KernelTable[isa];
+  return 1;
+}
+
+/*****************************************************************************/
+/*   Kernels: the kernels of the selected level, the best supported level    */
+/*   or the one set by TERRAIN_ISA on the first call.                        */
+/*****************************************************************************/
+KERNELS *Kernels(void)
+{
+  KERNELS *k;
+
+#ifdef _OPENMP
+#pragma omp critical(terrainkernels)
+#endif
+  {
+    if(Selected == NULL) {
+      char *env = getenv("TERRAIN_ISA");
+      int  isa;
+
+      for(isa=NISA-1; isa>ISA_GENERIC && !IsaSupported(isa); isa--);
+      Selected = &KernelTable[isa];
+
+      if(env != NULL && env[0] != '\0') {
+	for(isa=0; isa<NISA && strcmp(env, IsaNames[isa]) != 0; isa++);
+	if(isa == NISA)
+	  fprintf(stderr, "WARNING: TERRAIN_ISA=%s is not one of generic, sse4.2, avx2, avx512, using %s\n",
+		  env, IsaNames[Selected->isa]);
+	else if(!IsaSupported(isa))
+	  fprintf(stderr, "WARNING: TERRAIN_ISA=%s is not supported by this processor, using %s\n",
+		  env, IsaNames[Selected->isa]);
+	else
+	  Selected = &KernelTable[isa];
+      }
+    }
+    k = Selected;
+  }
+  return k;
+}
+
+/*****************************************************************************/
+/*   SetMfdError: compute drop^1.1 of the MFD flow fractions within a        */
+/*   relative error of maxerr, by the shortest series of MfdLevels within    */
+/*   it, or by pow() if maxerr is 0 or below the finest level.  Returns the  */
+/*   bound of the series used (0 for pow()).                                 */
+/*****************************************************************************/
+double SetMfdError(double maxerr)
+{
+  double bound;
+
+#ifdef _OPENMP
+#pragma omp critical(terrainmfd)
+#endif
+  {
+    mfdseries(maxerr);
+    bound = MfdSeries.maxerr;
+  }
+  return bound;
+}
+
+/*****************************************************************************/
+/*   MfdPower: the series for drop^1.1, NULL for pow().  TERRAIN_MFDERR      */
+/*   sets the error on the first call.                                       */
+/*****************************************************************************/
+const MFDPOW *MfdPower(void)
+{
+  const MFDPOW *pw;
+
+#ifdef _OPENMP
+#pragma omp critical(terrainmfd)
+#endif
+  {
+    if(!MfdSet) {
+      char   *env = getenv("TERRAIN_MFDERR"), *end;
+      double maxerr = 0.;
+
+      if(env != NULL && env[0] != '\0') {
+	maxerr = strtod(env, &end);
+	if(*end != '\0' || maxerr < 0.) {
+	  fprintf(stderr, "WARNING: TERRAIN_MFDERR=%s is not a relative error, using pow()\n", env);
+	  maxerr = 0.;
+	}
+      }
+      mfdseries(maxerr);
+    }
+    pw = (MfdSeries.maxerr > 0.) ? &MfdSeries : NULL;
+  }
+  return pw;
+}
+
+/*****************************************************************************/
+/*   MfdError: the bound on the relative error of drop^1.1 (0 for pow()).    */
+/*****************************************************************************/
+double MfdError(void)
+{
+  const MFDPOW *pw = MfdPower();
+
+  return (pw != NULL) ? pw->maxerr : 0.;
+}
+
+/* ----------------------
+  Set MfdSeries for a relative error of maxerr.
+ ------------------------*/
+static void mfdseries(double maxerr)
+{
+  int level, k;
+
+  for(level=0; level<NMFDLEVELS && MfdLevels[level].maxerr > maxerr; level++);
+  memset(&MfdSeries, 0, sizeof(MFDPOW));
+  if(maxerr > 0. && level < NMFDLEVELS) {
+    MfdSeries.maxerr = MfdLevels[level].maxerr;
+    MfdSeries.level = level;
+    MfdSeries.nlog = MfdLevels[level].nlog;
+    MfdSeries.nexp = MfdLevels[level].nexp;
+    for(k=0; k<MFDTERMS; k++) {
+      MfdSeries.clog[k] = 2./(M_LN2*(2*k + 1));
+      MfdSeries.cexp[k] = 1./(k + 1);
+    }
+  }
+  MfdSet = 1;
+}
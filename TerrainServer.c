@@ -0,0 +1,783 @@
+/******************************************************************************
+   SUMMARY:
+   This program runs the terrain engine as a local server for interactive
+   calibration tools, which ask for the wetness index products of the same
+   few VIC grid cells many times with different parameters.  FindTWI and
+   CreateLakeParamTisza read, fill and route the cell DEM on every call; the
+   server keeps the filled and routed DEMs of the most recently used cells
+   in memory (TerrainCache.c), so repeated queries are answered in
+   milliseconds.
+
+   The server listens on a UNIX domain socket.  Connections are queued and
+   served by a fixed pool of worker threads, each connection sending any
+   number of requests, one per line, and reading one reply per request.
+   The workers share a cache of up to <cache> MB of cell DEMs (least
+   recently used are dropped first).  A cached DEM is used again when the
+   file, the minimum elevation and the projection are the same and the file
+   has not been modified.  Several workers asking for the same new cell wait
+   for one fill.
+
+******************************************************************************
+   NOTES:
+
+   Requests are flat JSON objects on one line:
+     {"cell":"dem_1234.txt","product":"thresholds","p":[5,10,20]}
+   keys:
+     cell      DEM file of the cell (arc/info ascii grid, or <pack>:<cell id>),
+               as for FindTWI
+     product   info       nvalid, columns, rows, col0, row0, xorig, yorig,
+                          delta of the crop
+               thresholds wetness index exceeded by p percent of the valid
+                          pixels (default p 5,10,15,20,25,30, as FindTWI)
+               quantiles  quantiles p (0..1) of ln(TWI) (default 0.05, 0.10
+                          ... 0.95, as the FindTWI preview); "log":0 for TWI
+               lake       fraction of upland, wetland and open water pixels
+                          and mean area (m2) of the open water pixels, with
+                          the "wetland" and "water" wetness index thresholds
+                          (default those of CreateLakeParamTisza)
+               grid       one product on the crop, row major, nodata outside
+                          the valid pixels: "field" elev, twi, sink,
+                          flowacc, tanbeta or contour (default twi)
+               stats      cache hits, misses, evictions, cached DEMs, cache
+                          MB and requests served
+     proj      geographic or equalarea (default geographic)
+     min_elev  elevations below are nodata (default 0 geographic, 0.1
+               equalarea, as FindTWI)
+     reply     json (default) or binary
+
+   JSON replies are one line:
+     {"status":"ok","cached":1,"ms":0.21,"columns":6,"rows":1,"values":[...]}
+     {"status":"error","message":"..."}
+   Binary replies are a 24 byte header followed by the payload, in the byte
+   order of the server:
+     uint32 magic 0x54525256 ("TRRV"), int32 status (0 ok, 1 error),
+     int32 columns, int32 rows, uint64 payload bytes
+   the payload is columns*rows doubles, or the error message.
+
+   USAGE: TerrainServer [-workers <n>] [-cache <MB>] <socket>
+          TerrainServer -query <socket> [<request> ...]
+     socket: path of the UNIX domain socket (an old socket file is removed)
+     -workers: number of worker threads (default 4)
+     -cache: memory for the cached DEMs in MB (default 512)
+     -query: client mode, sends the requests (or the lines of the standard
+             input) and prints the replies, binary replies as text
+
+   Compile with: gcc -O3 -fopenmp-simd TerrainServer.c TerrainEngine.c TerrainKernels.c TerrainCache.c TilePack.c -lpthread -lm -o TerrainServer
+
+   COMMENTS:
+   A worker serves one connection until it is closed, so clients should not
+   keep idle connections open when there are more clients than workers.
+   Errors in the DEM itself (bad header, out of memory) stop the server as
+   they stop FindTWI.
+
+*******************************************************************************/
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include "TerrainEngine.h"
+
+#define MAXREQUEST   65536
+#define MAXPARAMS    64
+#define MAXQUEUE     256
+#define REPLYMAGIC   0x54525256
+#define WETLANDTHRESH 13552      /* as CreateLakeParamTisza */
+#define WATERTHRESH  216623
+
+#define PROD_INFO       0
+#define PROD_THRESHOLDS 1
+#define PROD_QUANTILES  2
+#define PROD_LAKE       3
+#define PROD_GRID       4
+#define PROD_STATS      5
+
+char *ProductNames[] = { "info", "thresholds", "quantiles", "lake", "grid", "stats", NULL };
+char *FieldNames[] = { "elev", "twi", "sink", "flowacc", "tanbeta", "contour", NULL };
+
+/* Connections waiting for a worker. */
+typedef struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t  ready;
+  int     fd[MAXQUEUE];
+  int     first, n;
+} QUEUE;
+
+typedef struct
+{
+  char    cell[MAXSTRING];
+  int     product;
+  int     projection;
+  double  min_elev;
+  int     binary;
+  int     field;
+  int     log;
+  int     np;
+  double  p[MAXPARAMS];
+  double  wetland, water;
+} REQUEST;
+
+TERRAINCACHE *Cache;
+QUEUE Queue;
+long Requests;
+
+/*--- Function Declaration---*/
+void   Serve(char *path, int workers, double mb);
+void   *Worker(void *arg);
+void   Connection(int fd);
+int    ParseRequest(char *line, REQUEST *r, char *message);
+int    Product(REQUEST *r, TERRAIN *t, double **values, int *columns, int *rows, char *message);
+void   Reply(FILE *fo, REQUEST *r, int status, int cached, double ms, double *values,
+	     int columns, int rows, char *message);
+int    Query(char *path, int nreq, char **requests);
+int    Lookup(char *name, char **names);
+double Elapsed(struct timespec *start);
+void   Usage(char *name);
+
+int main(int argc, char *argv[])
+{
+  int    i, workers = 4;
+  double mb = 512;
+
+  if (argc > 2 && strcmp(argv[1], "-query") == 0)
+    return Query(argv[2], argc-3, argv+3);
+
+  for (i = 1; i < argc-1; i++) {
+    if (strcmp(argv[i], "-workers") == 0 && i+1 < argc-1)
+      workers = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-cache") == 0 && i+1 < argc-1)
+      mb = atof(argv[++i]);
+    else {
+      fprintf(stderr, "ERROR - No such option.\n");
+      Usage(argv[0]);
+    }
+  }
+  if (argc < 2 || argv[argc-1][0] == '-' || workers < 1 || mb <= 0)
+    Usage(argv[0]);
+
+  Serve(argv[argc-1], workers, mb);
+  return (0);
+}
+
+void Usage(char *name)
+{
+  fprintf(stderr, "Usage: %s [-workers <n>] [-cache <MB>] <socket>\n", name);
+  fprintf(stderr, "       %s -query <socket> [<request> ...]\n", name);
+  fprintf(stderr, "\t\t socket : path of the UNIX domain socket;\n");
+  fprintf(stderr, "\t\t -workers : number of worker threads (default 4);\n");
+  fprintf(stderr, "\t\t -cache : memory for the cached DEMs in MB (default 512);\n");
+  fprintf(stderr, "\t\t request : one line JSON request, e.g. {\"cell\":\"dem.txt\",\"product\":\"thresholds\"}.\n");
+  exit(0);
+}
+
+/* ----------------------
+  Listen on the socket and hand the connections to the workers.
+ ------------------------*/
+void Serve(char *path, int workers, double mb)
+{
+  struct sockaddr_un addr;
+  pthread_t *threads;
+  int       listener, fd, i;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "socket path is too long,%s\n", path);
+    exit(1);
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if ((listener = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+      bind(listener, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+      listen(listener, MAXQUEUE) < 0) {
+    fprintf(stderr, "cannot open socket,%s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  /* The kernels are chosen before the workers start. */
+  Kernels();
+
+  Cache = NewTerrainCache((size_t) (mb * 1048576.0), workers);
+  memset(&Queue, 0, sizeof(QUEUE));
+  pthread_mutex_init(&Queue.lock, NULL);
+  pthread_cond_init(&Queue.ready, NULL);
+
+  if (!(threads = (pthread_t *) calloc(workers, sizeof(pthread_t)))) {
+    printf("Cannot allocate memory to first record: threads\n");
+    exit(8);
+  }
+  for (i = 0; i < workers; i++)
+    if (pthread_create(&threads[i], NULL, Worker, NULL) != 0) {
+      fprintf(stderr, "cannot start worker %d\n", i);
+      exit(1);
+    }
+  fprintf(stderr, "TerrainServer listening on %s, %d workers, %g MB cache\n", path, workers, mb);
+
+  for (;;) {
+    if ((fd = accept(listener, NULL, NULL)) < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "cannot accept connection: %s\n", strerror(errno));
+      exit(1);
+    }
+    pthread_mutex_lock(&Queue.lock);
+    if (Queue.n == MAXQUEUE) {
+      pthread_mutex_unlock(&Queue.lock);
+      close(fd);
+      continue;
+    }
+    Queue.fd[(Queue.first + Queue.n) % MAXQUEUE] = fd;
+    Queue.n++;
+    pthread_cond_signal(&Queue.ready);
+    pthread_mutex_unlock(&Queue.lock);
+  }
+}
+
+void *Worker(void *arg)
+{
+  int fd;
+
+  (void) arg;
+
+  for (;;) {
+    pthread_mutex_lock(&Queue.lock);
+    while (Queue.n == 0)
+      pthread_cond_wait(&Queue.ready, &Queue.lock);
+    fd = Queue.fd[Queue.first];
+    Queue.first = (Queue.first + 1) % MAXQUEUE;
+    Queue.n--;
+    pthread_mutex_unlock(&Queue.lock);
+
+    Connection(fd);
+  }
+  return NULL;
+}
+
+/* ----------------------
+  Answer the requests of one connection until it is closed.
+ ------------------------*/
+void Connection(int fd)
+{
+  FILE    *fi, *fo;
+  char    *line, message[MAXSTRING];
+  REQUEST r;
+  TERRAIN *t;
+  CACHESTATS stats;
+  double  *values;
+  int     columns, rows, cached, status;
+  struct timespec start;
+
+  fi = fdopen(fd, "r");
+  fo = fdopen(dup(fd), "w");
+  if (fi == NULL || fo == NULL || !(line = (char *) malloc(MAXREQUEST))) {
+    printf("Cannot allocate memory to first record: connection\n");
+    exit(8);
+  }
+
+  while (fgets(line, MAXREQUEST, fi) != NULL) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    values = NULL;
+    columns = rows = cached = 0;
+    t = NULL;
+    message[0] = '\0';
+
+    status = ParseRequest(line, &r, message);
+    if (status == 0 && r.product == PROD_STATS) {
+      if (!(values = (double *) malloc(6 * sizeof(double)))) {
+	printf("Cannot allocate memory to first record: values\n");
+	exit(8);
+      }
+      TerrainCacheStats(Cache, &stats);
+      values[0] = stats.hits;
+      values[1] = stats.misses;
+      values[2] = stats.evictions;
+      values[3] = stats.entries;
+      values[4] = stats.bytes / 1048576.0;
+      values[5] = __sync_add_and_fetch(&Requests, 1);
+      columns = 6;
+      rows = 1;
+    }
+    else if (status == 0) {
+      __sync_add_and_fetch(&Requests, 1);
+      if ((t = CachedTerrain(Cache, r.cell, r.min_elev, r.projection, STAGE_TWI, &cached)) == NULL) {
+	sprintf(message, "cannot open/read dem file,%.400s", r.cell);
+	status = 1;
+      }
+      else
+	status = Product(&r, t, &values, &columns, &rows, message);
+    }
+    Reply(fo, &r, status, cached, Elapsed(&start), values, columns, rows, message);
+    if (t != NULL) ReleaseTerrain(Cache, t);
+    free(values);
+    if (fflush(fo) != 0) break;
+  }
+
+  free(line);
+  fclose(fi);
+  fclose(fo);
+}
+
+/* ----------------------
+  Four hex digits of a \u escape at p, -1 if they are not all there.
+ ------------------------*/
+static long HexEscape(const char *p)
+{
+  long c = 0;
+  int  k;
+
+  for (k = 0; k < 4; k++) {
+    if (!isxdigit((unsigned char)p[k])) return -1;
+    c = 16*c + (isdigit((unsigned char)p[k]) ? p[k] - '0' : tolower((unsigned char)p[k]) - 'a' + 10);
+  }
+  return c;
+}
+
+/* ----------------------
+  Read a JSON string starting at the opening quote, returns the position
+  after the closing quote, or NULL if it is not terminated or has a bad
+  \u escape (cut short, a lone surrogate or \u0000).  \u escapes are
+  written as UTF-8.
+ ------------------------*/
+static char *JsonString(char *p, char *out, int maxlen)
+{
+  char utf[4];
+  long c, lo;
+  int  n = 0, len, k;
+
+  for (p++; *p && *p != '"'; p++) {
+    if (*p == '\\' && p[1]) {
+      p++;
+      if (*p == 'n') *p = '\n';
+      else if (*p == 't') *p = '\t';
+      else if (*p == 'u') {
+	if ((c = HexEscape(p+1)) <= 0 || (c >= 0xdc00 && c < 0xe000))
+	  return NULL;
+	p += 4;
+	if (c >= 0xd800 && c < 0xdc00) {
+	  /* high surrogate, the low one must follow */
+	  if (p[1] != '\\' || p[2] != 'u' || (lo = HexEscape(p+3)) < 0xdc00 || lo >= 0xe000)
+	    return NULL;
+	  c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+	  p += 6;
+	}
+	if (c < 0x80) { utf[0] = c; len = 1; }
+	else if (c < 0x800) { utf[0] = 0xc0 | (c >> 6); utf[1] = 0x80 | (c & 0x3f); len = 2; }
+	else if (c < 0x10000) {
+	  utf[0] = 0xe0 | (c >> 12); utf[1] = 0x80 | ((c >> 6) & 0x3f);
+	  utf[2] = 0x80 | (c & 0x3f); len = 3;
+	}
+	else {
+	  utf[0] = 0xf0 | (c >> 18); utf[1] = 0x80 | ((c >> 12) & 0x3f);
+	  utf[2] = 0x80 | ((c >> 6) & 0x3f); utf[3] = 0x80 | (c & 0x3f); len = 4;
+	}
+	if (n + len < maxlen)
+	  for (k = 0; k < len; k++) out[n++] = utf[k];
+	continue;
+      }
+    }
+    if (n < maxlen-1) out[n++] = *p;
+  }
+  out[n] = '\0';
+  return (*p == '"') ? p+1 : NULL;
+}
+
+/* ----------------------
+  Parse a flat JSON request.  Returns 0, or 1 with an error message.
+ ------------------------*/
+int ParseRequest(char *line, REQUEST *r, char *message)
+{
+  char *p, *end, key[MAXSTRING], value[MAXSTRING];
+  int  n, proj = 0;
+
+  memset(r, 0, sizeof(REQUEST));
+  r->product = -1;
+  r->min_elev = -1;
+  r->field = 1;
+  r->log = 1;
+  r->wetland = WETLANDTHRESH;
+  r->water = WATERTHRESH;
+
+  for (p = line; *p && *p != '{'; p++);
+  if (*p != '{') {
+    strcpy(message, "request is not a JSON object");
+    return 1;
+  }
+
+  while (*p) {
+    if (*p != '"') { p++; continue; }
+    if ((p = JsonString(p, key, MAXSTRING)) == NULL) {
+      strcpy(message, "unterminated string or bad \\u escape");
+      return 1;
+    }
+    while (isspace(*p) || *p == ':') p++;
+
+    if (*p == '[') {
+      /* list of numbers, only p */
+      for (p++; *p && *p != ']'; ) {
+	double v = strtod(p, &end);
+	if (end == p) { p++; continue; }
+	if (strcmp(key, "p") == 0 && r->np < MAXPARAMS)
+	  r->p[r->np++] = v;
+	p = end;
+      }
+      if (*p) p++;
+      continue;
+    }
+    if (*p == '"') {
+      if ((p = JsonString(p, value, MAXSTRING)) == NULL) {
+	strcpy(message, "unterminated string or bad \\u escape");
+	return 1;
+      }
+    }
+    else {
+      n = 0;
+      while (*p && *p != ',' && *p != '}' && !isspace(*p) && n < MAXSTRING-1)
+	value[n++] = *p++;
+      value[n] = '\0';
+    }
+
+    if (strcmp(key, "cell") == 0) strcpy(r->cell, value);
+    else if (strcmp(key, "product") == 0) {
+      if ((r->product = Lookup(value, ProductNames)) < 0) {
+	sprintf(message, "no such product %.100s", value);
+	return 1;
+      }
+    }
+    else if (strcmp(key, "proj") == 0) {
+      if (strcmp(value, "geographic") == 0) proj = PROJ_GEOGRAPHIC;
+      else if (strcmp(value, "equalarea") == 0) proj = PROJ_EQUALAREA;
+      else {
+	sprintf(message, "no such projection %.100s", value);
+	return 1;
+      }
+    }
+    else if (strcmp(key, "field") == 0) {
+      if ((r->field = Lookup(value, FieldNames)) < 0) {
+	sprintf(message, "no such field %.100s", value);
+	return 1;
+      }
+    }
+    else if (strcmp(key, "reply") == 0) r->binary = (strcmp(value, "binary") == 0);
+    else if (strcmp(key, "min_elev") == 0) r->min_elev = atof(value);
+    else if (strcmp(key, "log") == 0) r->log = (atoi(value) != 0 || strcmp(value, "true") == 0);
+    else if (strcmp(key, "wetland") == 0) r->wetland = atof(value);
+    else if (strcmp(key, "water") == 0) r->water = atof(value);
+  }
+
+  r->projection = proj;
+  if (r->min_elev < 0)
+    r->min_elev = (proj == PROJ_EQUALAREA) ? 0.1 : 0.0;
+  if (r->product < 0) {
+    strcpy(message, "request has no product");
+    return 1;
+  }
+  if (r->product != PROD_STATS && r->cell[0] == '\0') {
+    strcpy(message, "request has no cell");
+    return 1;
+  }
+  return 0;
+}
+
+int Lookup(char *name, char **names)
+{
+  int i;
+
+  for (i = 0; names[i] != NULL; i++)
+    if (strcmp(name, names[i]) == 0) return i;
+  return -1;
+}
+
+/* ----------------------
+  k-th smallest of n values (quickselect), reorders the values.
+ ------------------------*/
+static double Select(double *v, int n, int k)
+{
+  int    left = 0, right = n-1, i, j;
+  double pivot, tmp;
+
+  while (left < right) {
+    pivot = v[(left+right)/2];
+    i = left;
+    j = right;
+    do {
+      while (v[i] < pivot) i++;
+      while (pivot < v[j]) j--;
+      if (i <= j) {
+	tmp = v[i]; v[i] = v[j]; v[j] = tmp;
+	i++;
+	j--;
+      }
+    } while (i <= j);
+    if (k <= j) right = j;
+    else if (k >= i) left = i;
+    else break;
+  }
+  return v[k];
+}
+
+/* ----------------------
+  Compute the product of a request.  Returns 0, or 1 with an error
+  message.
+ ------------------------*/
+int Product(REQUEST *r, TERRAIN *t, double **values, int *columns, int *rows, char *message)
+{
+  double  *v, *w, **field, p;
+  int     i, k, x, y, n, count = t->nvalid;
+  double  upland, wetland, water, waterArea, twi;
+
+  if (count == 0) {
+    sprintf(message, "no valid value in this grid,%.400s", r->cell);
+    return 1;
+  }
+
+  n = (r->product == PROD_GRID) ? t->columns * t->rows : (r->np > 0) ? r->np : 19;
+  if (n < 8) n = 8;
+  if (!(v = (double *) malloc(n * sizeof(double)))) {
+    printf("Cannot allocate memory to first record: values\n");
+    exit(8);
+  }
+  *values = v;
+  *rows = 1;
+
+  /* wetness index of the valid pixels, for the order statistics */
+  w = NULL;
+  if (r->product == PROD_THRESHOLDS || r->product == PROD_QUANTILES) {
+    if (!(w = (double *) malloc(count * sizeof(double)))) {
+      printf("Cannot allocate memory to first record: w\n");
+      exit(8);
+    }
+    for (k = 0; k < count; k++)
+      w[k] = t->wetnessindex[t->valid[k] / t->columns][t->valid[k] % t->columns];
+  }
+
+  switch (r->product) {
+  case PROD_INFO:
+    v[0] = t->nvalid;
+    v[1] = t->columns;
+    v[2] = t->rows;
+    v[3] = t->col0;
+    v[4] = t->row0;
+    v[5] = t->xorig;
+    v[6] = t->yorig;
+    v[7] = t->delta;
+    *columns = 8;
+    break;
+
+  case PROD_THRESHOLDS:
+    /* as PrintThresholds of FindTWI */
+    if (r->np == 0)
+      for (r->np = 0; r->np < 6; r->np++) r->p[r->np] = 5 * (r->np+1);
+    for (i = 0; i < r->np; i++) {
+      k = (int) (r->p[i] / 100.0 * (float) count);
+      if (k < 0) k = 0;
+      if (k > count-1) k = count-1;
+      v[i] = Select(w, count, count-1-k);
+    }
+    *columns = r->np;
+    break;
+
+  case PROD_QUANTILES:
+    /* as CellQuantiles of FindTWI */
+    if (r->np == 0)
+      for (r->np = 0; r->np < 19; r->np++) r->p[r->np] = 0.05 * (r->np+1);
+    for (i = 0; i < r->np; i++) {
+      p = r->p[i];
+      if (p < 0) p = 0;
+      if (p > 1) p = 1;
+      twi = Select(w, count, (int) (p * (count-1) + 0.5));
+      v[i] = r->log ? log(twi) : twi;
+    }
+    *columns = r->np;
+    break;
+
+  case PROD_LAKE:
+    /* classes of Topindex in CreateLakeParamTisza */
+    upland = wetland = water = waterArea = 0;
+    for (k = 0; k < count; k++) {
+      y = t->valid[k] / t->columns;
+      x = t->valid[k] % t->columns;
+      twi = t->wetnessindex[y][x];
+      if (twi == t->nodata) continue;
+      if (twi >= r->water) {
+	water++;
+	waterArea += t->dx[y] * t->dy[y];
+      }
+      else if (twi >= r->wetland) wetland++;
+      else upland++;
+    }
+    if (water > 0) waterArea /= water;
+    n = upland + wetland + water;
+    v[0] = (n > 0) ? upland / n : 0;
+    v[1] = (n > 0) ? wetland / n : 0;
+    v[2] = (n > 0) ? water / n : 0;
+    v[3] = waterArea;
+    *columns = 4;
+    break;
+
+  case PROD_GRID:
+    switch (r->field) {
+    case 0: field = t->dem; break;
+    case 2: field = t->sink; break;
+    case 3: field = t->flowacc; break;
+    case 4: field = t->tanbeta; break;
+    case 5: field = t->contour_length; break;
+    default: field = t->wetnessindex; break;
+    }
+    for (k = 0; k < t->columns * t->rows; k++)
+      v[k] = t->nodata;
+    for (k = 0; k < count; k++) {
+      y = t->valid[k] / t->columns;
+      x = t->valid[k] % t->columns;
+      v[t->valid[k]] = field[y][x];
+    }
+    *columns = t->columns;
+    *rows = t->rows;
+    break;
+  }
+  free(w);
+  return 0;
+}
+
+/* ----------------------
+  Write the reply of a request, JSON or binary.
+ ------------------------*/
+void Reply(FILE *fo, REQUEST *r, int status, int cached, double ms, double *values,
+	   int columns, int rows, char *message)
+{
+  uint32_t magic = REPLYMAGIC;
+  int32_t  head[3];
+  uint64_t nbytes;
+  char     *c;
+  long     k, n = (long) columns * rows;
+
+  if (r->binary) {
+    head[0] = status;
+    head[1] = status ? 0 : columns;
+    head[2] = status ? 0 : rows;
+    nbytes = status ? strlen(message) : n * sizeof(double);
+    fwrite(&magic, sizeof(magic), 1, fo);
+    fwrite(head, sizeof(int32_t), 3, fo);
+    fwrite(&nbytes, sizeof(nbytes), 1, fo);
+    if (status) fwrite(message, 1, nbytes, fo);
+    else fwrite(values, sizeof(double), n, fo);
+    return;
+  }
+
+  if (status) {
+    fprintf(fo, "{\"status\":\"error\",\"message\":\"");
+    for (c = message; *c; c++) {
+      if (*c == '"' || *c == '\\') fputc('\\', fo);
+      fputc(*c, fo);
+    }
+    fprintf(fo, "\"}\n");
+    return;
+  }
+  fprintf(fo, "{\"status\":\"ok\",\"cached\":%d,\"ms\":%.3f,\"columns\":%d,\"rows\":%d,\"values\":[",
+	  cached, ms, columns, rows);
+  for (k = 0; k < n; k++)
+    fprintf(fo, (k > 0) ? ",%.10g" : "%.10g", values[k]);
+  fprintf(fo, "]}\n");
+}
+
+double Elapsed(struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) * 1e-6;
+}
+
+/* ----------------------
+  Client mode: send the requests and print the replies.
+ ------------------------*/
+int Query(char *path, int nreq, char **requests)
+{
+  struct sockaddr_un addr;
+  FILE     *fi, *fo;
+  char     line[MAXREQUEST], *msg, *reply = NULL;
+  size_t   size = 0;
+  int      fd, i, more;
+  uint32_t magic;
+  int32_t  head[3];
+  uint64_t nbytes, k;
+  double   v;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+      connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    fprintf(stderr, "cannot open socket,%s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  fi = fdopen(fd, "r");
+  fo = fdopen(dup(fd), "w");
+
+  for (i = 0; ; i++) {
+    if (nreq > 0) {
+      if (i == nreq) break;
+      snprintf(line, MAXREQUEST, "%s\n", requests[i]);
+    }
+    else if (fgets(line, MAXREQUEST, stdin) == NULL)
+      break;
+    if (strspn(line, " \t\r\n") == strlen(line)) continue;
+    fputs(line, fo);
+    if (line[strlen(line)-1] != '\n') fputc('\n', fo);
+    fflush(fo);
+
+    /* A binary reply starts with the magic number, JSON with '{' (a
+       JSON reply has no length limit, the grid of a large cell) */
+    if ((more = fgetc(fi)) == EOF) {
+      fprintf(stderr, "no reply from %s\n", path);
+      exit(1);
+    }
+    ungetc(more, fi);
+    if (more == '{') {
+      if (getline(&reply, &size, fi) < 0) {
+	fprintf(stderr, "bad reply from %s\n", path);
+	exit(1);
+      }
+      fputs(reply, stdout);
+      continue;
+    }
+    if (fread(&magic, sizeof(magic), 1, fi) != 1 || magic != REPLYMAGIC ||
+	fread(head, sizeof(int32_t), 3, fi) != 3 || fread(&nbytes, sizeof(nbytes), 1, fi) != 1) {
+      fprintf(stderr, "bad reply from %s\n", path);
+      exit(1);
+    }
+    if (head[0]) {
+      if (!(msg = (char *) calloc(nbytes+1, 1)) || fread(msg, 1, nbytes, fi) != nbytes) {
+	fprintf(stderr, "bad reply from %s\n", path);
+	exit(1);
+      }
+      printf("error %s\n", msg);
+      free(msg);
+      continue;
+    }
+    printf("ok %d %d", head[1], head[2]);
+    for (k = 0; k < nbytes / sizeof(double); k++) {
+      if (fread(&v, sizeof(double), 1, fi) != 1) {
+	fprintf(stderr, "bad reply from %s\n", path);
+	exit(1);
+      }
+      printf(" %.10g", v);
+    }
+    printf("\n");
+  }
+
+  free(reply);
+  fclose(fo);
+  fclose(fi);
+  return (0);
+}
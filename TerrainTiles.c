@@ -0,0 +1,806 @@
+/******************************************************************************
+   SUMMARY:
+   Processing of the cell DEMs of a basin as tiles of one mosaic.  A cell
+   DEM filled and routed alone loses the flow that enters it from the
+   upslope cells, and the pixels on its edges get artificial pits.  Here a
+   cell is filled and routed on a window made of the cell and a ring of
+   <halo> pixels taken from the adjacent cell DEMs, and only the products
+   of the cell itself (the core) are kept.  A halo of a few hundred pixels
+   brings in most of the local inflow without holding the whole basin in
+   memory.
+
+   The window does not go past the extent of the mosaic.  Pixels on the
+   edge of a grid are outlets in fillin(), and nodata pixels are not, so
+   the edges of the mosaic drain as they do when the whole basin is one
+   DEM, and the window of a cell on the edge of the basin is not closed by
+   a ring of nodata.
+
+   The tiles are found from the headers of the DEMs of a cell list, and
+   must have the same pixel size and be aligned on the same grid.  The
+   cell list may also be a pack of cell DEMs (TilePack.c).  The
+   parsed DEMs of the core and its neighbours come from the shared DEM
+   cache (TerrainCache.c), so a neighbour is read once while it is used by
+   the halos of the cells around it.  TileOrder() gives an order of the
+   cells (rows of tiles, alternately west to east and east to west) in
+   which consecutive cells share most of their neighbours.
+
+   RouteBasin() routes the whole basin instead: the cells are filled on
+   their halo windows, then routed one at a time from upstream to
+   downstream, passing only the flow across the cell edges.
+*******************************************************************************/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "TerrainEngine.h"
+
+#define MAXSWEEPS      100     /* routing sweeps of a cycle of tiles */
+#define SWEEPTOLERANCE 1.e-12  /* change of the outflow that ends the sweeps */
+
+/* ----------------------
+  Georeference of a DEM file or of a tile of a pack.
+ ------------------------*/
+static void TileHeader(char *name, TILE *tile)
+{
+  FILE      *fd;
+  char      tempstr[MAXSTRING];
+  TILEPACK  *pack;
+  PACKENTRY *e;
+  int       id;
+
+  if(PackedTileName(name, NULL, NULL)) {
+    if((pack = SharedTilePack(name, &id)) == NULL || (e = FindPackedTile(pack, id)) == NULL)
+      {
+	fprintf(stderr, "cannot open/read dem file,%s\n",name);
+	exit(1);
+      }
+    tile->fullcols = e->fullcols;
+    tile->fullrows = e->fullrows;
+    tile->xorig = e->xorig;
+    tile->yorig = e->yorig;
+    tile->delta = e->delta;
+    tile->nodata = e->nodata;
+    return;
+  }
+  if((fd=fopen(name,"r"))==NULL)
+    {
+      fprintf(stderr, "cannot open/read dem file,%s\n",name);
+      exit(1);
+    }
+  if(fscanf(fd,"%s %d",tempstr,&tile->fullcols) != 2 ||
+     fscanf(fd,"%s %d",tempstr,&tile->fullrows) != 2 ||
+     fscanf(fd,"%s %lf",tempstr,&tile->xorig) != 2 ||
+     fscanf(fd,"%s %lf",tempstr,&tile->yorig) != 2 ||
+     fscanf(fd,"%s %lf",tempstr,&tile->delta) != 2 ||
+     fscanf(fd,"%s %lf",tempstr,&tile->nodata) != 2)
+    {
+      fprintf(stderr, "cannot read the header of dem file,%s\n",name);
+      exit(1);
+    }
+  fclose(fd);
+}
+
+/* ----------------------
+  Read the header of every DEM of a cell list (one file name per line), or
+  of every DEM of a pack if listfile is a pack.  Returns the number of
+  tiles.
+ ------------------------*/
+int ReadTileSet(char *listfile, TILESET *ts)
+{
+  FILE     *fl = NULL;
+  char     name[2*MAXSTRING];
+  TILE     *tile;
+  TILEPACK *pack = NULL;
+  int      alloc = 0, k = 0;
+
+  memset(ts, 0, sizeof(TILESET));
+  if(IsTilePack(listfile))
+    pack = OpenTilePack(listfile);
+  else if((fl=fopen(listfile,"r"))==NULL)
+    {
+      fprintf(stderr, "cannot open/read cell list,%s\n",listfile);
+      exit(1);
+    }
+  for(;;) {
+    if(pack != NULL) {
+      while(k < pack->ntiles && (pack->index[k].type & ~PACK_ZLIB) != PACK_GRID) k++;
+      if(k == pack->ntiles) break;
+      sprintf(name, "%s:%d", listfile, pack->index[k++].id);
+    }
+    else if(fscanf(fl, "%s", name) != 1)
+      break;
+    if(ts->ntiles == alloc) {
+      alloc = alloc ? 2*alloc : 64;
+      if(!(ts->tiles = (TILE*) realloc(ts->tiles, alloc*sizeof(TILE))))
+	{ printf("Cannot allocate memory to first record: tiles\n");
+	  exit(8);
+	}
+    }
+    tile = &ts->tiles[ts->ntiles];
+    TileHeader(name, tile);
+    tile->dem = strdup(name);
+
+    if(ts->ntiles == 0)
+      ts->delta = tile->delta;
+    else if(fabs(tile->delta - ts->delta) > 1.e-6*ts->delta) {
+      fprintf(stderr, "ERROR: pixel size of %s is not that of %s\n", name, ts->tiles[0].dem);
+      exit(1);
+    }
+    if(ts->ntiles == 0 || tile->xorig < ts->xmin) ts->xmin = tile->xorig;
+    if(ts->ntiles == 0 || tile->yorig < ts->ymin) ts->ymin = tile->yorig;
+    if(ts->ntiles == 0 || tile->xorig + tile->fullcols*ts->delta > ts->xmax)
+      ts->xmax = tile->xorig + tile->fullcols*ts->delta;
+    if(ts->ntiles == 0 || tile->yorig + tile->fullrows*ts->delta > ts->ymax)
+      ts->ymax = tile->yorig + tile->fullrows*ts->delta;
+    ts->ntiles++;
+  }
+  if(pack != NULL) CloseTilePack(pack);
+  else fclose(fl);
+  return ts->ntiles;
+}
+
+void FreeTileSet(TILESET *ts)
+{
+  int n;
+
+  for(n=0; n<ts->ntiles; n++)
+    free(ts->tiles[n].dem);
+  free(ts->tiles);
+  memset(ts, 0, sizeof(TILESET));
+}
+
+/* ----------------------
+  Tiles (other than n) with pixels in the halo of tile n.  Returns a list
+  to be freed, and its length in *count.
+ ------------------------*/
+int *TileNeighbors(TILESET *ts, int n, int halo, int *count)
+{
+  TILE   *t = &ts->tiles[n], *o;
+  double h = (halo + 0.5) * ts->delta;
+  double xmin = t->xorig - h, xmax = t->xorig + t->fullcols*ts->delta + h;
+  double ymin = t->yorig - h, ymax = t->yorig + t->fullrows*ts->delta + h;
+  int    m, *list;
+
+  if(!(list = (int*) malloc(ts->ntiles*sizeof(int))))
+    { printf("Cannot allocate memory to first record: neighbors\n");
+      exit(8);
+    }
+  *count = 0;
+  for(m=0; m<ts->ntiles; m++) {
+    o = &ts->tiles[m];
+    if(m == n || o->xorig >= xmax || o->xorig + o->fullcols*ts->delta <= xmin ||
+       o->yorig >= ymax || o->yorig + o->fullrows*ts->delta <= ymin)
+      continue;
+    list[(*count)++] = m;
+  }
+  return list;
+}
+
+/* key of a tile in TileOrder() */
+typedef struct
+{
+  int    n, row;
+  double x;
+} TILEKEY;
+
+static int CompareTileKeys(const void *a, const void *b)
+{
+  const TILEKEY *ka = (const TILEKEY*)a, *kb = (const TILEKEY*)b;
+
+  if(ka->row != kb->row) return (ka->row < kb->row) ? -1 : 1;
+  if(ka->x != kb->x) return (ka->x < kb->x) ? -1 : 1;
+  return ka->n - kb->n;
+}
+
+/* ----------------------
+  Processing order of the tiles: rows of tiles from north to south, west
+  to east on even rows and east to west on odd rows, so that the halo
+  neighbours of a tile were mostly used by the tiles just before it.
+  Returns a list to be freed.
+ ------------------------*/
+int *TileOrder(TILESET *ts)
+{
+  TILEKEY *keys;
+  int     n, *order;
+  double  ytop = -HUGE_VAL, height = HUGE_VAL, yc;
+
+  for(n=0; n<ts->ntiles; n++) {
+    TILE *t = &ts->tiles[n];
+    if(t->yorig + t->fullrows*ts->delta > ytop) ytop = t->yorig + t->fullrows*ts->delta;
+    if(t->fullrows*ts->delta < height) height = t->fullrows*ts->delta;
+  }
+
+  keys = (TILEKEY*) malloc(ts->ntiles*sizeof(TILEKEY));
+  order = (int*) malloc(ts->ntiles*sizeof(int));
+  if(keys == NULL || order == NULL)
+    { printf("Cannot allocate memory to first record: order\n");
+      exit(8);
+    }
+  for(n=0; n<ts->ntiles; n++) {
+    TILE *t = &ts->tiles[n];
+    yc = t->yorig + 0.5*t->fullrows*ts->delta;
+    keys[n].n = n;
+    keys[n].row = (int)floor((ytop - yc)/height);
+    keys[n].x = t->xorig + 0.5*t->fullcols*ts->delta;
+    if(keys[n].row % 2) keys[n].x = -keys[n].x;
+  }
+  qsort(keys, ts->ntiles, sizeof(TILEKEY), CompareTileKeys);
+  for(n=0; n<ts->ntiles; n++)
+    order[n] = keys[n].n;
+  free(keys);
+  return order;
+}
+
+/* Copy the valid pixels of a parsed tile into the window. */
+static void PasteTile(TERRAIN *w, TERRAIN *p, double delta)
+{
+  int c0, r0, i, j, k;
+
+  c0 = (int)floor((p->xorig - w->xorig)/delta + 0.5) + p->col0;
+  r0 = (int)floor((w->yorig + w->fullrows*delta - p->yorig - p->fullrows*delta)/delta + 0.5) + p->row0;
+  for(k=0; k<p->nvalid; k++) {
+    i = p->valid[k] / p->columns;
+    j = p->valid[k] % p->columns;
+    if(r0+i >= 0 && r0+i < w->fullrows && c0+j >= 0 && c0+j < w->fullcols)
+      w->dem[r0+i][c0+j] = p->dem[i][j];
+  }
+}
+
+/* ----------------------
+  Window of tile n with a halo of <halo> pixels from its neighbours,
+  cropped to its valid pixels and with the cell sizes set.  *left and
+  *top are the pixels of halo on the west and north of the tile.  Returns
+  the parsed tile, to be released by the caller, or NULL (w is then
+  empty) if the tile has no valid pixels.
+ ------------------------*/
+static TERRAIN *HaloWindow(TERRAINCACHE *c, TILESET *ts, int n, int halo, double min_elev,
+			   int projection, TERRAIN *w, int *left, int *top)
+{
+  TILE    *tile = &ts->tiles[n];
+  TERRAIN *p;
+  int     *neighbors, nneighbors, m, i, j;
+  int     right, bottom;
+
+  memset(w, 0, sizeof(TERRAIN));
+  if((p = CachedTerrain(c, tile->dem, min_elev, projection, STAGE_PARSED, NULL)) == NULL)
+    {
+      fprintf(stderr, "cannot open/read dem file,%s\n",tile->dem);
+      exit(1);
+    }
+  if(p->nvalid == 0) {
+    ReleaseTerrain(c, p);
+    return NULL;
+  }
+
+  /* Window: the grid of the tile with <halo> more pixels on every side,
+     inside the mosaic. */
+  *left = (int)floor((tile->xorig - ts->xmin)/ts->delta + 0.5);
+  right = (int)floor((ts->xmax - tile->xorig)/ts->delta + 0.5) - tile->fullcols;
+  bottom = (int)floor((tile->yorig - ts->ymin)/ts->delta + 0.5);
+  *top = (int)floor((ts->ymax - tile->yorig)/ts->delta + 0.5) - tile->fullrows;
+  if(*left > halo) *left = halo;
+  if(right > halo) right = halo;
+  if(bottom > halo) bottom = halo;
+  if(*top > halo) *top = halo;
+  w->fullcols = tile->fullcols + *left + right;
+  w->fullrows = tile->fullrows + *top + bottom;
+  w->xorig = tile->xorig - *left*ts->delta;
+  w->yorig = tile->yorig - bottom*ts->delta;
+  w->delta = ts->delta;
+  w->nodata = p->nodata;
+  w->dem = Memoryalloc(w->fullcols, w->fullrows);
+  for(i=0; i<w->fullrows; i++)
+    for(j=0; j<w->fullcols; j++)
+      w->dem[i][j] = w->nodata;
+
+  /* The tile is pasted last, so its own pixels win where tiles overlap. */
+  neighbors = TileNeighbors(ts, n, halo, &nneighbors);
+  for(m=0; m<nneighbors; m++) {
+    TERRAIN *q = CachedTerrain(c, ts->tiles[neighbors[m]].dem, min_elev, projection,
+			       STAGE_PARSED, NULL);
+    if(q == NULL) continue;
+    PasteTile(w, q, ts->delta);
+    ReleaseTerrain(c, q);
+  }
+  free(neighbors);
+  PasteTile(w, p, ts->delta);
+
+  w->columns = w->fullcols;
+  w->rows = w->fullrows;
+  w->nvalid = CropToValid(&w->dem, &w->columns, &w->rows, &w->col0, &w->row0, w->nodata);
+  w->valid = ValidPixels(w->dem, w->columns, w->rows, w->nodata, w->nvalid);
+  SetCellSize(w, projection);
+  return p;
+}
+
+/* ----------------------
+  Core of a window: t is set as ReadDEM() and SetCellSize() would set it
+  for the tile p alone, with the products of the window w at its valid
+  pixels.  (wr0, wc0) is the pixel of w at the first pixel of the file
+  grid of the tile.
+ ------------------------*/
+static void CoreTerrain(TERRAIN *w, TERRAIN *p, int wr0, int wc0, TERRAIN *t)
+{
+  double  **grids[6], **wgrids[6];
+  int     g, i, j, k, wr, wc;
+
+  CopyTerrain(p, t);
+  t->sink = Memoryalloc(t->columns, t->rows);
+  t->flowacc = Memoryalloc(t->columns, t->rows);
+  t->tanbeta = Memoryalloc(t->columns, t->rows);
+  t->contour_length = Memoryalloc(t->columns, t->rows);
+  t->wetnessindex = Memoryalloc(t->columns, t->rows);
+  grids[0] = t->dem;            wgrids[0] = w->dem;
+  grids[1] = t->sink;           wgrids[1] = w->sink;
+  grids[2] = t->flowacc;        wgrids[2] = w->flowacc;
+  grids[3] = t->tanbeta;        wgrids[3] = w->tanbeta;
+  grids[4] = t->contour_length; wgrids[4] = w->contour_length;
+  grids[5] = t->wetnessindex;   wgrids[5] = w->wetnessindex;
+  t->products = PROD_FILLED | PROD_SINK | PROD_FLOWACC | PROD_SLOPE | PROD_TWI;
+  for(g=1; g<6; g++)
+    for(i=0; i<t->rows; i++)
+      for(j=0; j<t->columns; j++)
+	grids[g][i][j] = t->nodata;
+  for(k=0; k<t->nvalid; k++) {
+    i = t->valid[k] / t->columns;
+    j = t->valid[k] % t->columns;
+    wr = wr0 + t->row0 + i;
+    wc = wc0 + t->col0 + j;
+    for(g=0; g<6; g++)
+      grids[g][i][j] = wgrids[g][wr][wc];
+  }
+}
+
+/* ----------------------
+  Fill, route and calculate the wetness index of tile n on a window with
+  a halo of <halo> pixels from its neighbours.  t is set as ReadDEM() and
+  SetCellSize() would set it for the tile alone, with all the products
+  (filled dem, sink, flowacc, tanbeta, contour length and wetness index)
+  of the window.  Returns the number of valid pixels of the tile, 0 if it
+  has none (t is then empty).
+ ------------------------*/
+int HaloTerrain(TERRAINCACHE *c, TILESET *ts, int n, int halo, double min_elev,
+		int projection, TERRAIN *t)
+{
+  TERRAIN w, *p;
+  int     left, top;
+
+  memset(t, 0, sizeof(TERRAIN));
+  if((p = HaloWindow(c, ts, n, halo, min_elev, projection, &w, &left, &top)) == NULL)
+    return 0;
+  FillAndRoute(&w);
+  WetnessIndex(&w);
+
+  /* Core: the tile as read alone, with the products of the window. */
+  CoreTerrain(&w, p, top - w.row0, left - w.col0, t);
+  ReleaseTerrain(c, p);
+
+  FreeTerrain(&w);
+  return t->nvalid;
+}
+
+/* ----------------------
+  Basin routing with edge vectors.
+
+  The tiles must abut without overlapping.  Pass 1 fills every tile on
+  its halo window (FillTerrain()) and keeps the filled core on a
+  temporary file and its boundary pixels (the strip of the tile) in
+  memory.  A pixel of one tile drains into a pixel of another if it is
+  an 8-neighbour on the other side of the tile edge and is higher, so the
+  strips give the graph of the flow between the tiles.  Pass 2 routes the
+  tiles in topological order of that graph, each on the filled core with
+  a ring of one pixel taken from the strips of its neighbours
+  (RouteTerrain()).  The flow that enters the boundary pixels of a tile
+  (its inflow vector) is the sum of the flow its upstream neighbours left
+  on their rings (their outflow vectors), so only the strips and the
+  outflows of the tiles are held for the whole basin.
+
+  The MFD routing sends flow to every lower neighbour, so wherever the
+  edge between two tiles is not a ridge, flow crosses it both ways and
+  the two tiles are in a cycle of the graph.  Unless the cells follow
+  the ridges, nearly all the tiles of a basin end up in one cycle.  The tiles of a cycle are routed in
+  sweeps until their outflow vectors settle, and each sweep routes every
+  tile of the cycle again, so pass 2 costs about ten to twenty routings
+  of the basin instead of one (the exchange across an edge shrinks by
+  about an order of magnitude each sweep).
+
+  The strips are indexed along the boundary of the tile: the top row
+  (0..C-1), the bottom row (C..2C-1), the left column (2C..2C+R-1) and the
+  right column (2C+R..2C+2R-1), the corners going with the rows.
+ ------------------------*/
+
+/* flow left by a tile on a boundary pixel of another */
+typedef struct
+{
+  int    tile, index;
+  double flow;
+} EDGEFLOW;
+
+typedef struct
+{
+  double   *strip;             /* filled dem on the boundary */
+  long     offset;             /* filled core and sink on the temporary file */
+  int      nout;
+  EDGEFLOW *out;               /* outflow vector */
+  int      ndown, *down;       /* downstream tiles */
+  int      index, low, onstack;
+} TILEFLOW;
+
+/* row and column of the first pixel of a tile in the mosaic */
+static int MosaicRow(TILESET *ts, TILE *t)
+{
+  return (int)floor((ts->ymax - t->yorig)/ts->delta + 0.5) - t->fullrows;
+}
+
+static int MosaicColumn(TILESET *ts, TILE *t)
+{
+  return (int)floor((t->xorig - ts->xmin)/ts->delta + 0.5);
+}
+
+/* index of pixel (r,c) of a tile on its strip, -1 if inside the tile */
+static int StripIndex(TILE *t, int r, int c)
+{
+  if(r < 0 || r >= t->fullrows || c < 0 || c >= t->fullcols) return -1;
+  if(r == 0) return c;
+  if(r == t->fullrows-1) return t->fullcols + c;
+  if(c == 0) return 2*t->fullcols + r;
+  if(c == t->fullcols-1) return 2*t->fullcols + t->fullrows + r;
+  return -1;
+}
+
+/* pixel of a strip index, returns 0 for the unused indices (corners of
+   the columns) */
+static int StripPixel(TILE *t, int k, int *r, int *c)
+{
+  int C = t->fullcols, R = t->fullrows;
+
+  if(k < C) { *r = 0; *c = k; }
+  else if(k < 2*C) { *r = R-1; *c = k - C; }
+  else if(k < 2*C + R) { *r = k - 2*C; *c = 0; }
+  else { *r = k - 2*C - R; *c = C-1; }
+  return StripIndex(t, *r, *c) == k;
+}
+
+/* ----------------------
+  Tarjan's strongly connected components of the tile graph.  The
+  components are found downstream first, and are numbered from the end of
+  order so that order is upstream first.
+ ------------------------*/
+static void StrongConnect(TILEFLOW *f, int n, int *counter, int *stack, int *nstack,
+			  int *order, int *norder, int *component, int *ncomponents)
+{
+  int k, m;
+
+  f[n].index = f[n].low = (*counter)++;
+  stack[(*nstack)++] = n;
+  f[n].onstack = 1;
+  for(k=0; k<f[n].ndown; k++) {
+    m = f[n].down[k];
+    if(f[m].index < 0) {
+      StrongConnect(f, m, counter, stack, nstack, order, norder, component, ncomponents);
+      if(f[m].low < f[n].low) f[n].low = f[m].low;
+    }
+    else if(f[m].onstack && f[m].index < f[n].low)
+      f[n].low = f[m].index;
+  }
+  if(f[n].low == f[n].index) {
+    do {
+      m = stack[--(*nstack)];
+      f[m].onstack = 0;
+      (*norder)--;
+      order[*norder] = m;
+      component[*norder] = *ncomponents;
+    } while(m != n);
+    (*ncomponents)++;
+  }
+}
+
+/* ----------------------
+  Route tile n on its filled core with a ring of one pixel from the strips
+  of its neighbours and the inflow of their outflow vectors, and replace
+  its outflow vector.  The products of the tile are passed to done() if
+  it is not NULL.  Returns the largest change of the outflow vector
+  relative to the flow of the tile.
+ ------------------------*/
+static double RouteTile(TERRAINCACHE *c, TILESET *ts, TILEFLOW *f, FILE *ft, int n,
+			double min_elev, int projection,
+			void (*done)(TILESET *ts, int n, TERRAIN *t, void *arg), void *arg)
+{
+  TILE     *tile = &ts->tiles[n], *o;
+  TERRAIN  w, *p, t;
+  double   **inflow, *buf, change = 0, old, total = 0;
+  EDGEFLOW *out = NULL;
+  int      *neighbors, nneighbors, m, k, l, i, j, r, cc, wr, wc;
+  int      r0, c0, rt, rl, mrows, mcols, nout = 0, *ring;
+
+  if((p = CachedTerrain(c, tile->dem, min_elev, projection, STAGE_PARSED, NULL)) == NULL)
+    {
+      fprintf(stderr, "cannot open/read dem file,%s\n",tile->dem);
+      exit(1);
+    }
+
+  /* Window: the tile with a ring of one pixel where it is not on the
+     edge of the mosaic. */
+  mrows = (int)floor((ts->ymax - ts->ymin)/ts->delta + 0.5);
+  mcols = (int)floor((ts->xmax - ts->xmin)/ts->delta + 0.5);
+  r0 = MosaicRow(ts, tile);
+  c0 = MosaicColumn(ts, tile);
+  rt = (r0 > 0);
+  rl = (c0 > 0);
+  memset(&w, 0, sizeof(TERRAIN));
+  w.fullrows = w.rows = tile->fullrows + rt + (r0 + tile->fullrows < mrows);
+  w.fullcols = w.columns = tile->fullcols + rl + (c0 + tile->fullcols < mcols);
+  w.xorig = tile->xorig - rl*ts->delta;
+  w.yorig = tile->yorig - (w.fullrows - tile->fullrows - rt)*ts->delta;
+  w.delta = ts->delta;
+  w.nodata = p->nodata;
+  w.dem = Memoryalloc(w.columns, w.rows);
+  w.sink = Memoryalloc(w.columns, w.rows);
+  inflow = Memoryalloc(w.columns, w.rows);
+  for(i=0; i<w.rows; i++)
+    for(j=0; j<w.columns; j++) {
+      w.dem[i][j] = w.sink[i][j] = w.nodata;
+      inflow[i][j] = 0.;
+    }
+
+  /* core: the filled dem and sink of pass 1 */
+  if(!(buf = (double*) malloc(2*(size_t)tile->fullcols*tile->fullrows*sizeof(double))))
+    { printf("Cannot allocate memory to first record: core\n");
+      exit(8);
+    }
+  if(fseek(ft, f[n].offset, SEEK_SET) != 0 ||
+     fread(buf, sizeof(double), 2*(size_t)tile->fullcols*tile->fullrows, ft) !=
+     2*(size_t)tile->fullcols*tile->fullrows)
+    {
+      fprintf(stderr, "cannot read the filled dem of,%s\n",tile->dem);
+      exit(1);
+    }
+  for(i=0; i<tile->fullrows; i++)
+    for(j=0; j<tile->fullcols; j++) {
+      w.dem[rt+i][rl+j] = buf[(size_t)i*tile->fullcols + j];
+      w.sink[rt+i][rl+j] = buf[(size_t)(tile->fullrows + i)*tile->fullcols + j];
+    }
+  free(buf);
+  w.nvalid = p->nvalid;
+  if(!(w.valid = (int*) malloc(w.nvalid*sizeof(int))))
+    { printf("Cannot allocate memory to first record: valid\n");
+      exit(8);
+    }
+  for(k=0; k<p->nvalid; k++)
+    w.valid[k] = (rt + p->row0 + p->valid[k]/p->columns)*w.columns +
+      rl + p->col0 + p->valid[k]%p->columns;
+
+  /* ring: the strips of the neighbours, and the inflow of their outflow
+     vectors */
+  if(!(ring = (int*) malloc(3*2*(w.rows + w.columns)*sizeof(int))))
+    { printf("Cannot allocate memory to first record: ring\n");
+      exit(8);
+    }
+  neighbors = TileNeighbors(ts, n, 1, &nneighbors);
+  for(m=0; m<nneighbors; m++) {
+    o = &ts->tiles[neighbors[m]];
+    for(k=0; k<2*(o->fullcols + o->fullrows); k++) {
+      if(!StripPixel(o, k, &r, &cc)) continue;
+      wr = MosaicRow(ts, o) + r - (r0 - rt);
+      wc = MosaicColumn(ts, o) + cc - (c0 - rl);
+      if(wr < 0 || wr >= w.rows || wc < 0 || wc >= w.columns) continue;
+      if(wr >= rt && wr < rt + tile->fullrows && wc >= rl && wc < rl + tile->fullcols)
+	continue;
+      w.dem[wr][wc] = f[neighbors[m]].strip[k];
+      if(w.dem[wr][wc] != w.nodata) {
+	ring[3*nout] = wr*w.columns + wc;
+	ring[3*nout+1] = neighbors[m];
+	ring[3*nout+2] = k;
+	nout++;
+      }
+    }
+    for(l=0; l<f[neighbors[m]].nout; l++)
+      if(f[neighbors[m]].out[l].tile == n) {
+	StripPixel(tile, f[neighbors[m]].out[l].index, &r, &cc);
+	inflow[rt+r][rl+cc] += f[neighbors[m]].out[l].flow;
+      }
+  }
+  free(neighbors);
+
+  SetCellSize(&w, projection);
+  RouteTerrain(&w, inflow);
+  Memoryfree(inflow, w.rows);
+
+  /* outflow vector */
+  if(nout > 0 && !(out = (EDGEFLOW*) malloc(nout*sizeof(EDGEFLOW))))
+    { printf("Cannot allocate memory to first record: outflow\n");
+      exit(8);
+    }
+  for(k=0, l=0; k<nout; k++) {
+    double flow = w.flowacc[ring[3*k]/w.columns][ring[3*k]%w.columns];
+    if(flow <= 0) continue;
+    out[l].tile = ring[3*k+1];
+    out[l].index = ring[3*k+2];
+    out[l].flow = flow;
+    total += flow;
+    l++;
+  }
+  free(ring);
+  for(k=0; k<p->nvalid; k++)
+    total += w.flowacc[w.valid[k]/w.columns][w.valid[k]%w.columns];
+  for(k=0; k<l || k<f[n].nout; k++) {
+    old = (k < f[n].nout) ? f[n].out[k].flow : 0;
+    if(k >= l || k >= f[n].nout || f[n].out[k].tile != out[k].tile ||
+       f[n].out[k].index != out[k].index)
+      change = 1;
+    else if(fabs(out[k].flow - old) > change*total)
+      change = fabs(out[k].flow - old)/total;
+  }
+  if(f[n].nout > 0) free(f[n].out);
+  f[n].out = (l > 0) ? out : NULL;
+  if(l == 0 && nout > 0) free(out);
+  f[n].nout = l;
+
+  if(done != NULL) {
+    WetnessIndex(&w);
+    CoreTerrain(&w, p, rt, rl, &t);
+    done(ts, n, &t, arg);
+    FreeTerrain(&t);
+  }
+  ReleaseTerrain(c, p);
+  FreeTerrain(&w);
+  return change;
+}
+
+/* ----------------------
+  Fill, route and calculate the wetness index of all the tiles of a
+  mosaic with the flow from the tiles upstream.  Every tile is filled on
+  a window with a halo of <halo> pixels, then routed alone with the
+  inflow on its edges, so the accumulation does not depend on the halo
+  once the filled dems of the tiles agree on their edges.  done() gets
+  the products of each tile, set as HaloTerrain() sets them, in the order
+  in which the tiles are routed.  Returns the number of tiles that are in
+  a cycle of the tile graph.
+ ------------------------*/
+int RouteBasin(TERRAINCACHE *c, TILESET *ts, int halo, double min_elev, int projection,
+	       void (*done)(TILESET *ts, int n, TERRAIN *t, void *arg), void *arg)
+{
+  TILEFLOW *f;
+  TILE     *tile, *o;
+  TERRAIN  w, *p;
+  FILE     *ft;
+  double   *buf, change;
+  size_t   at;
+  int      *order, *component, *stack, *neighbors, nneighbors;
+  int      n, m, k, l, i, j, r, cc, dr, dc, left, top, wr, wc, sweep;
+  int      counter = 0, nstack = 0, norder, ncomponents = 0, ncycle = 0, found;
+
+  if(!(f = (TILEFLOW*) calloc(ts->ntiles, sizeof(TILEFLOW))))
+    { printf("Cannot allocate memory to first record: tiles\n");
+      exit(8);
+    }
+  if((ft = tmpfile()) == NULL)
+    {
+      fprintf(stderr, "cannot open/write temporary file\n");
+      exit(1);
+    }
+
+  /* Pass 1: filled cores and strips */
+  order = TileOrder(ts);
+  for(l=0; l<ts->ntiles; l++) {
+    n = order[l];
+    tile = &ts->tiles[n];
+    buf = (double*) malloc(2*(size_t)tile->fullcols*tile->fullrows*sizeof(double));
+    f[n].strip = (double*) malloc(2*(tile->fullcols + tile->fullrows)*sizeof(double));
+    if(buf == NULL || f[n].strip == NULL)
+      { printf("Cannot allocate memory to first record: strip\n");
+	exit(8);
+      }
+    for(k=0; k<2*(tile->fullcols + tile->fullrows); k++)
+      f[n].strip[k] = tile->nodata;
+    f[n].offset = -1;
+    if((p = HaloWindow(c, ts, n, halo, min_elev, projection, &w, &left, &top)) == NULL) {
+      free(buf);
+      continue;
+    }
+    FillTerrain(&w);
+    for(at=0; at<2*(size_t)tile->fullcols*tile->fullrows; at++)
+      buf[at] = p->nodata;
+    for(k=0; k<p->nvalid; k++) {
+      i = p->row0 + p->valid[k]/p->columns;
+      j = p->col0 + p->valid[k]%p->columns;
+      wr = top + i - w.row0;
+      wc = left + j - w.col0;
+      buf[(size_t)i*tile->fullcols + j] = w.dem[wr][wc];
+      buf[(size_t)(tile->fullrows + i)*tile->fullcols + j] = w.sink[wr][wc];
+      if((m = StripIndex(tile, i, j)) >= 0)
+	f[n].strip[m] = w.dem[wr][wc];
+    }
+    fseek(ft, 0, SEEK_END);
+    f[n].offset = ftell(ft);
+    if(fwrite(buf, sizeof(double), 2*(size_t)tile->fullcols*tile->fullrows, ft) !=
+       2*(size_t)tile->fullcols*tile->fullrows)
+      {
+	fprintf(stderr, "cannot write temporary file\n");
+	exit(1);
+      }
+    free(buf);
+    ReleaseTerrain(c, p);
+    FreeTerrain(&w);
+  }
+  free(order);
+
+  /* Tile graph: m is downstream of n if a pixel of n is higher than an
+     8-neighbour of it in m, which is where the MFD routing of n leaves
+     flow in m. */
+  for(n=0; n<ts->ntiles; n++) {
+    tile = &ts->tiles[n];
+    f[n].index = -1;
+    neighbors = TileNeighbors(ts, n, 1, &nneighbors);
+    if(nneighbors > 0 && !(f[n].down = (int*) malloc(nneighbors*sizeof(int))))
+      { printf("Cannot allocate memory to first record: graph\n");
+	exit(8);
+      }
+    for(m=0; m<nneighbors; m++) {
+      o = &ts->tiles[neighbors[m]];
+      found = 0;
+      for(k=0; k<2*(tile->fullcols + tile->fullrows) && !found; k++) {
+	if(!StripPixel(tile, k, &r, &cc) || f[n].strip[k] == tile->nodata) continue;
+	for(dr=-1; dr<=1 && !found; dr++)
+	  for(dc=-1; dc<=1 && !found; dc++) {
+	    i = StripIndex(o, MosaicRow(ts, tile) + r + dr - MosaicRow(ts, o),
+			   MosaicColumn(ts, tile) + cc + dc - MosaicColumn(ts, o));
+	    found = (i >= 0 && f[neighbors[m]].strip[i] != o->nodata &&
+		     f[n].strip[k] > f[neighbors[m]].strip[i]);
+	  }
+      }
+      if(found)
+	f[n].down[f[n].ndown++] = neighbors[m];
+    }
+    free(neighbors);
+  }
+
+  order = (int*) malloc(ts->ntiles*sizeof(int));
+  component = (int*) malloc(ts->ntiles*sizeof(int));
+  stack = (int*) malloc(ts->ntiles*sizeof(int));
+  if(order == NULL || component == NULL || stack == NULL)
+    { printf("Cannot allocate memory to first record: order\n");
+      exit(8);
+    }
+  norder = ts->ntiles;
+  for(n=0; n<ts->ntiles; n++)
+    if(f[n].index < 0)
+      StrongConnect(f, n, &counter, stack, &nstack, order, &norder, component, &ncomponents);
+  free(stack);
+
+  /* Pass 2: route the components upstream first.  The tiles of a cycle
+     are routed until their outflow vectors no longer change, then once
+     more for their products. */
+  for(l=0; l<ts->ntiles; l=k) {
+    for(k=l+1; k<ts->ntiles && component[k] == component[l]; k++);
+    if(k - l > 1) {
+      ncycle += k - l;
+      for(sweep=0; sweep<MAXSWEEPS; sweep++) {
+	change = 0;
+	for(m=l; m<k; m++)
+	  if(f[order[m]].offset >= 0) {
+	    double d = RouteTile(c, ts, f, ft, order[m], min_elev, projection, NULL, NULL);
+	    if(d > change) change = d;
+	  }
+	if(change <= SWEEPTOLERANCE) break;
+      }
+      if(sweep == MAXSWEEPS)
+	fprintf(stderr, "WARNING: outflow of a cycle of %d tiles from %s did not converge\n",
+		k - l, ts->tiles[order[l]].dem);
+    }
+    for(m=l; m<k; m++)
+      if(f[order[m]].offset >= 0)
+	RouteTile(c, ts, f, ft, order[m], min_elev, projection, done, arg);
+  }
+
+  fclose(ft);
+  for(n=0; n<ts->ntiles; n++) {
+    free(f[n].strip);
+    free(f[n].out);
+    free(f[n].down);
+  }
+  free(f);
+  free(order);
+  free(component);
+  return ncycle;
+}
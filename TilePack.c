@@ -0,0 +1,543 @@
+/******************************************************************************
+   SUMMARY:
+   Packed cell tiles: one file holding the DEMs (or the output tables) of
+   all the VIC grid cells of a basin, so that a batch of cells needs one
+   open and sequential reads instead of thousands of small files.
+
+   A pack is a header, an index of up to <capacity> tiles sorted by cell
+   id, and the payloads of the tiles one after the other:
+
+     header   magic "VICTPACK", version, byte order mark, number of tiles,
+              capacity of the index, end of the payloads (64 bytes)
+     index    per tile: cell id, type, georeference (columns, rows, lower
+              left corner, pixel size, nodata), offset and length of the
+              payload in the file, size of the payload when unpacked and
+              the CRC-32 of the payload as stored (PACKENTRY, 80 bytes)
+     payloads PACK_GRID tiles are the grid as doubles in row order, in the
+              byte order of the machine that wrote the pack; PACK_TEXT
+              tiles are text (e.g. the output table of FindTWI).  With
+              PACK_ZLIB the payload is deflated by zlib.
+
+   Packs are read through mmap, and a tile is named "<pack file>:<cell
+   id>" wherever the tools take a DEM file name (ReadDEM()).  Writers hold
+   an exclusive lock on the file, append the payloads and rewrite the
+   index when the pack is closed, so several programs can add their tiles
+   to the same pack.  A tile written again replaces the old one in the
+   index, and the old payload is left unused until the pack is unpacked
+   and packed again (PackTiles).
+
+   Compile with -DHAVE_ZLIB and link with -lz to read and write
+   compressed tiles.
+*******************************************************************************/
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#include "TerrainEngine.h"
+
+#define PACKMAGIC   "VICTPACK"
+#define PACKVERSION 1
+#define PACKBOM     0x01020304
+#define PACKHEADER  64
+
+typedef struct
+{
+  char      magic[8];
+  int32_t   version, bom;
+  int32_t   ntiles, capacity;
+  int64_t   end;
+  char      pad[PACKHEADER - 32];
+} PACKHEAD;
+
+/* packs opened by name, shared by all the threads of the program */
+typedef struct SHAREDPACK
+{
+  TILEPACK  *pack;
+  dev_t     dev;
+  ino_t     ino;
+  off_t     size;
+  struct timespec mtime;
+  struct SHAREDPACK *next;
+} SHAREDPACK;
+
+static SHAREDPACK      *SharedPacks = NULL;
+static pthread_mutex_t SharedLock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t CrcTable[256];
+static pthread_once_t CrcOnce = PTHREAD_ONCE_INIT;
+
+static void MakeCrcTable(void)
+{
+  uint32_t c;
+  int      n, k;
+
+  for(n=0; n<256; n++) {
+    c = (uint32_t)n;
+    for(k=0; k<8; k++)
+      c = (c & 1) ? 0xedb88320U ^ (c >> 1) : c >> 1;
+    CrcTable[n] = c;
+  }
+}
+
+/* CRC-32 of a payload, as zlib's crc32() */
+static uint32_t Crc32(const unsigned char *buf, size_t len)
+{
+  uint32_t c = 0xffffffffU;
+  size_t   k;
+
+  pthread_once(&CrcOnce, MakeCrcTable);
+  for(k=0; k<len; k++)
+    c = CrcTable[(c ^ buf[k]) & 0xff] ^ (c >> 8);
+  return c ^ 0xffffffffU;
+}
+
+static int CompareEntries(const void *a, const void *b)
+{
+  const PACKENTRY *ea = (const PACKENTRY*)a, *eb = (const PACKENTRY*)b;
+
+  return (ea->id > eb->id) - (ea->id < eb->id);
+}
+
+static TILEPACK *NewPack(char *name, int fd)
+{
+  TILEPACK *p;
+
+  if(!(p = (TILEPACK*) calloc(1, sizeof(TILEPACK))) || !(p->name = strdup(name)))
+    { printf("Cannot allocate memory to first record: pack\n");
+      exit(8);
+    }
+  p->fd = fd;
+  return p;
+}
+
+/* Read and check the header and the index of a pack from fd.  Returns 1,
+   with a message, if it is not a pack or is damaged. */
+static int ReadIndex(TILEPACK *p)
+{
+  PACKHEAD h;
+
+  if(pread(p->fd, &h, sizeof(PACKHEAD), 0) != sizeof(PACKHEAD) ||
+     memcmp(h.magic, PACKMAGIC, 8) != 0)
+    {
+      fprintf(stderr, "ERROR: %s is not a tile pack\n", p->name);
+      return 1;
+    }
+  if(h.version != PACKVERSION || h.bom != PACKBOM) {
+    fprintf(stderr, "ERROR: %s was written by another version or byte order\n", p->name);
+    return 1;
+  }
+  if(h.ntiles < 0 || h.capacity < h.ntiles) {
+    fprintf(stderr, "ERROR: the index of tile pack %s is damaged\n", p->name);
+    return 1;
+  }
+  p->ntiles = h.ntiles;
+  p->capacity = h.capacity;
+  p->end = h.end;
+  if(!(p->index = (PACKENTRY*) malloc((p->capacity > 0 ? p->capacity : 1)*sizeof(PACKENTRY))))
+    { printf("Cannot allocate memory to first record: pack index\n");
+      exit(8);
+    }
+  if(pread(p->fd, p->index, p->ntiles*sizeof(PACKENTRY), PACKHEADER) !=
+     (ssize_t)(p->ntiles*sizeof(PACKENTRY)))
+    {
+      fprintf(stderr, "cannot read the index of tile pack,%s\n", p->name);
+      return 1;
+    }
+  return 0;
+}
+
+/* Write the header and the index of a pack. */
+static void WriteIndex(TILEPACK *p)
+{
+  PACKHEAD h;
+
+  memset(&h, 0, sizeof(PACKHEAD));
+  memcpy(h.magic, PACKMAGIC, 8);
+  h.version = PACKVERSION;
+  h.bom = PACKBOM;
+  h.ntiles = p->ntiles;
+  h.capacity = p->capacity;
+  h.end = p->end;
+  if(pwrite(p->fd, &h, sizeof(PACKHEAD), 0) != sizeof(PACKHEAD) ||
+     pwrite(p->fd, p->index, p->ntiles*sizeof(PACKENTRY), PACKHEADER) !=
+     (ssize_t)(p->ntiles*sizeof(PACKENTRY)))
+    {
+      fprintf(stderr, "cannot write tile pack,%s\n", p->name);
+      exit(1);
+    }
+}
+
+/* Start an empty pack on a locked, empty file. */
+static void InitPack(TILEPACK *p, int capacity)
+{
+  p->ntiles = 0;
+  p->capacity = capacity;
+  p->end = PACKHEADER + (int64_t)capacity*sizeof(PACKENTRY);
+  if(!(p->index = (PACKENTRY*) malloc((capacity > 0 ? capacity : 1)*sizeof(PACKENTRY))))
+    { printf("Cannot allocate memory to first record: pack index\n");
+      exit(8);
+    }
+  if(ftruncate(p->fd, p->end) != 0) {
+    fprintf(stderr, "cannot write tile pack,%s\n", p->name);
+    exit(1);
+  }
+  WriteIndex(p);
+}
+
+/* Open a pack for reading, mapped in memory.  Returns NULL, with a
+   message, if it cannot be read or is not a pack. */
+static TILEPACK *MapPack(char *name)
+{
+  TILEPACK    *p;
+  struct stat st;
+  int         fd;
+
+  if((fd = open(name, O_RDONLY)) < 0 || fstat(fd, &st) != 0)
+    {
+      fprintf(stderr, "cannot open/read tile pack,%s\n",name);
+      if(fd >= 0) close(fd);
+      return NULL;
+    }
+  p = NewPack(name, fd);
+  if(ReadIndex(p) == 0) {
+    p->mapsize = st.st_size;
+    if((p->map = (unsigned char*) mmap(NULL, p->mapsize, PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED) {
+      /* A batch reads the tiles in about the order they were packed. */
+      madvise(p->map, p->mapsize, MADV_SEQUENTIAL);
+      return p;
+    }
+    fprintf(stderr, "cannot map tile pack,%s\n",name);
+    p->map = NULL;
+  }
+  CloseTilePack(p);
+  return NULL;
+}
+
+/*****************************************************************************/
+/*   OpenTilePack: open a pack for reading, mapped in memory.                */
+/*****************************************************************************/
+TILEPACK *OpenTilePack(char *name)
+{
+  TILEPACK *p;
+
+  if((p = MapPack(name)) == NULL)
+    exit(1);
+  return p;
+}
+
+/*****************************************************************************/
+/*   CreateTilePack: create (or empty) a pack for writing, with room for    */
+/*   <capacity> tiles in its index.  Payloads are compressed if compress.    */
+/*****************************************************************************/
+TILEPACK *CreateTilePack(char *name, int capacity, int compress)
+{
+  TILEPACK *p;
+  int      fd;
+
+#ifndef HAVE_ZLIB
+  /* before the pack is created or emptied */
+  if(compress) {
+    fprintf(stderr, "ERROR: compressed tiles need -DHAVE_ZLIB -lz\n");
+    exit(1);
+  }
+#endif
+  if((fd = open(name, O_RDWR | O_CREAT, 0644)) < 0 || flock(fd, LOCK_EX) != 0 ||
+     ftruncate(fd, 0) != 0)
+    {
+      fprintf(stderr, "cannot open/write tile pack,%s\n",name);
+      exit(1);
+    }
+  p = NewPack(name, fd);
+  p->writing = 1;
+  p->compress = compress;
+  InitPack(p, capacity);
+  return p;
+}
+
+/*****************************************************************************/
+/*   UpdateTilePack: open a pack for adding tiles, created with room for     */
+/*   PACKCAPACITY tiles if it does not exist.  Other writers wait until it   */
+/*   is closed.                                                              */
+/*****************************************************************************/
+TILEPACK *UpdateTilePack(char *name, int compress)
+{
+  TILEPACK    *p;
+  struct stat st;
+  int         fd;
+
+  if((fd = open(name, O_RDWR | O_CREAT, 0644)) < 0 || flock(fd, LOCK_EX) != 0 ||
+     fstat(fd, &st) != 0)
+    {
+      fprintf(stderr, "cannot open/write tile pack,%s\n",name);
+      exit(1);
+    }
+  p = NewPack(name, fd);
+  p->writing = 1;
+  p->compress = compress;
+  if(st.st_size == 0)
+    InitPack(p, PACKCAPACITY);
+  else if(ReadIndex(p) != 0)
+    exit(1);
+  return p;
+}
+
+/*****************************************************************************/
+/*   CloseTilePack: write the index of a pack being written and close it.   */
+/*****************************************************************************/
+void CloseTilePack(TILEPACK *p)
+{
+  if(p->writing) {
+    WriteIndex(p);
+    flock(p->fd, LOCK_UN);
+  }
+  if(p->map != NULL)
+    munmap(p->map, p->mapsize);
+  close(p->fd);
+  free(p->index);
+  free(p->name);
+  free(p);
+}
+
+/*****************************************************************************/
+/*   FindPackedTile: index entry of a cell, NULL if not in the pack.         */
+/*****************************************************************************/
+PACKENTRY *FindPackedTile(TILEPACK *p, int id)
+{
+  PACKENTRY key;
+
+  key.id = id;
+  return (PACKENTRY*) bsearch(&key, p->index, p->ntiles, sizeof(PACKENTRY), CompareEntries);
+}
+
+/*****************************************************************************/
+/*   LoadPackedTile: payload of a tile of a pack opened for reading, after   */
+/*   checking its CRC.  Points into the mapped pack unless the tile is      */
+/*   compressed; release it with FreePackedTile().  Returns NULL, with a     */
+/*   message, if the tile is damaged or cannot be inflated.                  */
+/*****************************************************************************/
+void *LoadPackedTile(TILEPACK *p, PACKENTRY *e)
+{
+  const unsigned char *data;
+  void  *out;
+
+  if(p->map == NULL || e->offset < PACKHEADER || e->length < 0 ||
+     (size_t)(e->offset + e->length) > p->mapsize)
+    {
+      fprintf(stderr, "ERROR: tile %d is outside of tile pack %s\n", e->id, p->name);
+      return NULL;
+    }
+  data = p->map + e->offset;
+  if(Crc32(data, e->length) != e->checksum) {
+    fprintf(stderr, "ERROR: tile %d of tile pack %s is corrupt (checksum)\n", e->id, p->name);
+    return NULL;
+  }
+  if(!(e->type & PACK_ZLIB))
+    return (void*)data;
+
+#ifdef HAVE_ZLIB
+  {
+    uLongf size = e->size;
+
+    if(!(out = malloc(e->size > 0 ? e->size : 1)))
+      { printf("Cannot allocate memory to first record: tile\n");
+	exit(8);
+      }
+    if(uncompress((Bytef*)out, &size, data, e->length) != Z_OK || size != (uLongf)e->size) {
+      fprintf(stderr, "ERROR: tile %d of tile pack %s cannot be inflated\n", e->id, p->name);
+      free(out);
+      return NULL;
+    }
+  }
+#else
+  out = NULL;
+  fprintf(stderr, "ERROR: tile %d of tile pack %s is compressed, compile with -DHAVE_ZLIB -lz\n",
+	  e->id, p->name);
+#endif
+  return out;
+}
+
+void FreePackedTile(PACKENTRY *e, void *data)
+{
+  if(e->type & PACK_ZLIB)
+    free(data);
+}
+
+/*****************************************************************************/
+/*   AddPackedTile: append a tile to a pack opened for writing.  e gives     */
+/*   the cell id, type, georeference and size of the payload; its offset,    */
+/*   length and checksum are set.  Not thread safe.                          */
+/*****************************************************************************/
+void AddPackedTile(TILEPACK *p, PACKENTRY *e, const void *data)
+{
+  const void *out = data;
+  void       *zbuf = NULL;
+  PACKENTRY  *old;
+  int        k;
+
+  e->type &= ~PACK_ZLIB;
+  e->length = e->size;
+#ifdef HAVE_ZLIB
+  if(p->compress) {
+    uLongf length = compressBound(e->size);
+
+    if(!(zbuf = malloc(length)))
+      { printf("Cannot allocate memory to first record: tile\n");
+	exit(8);
+      }
+    if(compress2((Bytef*)zbuf, &length, (const Bytef*)data, e->size, Z_DEFAULT_COMPRESSION) != Z_OK) {
+      fprintf(stderr, "ERROR: tile %d cannot be deflated\n", e->id);
+      exit(1);
+    }
+    e->type |= PACK_ZLIB;
+    e->length = length;
+    out = zbuf;
+  }
+#else
+  if(p->compress) {
+    fprintf(stderr, "ERROR: compressed tiles need -DHAVE_ZLIB -lz\n");
+    exit(1);
+  }
+#endif
+  e->offset = p->end;
+  e->checksum = Crc32((const unsigned char*)out, e->length);
+  if(pwrite(p->fd, out, e->length, e->offset) != (ssize_t)e->length) {
+    fprintf(stderr, "cannot write tile pack,%s\n", p->name);
+    exit(1);
+  }
+  free(zbuf);
+  /* payloads stay aligned to doubles */
+  p->end += (e->length + 7) & ~(int64_t)7;
+
+  if((old = FindPackedTile(p, e->id)) != NULL) {
+    *old = *e;
+    return;
+  }
+  if(p->ntiles == p->capacity) {
+    fprintf(stderr, "ERROR: tile pack %s is full (%d tiles), pack it again with a larger capacity\n",
+	    p->name, p->capacity);
+    exit(1);
+  }
+  for(k = p->ntiles; k > 0 && p->index[k-1].id > e->id; k--)
+    p->index[k] = p->index[k-1];
+  p->index[k] = *e;
+  p->ntiles++;
+}
+
+/*****************************************************************************/
+/*   PutPackedTile: add one tile to a pack, see UpdateTilePack().            */
+/*****************************************************************************/
+void PutPackedTile(char *name, PACKENTRY *e, const void *data)
+{
+  TILEPACK *p = UpdateTilePack(name, 0);
+
+  AddPackedTile(p, e, data);
+  CloseTilePack(p);
+}
+
+/*****************************************************************************/
+/*   PackedTileName: split a tile name "<pack file>:<cell id>".  Returns 1   */
+/*   if name is a tile name, with the pack file name in pack (if not NULL).  */
+/*   The pack file does not need to exist.                                   */
+/*****************************************************************************/
+int PackedTileName(const char *name, char *pack, int *id)
+{
+  const char *colon = strrchr(name, ':'), *s;
+
+  if(colon == NULL || colon == name || colon[1] == '\0')
+    return 0;
+  for(s = colon+1; *s; s++)
+    if(*s < '0' || *s > '9')
+      return 0;
+  if(id != NULL) *id = atoi(colon+1);
+  if(pack != NULL) {
+    memcpy(pack, name, colon - name);
+    pack[colon - name] = '\0';
+  }
+  return 1;
+}
+
+/*****************************************************************************/
+/*   SharedTilePack: pack of a tile name, opened once by the program and     */
+/*   again only if the file has been modified.  Returns NULL if name is not  */
+/*   a tile name of an existing pack, or the pack cannot be read.            */
+/*****************************************************************************/
+TILEPACK *SharedTilePack(const char *name, int *id)
+{
+  char        pack[MAXSTRING];
+  struct stat st;
+  SHAREDPACK  *s;
+
+  if(strlen(name) >= MAXSTRING || !PackedTileName(name, pack, id) || stat(pack, &st) != 0)
+    return NULL;
+
+  pthread_mutex_lock(&SharedLock);
+  for(s = SharedPacks; s != NULL; s = s->next)
+    if(strcmp(s->pack->name, pack) == 0 && s->dev == st.st_dev && s->ino == st.st_ino &&
+       s->size == st.st_size && s->mtime.tv_sec == st.st_mtim.tv_sec &&
+       s->mtime.tv_nsec == st.st_mtim.tv_nsec)
+      break;
+  /* The old mapping is kept, its tiles may still be in use. */
+  if(s == NULL) {
+    if(!(s = (SHAREDPACK*) malloc(sizeof(SHAREDPACK))))
+      { printf("Cannot allocate memory to first record: pack\n");
+	exit(8);
+      }
+    if((s->pack = MapPack(pack)) == NULL) {
+      pthread_mutex_unlock(&SharedLock);
+      free(s);
+      return NULL;
+    }
+    s->dev = st.st_dev;
+    s->ino = st.st_ino;
+    s->size = st.st_size;
+    s->mtime = st.st_mtim;
+    s->next = SharedPacks;
+    SharedPacks = s;
+  }
+  pthread_mutex_unlock(&SharedLock);
+  return s->pack;
+}
+
+/*****************************************************************************/
+/*   IsTilePack: 1 if the file exists and is a pack.                         */
+/*****************************************************************************/
+int IsTilePack(const char *name)
+{
+  char magic[8];
+  int  fd, is;
+
+  if((fd = open(name, O_RDONLY)) < 0)
+    return 0;
+  is = (read(fd, magic, 8) == 8 && memcmp(magic, PACKMAGIC, 8) == 0);
+  close(fd);
+  return is;
+}
+
+/*****************************************************************************/
+/*   TileCellId: cell id of a tile name, or of a file named by the number of */
+/*   its cell (e.g. CellDems/320.txt).  Returns -1 if there is none.         */
+/*****************************************************************************/
+int TileCellId(const char *name)
+{
+  const char *base;
+  char       *end;
+  long       id;
+  int        packed;
+
+  if(PackedTileName(name, NULL, &packed))
+    return packed;
+  if((base = strrchr(name, '/')) == NULL) base = name;
+  else base++;
+  id = strtol(base, &end, 10);
+  if(end == base || (*end != '\0' && *end != '.') || id < 0)
+    return -1;
+  return (int)id;
+}
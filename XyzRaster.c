@@ -0,0 +1,437 @@
+/******************************************************************************
+   SUMMARY:
+   This program converts between XYZ tables and rasters without reading
+   either whole, so that the XYZ outputs of SimplifySoilDatabase.py,
+   CalculatePerSoilDBLayer.py or FindTWIDistribution can be gridded however
+   many records they have, and grids can be listed as XYZ tables.
+
+   XYZ tables are text (whitespace or comma separated, such as the
+   "<index> <lng> <lat> <value>" files of SimplifySoil or pandas csv files)
+   or binary records of doubles.  Rasters are arc/info ascii grids or ESRI
+   float grids (.flt + .hdr), see RasterIO.c.
+
+   The grid of an XYZ table is taken from a reference grid, or found in a
+   first pass over the table: the extent of the points and, unless it is
+   given, the cell size, the smallest step between successive records (the
+   points are cell centers).  The table is then read again, and the values
+   are placed in the grid.  If the grid is larger than the memory allowed
+   (-mem), the records are first sorted into bands of rows in temporary
+   files, and each band is then filled and written in turn.
+
+******************************************************************************
+   NOTES:
+
+   USAGE: XyzRaster <input> <output> [-cols <x,y,z>] [-binary] [-ref <grid>]
+                    [-cellsize <size>] [-nodata <value>] [-precision <n>]
+                    [-mem <MB>] [-header] [-grid]
+     input: XYZ table, ascii grid or float grid (<name>.flt)
+     output: a grid for an XYZ input (float grid if named .flt), an XYZ
+             table for a grid input, unless -grid is given or it is named
+             .flt, then the grid is copied to that format
+     -cols: columns of x (longitude), y (latitude) and z (value) of the
+            table, from 0 (default 0,1,2; 1,2,3 for SimplifySoil tables)
+     -binary: the table is binary, records of doubles
+     -ref: take the grid of the output from this grid
+     -cellsize: cell size of the output grid, instead of the smallest step
+     -nodata: value of cells without records (default the nodata of the
+            -ref grid, or -9999)
+     -precision: significant digits of ascii coordinates and values
+            (default 10)
+     -mem: memory for the output grid in MB (default 1024)
+     -header: write a "lng lat value" header line to XYZ tables
+     -grid: copy a grid to an ascii (or .flt) grid, not to an XYZ table
+
+   Compile with: gcc -O3 -fopenmp XyzRaster.c RasterIO.c -lm -o XyzRaster
+
+   COMMENTS:
+   Cells with several records get the value of the last one.  Records
+   outside the reference grid or away from the cell centers are counted
+   and reported.
+
+*******************************************************************************/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "RasterIO.h"
+
+#define ROWBLOCK 256        /* rows read and written at a time */
+#define MAXBANDS 256        /* temporary band files */
+#define SPILLBUF 4096       /* records buffered per band file */
+
+/* a record sorted into a band: cell in the band and value */
+typedef struct
+{
+  long   cell;
+  double z;
+} SPILL;
+
+void Usage(char *name);
+void Georeference(XYZREADER *t, double cellsize, RASTER *g);
+void XyzToRaster(XYZREADER *t, RASTER *g, double mem);
+void RasterToXyz(RASTER *g, char *outfile, int binary, int header);
+void RasterToRaster(RASTER *g, char *outfile);
+
+int main(int argc, char *argv[])
+{
+  char      *reffile = NULL;
+  int       i, cols[3] = { 0, 1, 2 }, binary = 0, header = 0, grid = 0, precision = 0;
+  double    cellsize = 0., nodata = -9999., mem = 1024.;
+  int       setnodata = 0;
+  XYZREADER t;
+  RASTER    g;
+
+  if(argc < 3)
+    Usage(argv[0]);
+  for(i=3; i<argc; i++) {
+    if(strcmp(argv[i], "-binary") == 0) binary = 1;
+    else if(strcmp(argv[i], "-header") == 0) header = 1;
+    else if(strcmp(argv[i], "-grid") == 0) grid = 1;
+    else if(i+1 < argc && strcmp(argv[i], "-cols") == 0) {
+      if(sscanf(argv[++i], "%d,%d,%d", &cols[0], &cols[1], &cols[2]) != 3
+	 || cols[0] < 0 || cols[1] < 0 || cols[2] < 0 || cols[0] >= MAXXYZCOLS
+	 || cols[1] >= MAXXYZCOLS || cols[2] >= MAXXYZCOLS)
+	Usage(argv[0]);
+    }
+    else if(i+1 < argc && strcmp(argv[i], "-ref") == 0) reffile = argv[++i];
+    else if(i+1 < argc && strcmp(argv[i], "-cellsize") == 0) cellsize = atof(argv[++i]);
+    else if(i+1 < argc && strcmp(argv[i], "-nodata") == 0) {
+      nodata = atof(argv[++i]);
+      setnodata = 1;
+    }
+    else if(i+1 < argc && strcmp(argv[i], "-precision") == 0) precision = atoi(argv[++i]);
+    else if(i+1 < argc && strcmp(argv[i], "-mem") == 0) mem = atof(argv[++i]);
+    else {
+      fprintf(stderr, "ERROR - No such option.\n");
+      Usage(argv[0]);
+    }
+  }
+
+  memset(&g, 0, sizeof(RASTER));
+  g.precision = precision;
+
+  /* grid to XYZ table, or to another grid format */
+  if(IsRaster(argv[1])) {
+    OpenRaster(argv[1], &g);
+    if(grid || IsBinaryRaster(argv[2]))
+      RasterToRaster(&g, argv[2]);
+    else
+      RasterToXyz(&g, argv[2], binary, header);
+    CloseRaster(&g);
+    return 0;
+  }
+
+  /* XYZ table to grid */
+  OpenXyz(argv[1], binary, cols, &t);
+  if(reffile != NULL) {
+    OpenRaster(reffile, &g);
+    CloseRaster(&g);
+    g.precision = precision;
+  }
+  else
+    Georeference(&t, cellsize, &g);
+  if(reffile == NULL || setnodata)
+    g.nodata = nodata;
+  printf("Grid %d x %d, lower left %.12g %.12g, cell size %.12g\n",
+	 g.ncols, g.nrows, g.xllcorner, g.yllcorner, g.cellsize);
+  CreateRaster(argv[2], &g);
+  XyzToRaster(&t, &g, mem);
+  CloseRaster(&g);
+  CloseXyz(&t);
+  return 0;
+}
+
+/*****************************************************************************/
+/*   Georeference: find the grid of the points of the table, whose cell      */
+/*   size is the smallest step between successive records, unless given.   */
+/*****************************************************************************/
+void Georeference(XYZREADER *t, double cellsize, RASTER *g)
+{
+  double xmin = HUGE_VAL, xmax = -HUGE_VAL, ymin = HUGE_VAL, ymax = -HUGE_VAL;
+  double dmin = HUGE_VAL, lastx = 0., lasty = 0., tol;
+  long   n, k, total = 0;
+
+  while((n = ReadXyz(t)) > 0) {
+    double bxmin = HUGE_VAL, bxmax = -HUGE_VAL, bymin = HUGE_VAL, bymax = -HUGE_VAL;
+    double bdmin = HUGE_VAL;
+
+#pragma omp parallel for reduction(min:bxmin,bymin,bdmin) reduction(max:bxmax,bymax)
+    for(k=0; k<n; k++) {
+      double x = t->x[k], y = t->y[k];
+      double px = (k > 0) ? t->x[k-1] : lastx, py = (k > 0) ? t->y[k-1] : lasty;
+      double dx = fabs(x - px), dy = fabs(y - py);
+      double step = 1.e-9*(1. + fabs(x) + fabs(y));
+
+      if(x < bxmin) bxmin = x;
+      if(x > bxmax) bxmax = x;
+      if(y < bymin) bymin = y;
+      if(y > bymax) bymax = y;
+      if((k > 0 || total > 0) && dx > step && dx < bdmin) bdmin = dx;
+      if((k > 0 || total > 0) && dy > step && dy < bdmin) bdmin = dy;
+    }
+    if(bxmin < xmin) xmin = bxmin;
+    if(bxmax > xmax) xmax = bxmax;
+    if(bymin < ymin) ymin = bymin;
+    if(bymax > ymax) ymax = bymax;
+    if(bdmin < dmin) dmin = bdmin;
+    lastx = t->x[n-1];
+    lasty = t->y[n-1];
+    total += n;
+  }
+  if(total == 0) {
+    fprintf(stderr, "ERROR: %s has no x y z records\n", t->name);
+    exit(1);
+  }
+
+  if(cellsize <= 0.) {
+    if(dmin == HUGE_VAL) {
+      fprintf(stderr, "ERROR: the cell size of %s cannot be found from one point, use -cellsize\n", t->name);
+      exit(1);
+    }
+    /* the step is rounded as the coordinates, so it is refined from the
+       extent and the number of cells */
+    cellsize = dmin;
+    if((n = (long)floor((xmax - xmin)/cellsize + 0.5)) > 0)
+      cellsize = (xmax - xmin)/n;
+    else if((n = (long)floor((ymax - ymin)/cellsize + 0.5)) > 0)
+      cellsize = (ymax - ymin)/n;
+  }
+  g->cellsize = cellsize;
+  g->ncols = (int)floor((xmax - xmin)/cellsize + 0.5) + 1;
+  g->nrows = (int)floor((ymax - ymin)/cellsize + 0.5) + 1;
+  g->xllcorner = xmin - 0.5*cellsize;
+  g->yllcorner = ymin - 0.5*cellsize;
+
+  /* steps that are not multiples of the cell size */
+  tol = 0.01*cellsize;
+  if(fabs((xmax - xmin) - (g->ncols - 1)*cellsize) > tol || fabs((ymax - ymin) - (g->nrows - 1)*cellsize) > tol)
+    fprintf(stderr, "WARNING: the extent of %s is not a whole number of cells of %.12g\n", t->name, cellsize);
+  printf("Read %ld records from %s\n", total, t->name);
+  RewindXyz(t);
+}
+
+/*****************************************************************************/
+/*   XyzToRaster: place the records of the table in the grid and write it,   */
+/*   in bands of rows that fit in mem MB.                                    */
+/*****************************************************************************/
+void XyzToRaster(XYZREADER *t, RASTER *g, double mem)
+{
+  long   bandrows, nbands, b, k, n, cell, total = 0, outside = 0, offcenter = 0, repeated = 0;
+  long   *nspill;
+  double *band;
+  unsigned char *seen;
+  FILE   **spillfile;
+  SPILL  **spill;
+  int    r;
+
+  bandrows = (long)(mem*1048576./(g->ncols*(sizeof(double) + 0.125)));
+  if(bandrows < 1) bandrows = 1;
+  if(bandrows > g->nrows) bandrows = g->nrows;
+  nbands = (g->nrows + bandrows - 1)/bandrows;
+  if(nbands > MAXBANDS) {
+    nbands = MAXBANDS;
+    bandrows = (g->nrows + nbands - 1)/nbands;
+    fprintf(stderr, "WARNING: -mem is too small, bands of %ld rows are used\n", bandrows);
+  }
+  band = (double*) malloc((size_t)bandrows*g->ncols*sizeof(double));
+  seen = (unsigned char*) malloc(((size_t)bandrows*g->ncols + 7)/8);
+  spillfile = (FILE**) calloc(nbands, sizeof(FILE*));
+  spill = (SPILL**) calloc(nbands, sizeof(SPILL*));
+  nspill = (long*) calloc(nbands, sizeof(long));
+  if(band == NULL || seen == NULL || spillfile == NULL || spill == NULL || nspill == NULL) {
+    printf("Cannot allocate memory to first record: grid band\n");
+    exit(8);
+  }
+  if(nbands > 1) {
+    printf("Grid written in %ld bands of %ld rows\n", nbands, bandrows);
+    for(b=0; b<nbands; b++)
+      if((spillfile[b] = tmpfile()) == NULL || (spill[b] = (SPILL*) malloc(SPILLBUF*sizeof(SPILL))) == NULL) {
+	fprintf(stderr, "ERROR: cannot create temporary band file\n");
+	exit(1);
+      }
+  }
+
+  for(k=0; k<(long)bandrows*g->ncols; k++)
+    band[k] = g->nodata;
+  memset(seen, 0, ((size_t)bandrows*g->ncols + 7)/8);
+
+  /* place (one band) or sort (several bands) the records, in file order */
+  while((n = ReadXyz(t)) > 0) {
+    for(k=0; k<n; k++) {
+      double fx = (t->x[k] - g->xllcorner)/g->cellsize;
+      double fy = (t->y[k] - g->yllcorner)/g->cellsize;
+      long   col = (long)floor(fx), row = g->nrows - 1 - (long)floor(fy);
+
+      if(fx < 0. || fy < 0. || col >= g->ncols || row < 0) {
+	outside++;
+	continue;
+      }
+      if(fabs(fx - col - 0.5) > 0.25 || fabs(fy - floor(fy) - 0.5) > 0.25)
+	offcenter++;
+      b = row/bandrows;
+      cell = (row - b*bandrows)*g->ncols + col;
+      if(nbands == 1) {
+	if(seen[cell >> 3] & (1 << (cell & 7))) repeated++;
+	seen[cell >> 3] |= 1 << (cell & 7);
+	band[cell] = t->z[k];
+      }
+      else {
+	spill[b][nspill[b]].cell = cell;
+	spill[b][nspill[b]].z = t->z[k];
+	if(++nspill[b] == SPILLBUF) {
+	  fwrite(spill[b], sizeof(SPILL), SPILLBUF, spillfile[b]);
+	  nspill[b] = 0;
+	}
+      }
+    }
+    total += n;
+  }
+
+  /* fill and write the bands */
+  for(b=0; b<nbands; b++) {
+    int rows = (int)((b == nbands-1) ? g->nrows - b*bandrows : bandrows);
+
+    if(nbands > 1) {
+      if(b > 0) {
+	for(k=0; k<(long)bandrows*g->ncols; k++)
+	  band[k] = g->nodata;
+	memset(seen, 0, ((size_t)bandrows*g->ncols + 7)/8);
+      }
+      fwrite(spill[b], sizeof(SPILL), nspill[b], spillfile[b]);
+      rewind(spillfile[b]);
+      while((n = fread(spill[b], sizeof(SPILL), SPILLBUF, spillfile[b])) > 0)
+	for(k=0; k<n; k++) {
+	  cell = spill[b][k].cell;
+	  if(seen[cell >> 3] & (1 << (cell & 7))) repeated++;
+	  seen[cell >> 3] |= 1 << (cell & 7);
+	  band[cell] = spill[b][k].z;
+	}
+      fclose(spillfile[b]);
+      free(spill[b]);
+    }
+    for(r=0; r<rows; r+=ROWBLOCK)
+      WriteRasterRows(g, (rows - r < ROWBLOCK) ? rows - r : ROWBLOCK, band + (long)r*g->ncols);
+  }
+
+  printf("Gridded %ld records\n", total - outside);
+  if(t->skipped > 0)
+    fprintf(stderr, "WARNING: %ld lines without x y z numbers were skipped\n", t->skipped);
+  if(outside > 0)
+    fprintf(stderr, "WARNING: %ld records are outside the grid\n", outside);
+  if(offcenter > 0)
+    fprintf(stderr, "WARNING: %ld records are away from the cell centers\n", offcenter);
+  if(repeated > 0)
+    fprintf(stderr, "WARNING: %ld records fall in cells that already had one, the last is kept\n", repeated);
+  free(band);
+  free(seen);
+  free(spillfile);
+  free(spill);
+  free(nspill);
+}
+
+/*****************************************************************************/
+/*   RasterToXyz: list the cells with data as x y z records, text lines     */
+/*   formatted in parallel or binary records of three doubles.              */
+/*****************************************************************************/
+void RasterToXyz(RASTER *g, char *outfile, int binary, int header)
+{
+  FILE   *fo;
+  double *rows, *rec;
+  char   *text;
+  size_t rowmax = (size_t)g->ncols*3*(g->precision + 8) + 1, *len;
+  long   total = 0;
+  int    n, i;
+
+  if((fo = fopen(outfile, binary ? "wb" : "w")) == NULL) {
+    fprintf(stderr, "cannot open output file,%s\n", outfile);
+    exit(1);
+  }
+  if(header && !binary)
+    fprintf(fo, "lng\tlat\tvalue\n");
+  rows = (double*) malloc((size_t)ROWBLOCK*g->ncols*sizeof(double));
+  rec = (double*) malloc(3*(size_t)g->ncols*sizeof(double));
+  text = binary ? NULL : (char*) malloc(ROWBLOCK*rowmax);
+  len = (size_t*) malloc(ROWBLOCK*sizeof(size_t));
+  if(rows == NULL || rec == NULL || len == NULL || (!binary && text == NULL)) {
+    printf("Cannot allocate memory to first record: rows\n");
+    exit(8);
+  }
+
+  while((n = ReadRasterRows(g, ROWBLOCK, rows)) > 0) {
+    long first = g->row - n;
+
+    if(binary) {
+      for(i=0; i<n; i++) {
+	double y = g->yllcorner + g->cellsize*(g->nrows - (first + i) - 0.5);
+	int    c, m = 0;
+
+	for(c=0; c<g->ncols; c++)
+	  if(rows[(long)i*g->ncols + c] != g->nodata) {
+	    rec[3*m] = g->xllcorner + g->cellsize*(c + 0.5);
+	    rec[3*m+1] = y;
+	    rec[3*m+2] = rows[(long)i*g->ncols + c];
+	    m++;
+	  }
+	fwrite(rec, 3*sizeof(double), m, fo);
+	total += m;
+      }
+      continue;
+    }
+
+#pragma omp parallel for schedule(dynamic) reduction(+:total)
+    for(i=0; i<n; i++) {
+      double y = g->yllcorner + g->cellsize*(g->nrows - (first + i) - 0.5);
+      char   *s = text + i*rowmax;
+      int    c;
+
+      for(c=0; c<g->ncols; c++)
+	if(rows[(long)i*g->ncols + c] != g->nodata) {
+	  s += sprintf(s, "%.*g\t%.*g\t%.*g\n", g->precision, g->xllcorner + g->cellsize*(c + 0.5),
+		       g->precision, y, g->precision, rows[(long)i*g->ncols + c]);
+	  total++;
+	}
+      len[i] = s - (text + i*rowmax);
+    }
+    for(i=0; i<n; i++)
+      fwrite(text + i*rowmax, 1, len[i], fo);
+  }
+  if(fclose(fo) != 0) {
+    fprintf(stderr, "ERROR: cannot write %s\n", outfile);
+    exit(1);
+  }
+  printf("Wrote %ld records\n", total);
+  free(rows);
+  free(rec);
+  free(text);
+  free(len);
+}
+
+/*****************************************************************************/
+/*   RasterToRaster: copy the grid to the format of outfile.                 */
+/*****************************************************************************/
+void RasterToRaster(RASTER *g, char *outfile)
+{
+  RASTER o;
+  double *rows;
+  int    n;
+
+  o = *g;
+  CreateRaster(outfile, &o);
+  if((rows = (double*) malloc((size_t)ROWBLOCK*g->ncols*sizeof(double))) == NULL) {
+    printf("Cannot allocate memory to first record: rows\n");
+    exit(8);
+  }
+  while((n = ReadRasterRows(g, ROWBLOCK, rows)) > 0)
+    WriteRasterRows(&o, n, rows);
+  CloseRaster(&o);
+  free(rows);
+}
+
+void Usage(char *name)
+{
+  fprintf(stderr, "\nUsage: %s <input> <output> [-cols <x,y,z>] [-binary] [-ref <grid>] [-cellsize <size>]\n", name);
+  fprintf(stderr, "\t\t[-nodata <value>] [-precision <n>] [-mem <MB>] [-header] [-grid]\n");
+  fprintf(stderr, "\n\tNOTE: XYZ tables are gridded, grids are listed as XYZ tables (or copied with -grid or to .flt).\n");
+  fprintf(stderr, "\tNOTE 2: Columns are counted from 0, -binary tables are records of doubles.\n\n");
+  exit(0);
+}